@@ -1,6 +1,10 @@
 -- See the documentation at
 -- https://github.com/appilee/luna/blob/master/src/plugins/backend.c for more
 -- details about how this process is intended to work.
+--
+-- This example receives the result through the events bus. To have it sent
+-- only to you instead, use `require('backend').request{...}`, which returns a
+-- future that can be awaited from a coroutine.
 
 local events = require('events')
 local inspect = require('inspect')
@@ -25,6 +29,13 @@ backend:send('url', 'https://www.google.com/api/v1/ping.json',
 -- the ID is used by you to wait for the HTTPS response data.
 local topic, request_id = backend:recv(-1)
 
+-- if too many requests are already waiting, the topic is 'error' instead and
+-- the request was not accepted; it may be retried later.
+if topic == 'error' then
+  print('backend is ' .. request_id)
+  return
+end
+
 -- register to wait for the information associated with request_id via the
 -- events system
 local listener = { trigger = function(evt)
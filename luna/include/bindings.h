@@ -5,8 +5,12 @@
 extern "C" {
 #endif
 
+  struct lua_State;
+
   int lua_run_file(const char *filename);
   int lua_run_script(const char *script);
+  int lua_reactor_owns(struct lua_State *L);
+  int lua_bundle_scripts(const char *dir);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,83 @@
+/*
+ * File:   backend_cache.h
+ *
+ * A cache of responses to backend GET requests, kept in memory and on disk,
+ * each within its own budget. Used by the backend plugin.
+ */
+
+#ifndef BACKEND_CACHE_H
+#define	BACKEND_CACHE_H
+
+#include <stddef.h>
+#include <time.h>
+#include "util/uthash.h"
+
+typedef struct cache_entry_t {
+  char *key;           // the hash of the request's key, as hex
+  char *etag;          // NULL if the server didn't send one
+  char *last_modified; // likewise
+  time_t expires_at;   // 0 if it must be revalidated before each use
+  long code;
+  size_t body_len;
+  char *body;          // NULL unless it's kept in memory
+  char *path;          // where it's kept on disk, without extension; or NULL
+  UT_hash_handle hh;
+  struct cache_entry_t *prev, *next; // least recently used first
+} cache_entry_t;
+
+typedef struct {
+  cache_entry_t *entries;
+  cache_entry_t *lru;
+  char *dir;           // NULL if there is no disk cache
+  size_t max_memory, memory_used;
+  size_t max_disk, disk_used;
+} response_cache_t;
+
+/*
+ * Creates a cache, picking up whatever was left on disk in `dir`, which may
+ * be NULL to only keep responses in memory. A budget of 0 disables that
+ * part of the cache.
+ */
+response_cache_t *cache_new(const char *dir, size_t max_memory, size_t max_disk);
+
+void cache_destroy(response_cache_t **cache);
+
+/*
+ * Changes the budgets, evicting whatever no longer fits.
+ */
+void cache_set_limits(response_cache_t *cache, size_t max_memory, size_t max_disk);
+
+/*
+ * Returns the entry for `key`, or NULL. Marks it as recently used.
+ */
+cache_entry_t *cache_find(response_cache_t *cache, const char *key);
+
+/*
+ * Returns a freeable copy of the entry's body, reading it from disk if
+ * necessary, or NULL if it can't be read.
+ */
+char *cache_read_body(response_cache_t *cache, cache_entry_t *entry);
+
+/*
+ * Stores a response, replacing any previous one for `key`.
+ */
+void cache_store(response_cache_t *cache, const char *key, long code, const char *body, size_t body_len,
+                 const char *etag, const char *last_modified, time_t expires_at);
+
+/*
+ * Updates an entry after the server has said that it's still valid.
+ */
+void cache_refresh(response_cache_t *cache, cache_entry_t *entry, const char *etag,
+                   const char *last_modified, time_t expires_at);
+
+void cache_remove(response_cache_t *cache, cache_entry_t *entry);
+
+/*
+ * Works out from the Cache-Control, Expires and Date response headers, any
+ * of which may be NULL, until when a response may be used without checking
+ * with the server. Returns 0 if the response must not be stored at all.
+ */
+int cache_freshness(const char *cache_control, const char *expires, const char *date,
+                    time_t now, time_t *expires_at);
+
+#endif	/* BACKEND_CACHE_H */
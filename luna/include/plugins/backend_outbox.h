@@ -0,0 +1,79 @@
+/*
+ * File:   backend_outbox.h
+ *
+ * Durable storage for backend requests which must eventually be delivered,
+ * such as reversals and transaction uploads. Used by the backend plugin.
+ */
+
+#ifndef BACKEND_OUTBOX_H
+#define	BACKEND_OUTBOX_H
+
+#include <czmq.h>
+#include <sqlite3.h>
+
+#define OUTBOX_MIN_BACKOFF 1000   // ms before the first retry
+#define OUTBOX_MAX_BACKOFF 600000 // ms between retries, at most
+
+/*
+ * A stored request. `request` holds its frames exactly as they were sent,
+ * so that any token placeholders are only resolved when it is sent.
+ */
+typedef struct outbox_entry_t {
+  long long id;
+  char *destination;
+  zmsg_t *request;
+  int attempts;
+  int64_t next_attempt_at; // ms since the epoch
+  struct outbox_entry_t *prev, *next;
+} outbox_entry_t;
+
+/*
+ * Opens and migrates the outbox database. Returns NULL if it can't be used.
+ */
+sqlite3 *outbox_open(void);
+
+void outbox_close(sqlite3 **db);
+
+/*
+ * Returns the part of `url` which identifies the server, such as
+ * "https://example.com:443", as a freeable string; or NULL if it isn't a
+ * URL. Requests to the same destination are delivered in order.
+ */
+char *outbox_destination(const char *url);
+
+/*
+ * Stores a request for `destination`. Returns its ID, or -1 on failure.
+ */
+long long outbox_add(sqlite3 *db, const char *destination, zmsg_t *request);
+
+/*
+ * Returns the oldest request for each destination, in a list which must be
+ * freed with `outbox_free_entries`.
+ */
+outbox_entry_t *outbox_heads(sqlite3 *db);
+
+void outbox_free_entries(outbox_entry_t **entries);
+
+/*
+ * Records a failed attempt to deliver a request, and when to try again.
+ */
+int outbox_retry_later(sqlite3 *db, long long id, int attempts, int64_t next_attempt_at);
+
+/*
+ * Forgets a request. Returns 1 if it was stored, 0 if not.
+ */
+int outbox_remove(sqlite3 *db, long long id);
+
+/*
+ * Returns the number of stored requests.
+ */
+long outbox_count(sqlite3 *db);
+
+/*
+ * Returns how long to wait, in ms, before making attempt number
+ * `attempts + 1`: exponentially longer each time, with random jitter so
+ * that terminals which lost connectivity together don't all retry at once.
+ */
+int64_t outbox_backoff(int attempts);
+
+#endif	/* BACKEND_OUTBOX_H */
@@ -0,0 +1,70 @@
+/*
+ * File:   backend_timings.h
+ *
+ * How long each phase of the recent backend requests to each host took,
+ * kept as a rolling window of samples and reported as histograms. Used by
+ * the backend plugin.
+ */
+
+#ifndef BACKEND_TIMINGS_H
+#define	BACKEND_TIMINGS_H
+
+#include <czmq.h>
+#include "util/uthash.h"
+
+#define TIMING_SAMPLES 100 // requests kept per host
+
+/*
+ * The phases of a request, as reported in histograms: DNS lookup, TCP
+ * connect, TLS handshake, waiting for the server to start its response,
+ * receiving the response, and all of it.
+ */
+typedef enum {
+  PHASE_DNS = 0,
+  PHASE_CONNECT,
+  PHASE_TLS,
+  PHASE_WAIT,
+  PHASE_TRANSFER,
+  PHASE_TOTAL,
+  NUM_PHASES
+} timing_phase_t;
+
+/*
+ * The times reported by curl for one request, in microseconds since it
+ * started, and how much it sent and received.
+ */
+typedef struct {
+  long long name_lookup;
+  long long connect;
+  long long app_connect;
+  long long pretransfer;
+  long long start_transfer;
+  long long total;
+  long long bytes_sent;
+  long long bytes_received;
+  int reused;
+} transfer_timing_t;
+
+typedef struct {
+  char *host;
+  long long samples[TIMING_SAMPLES][NUM_PHASES]; // -1 if the phase didn't happen
+  int next;
+  int count;
+  UT_hash_handle hh;
+} host_timings_t;
+
+/*
+ * Adds a completed request to the samples for `host`, replacing the oldest
+ * once there are TIMING_SAMPLES of them.
+ */
+void timings_record(host_timings_t **hosts, const char *host, const transfer_timing_t *timing);
+
+/*
+ * Appends histograms of every host's samples to `msg`. See "Timing" in
+ * backend.c for the format.
+ */
+void timings_add_histograms(zmsg_t *msg, host_timings_t *hosts);
+
+void timings_free(host_timings_t **hosts);
+
+#endif	/* BACKEND_TIMINGS_H */
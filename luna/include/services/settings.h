@@ -19,6 +19,7 @@ extern "C" {
 #define SETTINGS_CHANGED_ENDPOINT "inproc://settings-changed"
 int init_settings_service(void);
 void shutdown_settings_service(void);
+int settings_service_running(void);
 int settings_get(zsock_t *getset, int num, ...);
 int settings_set(zsock_t *getset, int num, ...);
 int settings_del(zsock_t *getset, int num, ...);
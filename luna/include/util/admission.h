@@ -0,0 +1,39 @@
+#ifndef UTIL_ADMISSION_H
+#define UTIL_ADMISSION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* transports which forward requests to the API */
+#define ADMISSION_TRANSPORT_HTTPS      0
+#define ADMISSION_TRANSPORT_USB        1
+#define ADMISSION_TRANSPORT_BLUETOOTH  2
+#define ADMISSION_NUM_TRANSPORTS       3
+
+/* priority classes, most urgent first */
+#define ADMISSION_PRIORITY_CRITICAL    0 // payment routes
+#define ADMISSION_PRIORITY_NORMAL      1
+#define ADMISSION_PRIORITY_POLLING     2 // status reads
+#define ADMISSION_NUM_PRIORITIES       3
+
+/* the API is served by a single Lua state, so there's no sense in handing
+ * it more than one request to work on plus one ready to go */
+#define ADMISSION_MAX_IN_FLIGHT        2
+#define ADMISSION_MAX_QUEUED           8
+#define ADMISSION_MAX_WAIT          3000 // ms
+
+#define ADMISSION_ADMITTED             0
+#define ADMISSION_BUSY                -1
+#define ADMISSION_TIMED_OUT           -2
+
+  int  admission_priority(const char *verb, const char *path);
+  int  admission_acquire(int transport, int priority, int timeout_ms);
+  void admission_release(int transport);
+  int  admission_waiting(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // UTIL_ADMISSION_H
@@ -13,13 +13,27 @@
 #define MAX_HTTP_VERB_LENGTH  7
 #define MAX_HTTP_PATH_LENGTH  2048
 
+#define API_TIMEOUT           5000  // ms to wait for the API to respond
+
+#define BATCH_RESOURCE        "/batch.json"
+#define BATCH_MAX_REQUESTS    16
+#define BATCH_TIMEOUT         8000  // ms for all of a batch's requests together
+
+#define BACKEND_ENDPOINT          "inproc://backend"
+#define BACKEND_TIMINGS_RESOURCE  "/backend/timings.json"
+
+#define LUA_MEMORY_RESOURCE       "/lua/memory.json"
+#define LUA_MEMORY_MAX_STATES     16
+
 #ifdef	__cplusplus
 extern "C" {
 #endif
 
-char *dispatch_request(const char *verb, const char *path,
+char *dispatch_request(int transport, const char *verb, const char *path,
                        header_t **headers, const char *request_body);
 
+int api_path_is(const char *path, const char *resource);
+
 unsigned int scan_http_path(const char *request,
                             unsigned int request_length,
                             char *verb,
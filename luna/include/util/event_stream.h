@@ -0,0 +1,26 @@
+#ifndef UTIL_EVENT_STREAM_H
+#define UTIL_EVENT_STREAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <czmq.h>
+#include <openssl/ssl.h>
+#include "rest_api.h"
+
+#define EVENT_STREAM_RESOURCE      "/events"
+#define EVENT_STREAM_MAX_CLIENTS   4
+#define EVENT_STREAM_MAX_TOPICS    16
+#define EVENT_STREAM_MAX_QUEUED    64     // events held per client before it is dropped
+#define EVENT_STREAM_KEEPALIVE     15000  // ms between comments sent to idle clients
+
+int is_event_stream_request(const char *verb, const char *path);
+void stream_events(zsock_t *pipe, SSL *ssl, const char *verb, const char *path,
+                   header_t **headers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // UTIL_EVENT_STREAM_H
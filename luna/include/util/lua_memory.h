@@ -0,0 +1,44 @@
+#ifndef UTIL_LUA_MEMORY_H
+#define UTIL_LUA_MEMORY_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /*
+   * One Lua state's memory accounting. Only the state's own thread writes
+   * it, with atomic stores, so that other threads can read it with atomic
+   * loads while the state runs; see src/bindings/lua/memory.c for what the
+   * numbers mean.
+   */
+  typedef struct lua_memory_account_t {
+    size_t live;
+    size_t peak;
+    size_t limit;
+    size_t pooled;
+    unsigned long allocations;
+    unsigned long failures;
+    struct lua_memory_account_t *prev, *next;
+  } lua_memory_account_t;
+
+  // a copy of one state's accounting
+  typedef struct {
+    size_t live;
+    size_t peak;
+    size_t limit;
+    size_t pooled;
+    unsigned long allocations;
+    unsigned long failures;
+  } lua_memory_stats_t;
+
+  void lua_memory_account_add(lua_memory_account_t *account);
+  void lua_memory_account_remove(lua_memory_account_t *account);
+  int  lua_memory_stats(lua_memory_stats_t *stats, int max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // UTIL_LUA_MEMORY_H
@@ -0,0 +1,42 @@
+#ifndef UTIL_RESOLVER_H
+#define UTIL_RESOLVER_H
+
+#include <netinet/in.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RESOLVER_TTL           300 // seconds a resolved host name is kept
+#define RESOLVER_MAX_ADDRS     8   // addresses kept per host name
+#define RESOLVER_MAX_HOSTS     64  // host names kept in the cache
+#define RESOLVER_MAX_LOOKUPS   4   // lookups run at once; the rest wait
+
+  typedef struct {
+    int family;                    // AF_INET or AF_INET6
+    char ip[INET6_ADDRSTRLEN];
+  } resolver_addr_t;
+
+  /*
+   * Looks up the addresses of `host`, filling in at most `max` of them, and
+   * returns how many it found. The default is getaddrinfo(); tests can
+   * install a fake host table instead with `resolver_set_lookup()`.
+   */
+  typedef int (*resolver_lookup_fn)(const char *host, resolver_addr_t *addrs, int max);
+
+  typedef struct resolver_query_t resolver_query_t;
+
+  resolver_query_t *resolver_query(const char *host);
+  int   resolver_query_fd(resolver_query_t *query);
+  int   resolver_query_result(resolver_query_t *query, resolver_addr_t *addrs, int max);
+  void  resolver_query_free(resolver_query_t *query);
+  int   resolver_cached(const char *host, resolver_addr_t *addrs, int max);
+  void  resolver_prefetch(const char *host);
+  void  resolver_set_lookup(resolver_lookup_fn lookup);
+  void  resolver_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // UTIL_RESOLVER_H
@@ -0,0 +1,23 @@
+#ifndef UTIL_SESSIONS_H
+#define UTIL_SESSIONS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SESSIONS_RESOURCE      "/sessions.json"
+#define SESSION_TTL            300 // seconds
+#define SESSION_MAX            8
+#define SESSION_USER_HEADER    "x-authenticated-user"
+
+  char *session_create(const char *user, int ttl);
+  int   session_lookup(const char *token, char **user);
+  void  session_revoke(const char *token);
+  void  sessions_revoke_all(void);
+  int   sessions_count(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // UTIL_SESSIONS_H
@@ -11,6 +11,7 @@ char *trim(char *str);
 char *bytes2hex(const char *data, size_t len);
 char *hex2bytes(const char *hex, size_t *len);
 unsigned char *hex2bcd(const char *hex, size_t *len);
+char *json_escape(const char *data, size_t len);
 
 #ifdef __cplusplus
 }
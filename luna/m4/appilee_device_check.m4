@@ -37,6 +37,18 @@ AC_DEFINE([DEFAULT_AUTOUPDATE_CHECK_INTERVAL], ["21600000"],         [The defaul
 AC_DEFINE([DEFAULT_WEBSERVER_BEACON_PORT],     ["33310"],            [The default port to send UDP broadcasts to advertise the location of the webserver])
 AC_DEFINE([DEFAULT_WEBSERVER_BEACON_ENABLED],  ["true"],             [Whether UDP broadcasting is enabled by default])
 AC_DEFINE([DEFAULT_WEBSERVER_PORT],            [44443],              [The default port to listen for HTTPS requests])
+AC_DEFINE([DEFAULT_BACKEND_MAX_HOST_CONNECTIONS], ["4"], [The default maximum number of open connections to each backend host])
+AC_DEFINE([DEFAULT_BACKEND_MAX_CONNECTIONS],   ["16"],               [The default maximum number of open connections to all backend hosts])
+AC_DEFINE([DEFAULT_BACKEND_MAX_ACTIVE_REQUESTS], ["8"],              [The default maximum number of backend requests running at once])
+AC_DEFINE([DEFAULT_BACKEND_MAX_QUEUED_REQUESTS], ["32"],             [The default maximum number of backend requests waiting to run])
+AC_DEFINE([DEFAULT_BACKEND_MAX_BODY_SIZE], ["4194304"],        [The default maximum size in bytes of a backend response body])
+AC_DEFINE([DEFAULT_BACKEND_CACHE_MAX_MEMORY], ["1048576"],     [The default number of bytes of cached backend responses to keep in memory])
+AC_DEFINE([DEFAULT_BACKEND_CACHE_MAX_DISK], ["8388608"],       [The default number of bytes of cached backend responses to keep on disk])
+AC_DEFINE([DEFAULT_BACKEND_PREWARM_INTERVAL], ["30000"],       [The default number of ms between refreshes of a prewarmed backend connection])
+AC_DEFINE([DEFAULT_BACKEND_PREWARM_IDLE_CLOSE], ["120000"],  [The default number of ms a prewarmed backend connection is kept without being used])
+AC_DEFINE([DEFAULT_LUA_MEMORY_LIMIT],          ["0"],                [The default number of bytes a Lua script may have allocated at once, or 0 for no limit])
+AC_DEFINE([DEFAULT_LUA_GC_PAUSE],              ["200"],              [The default Lua garbage collector pause, in percent])
+AC_DEFINE([DEFAULT_LUA_GC_STEPMUL],            ["200"],              [The default Lua garbage collector step multiplier, in percent])
 AC_DEFINE([MULTI_PATH_SEPARATOR],              [':'],                [The character that separates multiple directories in PATH])
 AC_DEFINE([FILE_PATH_SEPARATOR],               ['/'],                [The character that separates directories in a file system path])
 case "$TARGET_DEVICE" in
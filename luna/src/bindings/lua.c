@@ -29,6 +29,15 @@ int  init_services_lua(lua_State *L);
 void shutdown_services_lua(lua_State *L);
 int  init_device_lua(lua_State *L);
 void shutdown_device_lua(lua_State *L);
+int  init_reactor_lua(lua_State *L);
+void shutdown_reactor_lua(lua_State *L);
+int  init_bytecode_lua(lua_State *L);
+void shutdown_bytecode_lua(lua_State *L);
+int  lua_load_cached(lua_State *L, const char *filename);
+int  init_memory_lua(lua_State *L);
+void shutdown_memory_lua(lua_State *L);
+lua_State *lua_memory_newstate(void);
+void lua_memory_close(lua_State *L);
 
 int init_plugin_lua_bindings(lua_State *L);
 void shutdown_plugin_lua_bindings(lua_State *L);
@@ -71,9 +80,15 @@ static int lua_wrap_fn(const char *script, int (*loader)(lua_State *, const char
   lua_State *L = NULL;
   int err = 0;
 
-  L = luaL_newstate();
+  L = lua_memory_newstate();
+  if (!L) {
+    LERROR("lua-main: not enough memory for a Lua state");
+    return 1;
+  }
   lua_atpanic(L, fatal_lua_error);
   luaL_openlibs(L);
+  init_memory_lua(L);
+  init_bytecode_lua(L);
   init_logger_lua(L);
   init_ctos_lua(L);
   init_printer_lua(L);
@@ -84,6 +99,7 @@ static int lua_wrap_fn(const char *script, int (*loader)(lua_State *, const char
   init_timer_lua(L);
   init_services_lua(L);
   init_device_lua(L);
+  init_reactor_lua(L);
   init_plugin_lua_bindings(L);
 
   lua_pushcfunction(L, fatal_lua_error);
@@ -100,6 +116,7 @@ static int lua_wrap_fn(const char *script, int (*loader)(lua_State *, const char
   }
 
   shutdown_plugin_lua_bindings(L);
+  shutdown_reactor_lua(L);
   shutdown_device_lua(L);
   shutdown_services_lua(L);
   shutdown_timer_lua(L);
@@ -110,7 +127,9 @@ static int lua_wrap_fn(const char *script, int (*loader)(lua_State *, const char
   shutdown_printer_lua(L);
   shutdown_ctos_lua(L);
   shutdown_logger_lua(L);
-  lua_close(L);
+  shutdown_bytecode_lua(L);
+  shutdown_memory_lua(L);
+  lua_memory_close(L);
 
   return err;
 }
@@ -119,12 +138,7 @@ int lua_run_script(const char *script) {
   return lua_wrap_fn(script, luaL_loadstring);
 }
 
-#undef luaL_loadfile
-static int luaL_loadfile(lua_State *L, const char *fn) {
-  return luaL_loadfilex(L, fn, NULL);
-}
-
 int lua_run_file(const char *filename) {
-  return lua_wrap_fn(filename, luaL_loadfile);
+  return lua_wrap_fn(filename, lua_load_cached);
 }
 
@@ -0,0 +1,665 @@
+#define LUA_LIB
+#define _GNU_SOURCE
+
+#include "config.h"
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "bindings.h"
+#include "services/logger.h"
+#include "util/files.h"
+
+/*
+ * Compiled scripts, so that they needn't be parsed on every boot.
+ *
+ * Each script loaded by `lua_run_file` or by `require` is compiled once and
+ * its bytecode written to the "bytecode" directory beneath one of the
+ * `WRITE_PATHS`, in a file named after a hash of the script's path. The
+ * cached copy records the script's path, size and modification time, and is
+ * only used while all three still match; otherwise the script is compiled
+ * from source again and the cache rewritten. Setting `LUA_BYTECODE_CACHE` to
+ * 0 turns the cache off.
+ *
+ * Scripts may also be shipped precompiled: `luna --bundle-lua=DIR` compiles
+ * every script beneath DIR into a single image, DIR/scripts.luab. If an
+ * image is found in the `READ_PATHS`, `require` looks in it before looking
+ * for files, so modules in the image take precedence over their sources.
+ * The image records each source's size and modification time, though, and
+ * a module whose source beside the image no longer matches is loaded from
+ * that source instead, with a warning that the image is out of date. An
+ * image built by a Lua with a different version or word size can't be
+ * loaded; its modules are then loaded from their sources as usual.
+ */
+
+#define MT_BYTECODE  "MT_BYTECODE"
+#define BUNDLE_NAME  "scripts.luab"
+
+static const char CACHE_MAGIC[8]  = "LUNABC1";
+static const char BUNDLE_MAGIC[8] = "LUNABN2";
+
+// precedes the bytecode of a cached script, followed by the script's path
+typedef struct {
+  char magic[8];
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t size;
+  uint32_t path_len;
+} cache_header_t;
+
+// precedes the entries of a bundle, each of which is a bundle_entry_header_t
+// followed by the module name, its source's path relative to the image, and
+// its bytecode
+typedef struct {
+  char magic[8];
+  uint32_t count;
+} bundle_header_t;
+
+typedef struct {
+  int64_t mtime_sec;    // of the source, when it was bundled
+  int64_t mtime_nsec;
+  int64_t size;
+  uint32_t name_len;
+  uint32_t path_len;
+  uint32_t chunk_len;
+} bundle_entry_header_t;
+
+typedef struct {
+  const char *name;
+  size_t name_len;
+  const char *path;
+  size_t path_len;
+  const char *chunk;
+  size_t chunk_len;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t size;
+} bundle_entry_t;
+
+typedef struct {
+  bool cache;
+  char *image_path;
+  char *image_dir;
+  char *image;
+  bundle_entry_t *entries;
+  uint32_t count;
+  lua_Integer hits;     // scripts loaded from the cache
+  lua_Integer misses;   // scripts compiled from source
+  lua_Integer writes;   // of those, how many were cached
+  lua_Integer bundled;  // modules loaded from the image
+  lua_Integer stale;    // modules in the image whose sources have changed
+} bytecode_t;
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t capacity;
+} dump_t;
+
+static char BYTECODE_KEY;
+
+static bytecode_t *get_bytecode(lua_State *L) {
+  bytecode_t *bc;
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &BYTECODE_KEY);
+  bc = (bytecode_t *) lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return bc;
+}
+
+static int dump_writer(lua_State *L, const void *p, size_t size, void *ud) {
+  dump_t *dump = (dump_t *) ud;
+  size_t capacity = dump->capacity ? dump->capacity : 4096;
+  char *data;
+
+  while (capacity < dump->len + size) capacity *= 2;
+  if (capacity != dump->capacity) {
+    if (!(data = (char *) realloc(dump->data, capacity))) return 1;
+    dump->data = data;
+    dump->capacity = capacity;
+  }
+  memcpy(dump->data + dump->len, p, size);
+  dump->len += size;
+  return 0;
+}
+
+static char *read_file(const char *path, size_t *len) {
+  FILE *file = fopen(path, "rb");
+  char *data = NULL;
+  long size;
+
+  if (!file) return NULL;
+  if (!fseek(file, 0, SEEK_END) && (size = ftell(file)) >= 0 && !fseek(file, 0, SEEK_SET) &&
+      (data = (char *) malloc(size > 0 ? size : 1)) != NULL) {
+    if (fread(data, 1, size, file) == (size_t) size) {
+      *len = (size_t) size;
+    } else {
+      free(data);
+      data = NULL;
+    }
+  }
+  fclose(file);
+  return data;
+}
+
+/*
+ * Writes `parts` to `path` by way of a temporary file, so that a reader
+ * never sees half of it.
+ */
+static int write_file(const char *path, const void **parts, const size_t *lens, int count) {
+  char tmp[PATH_MAX];
+  FILE *file;
+  int i, err = 0;
+
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid());
+  if (!(file = fopen(tmp, "wb"))) return errno;
+  for (i = 0; i < count && !err; i++) {
+    if (lens[i] && fwrite(parts[i], 1, lens[i], file) != lens[i]) err = errno ? errno : EIO;
+  }
+  if (fclose(file) && !err) err = errno;
+  if (!err && rename(tmp, path)) err = errno;
+  if (err) unlink(tmp);
+  return err;
+}
+
+/*
+ * Returns the freeable path of the cache file for the script at `path`, or
+ * NULL if there's nowhere to keep one.
+ */
+static char *cache_file_for(const char *path) {
+  char name[32];
+  uint64_t hash = 14695981039346656037ULL;  // FNV-1a
+  const char *ch;
+
+  for (ch = path; *ch; ch++) {
+    hash ^= (unsigned char) *ch;
+    hash *= 1099511628211ULL;
+  }
+  snprintf(name, sizeof(name), "%016llx.luac", (unsigned long long) hash);
+  return find_writable_file("bytecode", name);
+}
+
+/*
+ * Pushes the cached chunk for the script at `path` and returns 0, or
+ * returns nonzero without pushing anything if the cache is missing, stale
+ * or unreadable.
+ */
+static int load_from_cache(lua_State *L, const char *cache_file, const char *path, struct stat *st) {
+  cache_header_t header;
+  size_t len, path_len = strlen(path);
+  char *data;
+  int err = 1;
+
+  if (!(data = read_file(cache_file, &len))) return 1;
+  if (len >= sizeof(header)) {
+    memcpy(&header, data, sizeof(header));
+    if (!memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) &&
+        header.mtime_sec  == (int64_t) st->st_mtim.tv_sec &&
+        header.mtime_nsec == (int64_t) st->st_mtim.tv_nsec &&
+        header.size       == (int64_t) st->st_size &&
+        header.path_len   == path_len &&
+        len >= sizeof(header) + path_len &&
+        !memcmp(data + sizeof(header), path, path_len)) {
+      err = luaL_loadbufferx(L, data + sizeof(header) + path_len,
+                             len - sizeof(header) - path_len, path, "b");
+      if (err) {
+        LDEBUG("lua: bytecode: ignoring %s: %s", cache_file, lua_tostring(L, -1));
+        lua_pop(L, 1);
+      }
+    }
+  }
+  free(data);
+  return err;
+}
+
+/*
+ * Writes the chunk at the top of the stack to the cache, as the compiled
+ * form of the script at `path`.
+ */
+static int write_to_cache(lua_State *L, const char *cache_file, const char *path, struct stat *st) {
+  cache_header_t header;
+  dump_t dump = { NULL, 0, 0 };
+  char *dir = strdup(cache_file);
+  const void *parts[3];
+  size_t lens[3];
+  int err;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+  header.mtime_sec  = (int64_t) st->st_mtim.tv_sec;
+  header.mtime_nsec = (int64_t) st->st_mtim.tv_nsec;
+  header.size       = (int64_t) st->st_size;
+  header.path_len   = (uint32_t) strlen(path);
+
+  if (!(err = mkdir_p(dirname(dir)))) {
+    if (lua_dump(L, dump_writer, &dump, 0)) {
+      err = ENOMEM;
+    } else {
+      parts[0] = &header;   lens[0] = sizeof(header);
+      parts[1] = path;      lens[1] = header.path_len;
+      parts[2] = dump.data; lens[2] = dump.len;
+      err = write_file(cache_file, parts, lens, 3);
+    }
+  }
+  if (err) LWARN("lua: bytecode: couldn't cache %s in %s: %s", path, cache_file, strerror(err));
+  free(dump.data);
+  free(dir);
+  return err;
+}
+
+/*
+ * Loads the script at `filename` like `luaL_loadfilex` does, but from its
+ * cached bytecode if that's still current, caching it if it isn't.
+ */
+int lua_load_cached(lua_State *L, const char *filename) {
+  bytecode_t *bc = get_bytecode(L);
+  char *cache_file = NULL;
+  struct stat st;
+  int err;
+
+  if (!filename || !bc || !bc->cache || stat(filename, &st) || !S_ISREG(st.st_mode) ||
+      !(cache_file = cache_file_for(filename)))
+    return luaL_loadfilex(L, filename, NULL);
+
+  if (!load_from_cache(L, cache_file, filename, &st)) {
+    bc->hits++;
+    free(cache_file);
+    return LUA_OK;
+  }
+
+  bc->misses++;
+  if ((err = luaL_loadfilex(L, filename, NULL)) == LUA_OK &&
+      !write_to_cache(L, cache_file, filename, &st))
+    bc->writes++;
+  free(cache_file);
+  return err;
+}
+
+/*
+ * Replaces the stock searcher for Lua files, finding them the same way but
+ * loading them through the cache.
+ */
+static int search_cached(lua_State *L) {
+  const char *name = luaL_checkstring(L, 1);
+  const char *filename;
+
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "searchpath");
+  lua_pushstring(L, name);
+  lua_getfield(L, -3, "path");
+  if (!lua_isstring(L, -1)) return luaL_error(L, "'package.path' must be a string");
+  lua_call(L, 2, 2);
+  if (lua_isnil(L, -2)) return 1;  // the list of files tried
+
+  filename = lua_tostring(L, -2);
+  if (lua_load_cached(L, filename) != LUA_OK)
+    return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s",
+                      name, filename, lua_tostring(L, -1));
+  lua_pushstring(L, filename);
+  return 2;
+}
+
+/*
+ * Returns true if the source of `entry` is still beside the image and has
+ * changed since the image was built. A missing source doesn't count, since
+ * an image may well be shipped without them.
+ */
+static bool is_stale(bytecode_t *bc, bundle_entry_t *entry) {
+  char path[PATH_MAX];
+  struct stat st;
+
+  snprintf(path, sizeof(path), "%s/%.*s", bc->image_dir, (int) entry->path_len, entry->path);
+  if (stat(path, &st) || !S_ISREG(st.st_mode)) return false;
+  if (entry->mtime_sec  == (int64_t) st.st_mtim.tv_sec &&
+      entry->mtime_nsec == (int64_t) st.st_mtim.tv_nsec &&
+      entry->size       == (int64_t) st.st_size)
+    return false;
+  LWARN("lua: bytecode: %s has changed since %s was built; loading it instead", path, bc->image_path);
+  return true;
+}
+
+/*
+ * Finds modules in the precompiled image.
+ */
+static int search_bundle(lua_State *L) {
+  const char *name = luaL_checkstring(L, 1);
+  bytecode_t *bc = get_bytecode(L);
+  size_t name_len = strlen(name);
+  uint32_t i;
+
+  for (i = 0; i < bc->count; i++) {
+    bundle_entry_t *entry = &bc->entries[i];
+    if (entry->name_len != name_len || memcmp(entry->name, name, name_len)) continue;
+    if (is_stale(bc, entry)) {
+      bc->stale++;
+      lua_pushfstring(L, "\n\tstale module '%s' in '%s'", name, bc->image_path);
+      return 1;
+    }
+    if (luaL_loadbufferx(L, entry->chunk, entry->chunk_len, name, "b") != LUA_OK) {
+      LWARN("lua: bytecode: couldn't load %s from %s: %s", name, bc->image_path, lua_tostring(L, -1));
+      lua_pushfstring(L, "\n\tno usable module '%s' in '%s'", name, bc->image_path);
+      return 1;
+    }
+    bc->bundled++;
+    lua_pushstring(L, bc->image_path);
+    return 2;
+  }
+
+  lua_pushfstring(L, "\n\tno module '%s' in '%s'", name, bc->image_path);
+  return 1;
+}
+
+/*
+ * Returns the freeable path of the first image in the `READ_PATHS`, or NULL.
+ * Not having one is usual, so unlike `find_readable_file` this doesn't warn
+ * about it.
+ */
+static char *find_bundle(void) {
+  char *paths = strdup(getenv("READ_PATHS") == NULL ? DEFAULT_READ_PATHS : getenv("READ_PATHS"));
+  char *dir, *saveptr = NULL, *path = NULL;
+  const char separator[2] = { MULTI_PATH_SEPARATOR, '\0' };
+
+  for (dir = strtok_r(paths, separator, &saveptr); dir; dir = strtok_r(NULL, separator, &saveptr)) {
+    if (asprintf(&path, "%s/%s", dir, BUNDLE_NAME) < 0) {
+      path = NULL;
+      break;
+    }
+    if (!access(path, R_OK)) break;
+    free(path);
+    path = NULL;
+  }
+  free(paths);
+  return path;
+}
+
+/*
+ * Reads the image at `path`, indexing its entries. Returns nonzero if it
+ * isn't a well-formed image.
+ */
+static int open_bundle(bytecode_t *bc, const char *path) {
+  bundle_header_t header;
+  bundle_entry_header_t entry;
+  size_t len, offset;
+  uint32_t i;
+
+  if (!(bc->image = read_file(path, &len))) return 1;
+  if (len < sizeof(header)) goto invalid;
+  memcpy(&header, bc->image, sizeof(header));
+  if (memcmp(header.magic, BUNDLE_MAGIC, sizeof(header.magic))) goto invalid;
+  if (header.count > len / sizeof(entry)) goto invalid;
+  bc->entries = (bundle_entry_t *) calloc(header.count ? header.count : 1, sizeof(bundle_entry_t));
+
+  offset = sizeof(header);
+  for (i = 0; i < header.count; i++) {
+    if (len - offset < sizeof(entry)) goto invalid;
+    memcpy(&entry, bc->image + offset, sizeof(entry));
+    offset += sizeof(entry);
+    if (len - offset < (size_t) entry.name_len + entry.path_len + entry.chunk_len) goto invalid;
+    bc->entries[i].name       = bc->image + offset;
+    bc->entries[i].name_len   = entry.name_len;
+    bc->entries[i].path       = bc->image + offset + entry.name_len;
+    bc->entries[i].path_len   = entry.path_len;
+    bc->entries[i].chunk      = bc->image + offset + entry.name_len + entry.path_len;
+    bc->entries[i].chunk_len  = entry.chunk_len;
+    bc->entries[i].mtime_sec  = entry.mtime_sec;
+    bc->entries[i].mtime_nsec = entry.mtime_nsec;
+    bc->entries[i].size       = entry.size;
+    offset += (size_t) entry.name_len + entry.path_len + entry.chunk_len;
+  }
+  bc->count = header.count;
+  bc->image_path = strdup(path);
+  bc->image_dir = strdup(path);
+  dirname(bc->image_dir);
+  return 0;
+
+invalid:
+  free(bc->image);
+  free(bc->entries);
+  bc->image = NULL;
+  bc->entries = NULL;
+  return 1;
+}
+
+/*
+ * Returns how scripts have been loaded by this Lua state so far, as a table
+ * with these fields:
+ *
+ * * `hits`: scripts loaded from the cache
+ * * `misses`: scripts compiled from source, because their cached bytecode
+ *   was missing or out of date
+ * * `writes`: compiled scripts which were then cached
+ * * `bundled`: modules loaded from the precompiled image
+ * * `stale`: modules in the image which were loaded from their sources
+ *   instead, because those have changed since the image was built
+ * * `image`: the path to the precompiled image, if there is one
+ *
+ * Examples:
+ *
+ *     bytecode = require("bytecode")
+ *     stats = bytecode.stats()
+ *     print(stats.hits .. " cached, " .. stats.misses .. " compiled")
+ */
+static int bytecode_stats(lua_State *L) {
+  bytecode_t *bc = get_bytecode(L);
+
+  lua_newtable(L);
+  lua_pushinteger(L, bc->hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, bc->misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushinteger(L, bc->writes);
+  lua_setfield(L, -2, "writes");
+  lua_pushinteger(L, bc->bundled);
+  lua_setfield(L, -2, "bundled");
+  lua_pushinteger(L, bc->stale);
+  lua_setfield(L, -2, "stale");
+  if (bc->image_path) {
+    lua_pushstring(L, bc->image_path);
+    lua_setfield(L, -2, "image");
+  }
+  return 1;
+}
+
+static int bytecode_gc(lua_State *L) {
+  bytecode_t *bc = (bytecode_t *) luaL_checkudata(L, 1, MT_BYTECODE);
+  free(bc->image_path);
+  free(bc->image_dir);
+  free(bc->image);
+  free(bc->entries);
+  bc->image_path = bc->image_dir = bc->image = NULL;
+  bc->entries = NULL;
+  bc->count = 0;
+  return 0;
+}
+
+static const luaL_Reg bytecode_methods[] = {
+  {"stats", bytecode_stats},
+  {NULL,    NULL}
+};
+
+LUALIB_API int luaopen_bytecode(lua_State *L) {
+  lua_newtable(L);
+  luaL_setfuncs(L, bytecode_methods, 0);
+  return 1;
+}
+
+typedef struct {
+  char **paths;
+  int count;
+} script_list_t;
+
+static void collect_script(const char *path, const char *name, int type, int level, void *arg) {
+  script_list_t *list = (script_list_t *) arg;
+  size_t len = strlen(name);
+
+  if (type == DT_DIR || len < 5 || strcmp(name + len - 4, ".lua")) return;
+  list->paths = (char **) realloc(list->paths, (list->count + 1) * sizeof(char *));
+  if (asprintf(&list->paths[list->count], "%s/%s", path, name) >= 0) list->count++;
+}
+
+static int compare_paths(const void *a, const void *b) {
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * Turns a script's path beneath `dir` into the name `require` knows it by:
+ * "net/http.lua" into "net.http", and "net/init.lua" into "net".
+ */
+static char *module_name(const char *dir, const char *path) {
+  char *name = strdup(path + strlen(dir) + 1), *ch;
+  size_t len;
+
+  name[strlen(name) - 4] = '\0';
+  len = strlen(name);
+  if (len > 5 && !strcmp(name + len - 5, "/init")) name[len - 5] = '\0';
+  for (ch = name; *ch; ch++) {
+    if (*ch == '/') *ch = '.';
+  }
+  return name;
+}
+
+/*
+ * Compiles every script beneath `dir` into DIR/scripts.luab. Returns 0 on
+ * success.
+ */
+int lua_bundle_scripts(const char *dir) {
+  script_list_t list = { NULL, 0 };
+  dump_t dump = { NULL, 0, 0 };
+  bundle_header_t header;
+  bundle_entry_header_t entry;
+  lua_State *L;
+  char *image_path = NULL, *name;
+  const void *parts[1];
+  size_t lens[1];
+  struct stat st;
+  int i, err = 0;
+
+  if (!dir) {
+    LERROR("lua: bytecode: no directory to bundle");
+    return 1;
+  }
+  if (!(L = luaL_newstate())) {
+    LERROR("lua: bytecode: couldn't create a Lua state to compile with");
+    return 1;
+  }
+
+  walkdir(dir, 0, collect_script, &list);
+  qsort(list.paths, list.count, sizeof(char *), compare_paths);
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+  header.count = (uint32_t) list.count;
+  dump_writer(L, &header, sizeof(header), &dump);
+
+  for (i = 0; i < list.count && !err; i++) {
+    size_t offset = dump.len;
+    const char *path = list.paths[i] + strlen(dir) + 1;
+    if (stat(list.paths[i], &st)) {
+      LERROR("lua: bytecode: %s: %s", list.paths[i], strerror(errno));
+      err = 1;
+      break;
+    }
+    if (luaL_loadfilex(L, list.paths[i], "t") != LUA_OK) {
+      LERROR("lua: bytecode: %s", lua_tostring(L, -1));
+      err = 1;
+      break;
+    }
+    name = module_name(dir, list.paths[i]);
+    memset(&entry, 0, sizeof(entry));
+    entry.mtime_sec  = (int64_t) st.st_mtim.tv_sec;
+    entry.mtime_nsec = (int64_t) st.st_mtim.tv_nsec;
+    entry.size       = (int64_t) st.st_size;
+    entry.name_len   = (uint32_t) strlen(name);
+    entry.path_len   = (uint32_t) strlen(path);
+    dump_writer(L, &entry, sizeof(entry), &dump);
+    dump_writer(L, name, entry.name_len, &dump);
+    dump_writer(L, path, entry.path_len, &dump);
+    if (lua_dump(L, dump_writer, &dump, 0)) {
+      err = 1;
+    } else {
+      entry.chunk_len = (uint32_t) (dump.len - offset - sizeof(entry) - entry.name_len - entry.path_len);
+      memcpy(dump.data + offset, &entry, sizeof(entry));
+      LINFO("lua: bytecode: bundled %s as '%s'", list.paths[i], name);
+    }
+    lua_pop(L, 1);
+    free(name);
+  }
+
+  if (!err && asprintf(&image_path, "%s/%s", dir, BUNDLE_NAME) >= 0) {
+    parts[0] = dump.data;
+    lens[0] = dump.len;
+    if ((err = write_file(image_path, parts, lens, 1)))
+      LERROR("lua: bytecode: couldn't write %s: %s", image_path, strerror(err));
+    else
+      LINFO("lua: bytecode: wrote %d scripts to %s", list.count, image_path);
+  }
+
+  for (i = 0; i < list.count; i++) free(list.paths[i]);
+  free(list.paths);
+  free(image_path);
+  free(dump.data);
+  lua_close(L);
+  return err;
+}
+
+int init_bytecode_lua(lua_State *L) {
+  bytecode_t *bc = (bytecode_t *) lua_newuserdata(L, sizeof(bytecode_t));
+  const char *setting = getenv("LUA_BYTECODE_CACHE");
+  char *image_path;
+  int i, n;
+
+  memset(bc, 0, sizeof(bytecode_t));
+  luaL_newmetatable(L, MT_BYTECODE);
+  lua_pushcfunction(L, bytecode_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, &BYTECODE_KEY);
+  bc->cache = !setting || strcmp(setting, "0");
+
+  // Get package.searchers so we can put ours in place of the file searcher.
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "searchers");
+  lua_pushcfunction(L, search_cached);
+  lua_rawseti(L, -2, 2);
+
+  // ...and look in the image, if there is one, before that.
+  if ((image_path = find_bundle()) != NULL) {
+    if (open_bundle(bc, image_path)) {
+      LWARN("lua: bytecode: %s is not a script bundle", image_path);
+    } else {
+      n = (int) lua_rawlen(L, -1);
+      for (i = n; i >= 2; i--) {
+        lua_rawgeti(L, -1, i);
+        lua_rawseti(L, -2, i + 1);
+      }
+      lua_pushcfunction(L, search_bundle);
+      lua_rawseti(L, -2, 2);
+    }
+    free(image_path);
+  }
+  lua_pop(L, 1);
+
+  // Get package.preload so we can store builtins in it.
+  lua_getfield(L, -1, "preload");
+  lua_remove(L, -2); // Remove package
+  lua_pushcfunction(L, luaopen_bytecode);
+  lua_setfield(L, -2, "bytecode");
+  lua_pop(L, 1);
+  return 0;
+}
+
+void shutdown_bytecode_lua(lua_State *L) {
+  bytecode_t *bc = get_bytecode(L);
+  if (bc && (bc->hits || bc->misses || bc->bundled))
+    LDEBUG("lua: bytecode: %d cached, %d compiled, %d bundled",
+           (int) bc->hits, (int) bc->misses, (int) bc->bundled);
+}
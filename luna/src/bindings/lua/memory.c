@@ -0,0 +1,457 @@
+#define LUA_LIB
+
+#include "config.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <czmq.h>
+
+#include "services/logger.h"
+#include "services/settings.h"
+#include "util/lua_memory.h"
+#include "util/utlist.h"
+
+/*
+ * The allocator for every Lua state which runs a script.
+ *
+ * Small blocks, which are most of what Lua allocates (strings, tables,
+ * closures, upvalues), come from per-state pools, one for each multiple of
+ * POOL_GRANULE up to POOL_MAX_SIZE. Lua tells the allocator the size of each
+ * block it frees or resizes, so a block needs no header to find its way back
+ * to its pool. Pools grow a slab at a time. Slabs are aligned to their size,
+ * so the slab a block belongs to is found from its address, and a slab is
+ * given back once none of its blocks are in use, unless it's the last one
+ * its pool has room in. Larger blocks go to malloc.
+ *
+ * Each state counts the bytes it has live and the most it has had live. If
+ * it's given a limit ("lua.memory_limit" in settings, or `memory.limit()`),
+ * growing past it fails as though memory had run out: Lua collects garbage
+ * and tries again, and then raises a memory error in the script, rather than
+ * the device running out of memory. The limit counts what the state holds,
+ * whole slabs included, as well as the bytes Lua asked for.
+ *
+ * Lua never expects a block to fail to shrink. A block which can't be moved
+ * to a smaller pool, for want of memory, stays where it is instead.
+ *
+ * The counters are the state's own, updated without locking. After each
+ * allocation they're copied into the state's account (see
+ * src/util/lua_memory.c) with atomic stores, which is what the REST API
+ * reads from its own threads.
+ *
+ * The garbage collector's pause and step multiplier are taken from
+ * "lua.gc_pause" and "lua.gc_stepmul". Settings are read when a state is
+ * created, so changes apply to the next script run.
+ */
+
+#define POOL_GRANULE  16
+#define POOL_MAX_SIZE 256
+#define NUM_POOLS     (POOL_MAX_SIZE / POOL_GRANULE)
+#define SLAB_SIZE     (16 * 1024) // a power of 2, since slabs are aligned to it
+#define SLAB_HEADER   ((sizeof(slab_t) + 15) & ~(size_t) 15) // keeps the blocks after it aligned
+
+typedef struct block_t {
+  struct block_t *next;
+} block_t;
+
+typedef struct slab_t {
+  struct slab_t *prev, *next;   // all of the state's slabs
+  struct slab_t *fprev, *fnext; // those of its pool with free blocks
+  block_t *free;
+  unsigned int used;            // blocks handed out
+  int pool;
+} slab_t;
+
+/*
+ * A block from malloc which Lua believes to be smaller than it is, because
+ * it couldn't be moved when Lua shrank it.
+ */
+typedef struct kept_t {
+  void *ptr;
+  size_t size;
+  struct kept_t *next;
+} kept_t;
+
+typedef struct lua_memory_t {
+  size_t live;                  // bytes Lua has allocated and not freed
+  size_t peak;
+  size_t limit;                 // or 0 for none
+  size_t pooled;                // bytes in slabs
+  size_t unpooled;              // bytes in blocks from malloc
+  unsigned long allocations;
+  unsigned long failures;       // refused for the limit, or out of memory
+  bool warned;
+  slab_t *partial[NUM_POOLS];   // each pool's slabs with free blocks
+  slab_t *slabs;
+  kept_t *kept;
+  lua_memory_account_t account; // the counters, as other threads see them
+} lua_memory_t;
+
+static int pool_for(size_t size) {
+  return size <= POOL_MAX_SIZE ? (int) ((size - 1) / POOL_GRANULE) : NUM_POOLS;
+}
+
+static slab_t *slab_of(void *ptr) {
+  return (slab_t *) ((uintptr_t) ptr & ~(uintptr_t) (SLAB_SIZE - 1));
+}
+
+static kept_t *find_kept(lua_memory_t *mem, void *ptr) {
+  kept_t *kept = NULL;
+  if (mem->kept) LL_SEARCH_SCALAR(mem->kept, kept, ptr, ptr);
+  return kept;
+}
+
+/*
+ * Returns the pool the block at `ptr`, of `size` bytes as far as Lua knows,
+ * came from, or NUM_POOLS if it came from malloc.
+ */
+static int pool_of(lua_memory_t *mem, void *ptr, size_t size) {
+  if (pool_for(size) == NUM_POOLS || find_kept(mem, ptr)) return NUM_POOLS;
+  return slab_of(ptr)->pool;
+}
+
+static bool can_hold(lua_memory_t *mem, size_t more) {
+  return !mem->limit || mem->pooled + mem->unpooled + more <= mem->limit;
+}
+
+/*
+ * Takes a block from a pool, growing it if need be and, when `limited`, if
+ * the limit allows.
+ */
+static void *pool_acquire(lua_memory_t *mem, int pool, bool limited) {
+  size_t block_size = (size_t) (pool + 1) * POOL_GRANULE, offset;
+  slab_t *slab = mem->partial[pool];
+  block_t *block;
+  void *ptr;
+
+  if (!slab) {
+    if ((limited && !can_hold(mem, SLAB_SIZE)) || posix_memalign(&ptr, SLAB_SIZE, SLAB_SIZE))
+      return NULL;
+    slab = (slab_t *) ptr;
+    memset(slab, 0, sizeof(slab_t));
+    slab->pool = pool;
+    for (offset = SLAB_HEADER; offset + block_size <= SLAB_SIZE; offset += block_size) {
+      block = (block_t *) ((char *) slab + offset);
+      block->next = slab->free;
+      slab->free = block;
+    }
+    DL_APPEND(mem->slabs, slab);
+    DL_PREPEND2(mem->partial[pool], slab, fprev, fnext);
+    mem->pooled += SLAB_SIZE;
+  }
+  block = slab->free;
+  slab->free = block->next;
+  slab->used++;
+  if (!slab->free) DL_DELETE2(mem->partial[pool], slab, fprev, fnext);
+  return block;
+}
+
+static void pool_release(lua_memory_t *mem, void *ptr) {
+  slab_t *slab = slab_of(ptr);
+  block_t *block = (block_t *) ptr;
+
+  if (!slab->free) DL_PREPEND2(mem->partial[slab->pool], slab, fprev, fnext);
+  block->next = slab->free;
+  slab->free = block;
+  if (--slab->used == 0 && (mem->partial[slab->pool] != slab || slab->fnext)) {
+    DL_DELETE2(mem->partial[slab->pool], slab, fprev, fnext);
+    DL_DELETE(mem->slabs, slab);
+    free(slab);
+    mem->pooled -= SLAB_SIZE;
+  }
+}
+
+static void *acquire(lua_memory_t *mem, size_t size, bool limited) {
+  int pool = pool_for(size);
+  void *block;
+
+  if (pool < NUM_POOLS) return pool_acquire(mem, pool, limited);
+  if ((limited && !can_hold(mem, size)) || !(block = malloc(size))) return NULL;
+  mem->unpooled += size;
+  return block;
+}
+
+static void release(lua_memory_t *mem, void *ptr, size_t size) {
+  kept_t *kept = find_kept(mem, ptr);
+
+  if (kept) {
+    size = kept->size;
+    LL_DELETE(mem->kept, kept);
+    free(kept);
+  } else if (pool_for(size) < NUM_POOLS) {
+    pool_release(mem, ptr);
+    return;
+  }
+  mem->unpooled -= size;
+  free(ptr);
+}
+
+/*
+ * Remembers that the block from malloc at `ptr` is `size` bytes, whatever
+ * Lua is told. Returns false if there's no memory even for that.
+ */
+static bool keep(lua_memory_t *mem, void *ptr, size_t size) {
+  kept_t *kept;
+
+  if (find_kept(mem, ptr)) return true;
+  if (!(kept = (kept_t *) malloc(sizeof(kept_t)))) return false;
+  kept->ptr = ptr;
+  kept->size = size;
+  LL_PREPEND(mem->kept, kept);
+  return true;
+}
+
+/*
+ * Resizes a block from malloc to another size too large for the pools.
+ * Fails only if it's growing.
+ */
+static void *resize_unpooled(lua_memory_t *mem, void *ptr, size_t old, size_t nsize) {
+  kept_t *kept = find_kept(mem, ptr);
+  size_t held = kept ? kept->size : old;
+  void *block;
+
+  if (nsize > held && !can_hold(mem, nsize - held)) return NULL;
+  if (!(block = realloc(ptr, nsize)))
+    return nsize <= old && keep(mem, ptr, held) ? ptr : NULL;
+  if (kept) {
+    LL_DELETE(mem->kept, kept);
+    free(kept);
+  }
+  mem->unpooled = mem->unpooled - held + nsize;
+  return block;
+}
+
+// copies the counters into the account
+static void publish(lua_memory_t *mem) {
+  lua_memory_account_t *account = &mem->account;
+  __atomic_store_n(&account->live,        mem->live,        __ATOMIC_RELAXED);
+  __atomic_store_n(&account->peak,        mem->peak,        __ATOMIC_RELAXED);
+  __atomic_store_n(&account->limit,       mem->limit,       __ATOMIC_RELAXED);
+  __atomic_store_n(&account->pooled,      mem->pooled,      __ATOMIC_RELAXED);
+  __atomic_store_n(&account->allocations, mem->allocations, __ATOMIC_RELAXED);
+  __atomic_store_n(&account->failures,    mem->failures,    __ATOMIC_RELAXED);
+}
+
+static void *refuse(lua_memory_t *mem, size_t nsize) {
+  mem->failures++;
+  if (mem->limit && !mem->warned) {
+    LWARN("lua: memory: refused %lu bytes with %lu of %lu in use",
+          (unsigned long) nsize, (unsigned long) mem->live, (unsigned long) mem->limit);
+    mem->warned = true;
+  }
+  publish(mem);
+  return NULL;
+}
+
+static void *lua_memory_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+  lua_memory_t *mem = (lua_memory_t *) ud;
+  size_t old = ptr ? osize : 0; // without a block, osize is the kind of object
+  bool grow = nsize > old;
+  int from, to;
+  void *block;
+
+  if (nsize == 0) {
+    if (ptr) {
+      release(mem, ptr, old);
+      mem->live -= old;
+      publish(mem);
+    }
+    return NULL;
+  }
+  if (grow && mem->limit && mem->live - old + nsize > mem->limit)
+    return refuse(mem, nsize);
+
+  from = ptr ? pool_of(mem, ptr, old) : -1;
+  to = pool_for(nsize);
+  if (from == to && to < NUM_POOLS) {
+    block = ptr;
+  } else if (from == NUM_POOLS && to == NUM_POOLS) {
+    if (!(block = resize_unpooled(mem, ptr, old, nsize))) return refuse(mem, nsize);
+  } else if ((block = acquire(mem, nsize, grow)) != NULL) {
+    if (ptr) {
+      memcpy(block, ptr, old < nsize ? old : nsize);
+      release(mem, ptr, old);
+    }
+  } else if (ptr && !grow && (from < NUM_POOLS || keep(mem, ptr, old))) {
+    block = ptr;  // it stays in the pool, or with malloc, that it came from
+  } else {
+    return refuse(mem, nsize);
+  }
+
+  if (!ptr) mem->allocations++;
+  mem->live = mem->live - old + nsize;
+  if (mem->live > mem->peak) mem->peak = mem->live;
+  publish(mem);
+  return block;
+}
+
+static lua_memory_t *get_memory(lua_State *L) {
+  void *ud = NULL;
+  return lua_getallocf(L, &ud) == lua_memory_alloc ? (lua_memory_t *) ud : NULL;
+}
+
+/*
+ * Creates a Lua state which allocates through the pools, or returns NULL if
+ * there's no memory for it.
+ */
+lua_State *lua_memory_newstate(void) {
+  lua_memory_t *mem = (lua_memory_t *) calloc(1, sizeof(lua_memory_t));
+  lua_State *L;
+
+  if (!mem) return NULL;
+  if (!(L = lua_newstate(lua_memory_alloc, mem))) {
+    free(mem);
+    return NULL;
+  }
+  publish(mem);
+  lua_memory_account_add(&mem->account);
+  return L;
+}
+
+/*
+ * Closes a state made by `lua_memory_newstate`, and frees its pools.
+ */
+void lua_memory_close(lua_State *L) {
+  lua_memory_t *mem = get_memory(L);
+  slab_t *slab, *tmp;
+  kept_t *kept, *next;
+
+  lua_close(L);
+  if (!mem) return;
+  lua_memory_account_remove(&mem->account);
+  DL_FOREACH_SAFE(mem->slabs, slab, tmp) free(slab);
+  LL_FOREACH_SAFE(mem->kept, kept, next) free(kept);
+  free(mem);
+}
+
+/*
+ * Returns how much memory this Lua state is using, as a table with these
+ * fields:
+ *
+ * * `live`: bytes allocated and not yet freed
+ * * `peak`: the most bytes that have been live at once
+ * * `limit`: the most bytes which may be live at once, or 0 for no limit
+ * * `pooled`: bytes set aside for small allocations, used or not
+ * * `allocations`: how many blocks have been allocated
+ * * `failures`: how many allocations were refused, for the limit or for
+ *   want of memory
+ *
+ * Examples:
+ *
+ *     memory = require("memory")
+ *     stats = memory.stats()
+ *     print(stats.live .. " bytes in use, at most " .. stats.peak)
+ */
+static int memory_stats(lua_State *L) {
+  lua_memory_t *mem = get_memory(L);
+
+  if (!mem) return luaL_error(L, "memory: this Lua state has its own allocator");
+  lua_newtable(L);
+  lua_pushinteger(L, (lua_Integer) mem->live);
+  lua_setfield(L, -2, "live");
+  lua_pushinteger(L, (lua_Integer) mem->peak);
+  lua_setfield(L, -2, "peak");
+  lua_pushinteger(L, (lua_Integer) mem->limit);
+  lua_setfield(L, -2, "limit");
+  lua_pushinteger(L, (lua_Integer) mem->pooled);
+  lua_setfield(L, -2, "pooled");
+  lua_pushinteger(L, (lua_Integer) mem->allocations);
+  lua_setfield(L, -2, "allocations");
+  lua_pushinteger(L, (lua_Integer) mem->failures);
+  lua_setfield(L, -2, "failures");
+  return 1;
+}
+
+/*
+ * Returns the most bytes this Lua state may have live at once, or 0 if it
+ * may have any number. If a number is given, it becomes the new limit
+ * first; 0 removes the limit. Once the limit is reached, allocations fail
+ * with a memory error, which can be caught with `pcall`.
+ *
+ * Examples:
+ *
+ *     memory = require("memory")
+ *     memory.limit(4 * 1024 * 1024)
+ *     ok, err = pcall(string.rep, "x", 8 * 1024 * 1024)
+ *     -- ok == false, err == "not enough memory"
+ */
+static int memory_limit(lua_State *L) {
+  lua_memory_t *mem = get_memory(L);
+
+  if (!mem) return luaL_error(L, "memory: this Lua state has its own allocator");
+  if (!lua_isnoneornil(L, 1)) {
+    lua_Integer limit = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, limit >= 0, 1, "limit must not be negative");
+    mem->limit = (size_t) limit;
+    mem->warned = false;
+    publish(mem);
+  }
+  lua_pushinteger(L, (lua_Integer) mem->limit);
+  return 1;
+}
+
+static const luaL_Reg memory_methods[] = {
+  {"stats", memory_stats},
+  {"limit", memory_limit},
+  {NULL,    NULL}
+};
+
+LUALIB_API int luaopen_memory(lua_State *L) {
+  lua_newtable(L);
+  luaL_setfuncs(L, memory_methods, 0);
+  return 1;
+}
+
+static void apply_setting(lua_State *L, lua_memory_t *mem, const char *key, const char *value) {
+  long n = value ? atol(value) : -1;
+
+  if (n < 0 || (n == 0 && strcmp(key, "lua.memory_limit"))) {
+    LWARN("lua: memory: ignoring invalid value for %s: %s", key, value ? value : "(none)");
+    return;
+  }
+  if (!strcmp(key, "lua.memory_limit")) {
+    mem->limit = (size_t) n;
+    publish(mem);
+  } else if (!strcmp(key, "lua.gc_pause")) {
+    lua_gc(L, LUA_GCSETPAUSE, (int) n);
+  } else if (!strcmp(key, "lua.gc_stepmul")) {
+    lua_gc(L, LUA_GCSETSTEPMUL, (int) n);
+  }
+}
+
+int init_memory_lua(lua_State *L) {
+  lua_memory_t *mem = get_memory(L);
+  char *limit = NULL, *pause = NULL, *stepmul = NULL;
+  zsock_t *settings;
+
+  if (mem && settings_service_running()) {
+    settings = zsock_new_req(SETTINGS_ENDPOINT);
+    settings_get(settings, 3, "lua.memory_limit", "lua.gc_pause", "lua.gc_stepmul",
+                              &limit,             &pause,         &stepmul);
+    zsock_destroy(&settings);
+    apply_setting(L, mem, "lua.memory_limit", limit);
+    apply_setting(L, mem, "lua.gc_pause",     pause);
+    apply_setting(L, mem, "lua.gc_stepmul",   stepmul);
+    free(limit);
+    free(pause);
+    free(stepmul);
+  }
+
+  // Get package.preload so we can store builtins in it.
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "preload");
+  lua_remove(L, -2); // Remove package
+  lua_pushcfunction(L, luaopen_memory);
+  lua_setfield(L, -2, "memory");
+  lua_pop(L, 1);
+  return 0;
+}
+
+void shutdown_memory_lua(lua_State *L) {
+  lua_memory_t *mem = get_memory(L);
+  if (mem)
+    LDEBUG("lua: memory: peak %lu bytes, %lu allocations, %lu failures",
+           (unsigned long) mem->peak, mem->allocations, mem->failures);
+}
@@ -0,0 +1,621 @@
+#define LUA_LIB
+
+#include "config.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <czmq.h>
+
+#include "bindings.h"
+#include "services/logger.h"
+#include "util/utlist.h"
+
+/*
+ * One event loop for each Lua state. Coroutines started with
+ * `reactor.spawn()` run until they have to wait: for a zmq socket, a
+ * network socket, a file descriptor or a timer. The reactor then waits for
+ * all of them in a single `zmq_poll()` and resumes each coroutine when what
+ * it waits for is ready, so that nothing polls in a loop and no timer needs
+ * a round trip to the timer service.
+ *
+ * A coroutine waits by yielding. `reactor.sleep()` and `reactor.wait()`
+ * yield to the reactor directly. Anything else a coroutine yields is waited
+ * on through its `waitable()` method, which returns the zmq socket (as a
+ * light userdata) or descriptor to poll, "read" or "write", and how many
+ * milliseconds may pass before the coroutine must be resumed anyway. zmq
+ * sockets, the socket plugin's sockets and backend futures have one, and
+ * yield themselves when a call inside a coroutine would block. A descriptor can be yielded
+ * as a number, followed by "read" or "write". A coroutine which yields
+ * nothing is resumed again after everything else that's ready. When a task
+ * is cancelled, the object it waited on is told through its `abandon()`
+ * method, if it has one, so that it can give up on the call in progress.
+ */
+
+#define MT_REACTOR "MT_REACTOR"
+
+typedef struct task_t {
+  lua_State *co;
+  int ref;             // keeps the coroutine from being collected
+  int nargs;           // on its stack, to be passed to it when it's started
+  int waited;          // a reference to the object it yielded, or LUA_NOREF
+  void *socket;        // the zmq socket it waits for, or NULL
+  int fd;              // or the descriptor, or -1
+  short events;        // ZMQ_POLLIN or ZMQ_POLLOUT
+  long long deadline;  // when to resume it anyway, in microseconds, or -1
+  bool ready;
+  bool timed_out;      // it was resumed at its deadline, not by an event
+  bool done;           // finished, failed or cancelled; freed after the pass
+  struct task_t *prev, *next;
+} task_t;
+
+typedef struct {
+  task_t *tasks;
+  task_t *current;     // the task being resumed, if any
+  bool running;
+  zmq_pollitem_t *items;
+  task_t **polled;     // the task waiting for each item
+  int capacity;
+  lua_Integer wakeups; // returns from zmq_poll()
+  lua_Integer resumes;
+  lua_Integer errors;
+} reactor_t;
+
+// yielded by reactor.sleep() and reactor.wait(), which set up the task themselves
+static char WAIT_SENTINEL;
+static char REACTOR_KEY;
+
+// in microseconds, so that rounding never wakes a task before its time
+static long long now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static reactor_t *get_reactor(lua_State *L) {
+  reactor_t *reactor;
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &REACTOR_KEY);
+  reactor = (reactor_t *) lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return reactor;
+}
+
+/*
+ * Returns the task if `L` is a coroutine being run by the reactor, or NULL.
+ */
+static task_t *current_task(lua_State *L) {
+  reactor_t *reactor = get_reactor(L);
+  if (!reactor || !reactor->current || reactor->current->co != L) return NULL;
+  return reactor->current;
+}
+
+/*
+ * Whether `L` is a coroutine being run by the reactor, which can yield
+ * rather than block while it waits. See `src/bindings/lua/reactor.c`.
+ */
+int lua_reactor_owns(lua_State *L) {
+  return current_task(L) != NULL;
+}
+
+static void wait_for_nothing(task_t *task) {
+  task->socket = NULL;
+  task->fd = -1;
+  task->events = 0;
+  task->deadline = -1;
+  task->timed_out = false;
+}
+
+static void forget_waited(lua_State *L, task_t *task) {
+  luaL_unref(L, LUA_REGISTRYINDEX, task->waited);
+  task->waited = LUA_NOREF;
+}
+
+static void free_task(lua_State *L, reactor_t *reactor, task_t *task) {
+  DL_DELETE(reactor->tasks, task);
+  forget_waited(L, task);
+  luaL_unref(L, LUA_REGISTRYINDEX, task->ref);
+  free(task);
+}
+
+/*
+ * Finds what the object at `index` is to be waited on with: a descriptor
+ * given as a number, or whatever its `waitable()` method returns. Sets
+ * `*timeout` to the object's own timeout, or -1. Returns 0 if the object
+ * needs no waiting, 1 if it does, or -1 with an error message pushed if it
+ * can't be waited on.
+ */
+static int find_waitable(lua_State *L, int index, const char *what,
+                         void **socket, int *fd, short *events, lua_Integer *timeout) {
+  index = lua_absindex(L, index);
+  *socket = NULL;
+  *fd = -1;
+  *timeout = -1;
+
+  if (lua_isinteger(L, index)) {
+    *fd = (int) lua_tointeger(L, index);
+  } else if (luaL_getmetafield(L, index, "waitable") != LUA_TNIL) {
+    lua_pushvalue(L, index);
+    lua_call(L, 1, 3);
+    if (lua_islightuserdata(L, -3)) *socket = lua_touserdata(L, -3);
+    else if (lua_isinteger(L, -3)) *fd = (int) lua_tointeger(L, -3);
+    if (!what) what = lua_tostring(L, -2);
+    if (lua_isinteger(L, -1)) *timeout = lua_tointeger(L, -1);
+    lua_pop(L, 3);
+    if (!*socket && *fd < 0) return 0;
+  } else {
+    lua_pushfstring(L, "reactor: can't wait on a %s", luaL_typename(L, index));
+    return -1;
+  }
+
+  *events = what && !strcmp(what, "write") ? ZMQ_POLLOUT : ZMQ_POLLIN;
+  return 1;
+}
+
+/*
+ * Decides what a task which has just yielded `nres` values, now on top of
+ * `L`'s stack, is waiting for. Returns 0, or -1 with an error message
+ * pushed.
+ */
+static int await_yielded(lua_State *L, task_t *task, int nres) {
+  int base = lua_gettop(L) - nres + 1, res;
+  lua_Integer timeout;
+
+  if (nres > 0 && lua_touserdata(L, base) == &WAIT_SENTINEL) return 0;
+
+  wait_for_nothing(task);
+  if (nres == 0) {
+    task->ready = true;
+    return 0;
+  }
+  res = find_waitable(L, base, nres > 1 ? lua_tostring(L, base + 1) : NULL,
+                      &task->socket, &task->fd, &task->events, &timeout);
+  if (res < 0) return -1;
+  if (res == 0) {
+    task->ready = true;
+    return 0;
+  }
+  if (timeout >= 0) task->deadline = now_us() + timeout * 1000;
+  if (!lua_isinteger(L, base)) {
+    lua_pushvalue(L, base);
+    task->waited = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  return 0;
+}
+
+static void fail_task(lua_State *L, reactor_t *reactor, task_t *task, const char *message) {
+  luaL_traceback(L, task->co, message, 0);
+  LERROR("lua: reactor: task failed: %s", lua_tostring(L, -1));
+  lua_pop(L, 1);
+  reactor->errors++;
+  task->done = true;
+}
+
+static void resume_task(lua_State *L, reactor_t *reactor, task_t *task) {
+  int status, nres;
+
+  task->ready = false;
+  forget_waited(L, task);
+  reactor->current = task;
+  reactor->resumes++;
+  status = lua_resume(task->co, L, task->nargs);
+  reactor->current = NULL;
+  task->nargs = 0;
+
+  if (status == LUA_OK) {
+    task->done = true;
+  } else if (status == LUA_YIELD) {
+    nres = lua_gettop(task->co);
+    lua_xmove(task->co, L, nres);
+    if (await_yielded(L, task, nres)) {
+      fail_task(L, reactor, task, lua_tostring(L, -1));
+      lua_pop(L, 1);
+    }
+    lua_pop(L, nres);
+  } else {
+    fail_task(L, reactor, task, lua_tostring(task->co, -1));
+  }
+}
+
+/*
+ * Resumes every task which is ready, then frees the ones which are done.
+ * Tasks spawned meanwhile are run in the same pass.
+ */
+static void resume_ready(lua_State *L, reactor_t *reactor) {
+  task_t *task, *tmp;
+
+  DL_FOREACH(reactor->tasks, task) {
+    if (task->ready && !task->done) resume_task(L, reactor, task);
+  }
+  DL_FOREACH_SAFE(reactor->tasks, task, tmp) {
+    if (task->done) free_task(L, reactor, task);
+  }
+}
+
+static bool any_ready(reactor_t *reactor) {
+  task_t *task;
+  DL_FOREACH(reactor->tasks, task) {
+    if (task->ready) return true;
+  }
+  return false;
+}
+
+/*
+ * Waits until a task's socket or descriptor is ready, a task's deadline
+ * passes, or `until` (-1 for never) comes, then marks the tasks which can
+ * carry on. Returns -1 if there was nothing to wait for.
+ */
+static int poll_tasks(reactor_t *reactor, long long until) {
+  long long wake_at = until, now;
+  task_t *task;
+  int n = 0, count = 0, i, ret;
+
+  DL_FOREACH(reactor->tasks, task) count++;
+  if (count > reactor->capacity) {
+    reactor->items = (zmq_pollitem_t *) realloc(reactor->items, count * sizeof(zmq_pollitem_t));
+    reactor->polled = (task_t **) realloc(reactor->polled, count * sizeof(task_t *));
+    reactor->capacity = count;
+  }
+
+  DL_FOREACH(reactor->tasks, task) {
+    if (task->deadline >= 0 && (wake_at < 0 || task->deadline < wake_at))
+      wake_at = task->deadline;
+    if (!task->socket && task->fd < 0) continue;
+    reactor->items[n].socket = task->socket;
+    reactor->items[n].fd = task->fd;
+    reactor->items[n].events = task->events;
+    reactor->items[n].revents = 0;
+    reactor->polled[n++] = task;
+  }
+  if (n == 0 && wake_at < 0) return -1;
+
+  do {
+    now = now_us();
+    ret = zmq_poll(reactor->items, n, wake_at < 0 ? -1 : wake_at > now ? (long) ((wake_at - now + 999) / 1000) : 0);
+  } while (ret < 0 && errno == EINTR);
+  reactor->wakeups++;
+
+  for (i = 0; i < n; i++) {
+    if (reactor->items[i].revents) reactor->polled[i]->ready = true;
+  }
+  now = now_us();
+  DL_FOREACH(reactor->tasks, task) {
+    if (!task->ready && task->deadline >= 0 && task->deadline <= now)
+      task->ready = task->timed_out = true;
+  }
+  return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Starts a function as a new task, passing it the rest of the arguments,
+ * and returns its coroutine. It runs once `reactor.run()` is called, or,
+ * if the reactor is running already, as soon as the current task waits.
+ *
+ * Examples:
+ *
+ *     reactor = require('reactor')
+ *     reactor.spawn(function(name) print('hello ' .. name) end, 'world')
+ *     reactor.run()
+ */
+static int reactor_spawn(lua_State *L) {
+  reactor_t *reactor = get_reactor(L);
+  int nargs = lua_gettop(L) - 1;
+  task_t *task;
+
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  task = (task_t *) calloc(1, sizeof(task_t));
+  task->co = lua_newthread(L);
+  lua_pushvalue(L, -1);
+  task->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  task->waited = LUA_NOREF;
+  lua_rotate(L, 1, 1);          // the thread goes below the function and its arguments
+  lua_xmove(L, task->co, nargs + 1);
+  task->nargs = nargs;
+  wait_for_nothing(task);
+  task->ready = true;
+  DL_APPEND(reactor->tasks, task);
+  return 1;
+}
+
+static int wait_done(lua_State *L, int status, lua_KContext ctx) {
+  task_t *task = current_task(L);
+  lua_pushboolean(L, task && !task->timed_out);
+  return 1;
+}
+
+static int sleep_done(lua_State *L, int status, lua_KContext ctx) {
+  return 0;
+}
+
+/*
+ * Waits for a number of milliseconds. Inside a task, other tasks run
+ * meanwhile; anywhere else, this blocks.
+ *
+ * Examples:
+ *
+ *     reactor = require('reactor')
+ *     reactor.spawn(function()
+ *       reactor.sleep(500)
+ *       print('half a second later')
+ *     end)
+ *     reactor.run()
+ */
+static int reactor_sleep(lua_State *L) {
+  lua_Integer ms = luaL_checkinteger(L, 1);
+  task_t *task = current_task(L);
+
+  if (!task) {
+    if (ms > 0) zclock_sleep((int) ms);
+    return 0;
+  }
+  wait_for_nothing(task);
+  task->deadline = now_us() + (ms > 0 ? ms : 0) * 1000;
+  lua_pushlightuserdata(L, &WAIT_SENTINEL);
+  return lua_yieldk(L, 1, 0, sleep_done);
+}
+
+/*
+ * Waits until a zmq socket, a network socket or a file descriptor (given as
+ * a number) is ready to be read from, or written to if the second argument
+ * is "write", or until the timeout in milliseconds given as the third
+ * argument passes. Returns `true` if it's ready or `false` if the time ran
+ * out. Inside a task, other tasks run meanwhile; anywhere else, this
+ * blocks.
+ *
+ * Examples:
+ *
+ *     reactor = require('reactor')
+ *     zmq = require('lzmq')
+ *     events = zmq.sub('inproc://events/sub', 'keyup')
+ *     reactor.spawn(function()
+ *       while reactor.wait(events, 'read', 30000) do
+ *         print(events:recv())
+ *       end
+ *       print('no key was pressed for 30 seconds')
+ *     end)
+ *     reactor.run()
+ */
+static int reactor_wait(lua_State *L) {
+  const char *what = luaL_optstring(L, 2, "read");
+  lua_Integer timeout = luaL_optinteger(L, 3, -1), own_timeout;
+  task_t *task = current_task(L);
+  zmq_pollitem_t item = { NULL, -1, 0, 0 };
+  int res, ret;
+
+  if (strcmp(what, "read") && strcmp(what, "write"))
+    return luaL_argerror(L, 2, "expected 'read' or 'write'");
+  res = find_waitable(L, 1, what, &item.socket, &item.fd, &item.events, &own_timeout);
+  if (res < 0) return lua_error(L);
+  if (res == 0) {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+
+  if (!task) {
+    do {
+      ret = zmq_poll(&item, 1, (long) timeout);
+    } while (ret < 0 && errno == EINTR);
+    lua_pushboolean(L, ret > 0);
+    return 1;
+  }
+  wait_for_nothing(task);
+  task->socket = item.socket;
+  task->fd = item.fd;
+  task->events = item.events;
+  if (timeout >= 0) task->deadline = now_us() + timeout * 1000;
+  lua_pushlightuserdata(L, &WAIT_SENTINEL);
+  return lua_yieldk(L, 1, 0, wait_done);
+}
+
+/*
+ * Lets go of a cancelled task: tells the object it was waiting on to give up
+ * on the call in progress, so that the object can be used again, then closes
+ * the coroutine. An error from `abandon()` is logged, not raised.
+ */
+static void abandon_task(lua_State *L, task_t *task) {
+  if (task->waited != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, task->waited);
+    if (luaL_getmetafield(L, -1, "abandon") != LUA_TNIL) {
+      lua_insert(L, -2);
+      if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+        LERROR("lua: reactor: abandoning a cancelled task's wait: %s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+      }
+    } else {
+      lua_pop(L, 1);
+    }
+    forget_waited(L, task);
+  }
+  // before 5.4 a suspended coroutine can't be closed, only collected once
+  // nothing refers to it
+#if LUA_VERSION_NUM >= 504
+  lua_resetthread(task->co);
+#endif
+}
+
+/*
+ * Stops running a task and closes its coroutine. Whatever it was waiting on
+ * gives up on the call in progress, as though its time had run out, so that
+ * another task can use it. Returns `true` if it was one of the reactor's
+ * tasks. A task can't cancel itself; it can just return.
+ *
+ * Examples:
+ *
+ *     reactor = require('reactor')
+ *     ticker = reactor.spawn(function()
+ *       while true do reactor.sleep(1000) print('tick') end
+ *     end)
+ *     reactor.spawn(function() reactor.sleep(5500) reactor.cancel(ticker) end)
+ *     reactor.run()
+ */
+static int reactor_cancel(lua_State *L) {
+  reactor_t *reactor = get_reactor(L);
+  lua_State *co = lua_tothread(L, 1);
+  task_t *task;
+
+  luaL_argcheck(L, co != NULL, 1, "expected a coroutine");
+  DL_FOREACH(reactor->tasks, task) {
+    if (task->co != co || task->done) continue;
+    if (task == reactor->current) return luaL_error(L, "reactor: a task can't cancel itself");
+    abandon_task(L, task);
+    if (reactor->running) task->done = true;
+    else free_task(L, reactor, task);
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  lua_pushboolean(L, 0);
+  return 1;
+}
+
+/*
+ * Runs the tasks until all of them have finished, or until the timeout in
+ * milliseconds, if one is given. Returns the number of tasks which haven't
+ * finished: those still waiting when the time ran out, and those waiting
+ * for something the reactor can't see, such as a coroutine which yields
+ * nothing but is never resumed elsewhere. A task which raises an error is
+ * logged and dropped; the others carry on.
+ *
+ * Examples:
+ *
+ *     reactor = require('reactor')
+ *     zmq = require('lzmq')
+ *     reactor.spawn(function()
+ *       local events = zmq.sub('inproc://events/sub', 'rs232')
+ *       while true do print(events:recv(-1)) end
+ *     end)
+ *     reactor.spawn(function()
+ *       local socket = require('socket')
+ *       local sock = assert(socket.tls('example.com', 443, 5000))
+ *       ...
+ *     end)
+ *     reactor.run()
+ */
+static int reactor_run(lua_State *L) {
+  reactor_t *reactor = get_reactor(L);
+  lua_Integer timeout = luaL_optinteger(L, 1, -1);
+  long long until = timeout >= 0 ? now_us() + timeout * 1000 : -1;
+  int left = 0;
+  task_t *task;
+
+  if (reactor->running) return luaL_error(L, "reactor: already running");
+  reactor->running = true;
+  while (reactor->tasks) {
+    resume_ready(L, reactor);
+    if (!reactor->tasks || (until >= 0 && now_us() >= until)) break;
+    if (any_ready(reactor)) continue;
+    if (poll_tasks(reactor, until)) break;
+  }
+  reactor->running = false;
+
+  DL_FOREACH(reactor->tasks, task) left++;
+  lua_pushinteger(L, left);
+  return 1;
+}
+
+/*
+ * Returns the time of the monotonic clock in milliseconds, with a fraction
+ * of a millisecond, for measuring how long something took.
+ *
+ * Examples:
+ *
+ *     reactor = require('reactor')
+ *     local started = reactor.now()
+ *     ...
+ *     print('took ' .. (reactor.now() - started) .. ' ms')
+ */
+static int reactor_now(lua_State *L) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  lua_pushnumber(L, ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0);
+  return 1;
+}
+
+/*
+ * Returns a table of counters: `wakeups`, the number of times the reactor
+ * woke up from waiting; `resumes`, the number of times a task was resumed;
+ * `errors`, the number of tasks which failed; and `tasks`, the number of
+ * tasks which haven't finished.
+ *
+ * Examples:
+ *
+ *     reactor = require('reactor')
+ *     reactor.run()
+ *     print(reactor.stats().wakeups)
+ */
+static int reactor_stats(lua_State *L) {
+  reactor_t *reactor = get_reactor(L);
+  lua_Integer tasks = 0;
+  task_t *task;
+
+  DL_FOREACH(reactor->tasks, task) {
+    if (!task->done) tasks++;
+  }
+  lua_newtable(L);
+  lua_pushinteger(L, reactor->wakeups);
+  lua_setfield(L, -2, "wakeups");
+  lua_pushinteger(L, reactor->resumes);
+  lua_setfield(L, -2, "resumes");
+  lua_pushinteger(L, reactor->errors);
+  lua_setfield(L, -2, "errors");
+  lua_pushinteger(L, tasks);
+  lua_setfield(L, -2, "tasks");
+  return 1;
+}
+
+static int reactor_gc(lua_State *L) {
+  reactor_t *reactor = (reactor_t *) luaL_checkudata(L, 1, MT_REACTOR);
+  task_t *task, *tmp;
+
+  // the coroutines themselves are collected along with the state
+  DL_FOREACH_SAFE(reactor->tasks, task, tmp) {
+    DL_DELETE(reactor->tasks, task);
+    free(task);
+  }
+  free(reactor->items);
+  free(reactor->polled);
+  reactor->items = NULL;
+  reactor->polled = NULL;
+  return 0;
+}
+
+static const luaL_Reg reactor_methods[] = {
+  {"spawn",  reactor_spawn},
+  {"sleep",  reactor_sleep},
+  {"wait",   reactor_wait},
+  {"cancel", reactor_cancel},
+  {"run",    reactor_run},
+  {"now",    reactor_now},
+  {"stats",  reactor_stats},
+  {NULL,     NULL}
+};
+
+LUALIB_API int luaopen_reactor(lua_State *L) {
+  lua_newtable(L);
+  luaL_setfuncs(L, reactor_methods, 0);
+  return 1;
+}
+
+int init_reactor_lua(lua_State *L) {
+  reactor_t *reactor = (reactor_t *) lua_newuserdata(L, sizeof(reactor_t));
+  memset(reactor, 0, sizeof(reactor_t));
+  luaL_newmetatable(L, MT_REACTOR);
+  lua_pushcfunction(L, reactor_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, &REACTOR_KEY);
+
+  // Get package.preload so we can store builtins in it.
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "preload");
+  lua_remove(L, -2); // Remove package
+  lua_pushcfunction(L, luaopen_reactor);
+  lua_setfield(L, -2, "reactor");
+  lua_pop(L, 1);
+  return 0;
+}
+
+void shutdown_reactor_lua(lua_State *L) {
+  (void) L;
+}
@@ -17,7 +17,9 @@ static zsock_t *timer_socket = NULL;
  * topic that will be broadcast on when the timer has expired. Takes the
  * number of milliseconds before the timer expires as an argument.
  *
- * Intended for use in combination with events.
+ * Intended for use in combination with events. Tasks run by the reactor can
+ * call `reactor.sleep()` instead, which needs no round trip to the timer
+ * service.
  * 
  * Examples:
  * 
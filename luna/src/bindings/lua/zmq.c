@@ -9,17 +9,28 @@
 #include <string.h>
 #include <stdint.h>
 
+#include "bindings.h"
 #include "services/logger.h"
 
 #define MT_ZSOCK  "MT_ZSOCK"
+#define MT_ZFRAME "MT_ZFRAME"
 
 typedef struct {
     zsock_t   *zsock;
-    zpoller_t *poller;
     int        as_coroutine; // see socket_as_coroutine()
+    int64_t    deadline;     // of a recv waiting in the reactor, or -1
     char      *human;        // human-readable info
 } lsock_t;
 
+/*
+ * A received frame, kept as it came off the socket so that large payloads
+ * reach Lua without being copied into a string. It can be sent on as it is,
+ * again without copying.
+ */
+typedef struct {
+    zframe_t *frame;
+} lframe_t;
+
 static int Lzmq_push_error(lua_State *L)
 {
     // const char *error;
@@ -61,8 +72,8 @@ static int lzmq_sub(lua_State *L) {
     luaL_getmetatable(L, MT_ZSOCK);
     lua_setmetatable(L, -2);
     sock->zsock = zsock_new_sub(endpoint, channel);
-    sock->poller = zpoller_new(sock->zsock, NULL);
     sock->as_coroutine = 0;
+    sock->deadline = -1;
     sock->human = (char *) calloc(strlen(endpoint) + strlen(channel) + 33, sizeof(char));
     sprintf(sock->human, "<zsock:0x%08" PRIxPTR " sub:%s/%s>", (uintptr_t) sock->zsock, endpoint, channel);
     LDEBUG("lua: zmq: creating socket: %s", sock->human);
@@ -86,8 +97,8 @@ static int lzmq_pub(lua_State *L) {
     luaL_getmetatable(L, MT_ZSOCK);
     lua_setmetatable(L, -2);
     sock->zsock = zsock_new_pub(endpoint);
-    sock->poller = zpoller_new(sock->zsock, NULL);
     sock->as_coroutine = 0;
+    sock->deadline = -1;
     sock->human = (char *) calloc(strlen(endpoint) + 31, sizeof(char));
     sprintf(sock->human, "<zsock:0x%08" PRIxPTR " pub:%s>", (uintptr_t) sock->zsock, endpoint);
     LDEBUG("lua: zmq: creating socket: %s", sock->human);
@@ -110,8 +121,8 @@ static int lzmq_req(lua_State *L) {
     luaL_getmetatable(L, MT_ZSOCK);
     lua_setmetatable(L, -2);
     sock->zsock = zsock_new_req(endpoint);
-    sock->poller = zpoller_new(sock->zsock, NULL);
     sock->as_coroutine = 0;
+    sock->deadline = -1;
     sock->human = (char *) calloc(strlen(endpoint) + 31, sizeof(char));
     sprintf(sock->human, "<zsock:0x%08" PRIxPTR " req:%s>", (uintptr_t) sock->zsock, endpoint);
     LDEBUG("lua: zmq: creating socket: %s", sock->human);
@@ -134,8 +145,8 @@ static int lzmq_rep(lua_State *L) {
     luaL_getmetatable(L, MT_ZSOCK);
     lua_setmetatable(L, -2);
     sock->zsock = zsock_new_rep(endpoint);
-    sock->poller = zpoller_new(sock->zsock, NULL);
     sock->as_coroutine = 0;
+    sock->deadline = -1;
     sock->human = (char *) calloc(strlen(endpoint) + 31, sizeof(char));
     sprintf(sock->human, "<zsock:0x%08" PRIxPTR " rep:%s>", (uintptr_t) sock->zsock, endpoint);
     LDEBUG("lua: zmq: creating socket: %s", sock->human);
@@ -158,8 +169,8 @@ static int lzmq_pair(lua_State *L) {
     luaL_getmetatable(L, MT_ZSOCK);
     lua_setmetatable(L, -2);
     sock->zsock = zsock_new_pair(endpoint);
-    sock->poller = zpoller_new(sock->zsock, NULL);
     sock->as_coroutine = 0;
+    sock->deadline = -1;
     sock->human = (char *) calloc(strlen(endpoint) + 31, sizeof(char));
     sprintf(sock->human, "<zsock:0x%08" PRIxPTR " pair:%s>", (uintptr_t) sock->zsock, endpoint);
     LDEBUG("lua: zmq: creating socket: %s", sock->human);
@@ -178,10 +189,9 @@ static int lzmq_pair(lua_State *L) {
  */
 static int socket_close(lua_State *L) {
     lsock_t *s = luaL_checkudata(L, 1, MT_ZSOCK);
-    LDEBUG("lua: zmq: destroying socket: %s", s->human);
     if (s->zsock) {
+        LDEBUG("lua: zmq: destroying socket: %s", s->human);
         zsock_set_linger(s->zsock, 0);
-        zpoller_destroy(&(s->poller));
         zsock_destroy(&(s->zsock));
         free(s->human);
         s->zsock = NULL;
@@ -190,28 +200,83 @@ static int socket_close(lua_State *L) {
     return 1;
 }
 
-static int poll(lua_State *L, zpoller_t *poller, long timeout) {
+static void push_frame(lua_State *L, zframe_t *frame) {
+    lframe_t *lframe = (lframe_t *) lua_newuserdata(L, sizeof(lframe_t));
+    lframe->frame = frame;
+    luaL_getmetatable(L, MT_ZFRAME);
+    lua_setmetatable(L, -2);
+}
+
+static int poll(lua_State *L, lsock_t *sock, long timeout, int as_frames) {
+    zmq_pollitem_t item = { zsock_resolve(sock->zsock), 0, ZMQ_POLLIN, 0 };
     zmsg_t *msg = NULL;
-    int num_frames = 0;
-    void *in = zpoller_wait(poller, timeout);
-    if (in) {
-        msg = zmsg_recv(in);
+    int num_frames = 0, ready;
+    ready = zmq_poll(&item, 1, timeout);
+    if (ready > 0) {
+        msg = zmsg_recv(sock->zsock);
         num_frames = zmsg_size(msg);
         while (zmsg_size(msg) > 0) {
             zframe_t *frame = zmsg_pop(msg);
-            lua_pushlstring(L, (char *) zframe_data(frame), zframe_size(frame));
-            zframe_destroy(&frame);
+            if (as_frames) {
+                push_frame(L, frame);
+            } else {
+                lua_pushlstring(L, (char *) zframe_data(frame), zframe_size(frame));
+                zframe_destroy(&frame);
+            }
         }
         zmsg_destroy(&msg);
-    } else if (!zpoller_expired(poller)) {
+    } else if (ready < 0) {
         luaL_error(L, "zmq: interrupted");
     }
     return num_frames;
 }
 
-static int socket_recv(lua_State *L);
-static int recv_again(lua_State *L, int status, lua_KContext arg) {
-    return socket_recv(L);
+static int receive(lua_State *L, int as_frames);
+static int recv_again(lua_State *L, int status, lua_KContext as_frames) {
+    return receive(L, (int) as_frames);
+}
+
+/*
+ * Carries on with a recv which yielded to the reactor: returns what has
+ * arrived, or nothing once the deadline has passed, or yields again.
+ */
+static int recv_in_reactor(lua_State *L, int status, lua_KContext as_frames) {
+    lsock_t *sock = (lsock_t *) luaL_checkudata(L, 1, MT_ZSOCK);
+    int num_frames;
+
+    if (!sock->zsock) return 0;
+    if ((num_frames = poll(L, sock, 0, (int) as_frames)) > 0 ||
+        (sock->deadline >= 0 && zclock_mono() >= sock->deadline)) {
+        sock->deadline = -1;
+        return num_frames;
+    }
+    lua_pushvalue(L, 1);
+    lua_pushliteral(L, "read");
+    return lua_yieldk(L, 2, as_frames, recv_in_reactor);
+}
+
+static int receive(lua_State *L, int as_frames) {
+    lsock_t *sock = (lsock_t *) luaL_checkudata(L, 1, MT_ZSOCK);
+    long timeout = (long) lua_tonumber(L, 2);
+    int num_frames = 0;
+
+    if ((num_frames = poll(L, sock, 0, as_frames)) == 0) {
+        // no immediate messages, should we wait for a timeout?
+        // ...yes, unless as_coroutine is true, in which case we should
+        // yield instead, or the reactor runs this coroutine, in which case
+        // we should yield to it until there's something to receive.
+        if (sock->as_coroutine) {
+            return lua_yieldk(L, 0, as_frames, recv_again);
+        } else if (timeout != 0 && lua_reactor_owns(L)) {
+            sock->deadline = timeout < 0 ? -1 : zclock_mono() + timeout;
+            lua_settop(L, 1);
+            return recv_in_reactor(L, LUA_OK, as_frames);
+        } else {
+            num_frames = poll(L, sock, timeout, as_frames);
+        }
+    }
+
+    return num_frames;
 }
 
 /*
@@ -226,6 +291,9 @@ static int recv_again(lua_State *L, int status, lua_KContext arg) {
  *
  * Note: even if you block forever, the return value may
  * still be `nil` if a read error or interrupt occurs.
+ *
+ * In a task run by the reactor (see `reactor.spawn()`), waiting doesn't
+ * block: the other tasks run until data arrives or the timeout passes.
  * 
  * Examples:
  * 
@@ -236,28 +304,65 @@ static int recv_again(lua_State *L, int status, lua_KContext arg) {
  *     evt = {sock:recv(-1)})  -- blocks forever
  */
 static int socket_recv(lua_State *L) {
-    lsock_t *sock = (lsock_t *) luaL_checkudata(L, 1, MT_ZSOCK);
-    long timeout = (long) lua_tonumber(L, 2);
-    int num_frames = 0;
+    return receive(L, 0);
+}
 
-    if ((num_frames = poll(L, sock->poller, 0)) == 0) {
-        // no immediate messages, should we wait for a timeout?
-        // ...yes, unless as_coroutine is true, in which case we should
-        // yield instead.
-        if (sock->as_coroutine) {
-            return lua_yieldk(L, 0, 0, recv_again);
-        } else {
-            num_frames = poll(L, sock->poller, timeout);
-        }
-    }
+/*
+ * Receives data on this socket just like `recv`, except that each frame is
+ * returned as a frame object rather than a string, without copying it.
+ * This is worthwhile for large payloads, such as images or update chunks,
+ * which are only looked at in part or passed on to another socket. See
+ * `frame:len()`, `frame:sub()` and `frame:tostring()`.
+ *
+ * Examples:
+ *
+ *     zmq = require("lzmq")
+ *     sock = zmq.pull("inproc://updates")
+ *     name, chunk = sock:recv_frames(-1)
+ *     print(name:tostring(), chunk:len())
+ *     other:send("chunk", chunk)  -- passed on without a copy
+ */
+static int socket_recv_frames(lua_State *L) {
+    return receive(L, 1);
+}
 
-    return num_frames;
+/*
+ * Sends the string or frame at `index` as one part of a message. Frames
+ * share their data with the message rather than copying it. Strings are
+ * copied once, into a buffer the message owns, since libzmq may still be
+ * sending them after the Lua state which owned them has closed.
+ */
+static int send_part(lua_State *L, lsock_t *sock, int index, int more) {
+    lframe_t *lframe = (lframe_t *) luaL_testudata(L, index, MT_ZFRAME);
+    const char *data;
+    zmq_msg_t msg;
+    size_t len;
+    int res;
+
+    if (lframe)
+        return zframe_send(&lframe->frame, sock->zsock, ZFRAME_REUSE | (more ? ZFRAME_MORE : 0));
+
+    data = lua_tolstring(L, index, &len);
+    if (data == NULL) {
+        data = "";
+        len = 0;
+    }
+    if (zmq_msg_init_size(&msg, len)) return -1;
+    memcpy(zmq_msg_data(&msg), data, len);
+    if ((res = zmq_msg_send(&msg, zsock_resolve(sock->zsock), more ? ZMQ_SNDMORE : 0)) < 0)
+        zmq_msg_close(&msg);
+    return res;
 }
 
 /*
  * Sends data on this socket. If more than 1 frame is
  * to be sent, each frame should be sent as a separate
- * argument.
+ * argument. Returns true, or nil and the reason if the message, or any
+ * part of it, couldn't be sent.
+ *
+ * Each argument may be a string or a frame received with `recv_frames` or
+ * made with `zmq.frame`. Frames are sent without copying their data, and
+ * can be sent again afterward. Strings are copied once.
  * 
  * Examples:
  * 
@@ -269,15 +374,24 @@ static int socket_send(lua_State *L) {
     lsock_t *sock = (lsock_t *) luaL_checkudata(L, 1, MT_ZSOCK);
 //    long timeout = (long) luaL_checkinteger(L, 2);
     int n = lua_gettop(L), i;
+    lframe_t *lframe;
 
-    zmsg_t *msg = zmsg_new();
+    // check every part first, so that a bad one can't cut a message short
     for (i = 2; i <= n; i++) {
-        const char *part = lua_tostring(L, i);
-        zmsg_addstr(msg, part == NULL ? "" : part);
+        lframe = (lframe_t *) luaL_testudata(L, i, MT_ZFRAME);
+        if (lframe && !lframe->frame) return luaL_argerror(L, i, "frame has been freed");
     }
-    // zmsg_print(msg);
-    zmsg_send(&msg, sock->zsock);
-    return 0;
+    for (i = 2; i <= n; i++) {
+        if (send_part(L, sock, i, i < n) < 0) {
+            if (i > 2) LWARN("lua: zmq: %s: message cut short after %d parts: %s",
+                             sock->human, i - 2, zmq_strerror(zmq_errno()));
+            lua_pushnil(L);
+            lua_pushstring(L, zmq_strerror(zmq_errno()));
+            return 2;
+        }
+    }
+    lua_pushboolean(L, 1);
+    return 1;
 }
 
 /*
@@ -298,6 +412,52 @@ static int socket_tostring(lua_State *L) {
     return 1;
 }
 
+/*
+ * Returns what the reactor polls to wait for this socket: the underlying
+ * ZeroMQ socket, "read", and the number of milliseconds left before a recv
+ * waiting on it times out, or `nil` if there isn't one. Returns nothing once
+ * the socket is closed. See `reactor.wait()`.
+ *
+ * Examples:
+ *
+ *     zmq = require("lzmq")
+ *     sock = zmq.sub("inproc://events")
+ *     handle, what, timeout = sock:waitable()
+ */
+static int socket_waitable(lua_State *L) {
+    lsock_t *sock = (lsock_t *) luaL_checkudata(L, 1, MT_ZSOCK);
+    int64_t now;
+
+    if (!sock->zsock) return 0;
+    lua_pushlightuserdata(L, zsock_resolve(sock->zsock));
+    lua_pushliteral(L, "read");
+    if (sock->deadline < 0) {
+        lua_pushnil(L);
+    } else {
+        now = zclock_mono();
+        lua_pushinteger(L, sock->deadline > now ? sock->deadline - now : 0);
+    }
+    return 3;
+}
+
+/*
+ * Gives up on a recv waiting on this socket in the reactor, so that the
+ * next recv starts afresh with its own timeout. This is how the reactor
+ * lets go of the socket when it cancels the task which was waiting on it;
+ * see `reactor.cancel()`.
+ *
+ * Examples:
+ *
+ *     zmq = require("lzmq")
+ *     sock = zmq.sub("inproc://events")
+ *     sock:abandon()
+ */
+static int socket_abandon(lua_State *L) {
+    lsock_t *sock = (lsock_t *) luaL_checkudata(L, 1, MT_ZSOCK);
+    sock->deadline = -1;
+    return 0;
+}
+
 /*
  * Whenever receiving or sending data would cause ZeroMQ to block, if this
  * method has been called, `coroutine.yield()` will be called instead. When
@@ -335,13 +495,112 @@ static int socket_as_coroutine(lua_State *L) {
     return 1;
 }
 
+/*
+ * Makes a frame out of a string, copying it once, so that it can be sent
+ * any number of times, to any number of sockets, without being copied
+ * again.
+ *
+ * Examples:
+ *
+ *     zmq = require("lzmq")
+ *     image = zmq.frame(io.open("logo.bmp", "rb"):read("a"))
+ *     sock:send("image", image)
+ */
+static int lzmq_frame(lua_State *L) {
+    size_t len;
+    const char *data = luaL_checklstring(L, 1, &len);
+    push_frame(L, zframe_new(data, len));
+    return 1;
+}
+
+static lframe_t *check_frame(lua_State *L) {
+    lframe_t *lframe = (lframe_t *) luaL_checkudata(L, 1, MT_ZFRAME);
+    if (!lframe->frame) luaL_argerror(L, 1, "frame has been freed");
+    return lframe;
+}
+
+/*
+ * Returns the number of bytes in this frame.
+ *
+ * Examples:
+ *
+ *     zmq = require("lzmq")
+ *     frame = sock:recv_frames(-1)
+ *     print(frame:len(), #frame)
+ */
+static int frame_len(lua_State *L) {
+    lframe_t *lframe = check_frame(L);
+    lua_pushinteger(L, (lua_Integer) zframe_size(lframe->frame));
+    return 1;
+}
+
+/*
+ * Returns part of this frame as a string, copying only that part. The
+ * arguments work like those of `string.sub`.
+ *
+ * Examples:
+ *
+ *     zmq = require("lzmq")
+ *     frame = sock:recv_frames(-1)
+ *     header = frame:sub(1, 4)
+ *     trailer = frame:sub(-2)
+ */
+static int frame_sub(lua_State *L) {
+    lframe_t *lframe = check_frame(L);
+    lua_Integer len = (lua_Integer) zframe_size(lframe->frame),
+                start = luaL_checkinteger(L, 2),
+                end = luaL_optinteger(L, 3, -1);
+
+    if (start < 0) start = start < -len ? 1 : len + start + 1;
+    if (end < 0) end = len + end + 1;
+    if (start < 1) start = 1;
+    if (end > len) end = len;
+    if (start > end) lua_pushliteral(L, "");
+    else lua_pushlstring(L, (char *) zframe_data(lframe->frame) + start - 1, end - start + 1);
+    return 1;
+}
+
+/*
+ * Returns the whole of this frame as a string.
+ *
+ * Examples:
+ *
+ *     zmq = require("lzmq")
+ *     frame = sock:recv_frames(-1)
+ *     print(frame:tostring(), tostring(frame))
+ */
+static int frame_tostring(lua_State *L) {
+    lframe_t *lframe = check_frame(L);
+    lua_pushlstring(L, (char *) zframe_data(lframe->frame), zframe_size(lframe->frame));
+    return 1;
+}
+
+static int frame_gc(lua_State *L) {
+    lframe_t *lframe = (lframe_t *) luaL_checkudata(L, 1, MT_ZFRAME);
+    if (lframe->frame) zframe_destroy(&lframe->frame);
+    return 0;
+}
+
+static const luaL_Reg zframe_methods[] = {
+    {"__gc",         frame_gc},
+    {"__len",        frame_len},
+    {"__tostring",   frame_tostring},
+    {"len",          frame_len},
+    {"sub",          frame_sub},
+    {"tostring",     frame_tostring},
+    {NULL,           NULL}
+};
+
 static const luaL_Reg zsock_methods[] = {
     {"__gc",         socket_close},
     {"__tostring",   socket_tostring},
     {"close",        socket_close},
     {"recv",         socket_recv},
+    {"recv_frames",  socket_recv_frames},
     {"send",         socket_send},
     {"as_coroutine", socket_as_coroutine},
+    {"waitable",     socket_waitable},
+    {"abandon",      socket_abandon},
     {NULL,           NULL}
 };
 
@@ -351,6 +610,7 @@ static const luaL_Reg zsock_new_methods[] = {
     {"req",   lzmq_req},
     {"rep",   lzmq_rep},
     {"pair",  lzmq_pair},
+    {"frame", lzmq_frame},
     {NULL,    NULL}
 };
 
@@ -364,6 +624,13 @@ LUALIB_API int luaopen_zmq(lua_State *L)
     lua_setfield(L, -2, "__index");
     luaL_setfuncs(L, zsock_methods, 0);
 
+    /* frame metatable. */
+    luaL_newmetatable(L, MT_ZFRAME);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_setfuncs(L, zframe_methods, 0);
+    lua_pop(L, 1);
+
     lua_newtable(L);
     luaL_setfuncs(L, zsock_new_methods, 0);
 
@@ -14,6 +14,7 @@
 static struct argp_option options[] = {
   {"exec-lua",           'l', "FILE", 0, "Run specified file, or stdin if FILE == '-', as lua", 0},
   {"disable",            'd', "NAME", 0, "Disable the named plugin or service",                 0},
+  {"bundle-lua",         'b', "DIR",  0, "Compile the lua scripts beneath DIR into DIR/scripts.luab", 0},
   
   {"stub1",              'q',          0, 0, "no effect, present as workaround for present firmware", 2},
   {"stub2",              'w',          0, 0, "no effect, present as workaround for present firmware", 2},
@@ -51,6 +52,13 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
       arguments->scripts[arguments->num_scripts - 1].execute = lua_run_file;
       break;
 
+    case 'b':
+      arguments->num_scripts++;
+      arguments->scripts = (script_t *) realloc(arguments->scripts, arguments->num_scripts * sizeof(script_t));
+      arguments->scripts[arguments->num_scripts - 1].file = strdup(arg);
+      arguments->scripts[arguments->num_scripts - 1].execute = lua_bundle_scripts;
+      break;
+
     case 'd':
       if (!arg) {
         argp_usage(state);
@@ -39,6 +39,21 @@
  * * "body" - the value will be the body of the HTTP request. If omitted,
  *   the request has no body.
  *
+ * * "priority" - one of "authorization", "reversal", "telemetry" or "bulk",
+ *   in order from most to least urgent. See "Queueing" below. The default is
+ *   "authorization".
+ *
+ * * "timeout" - the number of milliseconds the request may take in total,
+ *   including any time spent waiting in the queue. The default is 40000.
+ *
+ * * "stream", "save_to" and "max_body_size" - see "Large responses" below.
+ *
+ * * "defer" - the value "true" stores the request until it can be
+ *   delivered. See "Store and forward" below.
+ *
+ * * "cache" - the value "true" allows the response to be answered from, and
+ *   stored in, the response cache. See "Response cache" below.
+ *
  * * "validate_ssl_certificates" - the value will be "true" to indicate that
  *   SSL certificate validation is required. The value will be "false" to
  *   indicate that SSL certificate validation should be suppressed, if this
@@ -61,6 +76,13 @@
  *
  * The first frame is the literal string value "broadcast_id".
  *
+ * If too many requests are already waiting, the request is refused and the
+ * response is instead:
+ *
+ *     ["error", "overloaded"]
+ *
+ * and nothing is broadcast for it.
+ *
  * The second frame contains the request ID to which the result will be
  * broadcast, on the "inproc://events/sub" channel, with the topic
  * "backend-complete".
@@ -72,7 +94,9 @@
  * "inproc://events/sub" channel with the following format:
  *
  *     ["backend-complete", "[id]", "result", "[result]", "code", "[code]",
- *      "body", "[body]", "duration", "[duration]"]
+ *      "body", "[body]", "duration", "[duration]", ...]
+ *
+ * followed by the timing keys described in "Timing" below.
  *
  * The first frame contains the topic name and is always "backend-complete".
  *
@@ -98,31 +122,446 @@
  * The "duration" key will contain the total duration of the HTTP request, in
  * seconds, encoded as a string containing a floating-point value.
  *
+ *
+ * ## Timing
+ *
+ * Every result also has these keys, each with a whole number:
+ *
+ * * "name_lookup_us", "connect_us", "app_connect_us", "pretransfer_us",
+ *   "start_transfer_us" and "total_us" - the microseconds from the start of
+ *   the request until the host name was resolved, the TCP connection was
+ *   made, the TLS handshake was done, the request was about to be sent, the
+ *   first byte of the response arrived, and it was complete. The first
+ *   three are 0 if the connection was reused.
+ *
+ * * "bytes_sent" and "bytes_received" - including headers.
+ *
+ * and "reused", which is "true" if the request used a connection which was
+ * already open, and "http_version", which is "1.1" or "2" (see "HTTP/2"
+ * below). A request which never got as far as curl, such as one answered
+ * from the cache, has 0 for all of them, and an empty "http_version".
+ *
+ * For each host, the last 100 successful requests are kept, and can be seen
+ * as histograms by sending the single frame "timings" to
+ * "inproc://backend", from Lua with `require('backend').timings()`, or over
+ * REST at /v1/backend/timings.json. The reply has the format:
+ *
+ *     ["timings", "bounds", "1 5 10 ... 10000",
+ *      "host", "[host]", "samples", "[n]", "dns", "[counts]",
+ *      "connect", "[counts]", "tls", "[counts]", "wait", "[counts]",
+ *      "transfer", "[counts]", "total", "[counts]",
+ *      "host", ...]
+ *
+ * "bounds" are the upper bounds, in ms, of each bucket but the last, which
+ * has none. Each "[counts]" has the number of requests in each bucket for
+ * how long the DNS lookup, TCP connect, TLS handshake, wait for the server
+ * to respond, receiving the response, and the whole request took. Requests
+ * on a reused connection aren't counted for the first three.
+ *
+ *
+ * ## Direct replies
+ *
+ * Broadcasting every result means that every subscriber to the events bus
+ * receives every response body. To have the result sent only to you, connect
+ * a DEALER socket to "inproc://backend/router" and send the same request
+ * (or command) on it. You will receive the ["broadcast_id", "[id]"] response
+ * on that socket, and later the result, in the same format as the broadcast
+ * above but sent only to you.
+ *
+ * If the request includes the key "notify" with the value "true", its
+ * completion is also announced on the "inproc://events/sub" channel, without
+ * the body:
+ *
+ *     ["backend-notice", "[id]", "result", "[result]", "code", "[code]",
+ *      "duration", "[duration]"]
+ *
+ * From Lua, use `require('backend').request{...}`, which returns a future
+ * for the result. See `backend_request()` below.
+ *
+ *
+ * ## Large responses
+ *
+ * Normally the whole response body is collected in memory and sent in the
+ * result. A body larger than "backend.max_body_size" bytes (0 means no
+ * limit) fails the request with the code for curl's "Maximum file size
+ * exceeded" error. A request can set its own limit with the "max_body_size"
+ * key.
+ *
+ * If the request includes the key "stream" with the value "true", each part
+ * of the body is instead sent as soon as it arrives, to the same place the
+ * result will go, in the format:
+ *
+ *     ["backend-chunk", "[id]", "seq", "[n]", "data", "[data]"]
+ *
+ * "seq" counts up from 1, so that a subscriber can tell if it missed one.
+ * The result which follows has an empty body.
+ *
+ * If the request includes the key "save_to", the body is written to the file
+ * of that name within the "files" directory of one of the `WRITE_PATHS`,
+ * which is the same place the Lua `file` module reads from. The file only
+ * appears once the body has been received in full. The result's body is the
+ * full path of the file.
+ *
+ *
+ * ## Store and forward
+ *
+ * A request with the key "defer" set to "true", such as a reversal or a
+ * transaction upload, is written to the outbox database before it is
+ * acknowledged, and is then sent until it gets a 2xx response, surviving
+ * restarts and loss of connectivity. Its ID has the form "outbox:[n]".
+ *
+ * Requests to the same destination (scheme, host and port) are delivered
+ * one at a time, in the order they were made. After a failure, a request is
+ * tried again after 1 second, then after twice as long each time up to 10
+ * minutes, less a random amount of up to half. Only the result of the
+ * successful attempt is published, to the caller if it sent the request on
+ * the router and is still around, or else broadcast. A request which is
+ * invalid, and so could never succeed, is published as an error and
+ * forgotten.
+ *
+ * The request is stored exactly as it was sent, so tokens in the URL,
+ * headers or body are only resolved when it is sent. Send ["cancel", "[id]"]
+ * to give up on a request. If the outbox can't be used, deferred requests
+ * are refused with ["error", "outbox unavailable"].
+ *
+ *
+ * ## Response cache
+ *
+ * Responses to GET requests with the key "cache" set to "true" are kept, up
+ * to "backend.cache.max_memory" bytes in memory and "backend.cache.max_disk"
+ * bytes on disk (0 disables either), throwing out the least recently used
+ * first. They are keyed by the URL and the "Accept", "Accept-Language" and
+ * "Authorization" headers, and kept on disk across restarts.
+ *
+ * A stored response is used without contacting the server for as long as its
+ * "Cache-Control: max-age" or "Expires" header allows. After that, or if it
+ * had "Cache-Control: no-cache", the request is sent with "If-None-Match"
+ * and "If-Modified-Since" headers, and if the server answers 304 the stored
+ * response is published as the result. Responses with "Cache-Control:
+ * no-store", and those which can neither be used for a while nor
+ * revalidated, are not kept. Only 200 responses are kept.
+ *
+ * Requests with a body, or with a token in the URL or a header, are never
+ * answered from the cache or stored, and nor are those using "stream" or
+ * "save_to". A result from the cache has a duration of 0.
+ *
+ *
+ * ## Queueing
+ *
+ * At most "backend.max_active_requests" requests run at once (0 means no
+ * limit), and telemetry and bulk requests may only use half of those, so that
+ * a slow upload can't hold up a payment. Other requests wait in a queue, and
+ * are started in order of priority and then in the order they arrived. At
+ * most "backend.max_queued_requests" requests can wait; after that, new
+ * requests are refused. If a request's timeout expires while it is waiting,
+ * it fails without being sent.
+ *
+ *
+ * ## Cancelling a request
+ *
+ * To abort a request which is waiting or running, send:
+ *
+ *     ["cancel", "[id]"]
+ *
+ * The response is ["cancelled", "[id]"], or ["error", "unknown request"] if
+ * the request has already completed. A cancelled request is broadcast as an
+ * error with the body "cancelled".
+ *
+ *
+ * ## Connection reuse
+ *
+ * All requests share one cache of resolved host names (kept for 5 minutes),
+ * one cache of TLS sessions and one pool of open connections, so a request
+ * to a host which was recently contacted can usually skip the DNS lookup,
+ * the TCP handshake and the full TLS handshake. CA certificates are loaded
+ * once, when the service starts. Host names are also looked up through the
+ * process-wide resolver which the socket plugin uses, so that each host is
+ * looked up once between them.
+ *
+ * The number of connections is limited by the "backend.max_host_connections"
+ * (per host) and "backend.max_connections" (in total) settings; requests
+ * beyond the limit wait for a connection to become free. 0 means no limit.
+ * Changes take effect immediately.
+ *
+ * To see how well the caches are working, send the single frame "stats" to
+ * "inproc://backend". The reply has the format:
+ *
+ *     ["stats", "requests", "[n]", "connections_opened", "[n]",
+ *      "connections_reused", "[n]", "tls_handshakes", "[n]",
+ *      "tls_sessions_resumed", "[n]", "dns_lookups", "[n]",
+ *      "dns_cache_hits", "[n]", "rejected", "[n]", "cancelled", "[n]",
+ *      "expired", "[n]", "cache_hits", "[n]", "cache_revalidated", "[n]",
+ *      "cache_misses", "[n]", "active", "[n]", "queued", "[n]",
+ *      "outbox", "[n]"]
+ *
+ * "active" and "queued" are the number of requests running and waiting right
+ * now, and "outbox" the number of deferred requests not yet delivered. The
+ * other counts are totals since the service started.
+ *
+ *
+ * ## HTTP/2
+ *
+ * Requests to the hosts listed in "backend.http2_hosts", separated by
+ * spaces or commas, or to any host if it is "*", offer HTTP/2 during the
+ * TLS handshake. If the server accepts, requests to it which run at the same
+ * time share one connection, instead of each opening their own; a request
+ * started while the first connection is still being made waits for it,
+ * rather than opening another. If the server doesn't accept, HTTP/1.1 is
+ * used, as for every other host. Changes apply to requests made after them.
+ *
+ *
+ * ## Pre-warming connections
+ *
+ * The first request to a host after a while has to look up its name, connect
+ * and do a full TLS handshake before it can be sent. To get that out of the
+ * way while the customer is still busy with the card, send:
+ *
+ *     ["prewarm", "[url]"]
+ *
+ * optionally followed by "validate_ssl_certificates" and "false", which must
+ * match what the request that follows will use. The host must be in the
+ * whitelist, and the URL must be HTTPS. The response is ["prewarmed",
+ * "[destination]"], with the scheme, host and port that will be kept warm,
+ * or ["error", "[reason]"].
+ *
+ * A HEAD request is sent to the URL, at "bulk" priority so that it never
+ * holds up real requests, and its connection is left open in the
+ * shared pool, where the next request to the same host and port picks it
+ * up, as long as the HEAD request has finished by then. Nothing is
+ * published for it.
+ *
+ * The connection is refreshed with another HEAD request every
+ * "backend.prewarm.interval" ms (0 means never), which should be less than
+ * the time the server lets a connection sit idle, until no request has been
+ * made to the host, and it hasn't been prewarmed again, for
+ * "backend.prewarm.idle_close" ms. A connection which has been idle for
+ * that long is not used again, and is closed.
+ *
+ * If "backend.prewarm.url" is set, that URL is prewarmed whenever a card is
+ * inserted ("card-inserted") or tapped ("txn-started"), or the amount is
+ * asked for ("ready-for-txn-data"), on the "contact-emv" and
+ * "contactless-emv" topics. Those topics aren't subscribed to while it's
+ * unset.
+ *
  **/
 
+#define LUA_LIB
 #define _GNU_SOURCE
 #include "config.h"
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <memory.h>
 #include <pthread.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
 #include <uriparser/Uri.h>
 #include "services.h"
+#include "lua.h"
+#include "lauxlib.h"
+#include "plugins/backend_cache.h"
+#include "plugins/backend_outbox.h"
+#include "plugins/backend_timings.h"
 #include "util/curl_utils.h"
 #include "util/detokenize_template.h"
 #include "util/files.h"
+#include "util/resolver.h"
+#include "util/utlist.h"
 
 extern bool ALLOW_DISABLE_SSL_VERIFICATION;
 
+#define BACKEND_ENDPOINT        "inproc://backend"
+#define BACKEND_ROUTER_ENDPOINT "inproc://backend/router"
+
+// how long resolved host names are kept in the shared DNS cache
+#define DNS_CACHE_TIMEOUT RESOLVER_TTL // seconds
+
+// the pipe, the REP socket, settings changes, the router and card events
+#define FIRST_CURL_ITEM         5
+
+#define DEFAULT_REQUEST_TIMEOUT 40000 // ms
+#define CONNECT_TIMEOUT         10000 // ms
+
+/*
+ * Request priorities, from most to least urgent. Anything from
+ * PRIORITY_TELEMETRY on is background work.
+ */
+typedef enum {
+  PRIORITY_AUTHORIZATION = 0,
+  PRIORITY_REVERSAL,
+  PRIORITY_TELEMETRY,
+  PRIORITY_BULK,
+  NUM_PRIORITIES
+} priority_t;
+
+static const char *priority_names[NUM_PRIORITIES] = {
+  "authorization", "reversal", "telemetry", "bulk"
+};
+
 typedef struct {
   char *hostname;
   UT_hash_handle hh;
 } whitelist_entry_t;
 
-typedef struct {
+/*
+ * A request which is waiting in the queue, or has been handed to curl and
+ * has not completed yet.
+ */
+typedef struct transfer_t {
   char id[64];
-  zmsg_t *params;
-} request_t;
+  CURL *curl;
+  priority_t priority;
+  int64_t deadline;
+  int active;
+  zframe_t *reply_to; // identity of the caller, if it's waiting on the router
+  int notify;         // whether to announce a direct reply on the bus
+  char *host;
+  int port;
+  struct curl_slist *resolve; // the addresses of the host, if already known
+  int dns_cached;     // whether the shared resolver had the host's addresses
+  int tls_checked;
+  int tls_resumed;
+  char *url;
+  char *method;
+  char *body;
+  struct curl_slist *headers;
+  struct MemoryStruct response;
+  size_t capacity;      // bytes allocated for `response`
+  size_t body_size;     // bytes received so far, however they were delivered
+  size_t max_body_size; // 0 if unlimited
+  int too_large;
+  int stream;           // whether to send the body in chunks as it arrives
+  unsigned long chunks_sent;
+  zsock_t *chunks_to;
+  char *save_to;        // where to save the body, instead of sending it
+  char *partial;        // where it's written until the transfer succeeds
+  FILE *file;
+  long long outbox_id;  // 0 unless it's a delivery attempt from the outbox
+  int outbox_attempts;
+  char *destination;
+  char *cache_key;      // NULL unless the response may be cached
+  int revalidating;     // whether a stale cached response is being checked
+  char *etag;           // response headers, if the response may be cached
+  char *last_modified;
+  char *cache_control;
+  char *expires;
+  char *date;
+  transfer_timing_t timing; // all 0 until curl has finished with it
+  int prewarm;          // whether it's only keeping a connection open
+  long http_version;    // CURL_HTTP_VERSION_*; 0 until curl has finished with it
+  struct transfer_t *prev, *next;
+} transfer_t;
+
+/*
+ * A socket which curl has asked us to watch, and the events it wants.
+ */
+typedef struct {
+  curl_socket_t fd;
+  short events;
+  UT_hash_handle hh;
+} watched_socket_t;
+
+/*
+ * A destination which an outbox request is being delivered to. Only one
+ * request is delivered to each destination at a time, so that they arrive
+ * in order.
+ */
+typedef struct {
+  char *destination;
+  UT_hash_handle hh;
+} busy_destination_t;
+
+/*
+ * A destination whose connection is being kept open, ready for the next
+ * request to it.
+ */
+typedef struct {
+  char *destination;
+  char *url;
+  int verify;
+  int refreshing;       // whether a HEAD request is on its way
+  int64_t refreshed_at; // when the last one was sent
+  int64_t refresh_at;   // when to send the next one; -1 if never
+  int64_t idle_at;      // when to stop, unless it's used before then
+  UT_hash_handle hh;
+} warm_host_t;
+
+/*
+ * Who sent a deferred request on the router, so that the result can be
+ * sent to them if they're still around when it's finally delivered.
+ */
+typedef struct {
+  long long id;
+  zframe_t *reply_to;
+  UT_hash_handle hh;
+} outbox_caller_t;
+
+/*
+ * How well the shared caches and the queue are working. Reported by the
+ * "stats" command.
+ */
+typedef struct {
+  long requests;
+  long connections_opened;
+  long connections_reused;
+  long tls_handshakes;
+  long tls_sessions_resumed;
+  long dns_lookups;
+  long dns_cache_hits;
+  long rejected;
+  long cancelled;
+  long expired;
+  long cache_hits;
+  long cache_revalidated;
+  long cache_misses;
+} backend_stats_t;
+
+/*
+ * State of the backend service. All transfers share one curl multi handle,
+ * which tells us which sockets to watch and when to call it back, so that
+ * any number of requests can run on the service's own thread.
+ */
+typedef struct {
+  CURLM *multi;
+  transfer_t *transfers;              // running, in no particular order
+  transfer_t *queued[NUM_PRIORITIES]; // waiting, oldest first
+  int num_active;
+  int num_active_background;
+  int num_queued;
+  long max_active;                    // 0 if unlimited
+  long max_queued;
+  long max_body_size;                 // 0 if unlimited
+  watched_socket_t *sockets;
+  int64_t timer_expires_at; // -1 if curl has no timeout pending
+  backend_stats_t stats;
+  zsock_t *bcast;
+  zsock_t *router;
+  sqlite3 *outbox;                    // NULL if it couldn't be opened
+  busy_destination_t *busy_destinations;
+  outbox_caller_t *outbox_callers;
+  int64_t outbox_wake_at;   // ms since the epoch; -1 if nothing is waiting
+  response_cache_t *cache;            // NULL if it hasn't been created yet
+  long cache_max_memory;
+  long cache_max_disk;
+  host_timings_t *host_timings;
+  warm_host_t *warm_hosts;
+  char *prewarm_url;                  // prewarmed on card events; NULL if none
+  zsock_t *card_events;               // subscribed only while prewarm_url is set
+  char *http2_hosts;                  // NULL if HTTP/2 isn't offered to any
+  long prewarm_interval;              // 0 if they aren't refreshed
+  long prewarm_idle_close;
+} engine_t;
+
+/*
+ * Where a request or command came from, so that it can be answered: either
+ * the REP socket, or the router together with the caller's identity.
+ */
+typedef struct {
+  zsock_t *sock;
+  zframe_t *identity;
+} caller_t;
 
 // The whitelist is loaded once at startup, and is immutable. It is shared
 // amongst all background processors. I think this is safe because it never
@@ -133,6 +572,15 @@ static whitelist_entry_t *whitelist = NULL;
 // The main backend service.
 static zactor_t          *service   = NULL;
 
+// DNS results, TLS sessions and open connections, shared by every backend
+// request. The locks let the share be used from other threads as well.
+static CURLSH            *share     = NULL;
+static pthread_mutex_t    share_locks[CURL_LOCK_DATA_LAST];
+
+// CA certificates, parsed once from `cacerts_bundle` and given to every TLS
+// connection, rather than being read from disk for each one.
+static X509_STORE        *ca_store  = NULL;
+
 /*
  * Returns 1 if the hostname appears in the whitelist, 0 otherwise.
  */
@@ -143,310 +591,1769 @@ int is_whitelisted(const char *hostname, const size_t len) {
   return 1;
 }
 
-void perform_request(int worker_id, const char *request_id, CURL *curl, zmsg_t *msg, zsock_t *pipe) {
+static void lock_share(CURL *handle, curl_lock_data data, curl_lock_access access, void *userp) {
+  pthread_mutex_lock(&share_locks[data]);
+}
+
+static void unlock_share(CURL *handle, curl_lock_data data, void *userp) {
+  pthread_mutex_unlock(&share_locks[data]);
+}
+
+static void init_share(void) {
+  int i;
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_init(&share_locks[i], NULL);
+  share = curl_share_init();
+  curl_share_setopt(share, CURLSHOPT_LOCKFUNC,   lock_share);
+  curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock_share);
+  curl_share_setopt(share, CURLSHOPT_SHARE,      CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share, CURLSHOPT_SHARE,      CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900 // 7.57.0
+  curl_share_setopt(share, CURLSHOPT_SHARE,      CURL_LOCK_DATA_CONNECT);
+#endif
+}
+
+static void shutdown_share(void) {
+  int i;
+  if (!share) return;
+  curl_share_cleanup(share);
+  share = NULL;
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_destroy(&share_locks[i]);
+}
+
+static void init_ca_store(void) {
+  ca_store = X509_STORE_new();
+  if (!strlen(cacerts_bundle) || X509_STORE_load_locations(ca_store, cacerts_bundle, NULL) != 1) {
+    LWARN("backend: could not load CA certificates from '%s'", cacerts_bundle);
+    X509_STORE_free(ca_store);
+    ca_store = NULL;
+  }
+}
+
+/*
+ * Called by curl with each new SSL_CTX, to give it the CA store which was
+ * loaded at startup.
+ */
+static CURLcode use_shared_ca_store(CURL *curl, void *ssl_ctx, void *userp) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  CRYPTO_add(&ca_store->references, 1, CRYPTO_LOCK_X509_STORE);
+#else
+  X509_STORE_up_ref(ca_store);
+#endif
+  SSL_CTX_set_cert_store((SSL_CTX *) ssl_ctx, ca_store);
+  return CURLE_OK;
+}
+
+/*
+ * If `line` is the header `name`, replaces `*value` with its value and
+ * returns 1.
+ */
+static int keep_header(const char *line, size_t len, const char *name, char **value) {
+  size_t name_len = strlen(name);
+  if (len <= name_len || line[name_len] != ':' || strncasecmp(line, name, name_len)) return 0;
+  line += name_len + 1;
+  len  -= name_len + 1;
+  while (len && (*line == ' ' || *line == '\t')) { line++; len--; }
+  while (len && isspace((unsigned char) line[len - 1])) len--;
+  free(*value);
+  *value = strndup(line, len);
+  return 1;
+}
+
+/*
+ * Notes whether a TLS session was resumed, while the connection is still
+ * attached to the transfer, and keeps the headers the response cache needs.
+ */
+static size_t on_response_header(char *buffer, size_t size, size_t nitems, void *userp) {
+  transfer_t *transfer = (transfer_t *) userp;
+  size_t len = size * nitems;
+  if (transfer->cache_key) {
+    if (len > 5 && !strncmp(buffer, "HTTP/", 5)) {
+      // a new response, after a redirect or "100 Continue"
+      free(transfer->etag);          transfer->etag          = NULL;
+      free(transfer->last_modified); transfer->last_modified = NULL;
+      free(transfer->cache_control); transfer->cache_control = NULL;
+      free(transfer->expires);       transfer->expires       = NULL;
+      free(transfer->date);          transfer->date          = NULL;
+    } else if (!keep_header(buffer, len, "ETag",          &transfer->etag)          &&
+               !keep_header(buffer, len, "Last-Modified", &transfer->last_modified) &&
+               !keep_header(buffer, len, "Cache-Control", &transfer->cache_control) &&
+               !keep_header(buffer, len, "Expires",       &transfer->expires)) {
+      keep_header(buffer, len, "Date", &transfer->date);
+    }
+  }
+#if LIBCURL_VERSION_NUM >= 0x073000 // 7.48.0
+  if (!transfer->tls_checked) {
+    struct curl_tlssessioninfo *info = NULL;
+    transfer->tls_checked = 1;
+    if (curl_easy_getinfo(transfer->curl, CURLINFO_TLS_SSL_PTR, &info) == CURLE_OK &&
+        info && info->backend == CURLSSLBACKEND_OPENSSL && info->internals)
+      transfer->tls_resumed = SSL_session_reused((SSL *) info->internals);
+  }
+#endif
+  return len;
+}
+
+static void free_transfer(transfer_t *transfer) {
+  if (transfer->curl) curl_easy_cleanup(transfer->curl);
+  curl_slist_free_all(transfer->headers);
+  curl_slist_free_all(transfer->resolve);
+  free(transfer->response.memory);
+  if (transfer->file) {
+    // the transfer didn't succeed, so what we have is incomplete
+    fclose(transfer->file);
+    unlink(transfer->partial);
+  }
+  free(transfer->save_to);
+  free(transfer->partial);
+  free(transfer->destination);
+  free(transfer->cache_key);
+  free(transfer->etag);
+  free(transfer->last_modified);
+  free(transfer->cache_control);
+  free(transfer->expires);
+  free(transfer->date);
+  if (transfer->reply_to) zframe_destroy(&transfer->reply_to);
+  free(transfer->host);
+  free(transfer->url);
+  free(transfer->method);
+  free(transfer->body);
+  free(transfer);
+}
+
+/*
+ * Sends a reply to whoever sent a request or command.
+ */
+static void reply_to_caller(caller_t *caller, zmsg_t **reply) {
+  if (caller->identity) {
+    zframe_t *identity = zframe_dup(caller->identity);
+    zmsg_prepend(*reply, &identity);
+  }
+  zmsg_send(reply, caller->sock);
+}
+
+static void reply_to_caller_with(caller_t *caller, const char *key, const char *value) {
+  zmsg_t *reply = zmsg_new();
+  zmsg_addstr(reply, key);
+  zmsg_addstr(reply, value);
+  reply_to_caller(caller, &reply);
+}
+
+/*
+ * Delivers the result of a request. `body` may be binary, and its length is
+ * given by `body_len`. Requests which came in on the router are answered
+ * directly, and only announced on the bus, without the body, if they asked
+ * for it. Others are broadcast in full.
+ */
+static void publish_result(engine_t *engine, transfer_t *transfer, const char *status,
+                           int code, const char *body, size_t body_len, double duration) {
+  transfer_timing_t *timing = &transfer->timing;
+  char duration_str[3 + DBL_MANT_DIG - DBL_MIN_EXP + 1];
+  zmsg_t *reply;
+
+  if (transfer->prewarm) return; // nobody is waiting for it
+  reply = zmsg_new();
+  sprintf(duration_str, "%f", duration);
+
+  zmsg_addstr(reply, "backend-complete");
+  zmsg_addstr(reply, transfer->id);
+  zmsg_addstr(reply, "result");
+  zmsg_addstr(reply, status);
+  zmsg_addstr(reply, "code");
+  zmsg_addstrf(reply, "%d", code);
+  zmsg_addstr(reply, "body");
+  zmsg_addmem(reply, body, body_len);
+  zmsg_addstr(reply, "duration");
+  zmsg_addstr(reply, duration_str);
+  #define add_timing(name, value) { zmsg_addstr(reply, name); zmsg_addstrf(reply, "%lld", value); }
+  add_timing("name_lookup_us",    timing->name_lookup);
+  add_timing("connect_us",        timing->connect);
+  add_timing("app_connect_us",    timing->app_connect);
+  add_timing("pretransfer_us",    timing->pretransfer);
+  add_timing("start_transfer_us", timing->start_transfer);
+  add_timing("total_us",          timing->total);
+  add_timing("bytes_sent",        timing->bytes_sent);
+  add_timing("bytes_received",    timing->bytes_received);
+  #undef add_timing
+  zmsg_addstr(reply, "reused");
+  zmsg_addstr(reply, timing->reused ? "true" : "false");
+  zmsg_addstr(reply, "http_version");
+  zmsg_addstr(reply, transfer->http_version == CURL_HTTP_VERSION_2_0 ? "2"   :
+                     transfer->http_version == CURL_HTTP_VERSION_1_1 ? "1.1" :
+                     transfer->http_version == CURL_HTTP_VERSION_1_0 ? "1.0" : "");
+
+  if (!transfer->reply_to) {
+    zmsg_send(&reply, engine->bcast);
+    LTRACE("backend: %s: sent result", transfer->id);
+    return;
+  }
+
+  zframe_t *identity = zframe_dup(transfer->reply_to);
+  zmsg_prepend(reply, &identity);
+  zmsg_send(&reply, engine->router);
+  LTRACE("backend: %s: sent result to caller", transfer->id);
+
+  if (transfer->notify)
+    zsock_send(engine->bcast, "sssssiss", "backend-notice", transfer->id,
+                                          "result",   status,
+                                          "code",     code,
+                                          "duration", duration_str);
+}
+
+static void publish_error(engine_t *engine, transfer_t *transfer, int code, const char *message) {
+  LERROR("backend: %s: %s", transfer->id, message);
+  publish_result(engine, transfer, "error", code, message, strlen(message), 0.0);
+}
+
+/*
+ * Sends part of a streamed response body to whoever is waiting for it.
+ */
+static void publish_chunk(transfer_t *transfer, const char *data, size_t len) {
+  zmsg_t *chunk = zmsg_new();
+  if (transfer->reply_to) {
+    zframe_t *identity = zframe_dup(transfer->reply_to);
+    zmsg_append(chunk, &identity);
+  }
+  zmsg_addstr(chunk, "backend-chunk");
+  zmsg_addstr(chunk, transfer->id);
+  zmsg_addstr(chunk, "seq");
+  zmsg_addstrf(chunk, "%lu", ++transfer->chunks_sent);
+  zmsg_addstr(chunk, "data");
+  zmsg_addmem(chunk, data, len);
+  zmsg_send(&chunk, transfer->chunks_to);
+}
+
+/*
+ * Called by curl with each part of the response body as it arrives. The
+ * body is kept in memory, streamed to the caller or written to a file,
+ * depending on the request. Returning less than was given aborts the
+ * transfer.
+ */
+static size_t on_response_body(char *data, size_t size, size_t nmemb, void *userp) {
+  transfer_t *transfer = (transfer_t *) userp;
+  struct MemoryStruct *response = &transfer->response;
+  size_t len = size * nmemb;
+
+  if (transfer->max_body_size && transfer->body_size + len > transfer->max_body_size) {
+    transfer->too_large = 1;
+    return 0;
+  }
+  transfer->body_size += len;
+
+  if (transfer->file)
+    return fwrite(data, 1, len, transfer->file);
+  if (transfer->stream) {
+    publish_chunk(transfer, data, len);
+    return len;
+  }
+
+  // grow geometrically, rather than copying the whole body for every chunk
+  if (response->size + len + 1 > transfer->capacity) {
+    size_t capacity = transfer->capacity ? transfer->capacity : CURL_MAX_WRITE_SIZE;
+    char *memory;
+    while (capacity < response->size + len + 1) capacity *= 2;
+    if (!(memory = (char *) realloc(response->memory, capacity))) {
+      LERROR("backend: %s: out of memory for a %zu byte response", transfer->id, response->size + len);
+      return 0;
+    }
+    response->memory = memory;
+    transfer->capacity = capacity;
+  }
+  memcpy(response->memory + response->size, data, len);
+  response->size += len;
+  response->memory[response->size] = '\0';
+  return len;
+}
+
+/*
+ * Opens the file named by the "save_to" key of a request, within the
+ * "files" directory of one of the `WRITE_PATHS`. The body is written next
+ * to it, and only moved into place once the whole of it has arrived.
+ * Returns 0 on success.
+ */
+static int open_save_file(transfer_t *transfer, const char *filename) {
+  char *dir, *slash;
+
+  if (!(transfer->save_to = find_writable_file("files", filename))) {
+    LWARN("backend: %s: %s is not a writable path", transfer->id, filename);
+    return 1;
+  }
+  dir = strdup(transfer->save_to);
+  if ((slash = strrchr(dir, '/'))) *slash = '\0';
+  if (mkdir_p(dir)) LWARN("backend: %s: could not create %s", transfer->id, dir);
+  free(dir);
+
+  if (asprintf(&transfer->partial, "%s.part", transfer->save_to) < 0) {
+    transfer->partial = NULL;
+    return 1;
+  }
+  if (!(transfer->file = fopen(transfer->partial, "wb"))) {
+    LWARN("backend: %s: could not open %s: %s", transfer->id, transfer->partial, strerror(errno));
+    return 1;
+  }
+  LDEBUG("backend: %s: saving response body to %s", transfer->id, transfer->save_to);
+  return 0;
+}
+
+/*
+ * Returns 1 if HTTP/2 should be offered to `host`, according to
+ * "backend.http2_hosts".
+ */
+static int wants_http2(engine_t *engine, const char *host) {
+  const char *hosts = engine->http2_hosts;
+  size_t len = strlen(host), n;
+  if (!hosts) return 0;
+  while (*(hosts += strspn(hosts, " ,"))) {
+    n = strcspn(hosts, " ,");
+    if ((n == 1 && *hosts == '*') || (n == len && !strncasecmp(hosts, host, n))) return 1;
+    hosts += n;
+  }
+  return 0;
+}
+
+/*
+ * Parses the request in `msg` into a new transfer and configures its easy
+ * handle. The transfer takes ownership of `reply_to`, which may be NULL. If
+ * the request is invalid, the error is published and NULL is returned.
+ */
+static transfer_t *prepare_transfer(engine_t *engine, const char *request_id, zmsg_t *msg,
+                                    zframe_t *reply_to) {
   UriParserStateA state;
   UriUriA uri;
-  int i, len;
-  char *request_url          = NULL;
-  char *request_method       = NULL;
-  char *request_body         = NULL;
-  struct MemoryStruct response_data;
-  struct curl_slist *request_headers = NULL;
-  CURLcode res;
-  struct {
-    char status[64];
-    int code;
-    char *body;
-    char duration[64];
-  } result;
-  memset(&result, 0, sizeof(result));
-  size_t val_len, request_body_len = 0;
-
-  memset(&response_data, 0, sizeof(response_data));
-  curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
-  curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 2L);
+  int i, len, verify = 1, cache = 0, tokenized = 0;
+  long timeout = DEFAULT_REQUEST_TIMEOUT;
+  size_t val_len, body_len = 0;
+  char *save_to = NULL, *varies = strdup("");
+  transfer_t *transfer = (transfer_t *) calloc(1, sizeof(transfer_t));
+  sprintf(transfer->id, "%.*s", (int) sizeof(transfer->id) - 1, request_id);
+  transfer->priority = PRIORITY_AUTHORIZATION;
+  transfer->reply_to = reply_to;
+  transfer->chunks_to = reply_to ? engine->router : engine->bcast;
+  transfer->max_body_size = (size_t) engine->max_body_size;
 
   len = zmsg_size(msg);
-  LINFO("backend: worker %d: %s: processing request %d parts", worker_id, request_id, len);
+  LINFO("backend: %s: processing request %d parts", request_id, len);
   for (i = 0; i < len; i += 2) {
     char *key = zmsg_popstr(msg);
     char *val = zmsg_popstr(msg);
+    if (!val) val = strdup("");
     val_len = strlen(val);
-    LTRACE("backend: worker %d: %s: processing key %s", worker_id, request_id, key);
+    LTRACE("backend: %s: processing key %s", request_id, key);
     if (!strcmp(key, "url")) {
-      request_url = detokenize_template(val, &val_len);
+      if (strstr(val, TOKEN_PREFIX)) tokenized = 1;
+      free(transfer->url);
+      transfer->url = detokenize_template(val, &val_len);
       free(val);
-      LINSEC("backend: worker %d: %s: request url: %s", worker_id, request_id, request_url);
+      LINSEC("backend: %s: request url: %s", request_id, transfer->url);
     } else if (!strcmp(key, "method") || !strcmp(key, "verb")) {
-      request_method = val;
-      LDEBUG("backend: worker %d: %s: request method: %s", worker_id, request_id, request_method);
+      free(transfer->method);
+      transfer->method = val;
+      LDEBUG("backend: %s: request method: %s", request_id, transfer->method);
     } else if (!strcmp(key, "body")) {
-      request_body_len = val_len;
-      request_body = strdup(val);
+      free(transfer->body);
+      body_len = val_len;
+      transfer->body = val;
+    } else if (!strcmp(key, "priority")) {
+      int p;
+      for (p = 0; p < NUM_PRIORITIES && strcmp(val, priority_names[p]); p++);
+      if (p < NUM_PRIORITIES) transfer->priority = (priority_t) p;
+      else LWARN("backend: %s: unknown priority '%s', using '%s'", request_id, val,
+                 priority_names[transfer->priority]);
+      free(val);
+    } else if (!strcmp(key, "notify")) {
+      transfer->notify = !strcmp(val, "true") || !strcmp(val, "yes");
+      free(val);
+    } else if (!strcmp(key, "cache")) {
+      cache = !strcmp(val, "true") || !strcmp(val, "yes");
+      free(val);
+    } else if (!strcmp(key, "defer")) {
+      free(val); // already in the outbox, if it was asked for
+    } else if (!strcmp(key, "stream")) {
+      transfer->stream = !strcmp(val, "true") || !strcmp(val, "yes");
+      free(val);
+    } else if (!strcmp(key, "save_to")) {
+      free(save_to);
+      save_to = val;
+    } else if (!strcmp(key, "max_body_size")) {
+      long max = atol(val);
+      if (max < 0 || (max == 0 && strcmp(val, "0")))
+        LWARN("backend: %s: invalid max_body_size '%s', using %zu", request_id, val, transfer->max_body_size);
+      else
+        transfer->max_body_size = (size_t) max;
+      free(val);
+    } else if (!strcmp(key, "timeout")) {
+      timeout = atol(val);
+      if (timeout <= 0) {
+        LWARN("backend: %s: invalid timeout '%s', using %d ms", request_id, val, DEFAULT_REQUEST_TIMEOUT);
+        timeout = DEFAULT_REQUEST_TIMEOUT;
+      }
       free(val);
     } else if (!strcmp(key, "validate_ssl_certificates")) {
       if (!strcmp(val, "true") || !strcmp(val, "yes")) {
-        LINFO("backend: worker %d: %s: SSL verification enabled", worker_id, request_id);
+        LINFO("backend: %s: SSL verification enabled", request_id);
+      } else if (ALLOW_DISABLE_SSL_VERIFICATION) {
+        LWARN("backend: %s: NOT performing SSL certificate validation!", request_id);
+        verify = 0;
       } else {
-        if (ALLOW_DISABLE_SSL_VERIFICATION) {
-          LWARN("backend: worker %d: %s: NOT performing SSL certificate validation!", worker_id, request_id);
-          curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
-          curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
-        } else {
-          LERROR("backend: worker %d: %s: SSL verification cannot be disabled", worker_id, request_id);
-        }
+        LERROR("backend: %s: SSL verification cannot be disabled", request_id);
       }
       free(val);
     } else {
       char *detokenized_val = detokenize_template(val, &val_len);
-      free(val);
-      val = detokenized_val;
       char *tmp = NULL;
-      if (asprintf(&tmp, "%s: %s", key, val)) {}
-      request_headers = curl_slist_append(request_headers, tmp);
-      LINSEC("backend: worker %d: %s: request header: %s", worker_id, request_id, tmp);
+      if (strstr(val, TOKEN_PREFIX)) tokenized = 1;
       free(val);
+      if (asprintf(&tmp, "%s: %s", key, detokenized_val)) {}
+      transfer->headers = curl_slist_append(transfer->headers, tmp);
+      if (!strcasecmp(key, "Accept") || !strcasecmp(key, "Accept-Language") ||
+          !strcasecmp(key, "Authorization")) {
+        char *more = NULL;
+        if (asprintf(&more, "%s\t%s", varies, tmp) < 0) more = NULL;
+        free(varies);
+        varies = more ? more : strdup("");
+      }
+      LINSEC("backend: %s: request header: %s", request_id, tmp);
+      free(detokenized_val);
       free(tmp);
     }
     free(key);
   }
 
-  if (!request_method) request_method = strdup("GET");
+  if (!transfer->method) transfer->method = strdup("GET");
+  transfer->deadline = zclock_mono() + timeout;
 
-#define RESULT(_status, _code, _body, _duration)             \
-        result.code = _code;                                 \
-        if (strlen(_body) > 0) result.body = strdup(_body);  \
-        sprintf(result.status,   "%.*s", 63, _status);       \
-        sprintf(result.duration, "%.*s", 63, _duration);
-  if (request_url) {
-    curl_easy_setopt(curl, CURLOPT_URL, request_url);
-    state.uri = &uri;
+  if (cache && !tokenized && !transfer->body && !save_to && !transfer->stream && transfer->url &&
+      !strcmp(transfer->method, "GET")) {
+    if (asprintf(&transfer->cache_key, "GET %s%s", transfer->url, varies) < 0) transfer->cache_key = NULL;
+  } else if (cache) {
+    LDEBUG("backend: %s: request can't be cached", request_id);
+  }
+  free(varies);
 
-    if (uriParseUriA(&state, request_url) != URI_SUCCESS) {
-      RESULT("error", -1, "could not parse your URL", "0.0");
-    } else if (uriNormalizeSyntaxExA(&uri, URI_NORMALIZE_SCHEME | URI_NORMALIZE_HOST) != URI_SUCCESS) {
-      RESULT("error", -2, "could not normalize your URL", "0.0");
-    } else {
-      const char *host = uri.hostText.first;
-      char scheme[20];
-      double total_duration = 0.0;
-      char total_duration_str[3 + DBL_MANT_DIG - DBL_MIN_EXP + 1];
-      int schemelen = uri.scheme.afterLast - uri.scheme.first;
-      if (schemelen > 19) schemelen = 19;
-      memcpy(scheme, uri.scheme.first, schemelen);
-      scheme[uri.scheme.afterLast - uri.scheme.first] = '\0';
-
-      if (strcmp(scheme, "https")) {
-        RESULT("error", -3, "only HTTPS URLs are allowed", "0.0");
-      } else {
-        if (is_whitelisted(host, (int) (uri.hostText.afterLast - uri.hostText.first))) {
-          LDEBUG("backend: worker %d: %s: URL is whitelisted, sensitive data will be allowed", worker_id, request_id);
-          if (request_body) {
-            char *tmp = detokenize_template(request_body, &request_body_len);
-            free(request_body);
-            request_body = tmp;
-            LINSEC("backend: worker %d: %s: request body (%lld bytes): %s", worker_id, request_id, (long long) request_body_len, request_body);
-          }
-        } else {
-          LDEBUG("backend: worker %d: %s: URL is NOT whitelisted, sensitive data will be disallowed", worker_id, request_id);
-          if (request_body) {
-            char *tmp = humanize_template(request_body, &request_body_len);
-            free(request_body);
-            request_body = tmp;
-            LINSEC("backend: worker %d: %s: request body (%lld bytes): %s", worker_id, request_id, (long long) request_body_len, request_body);
-          }
-        }
+  if (!transfer->url) {
+    free(save_to);
+    publish_error(engine, transfer, -5, "you did not specify a URL");
+    free_transfer(transfer);
+    return NULL;
+  }
 
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER,    request_headers);
-        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request_method);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS,    request_body);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, request_body_len);
-        curl_easy_setopt(curl, CURLOPT_CAINFO,        cacerts_bundle);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA,     &response_data);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_cb_accum_mem);
-
-        res = curl_easy_perform(curl);
-        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total_duration);
-        sprintf(total_duration_str, "%f", total_duration);
-        if(res != CURLE_OK) {
-          LERROR("backend: worker %d: %s: request failed: %s (%s secs)", worker_id, request_id, curl_easy_strerror(res), total_duration_str);
-          RESULT("error", res, curl_easy_strerror(res), total_duration_str);
-        } else {
-          long http_code = 0;
-          curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-          LDEBUG("backend: worker %d: %s: request succeeded: %ld in %s ms", worker_id, request_id, http_code, total_duration_str);
-          int i, printable = 1;
-          for (i = 0; i < response_data.size; i++)
-            if (!isprint(*(response_data.memory + i)) && *(response_data.memory + i) != '\n' && *(response_data.memory + i) != '\r')
-              printable = 0;
-          if (printable && response_data.size)
-            LINSEC("backend: worker %d: %s: response body (cstr): %.*s", worker_id, request_id, response_data.size, response_data.memory);
-          else {
-            LINSEC("backend: worker %d: %s: response body (blob): %zu bytes", worker_id, request_id, response_data.size);
-            char prefix[1024];
-            sprintf(prefix, "backend: worker %d: %s: response body (blob):", worker_id, request_id);
-            // dump_blob_as_hex((unsigned char *) response_data.memory, response_data.size, prefix);
-          }
-          RESULT("success", http_code, "", total_duration_str);
-          result.body = NULL;
-        }
-      }
+  if (save_to) {
+    int failed = open_save_file(transfer, save_to);
+    free(save_to);
+    if (failed) {
+      publish_error(engine, transfer, -8, "could not open the file to save to");
+      free_transfer(transfer);
+      return NULL;
     }
+    if (transfer->stream) LWARN("backend: %s: saving to a file, so not streaming", request_id);
+    transfer->stream = 0;
+  }
 
+  state.uri = &uri;
+  if (uriParseUriA(&state, transfer->url) != URI_SUCCESS) {
+    publish_error(engine, transfer, -1, "could not parse your URL");
+    free_transfer(transfer);
+    return NULL;
+  }
+  if (uriNormalizeSyntaxExA(&uri, URI_NORMALIZE_SCHEME | URI_NORMALIZE_HOST) != URI_SUCCESS) {
     uriFreeUriMembersA(&uri);
-  } else {
-    RESULT("error", -5, "you did not specify a URL", "0.0");
+    publish_error(engine, transfer, -2, "could not normalize your URL");
+    free_transfer(transfer);
+    return NULL;
+  }
+  if (uri.scheme.afterLast - uri.scheme.first != 5 || strncmp(uri.scheme.first, "https", 5)) {
+    uriFreeUriMembersA(&uri);
+    publish_error(engine, transfer, -3, "only HTTPS URLs are allowed");
+    free_transfer(transfer);
+    return NULL;
   }
 
-  if (!response_data.memory) {
-    if (result.body) {
-      response_data.memory = result.body;
-      response_data.size = strlen(result.body);
-      result.body = NULL;
-    } else {
-      response_data.memory = strdup("");
-      response_data.size = 1;
-    }
-  }
-  assert(result.body == NULL);
-  assert(!zsock_send(pipe, "sssssisbss", "backend-complete", request_id,
-                                         "result",   result.status,
-                                         "code",     result.code,
-                                         "body",     response_data.memory, response_data.size,
-                                         "duration", result.duration));
-  LTRACE("backend: worker %d: %s: sent result", worker_id, request_id);
-
-  if (response_data.memory) free(response_data.memory);
-  free(request_url);
-  free(request_method);
-  free(request_body);
-  curl_slist_free_all(request_headers);
-  LDEBUG("backend: worker %d: %s: request completed", worker_id, request_id);
-}
-
-void backend_worker(zsock_t *pipe, void *arg) {
-  zpoller_t *poller = zpoller_new(pipe, NULL);
-  CURL *curl = curl_easy_init();
-  curl_easy_setopt(curl, CURLOPT_NOSIGNAL,        1L);
-  curl_easy_setopt(curl, CURLOPT_TIMEOUT,        40L);
-  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
-  int worker_id = (int) (intptr_t) arg;
-  LDEBUG("backend: worker %d instantiated", worker_id);
-  zsock_signal(pipe, 0);
-  if (LGETLEVEL() <= LOG_LEVEL_INSEC)
-    curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-  else
-    curl_easy_setopt(curl, CURLOPT_VERBOSE, 0L);
-
-  void *in = NULL;
-  while ((in = zpoller_wait(poller, -1))) {
-    zmsg_t *msg = zmsg_recv(pipe);
-    assert(msg);
-    assert(zmsg_size(msg) > 0);
-    char *request_id = zmsg_popstr(msg);
-    if (!strcmp(request_id, "$TERM")) {
-      LDEBUG("backend: worker %d: received shutdown signal", worker_id);
-      free(request_id);
-      zmsg_destroy(&msg);
-      break;
+  transfer->host = strndup(uri.hostText.first, uri.hostText.afterLast - uri.hostText.first);
+  transfer->port = 443;
+  if (uri.portText.first && uri.portText.afterLast > uri.portText.first) {
+    char *port = strndup(uri.portText.first, uri.portText.afterLast - uri.portText.first);
+    transfer->port = atoi(port);
+    free(port);
+  }
+  if (transfer->body) {
+    char *tmp;
+    if (is_whitelisted(uri.hostText.first, (int) (uri.hostText.afterLast - uri.hostText.first))) {
+      LDEBUG("backend: %s: URL is whitelisted, sensitive data will be allowed", request_id);
+      tmp = detokenize_template(transfer->body, &body_len);
     } else {
-      perform_request(worker_id, request_id, curl, msg, pipe);
+      LDEBUG("backend: %s: URL is NOT whitelisted, sensitive data will be disallowed", request_id);
+      tmp = humanize_template(transfer->body, &body_len);
     }
-    free(request_id);
-    zmsg_destroy(&msg);
+    free(transfer->body);
+    transfer->body = tmp;
+    LINSEC("backend: %s: request body (%lld bytes): %s", request_id, (long long) body_len, transfer->body);
+  }
+  uriFreeUriMembersA(&uri);
+
+  transfer->curl = curl_easy_init();
+  curl_easy_setopt(transfer->curl, CURLOPT_NOSIGNAL,        1L);
+  curl_easy_setopt(transfer->curl, CURLOPT_VERBOSE,        LGETLEVEL() <= LOG_LEVEL_INSEC ? 1L : 0L);
+  curl_easy_setopt(transfer->curl, CURLOPT_SSL_VERIFYPEER, verify ? 1L : 0L);
+  curl_easy_setopt(transfer->curl, CURLOPT_SSL_VERIFYHOST, verify ? 2L : 0L);
+  curl_easy_setopt(transfer->curl, CURLOPT_URL,            transfer->url);
+  curl_easy_setopt(transfer->curl, CURLOPT_HTTPHEADER,     transfer->headers);
+  curl_easy_setopt(transfer->curl, CURLOPT_CUSTOMREQUEST,  transfer->method);
+  curl_easy_setopt(transfer->curl, CURLOPT_POSTFIELDS,     transfer->body);
+  curl_easy_setopt(transfer->curl, CURLOPT_POSTFIELDSIZE,  (long) body_len);
+  curl_easy_setopt(transfer->curl, CURLOPT_WRITEDATA,      transfer);
+  curl_easy_setopt(transfer->curl, CURLOPT_WRITEFUNCTION,  on_response_body);
+  curl_easy_setopt(transfer->curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t) transfer->max_body_size);
+  curl_easy_setopt(transfer->curl, CURLOPT_HEADERDATA,     transfer);
+  curl_easy_setopt(transfer->curl, CURLOPT_HEADERFUNCTION, on_response_header);
+  curl_easy_setopt(transfer->curl, CURLOPT_PRIVATE,        transfer);
+  curl_easy_setopt(transfer->curl, CURLOPT_SHARE,          share);
+  curl_easy_setopt(transfer->curl, CURLOPT_DNS_CACHE_TIMEOUT, (long) DNS_CACHE_TIMEOUT);
+#if LIBCURL_VERSION_NUM >= 0x072f00 // 7.47.0
+  // curl would otherwise offer HTTP/2 to every host, if it was built with it
+  if (wants_http2(engine, transfer->host) &&
+      curl_easy_setopt(transfer->curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS) == CURLE_OK) {
+    curl_easy_setopt(transfer->curl, CURLOPT_PIPEWAIT, 1L);
+  } else {
+    curl_easy_setopt(transfer->curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
   }
+#endif
+#if LIBCURL_VERSION_NUM >= 0x074100 // 7.65.0
+  // so that a prewarmed connection which has gone idle is closed, not used
+  if (engine->prewarm_idle_close > 0)
+    curl_easy_setopt(transfer->curl, CURLOPT_MAXAGE_CONN, (engine->prewarm_idle_close + 999) / 1000);
+#endif
 
-  LDEBUG("backend: worker %d shutting down", worker_id);
-  curl_easy_cleanup(curl);
+  // curl only supports this with OpenSSL; with any other TLS library it
+  // reads the CA bundle itself, as before
+  if (!ca_store || curl_easy_setopt(transfer->curl, CURLOPT_SSL_CTX_FUNCTION, use_shared_ca_store) != CURLE_OK) {
+    curl_easy_setopt(transfer->curl, CURLOPT_CAINFO, cacerts_bundle);
+  } else {
+    curl_easy_setopt(transfer->curl, CURLOPT_CAINFO, NULL);
+    curl_easy_setopt(transfer->curl, CURLOPT_CAPATH, NULL);
+  }
+  return transfer;
 }
 
-void backend_service(zsock_t *pipe, void *arg) {
-  zsock_t *incoming_requests = zsock_new_rep("inproc://backend");
-  zpoller_t *poller = zpoller_new(pipe, incoming_requests, NULL);
-  zsock_t *bcast = zsock_new_pub(">" EVENTS_PUB_ENDPOINT);
-  long req_id = 0;
+static int is_ip_address(const char *host) {
+  unsigned char addr[sizeof(struct in6_addr)];
+  return inet_pton(AF_INET, host, addr) == 1 || inet_pton(AF_INET6, host, addr) == 1;
+}
 
-  typedef struct { zactor_t *actor; bool busy; } worker_t;
-  worker_t *worker_pool = NULL;
-  int worker_pool_size = 0;
+/*
+ * Counts whether the transfer was able to use the shared caches.
+ */
+static void update_cache_stats(engine_t *engine, transfer_t *transfer, CURLcode res) {
+  backend_stats_t *stats = &engine->stats;
+  long num_connects = 0;
 
-  LINFO("backend: service initialized");
-  zsock_signal(pipe, 0);
+  stats->requests++;
+  curl_easy_getinfo(transfer->curl, CURLINFO_NUM_CONNECTS, &num_connects);
+  if (num_connects == 0 && res != CURLE_OK) return; // never connected
+  if (num_connects == 0) {
+    stats->connections_reused++;
+    return;
+  }
+  stats->connections_opened++;
+  stats->tls_handshakes++;
+  if (transfer->tls_resumed) stats->tls_sessions_resumed++;
 
-  while (1) {
-    void *in = zpoller_wait(poller, -1);
+  // IP addresses aren't looked up at all
+  if (is_ip_address(transfer->host)) return;
+  if (transfer->dns_cached) stats->dns_cache_hits++;
+  else                      stats->dns_lookups++;
+}
 
-    if (in == pipe) {
-      LDEBUG("backend: received shutdown signal");
-      break;
-    } else if (in == NULL) {
-      LWARN("backend: service interrupted!");
-      break;
-    } else if (in == incoming_requests) {
-      zmsg_t *msg = zmsg_recv(incoming_requests);
-
-      // generate an id and let the other thread go back to doing useful stuff
-      // and then add the request id to the msg before the msg is forwarded to
-      // a worker
-      char *request_id = calloc(1, 128 * sizeof(char));
-      sprintf(request_id, "request:%ld", ++req_id);
-      zsock_send(incoming_requests, "ss", "broadcast_id", request_id);
-      zmsg_pushstr(msg, request_id);
-      free(request_id);
-
-      // check out or instantiate a new background processor
-      zactor_t *worker = NULL;
-      int i;
-      for (i = 0; i < worker_pool_size; i++) {
-        // waiting worker found, forward the request along
-        if (!worker_pool[i].busy) {
-          worker = worker_pool[i].actor;
-          worker_pool[i].busy = true;
-          break;
-        }
-      }
+/*
+ * Notes how long each phase of the transfer took and how much it sent and
+ * received, for its result, and adds it to its host's samples if it got a
+ * response.
+ */
+static void measure_transfer(engine_t *engine, transfer_t *transfer, CURLcode res) {
+  transfer_timing_t *timing = &transfer->timing;
+  CURL *curl = transfer->curl;
+#if LIBCURL_VERSION_NUM >= 0x073700 // 7.55.0
+  curl_off_t value;
+#endif
+#if LIBCURL_VERSION_NUM < 0x073d00 // 7.61.0
+  double number;
+#endif
+  long size, num_connects = 0;
 
-      // if worker == NULL, we need to instantiate a new worker
-      if (worker == NULL) {
-        worker_pool = realloc(worker_pool, (++worker_pool_size) * sizeof(worker_t));
-        worker = zactor_new(backend_worker, (void *) (intptr_t) worker_pool_size);
-        worker_pool[worker_pool_size-1].actor = worker;
-        worker_pool[worker_pool_size-1].busy = true;
-        zpoller_add(poller, worker);
-      }
+  // older versions of curl only give times in seconds and sizes as doubles
+#if LIBCURL_VERSION_NUM >= 0x073d00 // 7.61.0
+  #define get_time(info, field) \
+    if (curl_easy_getinfo(curl, info##_T, &value) == CURLE_OK) timing->field = (long long) value;
+#else
+  #define get_time(info, field) \
+    if (curl_easy_getinfo(curl, info, &number) == CURLE_OK) timing->field = (long long) (number * 1000000);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x073700 // 7.55.0
+  #define get_size(info, field) \
+    if (curl_easy_getinfo(curl, info##_T, &value) == CURLE_OK) timing->field = (long long) value;
+#else
+  #define get_size(info, field) \
+    if (curl_easy_getinfo(curl, info, &number) == CURLE_OK) timing->field = (long long) number;
+#endif
+  get_time(CURLINFO_NAMELOOKUP_TIME,    name_lookup);
+  get_time(CURLINFO_CONNECT_TIME,       connect);
+  get_time(CURLINFO_APPCONNECT_TIME,    app_connect);
+  get_time(CURLINFO_PRETRANSFER_TIME,   pretransfer);
+  get_time(CURLINFO_STARTTRANSFER_TIME, start_transfer);
+  get_time(CURLINFO_TOTAL_TIME,         total);
+  get_size(CURLINFO_SIZE_UPLOAD,        bytes_sent);
+  get_size(CURLINFO_SIZE_DOWNLOAD,      bytes_received);
+  #undef get_time
+  #undef get_size
+  // the bodies, plus the headers
+  if (curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &size) == CURLE_OK) timing->bytes_sent += size;
+  if (curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &size) == CURLE_OK) timing->bytes_received += size;
+  curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &num_connects);
+  timing->reused = res == CURLE_OK && num_connects == 0;
+#if LIBCURL_VERSION_NUM >= 0x073200 // 7.50.0
+  curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &transfer->http_version);
+#endif
 
-      zmsg_send(&msg, worker);
-    } else {
-      LTRACE("backend: receiving response data");
-      // in == a worker (outstanding request) that has completed and is ready
-      // to be cleaned up
-      zactor_t *worker = (zactor_t *) in;
-      // receive the response msg from the worker, and broadcast it
-      zmsg_t *msg = zmsg_recv(worker);
-      zmsg_send(&msg, bcast);
-      LTRACE("backend: response data broadcasted");
-      // place the worker back into the pool
-      int i;
-      for (i = 0; i < worker_pool_size; i++)
-        if (worker_pool[i].actor == worker) {
-          worker_pool[i].busy = false;
-          worker = NULL;
-          break;
-        }
-      assert(worker == NULL);
+  if (res == CURLE_OK && !transfer->prewarm) timings_record(&engine->host_timings, transfer->host, timing);
+}
+
+/*
+ * Returns 1 if the body can be logged as text.
+ */
+static int is_printable(const char *data, size_t len) {
+  size_t i;
+  for (i = 0; i < len; i++)
+    if (!isprint((unsigned char) data[i]) && data[i] != '\n' && data[i] != '\r')
+      return 0;
+  return 1;
+}
+
+/*
+ * Moves a saved body into place. Returns 0 on success.
+ */
+static int finish_save_file(transfer_t *transfer) {
+  int err = fclose(transfer->file);
+  transfer->file = NULL;
+  if (!err) err = rename(transfer->partial, transfer->save_to);
+  if (err) {
+    LERROR("backend: %s: could not save %s: %s", transfer->id, transfer->save_to, strerror(errno));
+    unlink(transfer->partial);
+  }
+  return err;
+}
+
+/*
+ * Forgets a request which is in the outbox, because it has been delivered,
+ * cancelled or can never be sent.
+ */
+static void forget_outbox_entry(engine_t *engine, long long id) {
+  outbox_caller_t *caller = NULL;
+  outbox_remove(engine->outbox, id);
+  HASH_FIND(hh, engine->outbox_callers, &id, sizeof(long long), caller);
+  if (caller) {
+    HASH_DEL(engine->outbox_callers, caller);
+    zframe_destroy(&caller->reply_to);
+    free(caller);
+  }
+}
+
+/*
+ * Leaves a request in the outbox, to be tried again after a while.
+ */
+static void retry_outbox_transfer(engine_t *engine, transfer_t *transfer, const char *reason) {
+  int attempts = transfer->outbox_attempts + 1;
+  int64_t backoff = outbox_backoff(attempts);
+  LWARN("backend: %s: delivery attempt %d failed (%s), retrying in %lld ms", transfer->id, attempts,
+        reason, (long long) backoff);
+  outbox_retry_later(engine->outbox, transfer->outbox_id, attempts, zclock_time() + backoff);
+}
+
+/*
+ * Returns 1 if an outbox request was delivered, and can be forgotten. Only
+ * a 2xx response counts; anything else is retried.
+ */
+static int outbox_delivered(engine_t *engine, transfer_t *transfer, CURLcode res) {
+  long http_code = 0;
+  char reason[64];
+
+  if (res != CURLE_OK) {
+    retry_outbox_transfer(engine, transfer, curl_easy_strerror(res));
+    return 0;
+  }
+  curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &http_code);
+  if (http_code < 200 || http_code >= 300) {
+    sprintf(reason, "HTTP status %ld", http_code);
+    retry_outbox_transfer(engine, transfer, reason);
+    return 0;
+  }
+  LINFO("backend: %s: delivered after %d attempts", transfer->id, transfer->outbox_attempts + 1);
+  forget_outbox_entry(engine, transfer->outbox_id);
+  return 1;
+}
+
+/*
+ * Updates the response cache with the response to a cacheable request.
+ * Returns 1 if the server said that the stored response is still valid, in
+ * which case it has been published as the result.
+ */
+static int update_response_cache(engine_t *engine, transfer_t *transfer, long http_code, double duration) {
+  struct MemoryStruct *response = &transfer->response;
+  cache_entry_t *entry;
+  time_t now = time(NULL), expires_at = 0;
+  char *body;
+  int storable;
+
+  if (!transfer->cache_key || !engine->cache) return 0;
+  storable = cache_freshness(transfer->cache_control, transfer->expires, transfer->date, now, &expires_at);
+  entry = cache_find(engine->cache, transfer->cache_key);
+
+  if (http_code == 304 && transfer->revalidating && entry &&
+      (body = cache_read_body(engine->cache, entry))) {
+    LDEBUG("backend: %s: cached response is still valid", transfer->id);
+    cache_refresh(engine->cache, entry, transfer->etag, transfer->last_modified, storable ? expires_at : 0);
+    engine->stats.cache_revalidated++;
+    publish_result(engine, transfer, "success", (int) entry->code, body, entry->body_len, duration);
+    free(body);
+    return 1;
+  }
+
+  if (transfer->revalidating) engine->stats.cache_misses++;
+  if (http_code == 200 && storable && (expires_at > now || transfer->etag || transfer->last_modified))
+    cache_store(engine->cache, transfer->cache_key, http_code, response->memory ? response->memory : "",
+                response->size, transfer->etag, transfer->last_modified, expires_at);
+  else if (entry)
+    cache_remove(engine->cache, entry);
+  return 0;
+}
+
+/*
+ * Publishes the result of a transfer which curl has finished with.
+ */
+static void complete_transfer(engine_t *engine, transfer_t *transfer, CURLcode res) {
+  struct MemoryStruct *response = &transfer->response;
+  double total_duration = 0.0;
+
+  update_cache_stats(engine, transfer, res);
+  measure_transfer(engine, transfer, res);
+  curl_easy_getinfo(transfer->curl, CURLINFO_TOTAL_TIME, &total_duration);
+  if (transfer->prewarm) {
+    if (res == CURLE_OK) LDEBUG("backend: %s: connection is warm (%f secs)", transfer->id, total_duration);
+    else LWARN("backend: %s: could not warm up the connection: %s", transfer->id, curl_easy_strerror(res));
+    return;
+  }
+  if (transfer->too_large) res = CURLE_FILESIZE_EXCEEDED;
+  if (res == CURLE_OK && transfer->file && finish_save_file(transfer)) res = CURLE_WRITE_ERROR;
+  if (transfer->outbox_id && !outbox_delivered(engine, transfer, res)) return;
+  if (res != CURLE_OK) {
+    LERROR("backend: %s: request failed: %s (%f secs)", transfer->id, curl_easy_strerror(res), total_duration);
+    publish_result(engine, transfer, "error", res, curl_easy_strerror(res),
+                   strlen(curl_easy_strerror(res)), total_duration);
+  } else {
+    long http_code = 0;
+    curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &http_code);
+    LDEBUG("backend: %s: request succeeded: %ld in %f secs, %zu bytes", transfer->id, http_code,
+           total_duration, transfer->body_size);
+    if (update_response_cache(engine, transfer, http_code, total_duration)) {
+      // answered from the cache
+    } else if (transfer->save_to) {
+      publish_result(engine, transfer, "success", http_code,
+                     transfer->save_to, strlen(transfer->save_to), total_duration);
+    } else if (transfer->stream) {
+      publish_result(engine, transfer, "success", http_code, "", 0, total_duration);
+    } else {
+      // only look at the body at all if it's going to be logged
+      if (LGETLEVEL() <= LOG_LEVEL_INSEC) {
+        if (response->size && is_printable(response->memory, response->size))
+          LINSEC("backend: %s: response body (cstr): %.*s", transfer->id, (int) response->size, response->memory);
+        else
+          LINSEC("backend: %s: response body (blob): %zu bytes", transfer->id, response->size);
+      }
+      publish_result(engine, transfer, "success", http_code,
+                     response->memory ? response->memory : "", response->size, total_duration);
     }
   }
+  LDEBUG("backend: %s: request completed", transfer->id);
+}
 
-  LINFO("backend: shutting down");
+/*
+ * Called by curl when it wants us to start, change or stop watching one of
+ * its sockets.
+ */
+static int on_curl_socket(CURL *easy, curl_socket_t fd, int what, void *userp, void *socketp) {
+  engine_t *engine = (engine_t *) userp;
+  watched_socket_t *sock = NULL;
+
+  HASH_FIND_INT(engine->sockets, &fd, sock);
+  if (what == CURL_POLL_REMOVE) {
+    if (sock) {
+      HASH_DEL(engine->sockets, sock);
+      free(sock);
+    }
+    return 0;
+  }
+
+  if (!sock) {
+    sock = (watched_socket_t *) calloc(1, sizeof(watched_socket_t));
+    sock->fd = fd;
+    HASH_ADD_INT(engine->sockets, fd, sock);
+  }
+  sock->events = 0;
+  if (what & CURL_POLL_IN)  sock->events |= ZMQ_POLLIN;
+  if (what & CURL_POLL_OUT) sock->events |= ZMQ_POLLOUT;
+  return 0;
+}
+
+/*
+ * Called by curl when it wants to be called back after `timeout_ms`, or not
+ * at all if `timeout_ms` is -1.
+ */
+static int on_curl_timer(CURLM *multi, long timeout_ms, void *userp) {
+  engine_t *engine = (engine_t *) userp;
+  engine->timer_expires_at = timeout_ms < 0 ? -1 : zclock_mono() + timeout_ms;
+  return 0;
+}
+
+static void remove_transfer(engine_t *engine, transfer_t *transfer);
+
+/*
+ * Publishes the results of all transfers which curl has finished with, and
+ * frees them.
+ */
+static void collect_completed_transfers(engine_t *engine) {
+  CURLMsg *info;
+  int pending;
+
+  while ((info = curl_multi_info_read(engine->multi, &pending))) {
+    transfer_t *transfer = NULL;
+    if (info->msg != CURLMSG_DONE) continue;
+    curl_easy_getinfo(info->easy_handle, CURLINFO_PRIVATE, (char **) &transfer);
+    complete_transfer(engine, transfer, info->data.result);
+    remove_transfer(engine, transfer);
+  }
+}
+
+static int is_background(priority_t priority) {
+  return priority >= PRIORITY_TELEMETRY;
+}
+
+/*
+ * Returns 1 if a request of the given priority may start now.
+ */
+static int can_start(engine_t *engine, priority_t priority) {
+  long background_limit;
+  if (engine->max_active == 0) return 1;
+  if (engine->num_active >= engine->max_active) return 0;
+  if (!is_background(priority)) return 1;
+  background_limit = engine->max_active / 2;
+  if (background_limit < 1) background_limit = 1;
+  return engine->num_active_background < background_limit;
+}
+
+/*
+ * Gives curl the addresses which the process-wide resolver (see
+ * util/resolver.c) has for the host, if it has them, so that the backend
+ * and the socket plugin look each host up once between them. If it hasn't,
+ * curl looks the host up itself, and the resolver starts doing so too, so
+ * that the answer is there for the next request. Which of the two happened
+ * is what the "dns_cache_hits" and "dns_lookups" stats count.
+ */
+static void use_shared_resolver(transfer_t *transfer) {
+  resolver_addr_t addrs[RESOLVER_MAX_ADDRS];
+  int n;
+#if LIBCURL_VERSION_NUM >= 0x074b00 // 7.75.0
+  char list[RESOLVER_MAX_ADDRS * (INET6_ADDRSTRLEN + 3)], *p = list, *entry = NULL;
   int i;
-  for (i = 0; i < worker_pool_size; i++) {
-    zpoller_remove(poller, worker_pool[i].actor);
-    zactor_destroy(&(worker_pool[i].actor));
+#endif
+
+  if (is_ip_address(transfer->host)) return;
+  n = resolver_cached(transfer->host, addrs, RESOLVER_MAX_ADDRS);
+  transfer->dns_cached = n > 0;
+  if (n == 0) {
+    resolver_prefetch(transfer->host);
+    return;
   }
-  free(worker_pool);
-  zpoller_destroy(&poller);
+#if LIBCURL_VERSION_NUM >= 0x074b00 // 7.75.0
+  for (i = 0; i < n; i++) {
+    p += sprintf(p, addrs[i].family == AF_INET6 ? "%s[%s]" : "%s%s", i ? "," : "", addrs[i].ip);
+  }
+  // "+" lets the entry expire from curl's cache like one of its own
+  if (asprintf(&entry, "+%s:%d:%s", transfer->host, transfer->port, list) < 0) return;
+  curl_slist_free_all(transfer->resolve);
+  transfer->resolve = curl_slist_append(NULL, entry);
+  curl_easy_setopt(transfer->curl, CURLOPT_RESOLVE, transfer->resolve);
+  free(entry);
+#endif
+}
+
+/*
+ * Hands a transfer to curl, with whatever is left of its time.
+ */
+static void activate_transfer(engine_t *engine, transfer_t *transfer) {
+  long remaining = (long) (transfer->deadline - zclock_mono());
+  if (remaining < 1) remaining = 1;
+  use_shared_resolver(transfer);
+  curl_easy_setopt(transfer->curl, CURLOPT_TIMEOUT_MS,        remaining);
+  curl_easy_setopt(transfer->curl, CURLOPT_CONNECTTIMEOUT_MS, remaining < CONNECT_TIMEOUT ? remaining : CONNECT_TIMEOUT);
+  transfer->active = 1;
+  engine->num_active++;
+  if (is_background(transfer->priority)) engine->num_active_background++;
+  DL_APPEND(engine->transfers, transfer);
+  curl_multi_add_handle(engine->multi, transfer->curl);
+  LDEBUG("backend: %s: started %s request", transfer->id, priority_names[transfer->priority]);
+}
+
+/*
+ * Takes a transfer out of the queue or away from curl, and frees it.
+ */
+static void remove_transfer(engine_t *engine, transfer_t *transfer) {
+  if (transfer->active) {
+    curl_multi_remove_handle(engine->multi, transfer->curl);
+    DL_DELETE(engine->transfers, transfer);
+    engine->num_active--;
+    if (is_background(transfer->priority)) engine->num_active_background--;
+  } else {
+    DL_DELETE(engine->queued[transfer->priority], transfer);
+    engine->num_queued--;
+  }
+  if (transfer->outbox_id) {
+    busy_destination_t *busy = NULL;
+    HASH_FIND_STR(engine->busy_destinations, transfer->destination, busy);
+    if (busy) {
+      HASH_DEL(engine->busy_destinations, busy);
+      free(busy->destination);
+      free(busy);
+    }
+    // the next request for the destination, if any, can go now
+    engine->outbox_wake_at = 0;
+  }
+  if (transfer->prewarm) {
+    warm_host_t *warm = NULL;
+    HASH_FIND_STR(engine->warm_hosts, transfer->destination, warm);
+    if (warm) {
+      warm->refreshing = 0;
+      warm->refresh_at = engine->prewarm_interval ? warm->refreshed_at + engine->prewarm_interval : -1;
+    }
+  }
+  free_transfer(transfer);
+}
+
+/*
+ * Fails every waiting transfer whose deadline has passed, and starts as
+ * many of the rest as the limits allow, most urgent first. Returns the
+ * earliest deadline of those still waiting, or -1 if none are.
+ */
+static int64_t run_queue(engine_t *engine) {
+  int64_t now = zclock_mono(), next_deadline = -1;
+  transfer_t *transfer, *tmp;
+  int p;
+
+  for (p = 0; p < NUM_PRIORITIES; p++) {
+    DL_FOREACH_SAFE(engine->queued[p], transfer, tmp) {
+      if (transfer->deadline <= now) {
+        engine->stats.expired++;
+        if (transfer->outbox_id)
+          retry_outbox_transfer(engine, transfer, "timed out waiting in the queue");
+        else
+          publish_error(engine, transfer, -6, "timed out waiting in the queue");
+        remove_transfer(engine, transfer);
+      }
+    }
+  }
+
+  for (p = 0; p < NUM_PRIORITIES; p++) {
+    while (engine->queued[p] && can_start(engine, (priority_t) p)) {
+      transfer = engine->queued[p];
+      DL_DELETE(engine->queued[p], transfer);
+      engine->num_queued--;
+      activate_transfer(engine, transfer);
+    }
+    DL_FOREACH(engine->queued[p], transfer) {
+      if (next_deadline == -1 || transfer->deadline < next_deadline)
+        next_deadline = transfer->deadline;
+    }
+  }
+
+  return next_deadline;
+}
+
+/*
+ * Queues the oldest request for each destination in the outbox which isn't
+ * already being delivered, if it's time to try it.
+ */
+static void run_outbox(engine_t *engine) {
+  outbox_entry_t *entries, *entry;
+  busy_destination_t *busy;
+  int64_t now = zclock_time(), wake_at = -1;
+
+  if (!engine->outbox || engine->outbox_wake_at < 0 || engine->outbox_wake_at > now) return;
+
+  entries = outbox_heads(engine->outbox);
+  DL_FOREACH(entries, entry) {
+    char request_id[64];
+    outbox_caller_t *caller = NULL;
+    transfer_t *transfer;
+
+    HASH_FIND_STR(engine->busy_destinations, entry->destination, busy);
+    if (busy) continue; // we'll be woken up when it's done
+    if (entry->next_attempt_at > now) {
+      if (wake_at < 0 || entry->next_attempt_at < wake_at) wake_at = entry->next_attempt_at;
+      continue;
+    }
+
+    sprintf(request_id, "outbox:%lld", entry->id);
+    HASH_FIND(hh, engine->outbox_callers, &entry->id, sizeof(long long), caller);
+    transfer = prepare_transfer(engine, request_id, entry->request,
+                                caller ? zframe_dup(caller->reply_to) : NULL);
+    if (!transfer) {
+      // it will never be valid, and the error has been published
+      forget_outbox_entry(engine, entry->id);
+      continue;
+    }
+    transfer->outbox_id = entry->id;
+    transfer->outbox_attempts = entry->attempts;
+    transfer->destination = strdup(entry->destination);
+    busy = (busy_destination_t *) calloc(1, sizeof(busy_destination_t));
+    busy->destination = strdup(entry->destination);
+    HASH_ADD_KEYPTR(hh, engine->busy_destinations, busy->destination, strlen(busy->destination), busy);
+    DL_APPEND(engine->queued[transfer->priority], transfer);
+    engine->num_queued++;
+    LDEBUG("backend: %s: delivery attempt %d to %s", transfer->id, entry->attempts + 1, entry->destination);
+  }
+  outbox_free_entries(&entries);
+  engine->outbox_wake_at = wake_at;
+}
+
+/*
+ * Queues a HEAD request to a warm host, to open its connection or to keep
+ * it open.
+ */
+static void refresh_warm_host(engine_t *engine, warm_host_t *warm) {
+  zmsg_t *request = zmsg_new();
+  char request_id[64];
+  transfer_t *transfer;
+
+  zmsg_addstr(request, "url");
+  zmsg_addstr(request, warm->url);
+  zmsg_addstr(request, "timeout");
+  zmsg_addstrf(request, "%d", CONNECT_TIMEOUT);
+  zmsg_addstr(request, "priority");
+  zmsg_addstr(request, priority_names[PRIORITY_BULK]);
+  zmsg_addstr(request, "validate_ssl_certificates");
+  zmsg_addstr(request, warm->verify ? "true" : "false");
+  snprintf(request_id, sizeof(request_id), "prewarm:%s", warm->destination);
+  transfer = prepare_transfer(engine, request_id, request, NULL);
+  zmsg_destroy(&request);
+  if (!transfer) {
+    warm->refresh_at = -1;
+    return;
+  }
+
+  transfer->prewarm = 1;
+  transfer->destination = strdup(warm->destination);
+  curl_easy_setopt(transfer->curl, CURLOPT_CUSTOMREQUEST, NULL);
+  curl_easy_setopt(transfer->curl, CURLOPT_NOBODY,        1L);
+  DL_APPEND(engine->queued[transfer->priority], transfer);
+  engine->num_queued++;
+  warm->refreshing = 1;
+  warm->refreshed_at = zclock_mono();
+}
+
+/*
+ * Starts keeping a connection to the host in `url` open, or keeps the one
+ * that is open for longer, and sets `*destination` to the scheme, host and
+ * port it's for. Returns NULL, or why it can't.
+ */
+static const char *prewarm(engine_t *engine, const char *url, int verify, char **destination) {
+  UriParserStateA state;
+  UriUriA uri;
+  warm_host_t *warm = NULL;
+  int https, whitelisted;
+  int64_t now = zclock_mono();
+
+  state.uri = &uri;
+  if (uriParseUriA(&state, url) != URI_SUCCESS) return "could not parse your URL";
+  if (uriNormalizeSyntaxExA(&uri, URI_NORMALIZE_SCHEME | URI_NORMALIZE_HOST) != URI_SUCCESS) {
+    uriFreeUriMembersA(&uri);
+    return "could not normalize your URL";
+  }
+  https = uri.scheme.afterLast - uri.scheme.first == 5 && !strncmp(uri.scheme.first, "https", 5);
+  whitelisted = is_whitelisted(uri.hostText.first, (int) (uri.hostText.afterLast - uri.hostText.first));
+  uriFreeUriMembersA(&uri);
+  if (!https) return "only HTTPS URLs are allowed";
+  if (!whitelisted) return "the host is not whitelisted";
+  if (!(*destination = outbox_destination(url))) return "you did not specify a URL";
+
+  HASH_FIND_STR(engine->warm_hosts, *destination, warm);
+  if (!warm) {
+    LINFO("backend: keeping a connection to %s warm", *destination);
+    warm = (warm_host_t *) calloc(1, sizeof(warm_host_t));
+    warm->destination = strdup(*destination);
+    warm->refresh_at = now;
+    HASH_ADD_KEYPTR(hh, engine->warm_hosts, warm->destination, strlen(warm->destination), warm);
+  } else if (!warm->refreshing &&
+             (!engine->prewarm_interval || now - warm->refreshed_at >= engine->prewarm_interval)) {
+    // it hasn't been refreshed recently enough to be sure it's still open
+    warm->refresh_at = now;
+  }
+  free(warm->url);
+  warm->url = strdup(url);
+  warm->verify = verify;
+  warm->idle_at = now + engine->prewarm_idle_close;
+  return NULL;
+}
+
+/*
+ * Keeps a warm connection to the destination of `url`, if there is one,
+ * for longer, because it's being used.
+ */
+static void note_host_used(engine_t *engine, const char *url) {
+  warm_host_t *warm = NULL;
+  char *destination;
+  if (!engine->warm_hosts || !(destination = outbox_destination(url))) return;
+  HASH_FIND_STR(engine->warm_hosts, destination, warm);
+  if (warm) warm->idle_at = zclock_mono() + engine->prewarm_idle_close;
+  free(destination);
+}
+
+static void free_warm_host(engine_t *engine, warm_host_t *warm) {
+  HASH_DEL(engine->warm_hosts, warm);
+  free(warm->destination);
+  free(warm->url);
+  free(warm);
+}
+
+/*
+ * Refreshes the warm connections which are due, and lets go of those which
+ * have been idle for too long. Returns when it next needs to be called, or
+ * -1 if there are none.
+ */
+static int64_t run_prewarm(engine_t *engine) {
+  warm_host_t *warm, *tmp;
+  int64_t now = zclock_mono(), wake_at = -1;
+
+  HASH_ITER(hh, engine->warm_hosts, warm, tmp) {
+    if (warm->refreshing) continue; // we'll be woken up when it's done
+    if (warm->idle_at <= now) {
+      LINFO("backend: %s is idle, no longer keeping it warm", warm->destination);
+      free_warm_host(engine, warm);
+      continue;
+    }
+    if (warm->refresh_at >= 0 && warm->refresh_at <= now) {
+      LDEBUG("backend: refreshing the connection to %s", warm->destination);
+      refresh_warm_host(engine, warm);
+      continue;
+    }
+    if (warm->refresh_at >= 0 && warm->refresh_at < warm->idle_at) {
+      if (wake_at < 0 || warm->refresh_at < wake_at) wake_at = warm->refresh_at;
+    } else if (wake_at < 0 || warm->idle_at < wake_at) {
+      wake_at = warm->idle_at;
+    }
+  }
+  return wake_at;
+}
+
+/*
+ * Prewarms "backend.prewarm.url", if it's set, when a transaction is about
+ * to start.
+ */
+static void handle_card_event(engine_t *engine, zsock_t *card_events) {
+  char *topic = NULL, *event = NULL, *destination = NULL;
+  const char *error;
+
+  if (zsock_recv(card_events, "ss", &topic, &event)) return;
+  if (engine->prewarm_url && event &&
+      (!strcmp(event, "card-inserted") || !strcmp(event, "txn-started") ||
+       !strcmp(event, "ready-for-txn-data"))) {
+    if ((error = prewarm(engine, engine->prewarm_url, 1, &destination)))
+      LWARN("backend: can't prewarm %s: %s", engine->prewarm_url, error);
+    else
+      LDEBUG("backend: prewarming %s on %s %s", destination, topic, event);
+  }
+  free(destination);
+  free(topic);
+  free(event);
+}
+
+static transfer_t *find_transfer(engine_t *engine, const char *request_id) {
+  transfer_t *transfer;
+  int p;
+  DL_FOREACH(engine->transfers, transfer) {
+    if (!strcmp(transfer->id, request_id)) return transfer;
+  }
+  for (p = 0; p < NUM_PRIORITIES; p++) {
+    DL_FOREACH(engine->queued[p], transfer) {
+      if (!strcmp(transfer->id, request_id)) return transfer;
+    }
+  }
+  return NULL;
+}
+
+static void cancel_transfer(engine_t *engine, caller_t *caller, const char *request_id) {
+  transfer_t *transfer = find_transfer(engine, request_id);
+  long long outbox_id = 0;
+
+  if (!transfer && engine->outbox && sscanf(request_id, "outbox:%lld", &outbox_id) == 1 &&
+      outbox_remove(engine->outbox, outbox_id)) {
+    // waiting to be retried, so there's no transfer to abort
+    outbox_caller_t *outbox_caller = NULL;
+    transfer_t waiting;
+    memset(&waiting, 0, sizeof(waiting));
+    snprintf(waiting.id, sizeof(waiting.id), "%s", request_id);
+    HASH_FIND(hh, engine->outbox_callers, &outbox_id, sizeof(long long), outbox_caller);
+    if (outbox_caller) waiting.reply_to = outbox_caller->reply_to; // freed below
+    reply_to_caller_with(caller, "cancelled", waiting.id);
+    LINFO("backend: %s: cancelling deferred request", waiting.id);
+    engine->stats.cancelled++;
+    publish_error(engine, &waiting, -7, "cancelled");
+    forget_outbox_entry(engine, outbox_id);
+    return;
+  }
+  if (!transfer) {
+    LDEBUG("backend: %s: can't cancel, request is unknown or already completed", request_id);
+    reply_to_caller_with(caller, "error", "unknown request");
+    return;
+  }
+  reply_to_caller_with(caller, "cancelled", transfer->id);
+  LINFO("backend: %s: cancelling %s request", transfer->id, transfer->active ? "running" : "queued");
+  engine->stats.cancelled++;
+  publish_error(engine, transfer, -7, "cancelled");
+  if (transfer->outbox_id) forget_outbox_entry(engine, transfer->outbox_id);
+  remove_transfer(engine, transfer);
+}
+
+static void send_stats(engine_t *engine, caller_t *caller) {
+  backend_stats_t *stats = &engine->stats;
+  zmsg_t *reply = zmsg_new();
+  zmsg_addstr(reply, "stats");
+  #define add_stat(name, value) { zmsg_addstr(reply, name); zmsg_addstrf(reply, "%ld", value); }
+  add_stat("requests",             stats->requests);
+  add_stat("connections_opened",   stats->connections_opened);
+  add_stat("connections_reused",   stats->connections_reused);
+  add_stat("tls_handshakes",       stats->tls_handshakes);
+  add_stat("tls_sessions_resumed", stats->tls_sessions_resumed);
+  add_stat("dns_lookups",          stats->dns_lookups);
+  add_stat("dns_cache_hits",       stats->dns_cache_hits);
+  add_stat("rejected",             stats->rejected);
+  add_stat("cancelled",            stats->cancelled);
+  add_stat("expired",              stats->expired);
+  add_stat("cache_hits",           stats->cache_hits);
+  add_stat("cache_revalidated",    stats->cache_revalidated);
+  add_stat("cache_misses",         stats->cache_misses);
+  add_stat("active",               (long) engine->num_active);
+  add_stat("queued",               (long) engine->num_queued);
+  add_stat("outbox",               engine->outbox ? outbox_count(engine->outbox) : 0L);
+  #undef add_stat
+  reply_to_caller(caller, &reply);
+}
+
+static void send_timings(engine_t *engine, caller_t *caller) {
+  zmsg_t *reply = zmsg_new();
+  zmsg_addstr(reply, "timings");
+  timings_add_histograms(reply, engine->host_timings);
+  reply_to_caller(caller, &reply);
+}
+
+/*
+ * Returns a copy of the value following `key` in a request, or NULL.
+ */
+static char *find_request_value(zmsg_t *msg, const char *key) {
+  zframe_t *frame;
+  for (frame = zmsg_first(msg); frame; frame = zmsg_next(msg)) {
+    zframe_t *value = zmsg_next(msg);
+    if (!value) break;
+    if (zframe_streq(frame, key)) return zframe_strdup(value);
+  }
+  return NULL;
+}
+
+static int is_deferred(zmsg_t *msg) {
+  char *defer = find_request_value(msg, "defer");
+  int deferred = defer && (!strcmp(defer, "true") || !strcmp(defer, "yes"));
+  free(defer);
+  return deferred;
+}
+
+/*
+ * Returns the priority which the request in `msg` asks for, without
+ * consuming it. An unknown priority is treated as an authorization, as
+ * prepare_transfer() does.
+ */
+static priority_t request_priority(zmsg_t *msg) {
+  char *name = find_request_value(msg, "priority");
+  int p = NUM_PRIORITIES;
+  if (name)
+    for (p = 0; p < NUM_PRIORITIES && strcmp(name, priority_names[p]); p++);
+  free(name);
+  return p < NUM_PRIORITIES ? (priority_t) p : PRIORITY_AUTHORIZATION;
+}
+
+/*
+ * Stores a deferred request in the outbox, as it was sent, and replies with
+ * its ID once it is safely on disk. Takes the caller's identity, if any, to
+ * send the result to.
+ */
+static void defer_request(engine_t *engine, caller_t *caller, zmsg_t *msg) {
+  char *url = find_request_value(msg, "url");
+  char *destination = url ? outbox_destination(url) : NULL;
+  char request_id[64];
+  long long id;
+
+  free(url);
+  if (!engine->outbox) {
+    reply_to_caller_with(caller, "error", "outbox unavailable");
+  } else if (!destination) {
+    reply_to_caller_with(caller, "error", "you did not specify a URL");
+  } else if ((id = outbox_add(engine->outbox, destination, msg)) < 0) {
+    reply_to_caller_with(caller, "error", "outbox unavailable");
+  } else {
+    sprintf(request_id, "outbox:%lld", id);
+    reply_to_caller_with(caller, "broadcast_id", request_id);
+    LINFO("backend: %s: stored for delivery to %s", request_id, destination);
+    if (caller->identity) {
+      outbox_caller_t *outbox_caller = (outbox_caller_t *) calloc(1, sizeof(outbox_caller_t));
+      outbox_caller->id = id;
+      outbox_caller->reply_to = caller->identity;
+      caller->identity = NULL;
+      HASH_ADD(hh, engine->outbox_callers, id, sizeof(long long), outbox_caller);
+    }
+    engine->outbox_wake_at = 0;
+  }
+  free(destination);
+}
+
+/*
+ * Answers a cacheable request from the response cache, if what's stored
+ * there can still be used, and returns 1. Otherwise returns 0, having asked
+ * the server to only send the response if it differs from the stored one.
+ */
+static int answer_from_cache(engine_t *engine, transfer_t *transfer) {
+  cache_entry_t *entry;
+  char *body, *header = NULL;
+
+  if (!transfer->cache_key || !engine->cache) return 0;
+  if (!(entry = cache_find(engine->cache, transfer->cache_key))) {
+    engine->stats.cache_misses++;
+    return 0;
+  }
+  if (entry->expires_at > time(NULL)) {
+    if ((body = cache_read_body(engine->cache, entry))) {
+      LDEBUG("backend: %s: answered from the cache", transfer->id);
+      engine->stats.cache_hits++;
+      publish_result(engine, transfer, "success", (int) entry->code, body, entry->body_len, 0.0);
+      free(body);
+      return 1;
+    }
+    cache_remove(engine->cache, entry);
+    engine->stats.cache_misses++;
+    return 0;
+  }
+
+  LDEBUG("backend: %s: revalidating cached response", transfer->id);
+  if (entry->etag && asprintf(&header, "If-None-Match: %s", entry->etag) >= 0) {
+    transfer->headers = curl_slist_append(transfer->headers, header);
+    free(header);
+  }
+  if (entry->last_modified && asprintf(&header, "If-Modified-Since: %s", entry->last_modified) >= 0) {
+    transfer->headers = curl_slist_append(transfer->headers, header);
+    free(header);
+  }
+  curl_easy_setopt(transfer->curl, CURLOPT_HTTPHEADER, transfer->headers);
+  transfer->revalidating = 1;
+  return 0;
+}
+
+/*
+ * Handles one request or command from `sock`. If `routed` is true, `sock`
+ * is the router and the first frame identifies the caller.
+ */
+static void handle_request(engine_t *engine, zsock_t *sock, int routed, long *req_id) {
+  zmsg_t *msg = zmsg_recv(sock);
+  caller_t caller = { sock, NULL };
+  transfer_t *transfer;
+  char request_id[64];
+
+  if (!msg) return;
+  if (routed) caller.identity = zmsg_pop(msg);
+
+  if (zmsg_size(msg) == 1) {
+    char *command = zmsg_popstr(msg);
+    if (!strcmp(command, "stats")) send_stats(engine, &caller);
+    else if (!strcmp(command, "timings")) send_timings(engine, &caller);
+    else reply_to_caller_with(&caller, "error", "unknown command");
+    free(command);
+    goto done;
+  }
+
+  if (zmsg_size(msg) == 2 && zframe_streq(zmsg_first(msg), "cancel")) {
+    char *id;
+    free(zmsg_popstr(msg));
+    id = zmsg_popstr(msg);
+    cancel_transfer(engine, &caller, id);
+    free(id);
+    goto done;
+  }
+
+  if ((zmsg_size(msg) == 2 || zmsg_size(msg) == 4) && zframe_streq(zmsg_first(msg), "prewarm")) {
+    char *url, *key, *value, *destination = NULL;
+    const char *error;
+    int verify = 1;
+    free(zmsg_popstr(msg));
+    url = zmsg_popstr(msg);
+    key = zmsg_popstr(msg);
+    value = zmsg_popstr(msg);
+    if (key && !strcmp(key, "validate_ssl_certificates") && strcmp(value, "true") && strcmp(value, "yes")) {
+      if (ALLOW_DISABLE_SSL_VERIFICATION) verify = 0;
+      else LERROR("backend: prewarm: SSL verification cannot be disabled");
+    }
+    if ((error = prewarm(engine, url, verify, &destination)))
+      reply_to_caller_with(&caller, "error", error);
+    else
+      reply_to_caller_with(&caller, "prewarmed", destination);
+    free(destination);
+    free(url);
+    free(key);
+    free(value);
+    goto done;
+  }
+
+  if (is_deferred(msg)) {
+    defer_request(engine, &caller, msg);
+    goto done;
+  }
+
+  if (engine->num_queued >= engine->max_queued && !can_start(engine, request_priority(msg))) {
+    LWARN("backend: refusing request, %d requests are already waiting", engine->num_queued);
+    engine->stats.rejected++;
+    reply_to_caller_with(&caller, "error", "overloaded");
+    goto done;
+  }
+
+  // reply with the id straight away so that the caller can get back to
+  // doing useful stuff
+  sprintf(request_id, "request:%ld", ++(*req_id));
+  reply_to_caller_with(&caller, "broadcast_id", request_id);
+
+  transfer = prepare_transfer(engine, request_id, msg, caller.identity);
+  caller.identity = NULL;
+  zmsg_destroy(&msg);
+  if (!transfer) return;
+  note_host_used(engine, transfer->url);
+  if (answer_from_cache(engine, transfer)) {
+    free_transfer(transfer);
+    return;
+  }
+
+  DL_APPEND(engine->queued[transfer->priority], transfer);
+  engine->num_queued++;
+  return;
+
+done:
+  if (caller.identity) zframe_destroy(&caller.identity);
+  zmsg_destroy(&msg);
+}
+
+/*
+ * Applies one of the "backend.max_*" limits, one of the response cache's
+ * budgets, or one of the prewarm intervals. Except for
+ * "backend.max_queued_requests", the cache budgets and the intervals, a
+ * value of 0 means no limit.
+ */
+static void apply_limit(engine_t *engine, const char *key, const char *value) {
+  long limit;
+  if (!key || !value || !strlen(value)) return;
+  limit = atol(value);
+  if (limit < 0) {
+    LWARN("backend: ignoring invalid value for %s: %s", key, value);
+    return;
+  }
+  if (!strcmp(key, "backend.max_host_connections"))
+    curl_multi_setopt(engine->multi, CURLMOPT_MAX_HOST_CONNECTIONS, limit);
+  else if (!strcmp(key, "backend.max_connections"))
+    curl_multi_setopt(engine->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, limit);
+  else if (!strcmp(key, "backend.max_active_requests"))
+    engine->max_active = limit;
+  else if (!strcmp(key, "backend.max_queued_requests"))
+    engine->max_queued = limit;
+  else if (!strcmp(key, "backend.max_body_size"))
+    engine->max_body_size = limit;
+  else if (!strcmp(key, "backend.cache.max_memory"))
+    engine->cache_max_memory = limit;
+  else if (!strcmp(key, "backend.cache.max_disk"))
+    engine->cache_max_disk = limit;
+  else if (!strcmp(key, "backend.prewarm.interval"))
+    engine->prewarm_interval = limit;
+  else if (!strcmp(key, "backend.prewarm.idle_close"))
+    engine->prewarm_idle_close = limit;
+  else
+    return;
+  if (engine->cache && !strncmp(key, "backend.cache.", 14))
+    cache_set_limits(engine->cache, (size_t) engine->cache_max_memory, (size_t) engine->cache_max_disk);
+  LDEBUG("backend: %s = %ld", key, limit);
+}
+
+/*
+ * Subscribes to the card events which trigger prewarming, or unsubscribes
+ * from them, according to whether there's a URL to prewarm.
+ */
+static void watch_card_events(engine_t *engine, int was_watching) {
+  if (!engine->prewarm_url == !was_watching) return;
+  if (engine->prewarm_url) {
+    zsock_set_subscribe(engine->card_events, "contact-emv");
+    zsock_set_subscribe(engine->card_events, "contactless-emv");
+  } else {
+    zsock_set_unsubscribe(engine->card_events, "contact-emv");
+    zsock_set_unsubscribe(engine->card_events, "contactless-emv");
+  }
+}
+
+static void apply_setting(engine_t *engine, const char *key, const char *value) {
+  char **setting;
+  int was_watching = engine->prewarm_url != NULL;
+  if (key && !strcmp(key, "backend.prewarm.url"))
+    setting = &engine->prewarm_url;
+  else if (key && !strcmp(key, "backend.http2_hosts"))
+    setting = &engine->http2_hosts;
+  else {
+    apply_limit(engine, key, value);
+    return;
+  }
+  free(*setting);
+  *setting = value && strlen(value) ? strdup(value) : NULL;
+  LDEBUG("backend: %s = %s", key, *setting ? *setting : "(none)");
+  watch_card_events(engine, was_watching);
+}
+
+void backend_service(zsock_t *pipe, void *arg) {
+  zsock_t *incoming_requests = zsock_new_rep(BACKEND_ENDPOINT);
+  zsock_t *settings = zsock_new_req(SETTINGS_ENDPOINT);
+  zsock_t *settings_changed = zsock_new_sub(SETTINGS_CHANGED_ENDPOINT, "backend.");
+  zsock_t *card_events = zsock_new_sub(">" EVENTS_SUB_ENDPOINT, NULL);
+  char *max_host_connections = NULL, *max_connections = NULL;
+  char *max_active = NULL, *max_queued = NULL, *max_body_size = NULL;
+  char *cache_max_memory = NULL, *cache_max_disk = NULL, *cache_dir;
+  char *prewarm_url = NULL, *prewarm_interval = NULL, *prewarm_idle_close = NULL;
+  char *http2_hosts = NULL;
+  zmq_pollitem_t *items = NULL;
+  int num_items = 0, running_transfers;
+  long req_id = 0;
+  int64_t queue_deadline = -1, prewarm_wake_at = -1;
+  engine_t engine;
+  transfer_t *transfer, *tmp;
+  int p;
+  watched_socket_t *sock, *tmp_sock;
+  busy_destination_t *busy, *tmp_busy;
+  outbox_caller_t *outbox_caller, *tmp_caller;
+  warm_host_t *warm, *tmp_warm;
+
+  memset(&engine, 0, sizeof(engine));
+  engine.card_events = card_events;
+  engine.timer_expires_at = -1;
+  engine.outbox = outbox_open();
+  engine.outbox_wake_at = engine.outbox ? 0 : -1; // resume whatever was left
+  engine.bcast = zsock_new_pub(">" EVENTS_PUB_ENDPOINT);
+  engine.router = zsock_new_router(BACKEND_ROUTER_ENDPOINT);
+  engine.multi = curl_multi_init();
+  curl_multi_setopt(engine.multi, CURLMOPT_SOCKETFUNCTION, on_curl_socket);
+  curl_multi_setopt(engine.multi, CURLMOPT_SOCKETDATA,     &engine);
+  curl_multi_setopt(engine.multi, CURLMOPT_TIMERFUNCTION,  on_curl_timer);
+  curl_multi_setopt(engine.multi, CURLMOPT_TIMERDATA,      &engine);
+#if LIBCURL_VERSION_NUM >= 0x072b00 // 7.43.0
+  curl_multi_setopt(engine.multi, CURLMOPT_PIPELINING,    CURLPIPE_MULTIPLEX);
+#endif
+
+  settings_get(settings, 11, "backend.max_host_connections", "backend.max_connections",
+                             "backend.max_active_requests",  "backend.max_queued_requests",
+                             "backend.max_body_size",
+                             "backend.cache.max_memory",     "backend.cache.max_disk",
+                             "backend.prewarm.url",          "backend.prewarm.interval",
+                             "backend.prewarm.idle_close",   "backend.http2_hosts",
+                             &max_host_connections,          &max_connections,
+                             &max_active,                    &max_queued,
+                             &max_body_size,
+                             &cache_max_memory,              &cache_max_disk,
+                             &prewarm_url,                   &prewarm_interval,
+                             &prewarm_idle_close,            &http2_hosts);
+  apply_setting(&engine, "backend.max_host_connections", max_host_connections);
+  apply_setting(&engine, "backend.max_connections",      max_connections);
+  apply_setting(&engine, "backend.max_active_requests",  max_active);
+  apply_setting(&engine, "backend.max_queued_requests",  max_queued);
+  apply_setting(&engine, "backend.max_body_size",        max_body_size);
+  apply_setting(&engine, "backend.cache.max_memory",     cache_max_memory);
+  apply_setting(&engine, "backend.cache.max_disk",       cache_max_disk);
+  apply_setting(&engine, "backend.prewarm.url",          prewarm_url);
+  apply_setting(&engine, "backend.prewarm.interval",     prewarm_interval);
+  apply_setting(&engine, "backend.prewarm.idle_close",   prewarm_idle_close);
+  apply_setting(&engine, "backend.http2_hosts",          http2_hosts);
+  free(max_host_connections);
+  free(max_connections);
+  free(max_active);
+  free(max_queued);
+  free(max_body_size);
+  free(cache_max_memory);
+  free(cache_max_disk);
+  free(prewarm_url);
+  free(prewarm_interval);
+  free(prewarm_idle_close);
+  free(http2_hosts);
+
+  // only once the budgets are known, so that nothing on disk is thrown out
+  // needlessly
+  if (!(cache_dir = find_writable_file(NULL, "backend_cache")))
+    LWARN("backend: could not find a writable path for the response cache, keeping it in memory only");
+  engine.cache = cache_new(cache_dir, (size_t) engine.cache_max_memory, (size_t) engine.cache_max_disk);
+  free(cache_dir);
+
+  LINFO("backend: service initialized");
+  zsock_signal(pipe, 0);
+
+  while (1) {
+    long timeout = -1;
+    int i, n = FIRST_CURL_ITEM;
+
+    // our own sockets come first, followed by curl's
+    if (num_items < FIRST_CURL_ITEM + (int) HASH_COUNT(engine.sockets)) {
+      num_items = FIRST_CURL_ITEM + HASH_COUNT(engine.sockets);
+      items = (zmq_pollitem_t *) realloc(items, num_items * sizeof(zmq_pollitem_t));
+    }
+    memset(items, 0, FIRST_CURL_ITEM * sizeof(zmq_pollitem_t));
+    items[0].socket = zsock_resolve(pipe);
+    items[0].events = ZMQ_POLLIN;
+    items[1].socket = zsock_resolve(incoming_requests);
+    items[1].events = ZMQ_POLLIN;
+    items[2].socket = zsock_resolve(settings_changed);
+    items[2].events = ZMQ_POLLIN;
+    items[3].socket = zsock_resolve(engine.router);
+    items[3].events = ZMQ_POLLIN;
+    items[4].socket = zsock_resolve(card_events);
+    items[4].events = ZMQ_POLLIN;
+    HASH_ITER(hh, engine.sockets, sock, tmp_sock) {
+      items[n].socket  = NULL;
+      items[n].fd      = sock->fd;
+      items[n].events  = sock->events;
+      items[n].revents = 0;
+      n++;
+    }
+
+    // wake up for curl's timer, or to fail the first queued request whose
+    // deadline passes, whichever is sooner
+    if (engine.timer_expires_at >= 0 || queue_deadline >= 0) {
+      int64_t wake_at = engine.timer_expires_at;
+      if (wake_at < 0 || (queue_deadline >= 0 && queue_deadline < wake_at)) wake_at = queue_deadline;
+      timeout = (long) (wake_at - zclock_mono());
+      if (timeout < 0) timeout = 0;
+    }
+    // or to retry a request from the outbox
+    if (engine.outbox_wake_at >= 0) {
+      long outbox_timeout = (long) (engine.outbox_wake_at - zclock_time());
+      if (outbox_timeout < 0) outbox_timeout = 0;
+      if (timeout < 0 || outbox_timeout < timeout) timeout = outbox_timeout;
+    }
+    // or to refresh a warm connection, or let it go
+    if (prewarm_wake_at >= 0) {
+      long prewarm_timeout = (long) (prewarm_wake_at - zclock_mono());
+      if (prewarm_timeout < 0) prewarm_timeout = 0;
+      if (timeout < 0 || prewarm_timeout < timeout) timeout = prewarm_timeout;
+    }
+
+    if (zmq_poll(items, n, timeout) == -1) {
+      LWARN("backend: service interrupted!");
+      break;
+    }
+
+    if (items[0].revents & ZMQ_POLLIN) {
+      LDEBUG("backend: received shutdown signal");
+      break;
+    }
+
+    // settings first, so that a limit changed just before a request was
+    // sent applies to that request
+    while (zsock_events(settings_changed) & ZMQ_POLLIN) {
+      char *key = NULL, *value = NULL;
+      zsock_recv(settings_changed, "ss", &key, &value);
+      apply_setting(&engine, key, value);
+      free(key);
+      free(value);
+    }
+
+    // start each request, if it can, before deciding whether the next one
+    // has to be refused
+    while (zsock_events(incoming_requests) & ZMQ_POLLIN) {
+      handle_request(&engine, incoming_requests, 0, &req_id);
+      run_queue(&engine);
+    }
+    while (zsock_events(engine.router) & ZMQ_POLLIN) {
+      handle_request(&engine, engine.router, 1, &req_id);
+      run_queue(&engine);
+    }
+    while (zsock_events(card_events) & ZMQ_POLLIN)
+      handle_card_event(&engine, card_events);
+
+    // tell curl about activity on its sockets. Doing so may cause curl to
+    // stop watching some of them, which is why we look each one up again.
+    for (i = FIRST_CURL_ITEM; i < n; i++) {
+      int action = 0;
+      if (!items[i].revents) continue;
+      HASH_FIND_INT(engine.sockets, &items[i].fd, sock);
+      if (!sock) continue;
+      if (items[i].revents & ZMQ_POLLIN)  action |= CURL_CSELECT_IN;
+      if (items[i].revents & ZMQ_POLLOUT) action |= CURL_CSELECT_OUT;
+      if (items[i].revents & ZMQ_POLLERR) action |= CURL_CSELECT_ERR;
+      curl_multi_socket_action(engine.multi, items[i].fd, action, &running_transfers);
+    }
+
+    if (engine.timer_expires_at >= 0 && engine.timer_expires_at <= zclock_mono()) {
+      engine.timer_expires_at = -1;
+      curl_multi_socket_action(engine.multi, CURL_SOCKET_TIMEOUT, 0, &running_transfers);
+    }
+
+    collect_completed_transfers(&engine);
+    run_outbox(&engine);
+    prewarm_wake_at = run_prewarm(&engine);
+    queue_deadline = run_queue(&engine);
+  }
+
+  LINFO("backend: shutting down");
+  DL_FOREACH_SAFE(engine.transfers, transfer, tmp) {
+    LWARN("backend: %s: abandoning request", transfer->id);
+    remove_transfer(&engine, transfer);
+  }
+  for (p = 0; p < NUM_PRIORITIES; p++) {
+    DL_FOREACH_SAFE(engine.queued[p], transfer, tmp) {
+      LWARN("backend: %s: abandoning queued request", transfer->id);
+      remove_transfer(&engine, transfer);
+    }
+  }
+  curl_multi_cleanup(engine.multi);
+  HASH_ITER(hh, engine.sockets, sock, tmp_sock) {
+    HASH_DEL(engine.sockets, sock);
+    free(sock);
+  }
+  // whatever is left in the outbox will be delivered next time
+  HASH_ITER(hh, engine.busy_destinations, busy, tmp_busy) {
+    HASH_DEL(engine.busy_destinations, busy);
+    free(busy->destination);
+    free(busy);
+  }
+  HASH_ITER(hh, engine.outbox_callers, outbox_caller, tmp_caller) {
+    HASH_DEL(engine.outbox_callers, outbox_caller);
+    zframe_destroy(&outbox_caller->reply_to);
+    free(outbox_caller);
+  }
+  HASH_ITER(hh, engine.warm_hosts, warm, tmp_warm) {
+    free_warm_host(&engine, warm);
+  }
+  free(engine.prewarm_url);
+  free(engine.http2_hosts);
+  outbox_close(&engine.outbox);
+  cache_destroy(&engine.cache);
+  timings_free(&engine.host_timings);
+  free(items);
+  zsock_destroy(&card_events);
+  zsock_destroy(&settings_changed);
+  zsock_destroy(&settings);
   zsock_destroy(&incoming_requests);
-  zsock_destroy(&bcast);
+  zsock_destroy(&engine.router);
+  zsock_destroy(&engine.bcast);
 }
 
 void add_whitelist_entry(const char *hostname) {
@@ -499,8 +2406,493 @@ int init_whitelist(void) {
   return 0;
 }
 
+/*
+ * A request made from Lua, whose response will be sent directly to it.
+ */
+#define MT_BACKEND_FUTURE "MT_BACKEND_FUTURE"
+#define ACK_TIMEOUT       5000 // ms to wait for the service to answer
+
+typedef struct {
+  zsock_t *dealer;
+  char id[64];
+  int response;    // registry reference to the response table, or LUA_NOREF
+  int64_t deadline; // when the service should have answered, or -1 if deferred
+} future_t;
+
+/*
+ * Pushes a table made from the frames of a "backend-complete" message which
+ * follow the topic.
+ */
+static void push_response(lua_State *L, zmsg_t *msg) {
+  char *id = zmsg_popstr(msg);
+  lua_newtable(L);
+  lua_pushstring(L, id ? id : "");
+  lua_setfield(L, -2, "id");
+  free(id);
+  while (zmsg_size(msg) >= 2) {
+    char *key = zmsg_popstr(msg);
+    zframe_t *value = zmsg_pop(msg);
+    size_t key_len = strlen(key);
+    if (!strcmp(key, "code") || !strcmp(key, "duration")) {
+      char *str = zframe_strdup(value);
+      lua_pushnumber(L, atof(str));
+      free(str);
+    } else if ((key_len > 3 && !strcmp(key + key_len - 3, "_us")) || !strncmp(key, "bytes_", 6)) {
+      char *str = zframe_strdup(value);
+      lua_pushinteger(L, (lua_Integer) atoll(str));
+      free(str);
+    } else if (!strcmp(key, "reused")) {
+      lua_pushboolean(L, zframe_streq(value, "true"));
+    } else {
+      lua_pushlstring(L, (const char *) zframe_data(value), zframe_size(value));
+    }
+    lua_setfield(L, -2, key);
+    zframe_destroy(&value);
+    free(key);
+  }
+}
+
+/*
+ * Waits up to `timeout` ms (-1 to wait forever) for a message from the
+ * service.
+ */
+static zmsg_t *future_recv(future_t *future, long timeout) {
+  zmq_pollitem_t item;
+  memset(&item, 0, sizeof(item));
+  item.socket = zsock_resolve(future->dealer);
+  item.events = ZMQ_POLLIN;
+  if (!(zsock_events(future->dealer) & ZMQ_POLLIN) && zmq_poll(&item, 1, timeout) <= 0)
+    return NULL;
+  return zmsg_recv(future->dealer);
+}
+
+/*
+ * Keeps the response if `msg` is one. Returns 1 if it was.
+ */
+static int keep_response(lua_State *L, future_t *future, zmsg_t *msg) {
+  if (!zframe_streq(zmsg_first(msg), "backend-complete")) return 0;
+  free(zmsg_popstr(msg));
+  push_response(L, msg);
+  future->response = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+/*
+ * Returns 1 if the response has arrived, waiting up to `timeout` ms for it.
+ */
+static int future_poll(lua_State *L, future_t *future, long timeout) {
+  int64_t give_up_at = zclock_mono() + timeout;
+  zmsg_t *msg;
+
+  while (future->response == LUA_NOREF && future->dealer) {
+    if (!(msg = future_recv(future, timeout))) break;
+    keep_response(L, future, msg); // anything else is a stale reply to a cancel
+    zmsg_destroy(&msg);
+    if (timeout > 0 && (timeout = (long) (give_up_at - zclock_mono())) < 0) timeout = 0;
+  }
+  return future->response != LUA_NOREF;
+}
+
+/*
+ * Starts a backend request and returns a future for its response. Takes a
+ * table with the same keys as a request sent to "inproc://backend", except
+ * that HTTP headers go in a `headers` table. On failure returns nil and the
+ * reason, such as "overloaded".
+ *
+ * The response is sent only to this future. Set `notify` to true to also
+ * announce on the events bus, without the body, that it has completed.
+ *
+ * Examples:
+ *
+ *     local backend = require('backend')
+ *     local future = backend.request{url = 'https://example.com/ping.json',
+ *                                    method = 'POST', body = '{}',
+ *                                    headers = {['Content-type'] = 'application/json'},
+ *                                    priority = 'telemetry', timeout = 5000}
+ */
+static int backend_request(lua_State *L) {
+  zmsg_t *msg = zmsg_new(), *ack;
+  future_t *future;
+  char *status, *id;
+  long timeout = DEFAULT_REQUEST_TIMEOUT;
+  int accepted, deferred = 0;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {
+    if (lua_type(L, -2) == LUA_TSTRING) {
+      const char *key = lua_tostring(L, -2);
+      size_t len;
+      if (!strcmp(key, "headers") && lua_istable(L, -1)) {
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+          if (lua_type(L, -2) == LUA_TSTRING && lua_isstring(L, -1)) {
+            zmsg_addstr(msg, lua_tostring(L, -2));
+            zmsg_addstr(msg, lua_tostring(L, -1));
+          }
+          lua_pop(L, 1);
+        }
+      } else if (lua_isboolean(L, -1)) {
+        zmsg_addstr(msg, key);
+        zmsg_addstr(msg, lua_toboolean(L, -1) ? "true" : "false");
+        if (!strcmp(key, "defer")) deferred = lua_toboolean(L, -1);
+      } else if (lua_isstring(L, -1)) {
+        const char *value = lua_tolstring(L, -1, &len);
+        zmsg_addstr(msg, key);
+        zmsg_addmem(msg, value, len);
+        if (!strcmp(key, "timeout") && atol(value) > 0) timeout = atol(value);
+        if (!strcmp(key, "defer")) deferred = !strcmp(value, "true") || !strcmp(value, "yes");
+      }
+    }
+    lua_pop(L, 1);
+  }
+
+  future = (future_t *) lua_newuserdata(L, sizeof(future_t));
+  memset(future, 0, sizeof(future_t));
+  future->response = LUA_NOREF;
+  luaL_getmetatable(L, MT_BACKEND_FUTURE);
+  lua_setmetatable(L, -2);
+  future->dealer = zsock_new_dealer(BACKEND_ROUTER_ENDPOINT);
+  zmsg_send(&msg, future->dealer);
+
+  if (!(ack = future_recv(future, ACK_TIMEOUT))) {
+    LERROR("lua: backend: no answer from the backend service");
+    lua_pushnil(L);
+    lua_pushstring(L, "no answer from the backend service");
+    return 2;
+  }
+  status = zmsg_popstr(ack);
+  id = zmsg_popstr(ack);
+  zmsg_destroy(&ack);
+  accepted = status && id && !strcmp(status, "broadcast_id");
+  if (accepted) {
+    snprintf(future->id, sizeof(future->id), "%s", id);
+    future->deadline = deferred ? -1 : zclock_mono() + timeout + ACK_TIMEOUT;
+    LDEBUG("lua: backend: started %s", future->id);
+  } else {
+    LWARN("lua: backend: request refused: %s", id ? id : "");
+    lua_pushnil(L);
+    lua_pushstring(L, id ? id : "unexpected answer from the backend service");
+  }
+  free(status);
+  free(id);
+  return accepted ? 1 : 2;
+}
+
+/*
+ * Returns the request ID, as used by "backend-complete" and
+ * "backend-notice" events.
+ */
+static int future_id(lua_State *L) {
+  future_t *future = (future_t *) luaL_checkudata(L, 1, MT_BACKEND_FUTURE);
+  lua_pushstring(L, future->id);
+  return 1;
+}
+
+/*
+ * Returns true if the response has arrived. Never blocks.
+ */
+static int future_ready(lua_State *L) {
+  future_t *future = (future_t *) luaL_checkudata(L, 1, MT_BACKEND_FUTURE);
+  lua_pushboolean(L, future_poll(L, future, 0));
+  return 1;
+}
+
+/*
+ * Blocks until the response arrives, or for at most the given number of
+ * milliseconds, and returns it as a table with the keys `id`, `result`,
+ * `code`, `body` and `duration`. Returns nil if it didn't arrive in time.
+ *
+ * Examples:
+ *
+ *     local response = future:wait(1000)
+ *     if response and response.result == 'success' then print(response.body) end
+ */
+static int future_wait(lua_State *L) {
+  future_t *future = (future_t *) luaL_checkudata(L, 1, MT_BACKEND_FUTURE);
+  long timeout = (long) luaL_optinteger(L, 2, -1);
+  if (future_poll(L, future, timeout)) lua_rawgeti(L, LUA_REGISTRYINDEX, future->response);
+  else lua_pushnil(L);
+  return 1;
+}
+
+/*
+ * Returns the next part of the body of a request made with `stream = true`,
+ * waiting for at most the given number of milliseconds for it. Returns nil
+ * once the response has arrived, or nil and "timeout" if nothing arrived in
+ * time. Parts which arrive while calling `wait()`, `await()` or `ready()`
+ * are discarded.
+ *
+ * Examples:
+ *
+ *     local future = backend.request{url = url, stream = true}
+ *     for data in function() return future:read() end do consume(data) end
+ *     local response = future:wait()
+ */
+static int future_read(lua_State *L) {
+  future_t *future = (future_t *) luaL_checkudata(L, 1, MT_BACKEND_FUTURE);
+  long timeout = (long) luaL_optinteger(L, 2, -1);
+  zmsg_t *msg;
+
+  while (future->response == LUA_NOREF && future->dealer) {
+    if (!(msg = future_recv(future, timeout))) {
+      lua_pushnil(L);
+      lua_pushstring(L, "timeout");
+      return 2;
+    }
+    if (zframe_streq(zmsg_first(msg), "backend-chunk") && zmsg_size(msg) == 6) {
+      zframe_t *data = zmsg_last(msg);
+      lua_pushlstring(L, (const char *) zframe_data(data), zframe_size(data));
+      zmsg_destroy(&msg);
+      return 1;
+    }
+    keep_response(L, future, msg);
+    zmsg_destroy(&msg);
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+static int future_await(lua_State *L);
+static int await_again(lua_State *L, int status, lua_KContext arg) {
+  return future_await(L);
+}
+
+/*
+ * Returns the response, like `wait()`. Inside a coroutine, rather than
+ * blocking, yields the future each time it is resumed until the response
+ * has arrived, so that a reactor task waits for it in `reactor.run()`.
+ * Outside of one, blocks until it arrives. Either way, returns nil and
+ * "timeout" if the service hasn't answered well after the request's own
+ * timeout has passed.
+ *
+ * Examples:
+ *
+ *     local co = coroutine.wrap(function()
+ *       local response = backend.request{url = url}:await()
+ *       print(response.code)
+ *     end)
+ *     while co() do --[[ do other work ]] end
+ */
+static int future_await(lua_State *L) {
+  future_t *future = (future_t *) luaL_checkudata(L, 1, MT_BACKEND_FUTURE);
+  int yieldable = lua_isyieldable(L);
+  int64_t now = zclock_mono();
+  long timeout = 0;
+
+  // outside a coroutine, block only until the deadline
+  if (!yieldable && future->deadline < 0) timeout = -1;
+  else if (!yieldable && future->deadline > now) timeout = (long) (future->deadline - now);
+  if (future_poll(L, future, timeout)) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, future->response);
+    return 1;
+  }
+  if (!future->dealer) {
+    lua_pushnil(L);
+    return 1;
+  }
+  if (future->deadline >= 0 && zclock_mono() >= future->deadline) {
+    lua_pushnil(L);
+    lua_pushstring(L, "timeout");
+    return 2;
+  }
+  if (!yieldable) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_settop(L, 1);
+  lua_pushvalue(L, 1);
+  return lua_yieldk(L, 1, 0, await_again);
+}
+
+/*
+ * Aborts the request if it hasn't completed. Returns true if it was
+ * cancelled, in which case its response will be an error with the body
+ * "cancelled".
+ */
+static int future_cancel(lua_State *L) {
+  future_t *future = (future_t *) luaL_checkudata(L, 1, MT_BACKEND_FUTURE);
+  int cancelled = 0;
+  zmsg_t *msg;
+
+  if (future->response == LUA_NOREF && future->dealer) {
+    zsock_send(future->dealer, "ss", "cancel", future->id);
+    while ((msg = future_recv(future, ACK_TIMEOUT))) {
+      if (!keep_response(L, future, msg)) {
+        cancelled = zframe_streq(zmsg_first(msg), "cancelled");
+        zmsg_destroy(&msg);
+        break;
+      }
+      zmsg_destroy(&msg);
+    }
+  }
+  lua_pushboolean(L, cancelled);
+  return 1;
+}
+
+/*
+ * Returns what a reactor should wait on for the response: the service's
+ * socket, "read", and the milliseconds left until `await()` gives up, or
+ * nil for a deferred request. Returns nothing once the future is closed.
+ *
+ * Examples:
+ *
+ *     handle, what, timeout = future:waitable()
+ */
+static int future_waitable(lua_State *L) {
+  future_t *future = (future_t *) luaL_checkudata(L, 1, MT_BACKEND_FUTURE);
+  int64_t now;
+
+  if (!future->dealer) return 0;
+  lua_pushlightuserdata(L, zsock_resolve(future->dealer));
+  lua_pushliteral(L, "read");
+  if (future->deadline < 0) {
+    lua_pushnil(L);
+  } else {
+    now = zclock_mono();
+    lua_pushinteger(L, future->deadline > now ? future->deadline - now : 0);
+  }
+  return 3;
+}
+
+static int future_gc(lua_State *L) {
+  future_t *future = (future_t *) luaL_checkudata(L, 1, MT_BACKEND_FUTURE);
+  if (future->response != LUA_NOREF) luaL_unref(L, LUA_REGISTRYINDEX, future->response);
+  future->response = LUA_NOREF;
+  if (future->dealer) {
+    zsock_set_linger(future->dealer, 0);
+    zsock_destroy(&future->dealer);
+  }
+  return 0;
+}
+
+static int future_tostring(lua_State *L) {
+  future_t *future = (future_t *) luaL_checkudata(L, 1, MT_BACKEND_FUTURE);
+  lua_pushfstring(L, "<backend future %s>", future->id);
+  return 1;
+}
+
+/*
+ * Pushes an array of the space-separated numbers in `str`.
+ */
+static void push_numbers(lua_State *L, const char *str) {
+  char *end;
+  int i = 0;
+  lua_newtable(L);
+  while (*str) {
+    long n = strtol(str, &end, 10);
+    if (end == str) break;
+    lua_pushinteger(L, (lua_Integer) n);
+    lua_rawseti(L, -2, ++i);
+    str = end;
+  }
+}
+
+/*
+ * Returns histograms of how long the recent requests to each host took, in
+ * the form
+ *
+ *     {bounds = {1, 5, ..., 10000},
+ *      hosts = {['example.com'] = {samples = 42, dns = {...}, connect = {...},
+ *                                  tls = {...}, wait = {...},
+ *                                  transfer = {...}, total = {...}}}}
+ *
+ * as described under "Timing" above. On failure returns nil and the reason.
+ */
+static int backend_timings(lua_State *L) {
+  zsock_t *sock = zsock_new_req(BACKEND_ENDPOINT);
+  zmq_pollitem_t item;
+  zmsg_t *reply = NULL;
+  char *key, *value;
+  int result, hosts, host = 0;
+
+  memset(&item, 0, sizeof(item));
+  item.socket = zsock_resolve(sock);
+  item.events = ZMQ_POLLIN;
+  if (!zsock_send(sock, "s", "timings") && zmq_poll(&item, 1, ACK_TIMEOUT) > 0)
+    reply = zmsg_recv(sock);
+  zsock_destroy(&sock);
+  if (!reply) {
+    lua_pushnil(L);
+    lua_pushstring(L, "no answer from the backend service");
+    return 2;
+  }
+
+  free(zmsg_popstr(reply));
+  lua_newtable(L);
+  result = lua_gettop(L);
+  lua_newtable(L);
+  hosts = lua_gettop(L);
+  lua_pushvalue(L, hosts);
+  lua_setfield(L, result, "hosts");
+  while ((key = zmsg_popstr(reply))) {
+    if (!(value = zmsg_popstr(reply))) {
+      free(key);
+      break;
+    }
+    if (!strcmp(key, "host")) {
+      lua_settop(L, hosts);
+      lua_newtable(L);
+      lua_pushvalue(L, -1);
+      lua_setfield(L, hosts, value);
+      host = lua_gettop(L);
+    } else if (!strcmp(key, "bounds")) {
+      push_numbers(L, value);
+      lua_setfield(L, result, key);
+    } else if (host && !strcmp(key, "samples")) {
+      lua_pushinteger(L, (lua_Integer) atol(value));
+      lua_setfield(L, host, key);
+    } else if (host) {
+      push_numbers(L, value);
+      lua_setfield(L, host, key);
+    }
+    free(key);
+    free(value);
+  }
+  zmsg_destroy(&reply);
+  lua_settop(L, result);
+  return 1;
+}
+
+static const luaL_Reg future_methods[] = {
+  {"__gc",       future_gc},
+  {"__tostring", future_tostring},
+  {"id",         future_id},
+  {"ready",      future_ready},
+  {"wait",       future_wait},
+  {"await",      future_await},
+  {"read",       future_read},
+  {"cancel",     future_cancel},
+  {"waitable",   future_waitable},
+  {NULL,         NULL}
+};
+
+static const luaL_Reg backend_methods[] = {
+  {"request", backend_request},
+  {"timings", backend_timings},
+  {NULL,      NULL}
+};
+
+LUALIB_API int luaopen_backend(lua_State *L) {
+  luaL_newmetatable(L, MT_BACKEND_FUTURE);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, future_methods, 0);
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+  luaL_setfuncs(L, backend_methods, 0);
+  return 1;
+}
+
+void shutdown_backend_lua(lua_State *L) {
+  (void) L;
+}
+
 int init_backend_service(void) {
   if (init_whitelist()) return 1;
+  init_share();
+  init_ca_store();
 
   service = zactor_new(backend_service, NULL);
   if (!service) {
@@ -525,4 +2917,9 @@ void shutdown_backend_service(void) {
     zactor_destroy(&service);
     service = NULL;
   }
+  shutdown_share();
+  if (ca_store) {
+    X509_STORE_free(ca_store);
+    ca_store = NULL;
+  }
 }
@@ -0,0 +1,365 @@
+#define _GNU_SOURCE
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <curl/curl.h>
+#include <openssl/sha.h>
+
+#include "services.h"
+#include "plugins/backend_cache.h"
+#include "util/files.h"
+#include "util/utlist.h"
+
+/*
+ * Each entry on disk is a ".meta" file, with one line each for the ETag,
+ * Last-Modified, expiry time, status code and body length, and a ".body"
+ * file. Both are named after the entry's hashed key.
+ */
+#define META_EXT ".meta"
+#define BODY_EXT ".body"
+#define HASHED_KEY_LEN (SHA256_DIGEST_LENGTH * 2)
+
+/*
+ * Entries are looked up by a hash of their key, so that header values such
+ * as "Authorization" are never written to disk.
+ */
+static void hash_key(const char *key, char hashed[HASHED_KEY_LEN + 1]) {
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  int i;
+  SHA256((const unsigned char *) key, strlen(key), digest);
+  for (i = 0; i < SHA256_DIGEST_LENGTH; i++) sprintf(hashed + i * 2, "%02x", digest[i]);
+}
+
+static char *entry_file(cache_entry_t *entry, const char *ext) {
+  char *path = NULL;
+  if (asprintf(&path, "%s%s", entry->path, ext) < 0) return NULL;
+  return path;
+}
+
+static int write_meta(cache_entry_t *entry) {
+  char *path = entry_file(entry, META_EXT);
+  FILE *out = path ? fopen(path, "w") : NULL;
+  int err;
+  if (!out) {
+    free(path);
+    return 1;
+  }
+  fprintf(out, "%s\n%s\n%lld\n%ld\n%zu\n",
+          entry->etag ? entry->etag : "", entry->last_modified ? entry->last_modified : "",
+          (long long) entry->expires_at, entry->code, entry->body_len);
+  err = fclose(out);
+  free(path);
+  return err;
+}
+
+static void delete_files(cache_entry_t *entry) {
+  char *path;
+  if ((path = entry_file(entry, META_EXT))) unlink(path);
+  free(path);
+  if ((path = entry_file(entry, BODY_EXT))) unlink(path);
+  free(path);
+}
+
+static void free_entry(cache_entry_t *entry) {
+  free(entry->key);
+  free(entry->etag);
+  free(entry->last_modified);
+  free(entry->body);
+  free(entry->path);
+  free(entry);
+}
+
+void cache_remove(response_cache_t *cache, cache_entry_t *entry) {
+  HASH_DEL(cache->entries, entry);
+  DL_DELETE(cache->lru, entry);
+  if (entry->body) cache->memory_used -= entry->body_len;
+  if (entry->path) {
+    delete_files(entry);
+    cache->disk_used -= entry->body_len;
+  }
+  free_entry(entry);
+}
+
+/*
+ * Drops the least recently used bodies from memory, and then from disk,
+ * until both are within budget. Entries which are left in neither are
+ * forgotten.
+ */
+static void evict(response_cache_t *cache) {
+  cache_entry_t *entry, *tmp;
+  DL_FOREACH_SAFE(cache->lru, entry, tmp) {
+    if (cache->memory_used <= cache->max_memory && cache->disk_used <= cache->max_disk) break;
+    if (entry->body && cache->memory_used > cache->max_memory) {
+      free(entry->body);
+      entry->body = NULL;
+      cache->memory_used -= entry->body_len;
+    }
+    if (entry->path && cache->disk_used > cache->max_disk) {
+      delete_files(entry);
+      free(entry->path);
+      entry->path = NULL;
+      cache->disk_used -= entry->body_len;
+    }
+    if (!entry->body && !entry->path) cache_remove(cache, entry);
+  }
+}
+
+static char *read_line(FILE *in) {
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len = getline(&line, &size, in);
+  if (len < 0) {
+    free(line);
+    return NULL;
+  }
+  if (len > 0 && line[len - 1] == '\n') line[len - 1] = '\0';
+  return line;
+}
+
+/*
+ * Reads an entry which was left on disk. Returns NULL, and deletes it, if it
+ * is incomplete.
+ */
+static cache_entry_t *load_entry(const char *dir, const char *meta_name) {
+  cache_entry_t *entry = (cache_entry_t *) calloc(1, sizeof(cache_entry_t));
+  char *path = NULL, *expires_at = NULL, *code = NULL, *body_len = NULL;
+  FILE *in = NULL;
+  long body_size = -1;
+
+  entry->key = strndup(meta_name, strlen(meta_name) - strlen(META_EXT));
+  if (asprintf(&entry->path, "%s/%s", dir, entry->key) < 0) {
+    entry->path = NULL;
+    goto invalid;
+  }
+  if (!(path = entry_file(entry, META_EXT)) || !(in = fopen(path, "r"))) goto invalid;
+  entry->etag          = read_line(in);
+  entry->last_modified = read_line(in);
+  expires_at           = read_line(in);
+  code                 = read_line(in);
+  body_len             = read_line(in);
+  fclose(in);
+  free(path);
+  if (!entry->etag || !entry->last_modified || !expires_at || !code || !body_len)
+    goto invalid;
+  if (!*entry->etag)          { free(entry->etag);          entry->etag          = NULL; }
+  if (!*entry->last_modified) { free(entry->last_modified); entry->last_modified = NULL; }
+  entry->expires_at = (time_t) atoll(expires_at);
+  entry->code       = atol(code);
+  entry->body_len   = (size_t) atoll(body_len);
+
+  if ((path = entry_file(entry, BODY_EXT)) && (in = fopen(path, "rb"))) {
+    fseek(in, 0, SEEK_END);
+    body_size = ftell(in);
+    fclose(in);
+  }
+  free(path);
+  if (body_size < 0 || (size_t) body_size != entry->body_len) goto invalid;
+
+  free(expires_at);
+  free(code);
+  free(body_len);
+  return entry;
+
+invalid:
+  LWARN("backend: cache: discarding incomplete entry %s", meta_name);
+  if (entry->path) delete_files(entry);
+  free(expires_at);
+  free(code);
+  free(body_len);
+  free_entry(entry);
+  return NULL;
+}
+
+response_cache_t *cache_new(const char *dir, size_t max_memory, size_t max_disk) {
+  response_cache_t *cache = (response_cache_t *) calloc(1, sizeof(response_cache_t));
+  DIR *listing;
+  struct dirent *file;
+
+  cache->max_memory = max_memory;
+  cache->max_disk   = dir ? max_disk : 0;
+  if (!dir) return cache;
+
+  cache->dir = strdup(dir);
+  if (mkdir_p(cache->dir)) LWARN("backend: cache: could not create %s", cache->dir);
+  if (!(listing = opendir(cache->dir))) return cache;
+  while ((file = readdir(listing))) {
+    cache_entry_t *entry;
+    size_t len = strlen(file->d_name);
+    if (len != HASHED_KEY_LEN + strlen(META_EXT) || strcmp(file->d_name + HASHED_KEY_LEN, META_EXT)) continue;
+    if (!(entry = load_entry(cache->dir, file->d_name))) continue;
+    HASH_ADD_KEYPTR(hh, cache->entries, entry->key, strlen(entry->key), entry);
+    DL_APPEND(cache->lru, entry);
+    cache->disk_used += entry->body_len;
+  }
+  closedir(listing);
+  LDEBUG("backend: cache: found %u responses on disk", HASH_COUNT(cache->entries));
+  evict(cache);
+  return cache;
+}
+
+void cache_destroy(response_cache_t **cache) {
+  cache_entry_t *entry, *tmp;
+  if (!*cache) return;
+  // what's on disk is kept for next time
+  HASH_ITER(hh, (*cache)->entries, entry, tmp) {
+    HASH_DEL((*cache)->entries, entry);
+    free_entry(entry);
+  }
+  free((*cache)->dir);
+  free(*cache);
+  *cache = NULL;
+}
+
+void cache_set_limits(response_cache_t *cache, size_t max_memory, size_t max_disk) {
+  cache->max_memory = max_memory;
+  cache->max_disk   = cache->dir ? max_disk : 0;
+  evict(cache);
+}
+
+cache_entry_t *cache_find(response_cache_t *cache, const char *key) {
+  cache_entry_t *entry = NULL;
+  char hashed[HASHED_KEY_LEN + 1];
+  hash_key(key, hashed);
+  HASH_FIND_STR(cache->entries, hashed, entry);
+  if (entry) {
+    DL_DELETE(cache->lru, entry);
+    DL_APPEND(cache->lru, entry);
+  }
+  return entry;
+}
+
+char *cache_read_body(response_cache_t *cache, cache_entry_t *entry) {
+  char *body = (char *) malloc(entry->body_len + 1), *path;
+  FILE *in;
+
+  body[entry->body_len] = '\0';
+  if (entry->body) {
+    memcpy(body, entry->body, entry->body_len);
+    return body;
+  }
+  path = entry_file(entry, BODY_EXT);
+  in = path ? fopen(path, "rb") : NULL;
+  free(path);
+  if (!in || fread(body, 1, entry->body_len, in) != entry->body_len) {
+    LWARN("backend: cache: could not read %s", entry->path);
+    if (in) fclose(in);
+    free(body);
+    return NULL;
+  }
+  fclose(in);
+  return body;
+}
+
+void cache_store(response_cache_t *cache, const char *key, long code, const char *body, size_t body_len,
+                 const char *etag, const char *last_modified, time_t expires_at) {
+  cache_entry_t *entry = NULL;
+  char hashed[HASHED_KEY_LEN + 1];
+
+  hash_key(key, hashed);
+  HASH_FIND_STR(cache->entries, hashed, entry);
+  if (entry) cache_remove(cache, entry);
+  if (body_len > cache->max_memory && body_len > cache->max_disk) return;
+
+  entry = (cache_entry_t *) calloc(1, sizeof(cache_entry_t));
+  entry->key           = strdup(hashed);
+  entry->etag          = etag ? strdup(etag) : NULL;
+  entry->last_modified = last_modified ? strdup(last_modified) : NULL;
+  entry->expires_at    = expires_at;
+  entry->code          = code;
+  entry->body_len      = body_len;
+
+  if (body_len <= cache->max_memory) {
+    entry->body = (char *) malloc(body_len + 1);
+    memcpy(entry->body, body, body_len);
+    entry->body[body_len] = '\0';
+    cache->memory_used += body_len;
+  }
+
+  if (cache->dir && body_len <= cache->max_disk) {
+    char *path = NULL;
+    FILE *out;
+    int err = 1;
+    if (asprintf(&entry->path, "%s/%s", cache->dir, hashed) < 0) entry->path = NULL;
+    path = entry->path ? entry_file(entry, BODY_EXT) : NULL;
+    if (path && (out = fopen(path, "wb"))) {
+      err = fwrite(body, 1, body_len, out) != body_len;
+      err = fclose(out) || err || write_meta(entry);
+    }
+    free(path);
+    if (err && entry->path) {
+      LWARN("backend: cache: could not write %s", entry->path);
+      delete_files(entry);
+      free(entry->path);
+      entry->path = NULL;
+    } else if (!err) {
+      cache->disk_used += body_len;
+    }
+  }
+
+  if (!entry->body && !entry->path) {
+    free_entry(entry);
+    return;
+  }
+  HASH_ADD_KEYPTR(hh, cache->entries, entry->key, strlen(entry->key), entry);
+  DL_APPEND(cache->lru, entry);
+  evict(cache);
+}
+
+void cache_refresh(response_cache_t *cache, cache_entry_t *entry, const char *etag,
+                   const char *last_modified, time_t expires_at) {
+  if (etag) {
+    free(entry->etag);
+    entry->etag = strdup(etag);
+  }
+  if (last_modified) {
+    free(entry->last_modified);
+    entry->last_modified = strdup(last_modified);
+  }
+  entry->expires_at = expires_at;
+  if (entry->path && write_meta(entry))
+    LWARN("backend: cache: could not update %s", entry->path);
+}
+
+/*
+ * Returns the value of `directive` in a Cache-Control header, such as "60"
+ * for "max-age" in "public, max-age=60"; an empty string if it has no
+ * value; or NULL if it isn't there.
+ */
+static const char *directive(const char *cache_control, const char *name) {
+  const char *p = cache_control;
+  size_t len = strlen(name);
+  while ((p = strcasestr(p, name))) {
+    int starts = p == cache_control || p[-1] == ',' || p[-1] == ' ';
+    p += len;
+    if (starts && *p == '=') return p + 1;
+    if (starts && (*p == '\0' || *p == ',' || *p == ' ')) return "";
+  }
+  return NULL;
+}
+
+int cache_freshness(const char *cache_control, const char *expires, const char *date,
+                    time_t now, time_t *expires_at) {
+  const char *max_age;
+  *expires_at = 0;
+
+  if (cache_control) {
+    if (directive(cache_control, "no-store")) return 0;
+    if (directive(cache_control, "no-cache")) return 1;
+    if ((max_age = directive(cache_control, "max-age")) && *max_age) {
+      long seconds = atol(max_age);
+      if (seconds > 0) *expires_at = now + seconds;
+      return 1;
+    }
+  }
+  if (expires) {
+    time_t until = curl_getdate(expires, NULL);
+    time_t sent = date ? curl_getdate(date, NULL) : -1;
+    // measured against the server's clock, in case ours is wrong
+    if (until != -1 && sent != -1) until = now + (until - sent);
+    if (until != -1 && until > now) *expires_at = until;
+  }
+  return 1;
+}
@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "services.h"
+#include "plugins/backend_outbox.h"
+#include "util/files.h"
+#include "util/migrations.h"
+#include "util/utlist.h"
+
+#define OUTBOX_FILENAME "outbox.sqlite3"
+
+sqlite3 *outbox_open(void) {
+  sqlite3 *db = NULL;
+  char *path = find_writable_file(NULL, OUTBOX_FILENAME);
+
+  if (!path) {
+    LERROR("backend: outbox: could not find a writable path for %s", OUTBOX_FILENAME);
+    return NULL;
+  }
+  if (sqlite3_open(path, &db) != SQLITE_OK) {
+    LERROR("backend: outbox: can't open database %s: %s", path, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    free(path);
+    return NULL;
+  }
+  free(path);
+
+  if (!(path = find_readable_file(NULL, "migrations/outbox"))) {
+    LERROR("backend: outbox: could not find migrations path for outbox database");
+    sqlite3_close(db);
+    return NULL;
+  }
+  if (migrate(db, path) < 0) {
+    LERROR("backend: outbox: could not migrate the outbox database");
+    sqlite3_close(db);
+    free(path);
+    return NULL;
+  }
+  free(path);
+
+  // so that the jitter in `outbox_backoff` differs between terminals
+  srandom((unsigned int) (zclock_time() ^ getpid()));
+  return db;
+}
+
+void outbox_close(sqlite3 **db) {
+  if (!*db) return;
+  sqlite3_close(*db);
+  *db = NULL;
+}
+
+char *outbox_destination(const char *url) {
+  const char *start = strstr(url, "://"), *end;
+  char *destination;
+  size_t i;
+
+  if (!start) return NULL;
+  start += 3;
+  end = start + strcspn(start, "/?#");
+  if (end == start) return NULL;
+  destination = strndup(url, end - url);
+  for (i = 0; destination[i]; i++) destination[i] = tolower(destination[i]);
+  return destination;
+}
+
+/*
+ * Each frame is stored as its length, as 4 bytes in network order, followed
+ * by its data.
+ */
+static void *encode_request(zmsg_t *request, size_t *len) {
+  zframe_t *frame;
+  unsigned char *data, *p;
+
+  *len = 0;
+  for (frame = zmsg_first(request); frame; frame = zmsg_next(request))
+    *len += 4 + zframe_size(frame);
+  p = data = (unsigned char *) malloc(*len ? *len : 1);
+  for (frame = zmsg_first(request); frame; frame = zmsg_next(request)) {
+    uint32_t size = htonl((uint32_t) zframe_size(frame));
+    memcpy(p, &size, 4);
+    memcpy(p + 4, zframe_data(frame), zframe_size(frame));
+    p += 4 + zframe_size(frame);
+  }
+  return data;
+}
+
+static zmsg_t *decode_request(const unsigned char *data, size_t len) {
+  zmsg_t *request = zmsg_new();
+  while (len >= 4) {
+    uint32_t size;
+    memcpy(&size, data, 4);
+    size = ntohl(size);
+    if (size > len - 4) break;
+    zmsg_addmem(request, data + 4, size);
+    data += 4 + size;
+    len -= 4 + size;
+  }
+  return request;
+}
+
+long long outbox_add(sqlite3 *db, const char *destination, zmsg_t *request) {
+  sqlite3_stmt *stmt = NULL;
+  long long id = -1;
+  size_t len;
+  void *data = encode_request(request, &len);
+
+  if (sqlite3_prepare_v2(db, "INSERT INTO outbox (destination, request, created_at) VALUES (?, ?, ?)",
+                         -1, &stmt, NULL) != SQLITE_OK) {
+    LERROR("backend: outbox: could not prepare insert: %s", sqlite3_errmsg(db));
+    free(data);
+    return -1;
+  }
+  sqlite3_bind_text(stmt, 1, destination, -1, SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 2, data, (int) len, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 3, zclock_time());
+  if (sqlite3_step(stmt) == SQLITE_DONE)
+    id = (long long) sqlite3_last_insert_rowid(db);
+  else
+    LERROR("backend: outbox: could not store request: %s", sqlite3_errmsg(db));
+  sqlite3_finalize(stmt);
+  free(data);
+  return id;
+}
+
+outbox_entry_t *outbox_heads(sqlite3 *db) {
+  sqlite3_stmt *stmt = NULL;
+  outbox_entry_t *entries = NULL, *entry;
+
+  if (sqlite3_prepare_v2(db, "SELECT id, destination, request, attempts, next_attempt_at FROM outbox "
+                             "WHERE id IN (SELECT MIN(id) FROM outbox GROUP BY destination) ORDER BY id",
+                         -1, &stmt, NULL) != SQLITE_OK) {
+    LERROR("backend: outbox: could not prepare query: %s", sqlite3_errmsg(db));
+    return NULL;
+  }
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    entry = (outbox_entry_t *) calloc(1, sizeof(outbox_entry_t));
+    entry->id              = (long long) sqlite3_column_int64(stmt, 0);
+    entry->destination     = strdup((const char *) sqlite3_column_text(stmt, 1));
+    entry->request         = decode_request((const unsigned char *) sqlite3_column_blob(stmt, 2),
+                                            (size_t) sqlite3_column_bytes(stmt, 2));
+    entry->attempts        = sqlite3_column_int(stmt, 3);
+    entry->next_attempt_at = (int64_t) sqlite3_column_int64(stmt, 4);
+    DL_APPEND(entries, entry);
+  }
+  sqlite3_finalize(stmt);
+  return entries;
+}
+
+void outbox_free_entries(outbox_entry_t **entries) {
+  outbox_entry_t *entry, *tmp;
+  DL_FOREACH_SAFE(*entries, entry, tmp) {
+    DL_DELETE(*entries, entry);
+    free(entry->destination);
+    zmsg_destroy(&entry->request);
+    free(entry);
+  }
+}
+
+int outbox_retry_later(sqlite3 *db, long long id, int attempts, int64_t next_attempt_at) {
+  char *zErrMsg = NULL;
+  char *query = sqlite3_mprintf("UPDATE outbox SET attempts = %d, next_attempt_at = %lld WHERE id = %lld",
+                                attempts, (long long) next_attempt_at, id);
+  int err = sqlite3_exec(db, query, NULL, NULL, &zErrMsg);
+  if (err != SQLITE_OK) {
+    LERROR("backend: outbox: could not execute query (%s): %s", zErrMsg, query);
+    sqlite3_free(zErrMsg);
+  }
+  sqlite3_free(query);
+  return err;
+}
+
+int outbox_remove(sqlite3 *db, long long id) {
+  char *zErrMsg = NULL;
+  char *query = sqlite3_mprintf("DELETE FROM outbox WHERE id = %lld", id);
+  int err = sqlite3_exec(db, query, NULL, NULL, &zErrMsg);
+  if (err != SQLITE_OK) {
+    LERROR("backend: outbox: could not execute query (%s): %s", zErrMsg, query);
+    sqlite3_free(zErrMsg);
+  }
+  sqlite3_free(query);
+  return err == SQLITE_OK && sqlite3_changes(db) > 0;
+}
+
+long outbox_count(sqlite3 *db) {
+  sqlite3_stmt *stmt = NULL;
+  long count = 0;
+  if (sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM outbox", -1, &stmt, NULL) != SQLITE_OK) return 0;
+  if (sqlite3_step(stmt) == SQLITE_ROW) count = (long) sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+  return count;
+}
+
+int64_t outbox_backoff(int attempts) {
+  int64_t backoff = OUTBOX_MIN_BACKOFF;
+  while (--attempts > 0 && backoff < OUTBOX_MAX_BACKOFF) backoff *= 2;
+  if (backoff > OUTBOX_MAX_BACKOFF) backoff = OUTBOX_MAX_BACKOFF;
+  // somewhere between half and all of it
+  return backoff / 2 + random() % (backoff / 2 + 1);
+}
@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "services.h"
+#include "plugins/backend_timings.h"
+
+static const char *phase_names[NUM_PHASES] = {
+  "dns", "connect", "tls", "wait", "transfer", "total"
+};
+
+// upper bounds of the histogram buckets, in ms; the last bucket has none
+static const long bucket_bounds[] = { 1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000 };
+#define NUM_BUCKETS (sizeof(bucket_bounds) / sizeof(bucket_bounds[0]) + 1)
+
+static long long phase_duration(long long from, long long to) {
+  return from >= 0 && to >= from ? to - from : -1;
+}
+
+void timings_record(host_timings_t **hosts, const char *host, const transfer_timing_t *timing) {
+  host_timings_t *entry = NULL;
+  long long *sample;
+
+  HASH_FIND_STR(*hosts, host, entry);
+  if (!entry) {
+    entry = (host_timings_t *) calloc(1, sizeof(host_timings_t));
+    entry->host = strdup(host);
+    HASH_ADD_KEYPTR(hh, *hosts, entry->host, strlen(entry->host), entry);
+  }
+
+  sample = entry->samples[entry->next];
+  // a reused connection skips the lookup and the handshakes altogether
+  sample[PHASE_DNS]      = timing->reused ? -1 : timing->name_lookup;
+  sample[PHASE_CONNECT]  = timing->reused ? -1 : phase_duration(timing->name_lookup, timing->connect);
+  sample[PHASE_TLS]      = timing->reused || !timing->app_connect ? -1 :
+                           phase_duration(timing->connect, timing->app_connect);
+  sample[PHASE_WAIT]     = phase_duration(timing->pretransfer, timing->start_transfer);
+  sample[PHASE_TRANSFER] = phase_duration(timing->start_transfer, timing->total);
+  sample[PHASE_TOTAL]    = timing->total;
+  entry->next = (entry->next + 1) % TIMING_SAMPLES;
+  if (entry->count < TIMING_SAMPLES) entry->count++;
+}
+
+/*
+ * Appends `counts` as one frame of space-separated numbers.
+ */
+static void add_counts(zmsg_t *msg, const long *counts, size_t n) {
+  char str[NUM_BUCKETS * 12], *p = str;
+  size_t i;
+  for (i = 0; i < n; i++) p += sprintf(p, i ? " %ld" : "%ld", counts[i]);
+  zmsg_addstr(msg, str);
+}
+
+void timings_add_histograms(zmsg_t *msg, host_timings_t *hosts) {
+  host_timings_t *entry, *tmp;
+  long counts[NUM_BUCKETS];
+  size_t b;
+  int i, phase;
+
+  zmsg_addstr(msg, "bounds");
+  add_counts(msg, bucket_bounds, NUM_BUCKETS - 1);
+  HASH_ITER(hh, hosts, entry, tmp) {
+    zmsg_addstr(msg, "host");
+    zmsg_addstr(msg, entry->host);
+    zmsg_addstr(msg, "samples");
+    zmsg_addstrf(msg, "%d", entry->count);
+    for (phase = 0; phase < NUM_PHASES; phase++) {
+      memset(counts, 0, sizeof(counts));
+      for (i = 0; i < entry->count; i++) {
+        long long us = entry->samples[i][phase];
+        if (us < 0) continue;
+        for (b = 0; b < NUM_BUCKETS - 1 && us > bucket_bounds[b] * 1000LL; b++);
+        counts[b]++;
+      }
+      zmsg_addstr(msg, phase_names[phase]);
+      add_counts(msg, counts, NUM_BUCKETS);
+    }
+  }
+}
+
+void timings_free(host_timings_t **hosts) {
+  host_timings_t *entry, *tmp;
+  HASH_ITER(hh, *hosts, entry, tmp) {
+    HASH_DEL(*hosts, entry);
+    free(entry->host);
+    free(entry);
+  }
+}
@@ -1,13 +1,104 @@
 #define LUA_LIB
 #include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
 #include "services.h"
 #include "lua.h"
 #include "lauxlib.h"
+#include "util/utlist.h"
 #if HAVE_CTOS
 #include <ctosapi.h>
 #endif
 
+// how many times per second to poll a COM port for rx data; unlike a tty,
+// it has no descriptor to wait on
+#define FREQUENCY 20
+
+#define RECV_CHUNK        4096  // read from the port at a time
+#define MAX_FRAME_SIZE    65536 // by default
+#define MAX_QUEUED_FRAMES 64    // kept for `recv`; older ones are dropped
+
+/*
+ * Each open port has a reader: an actor which owns the port from then on.
+ * It reads whatever arrives, splits it into frames, and publishes each
+ * frame on the event bus as it's completed:
+ *
+ *     "rs232", "frame-received", "port", <port>, "data", <frame>
+ *
+ * It also keeps the last few frames for `recv`. Data to send is queued
+ * with it, and written whenever the port can take it, so that neither
+ * sending nor receiving holds up the Lua state. If queued data can't be
+ * sent in time, it's dropped and this is published:
+ *
+ *     "rs232", "send-failed", "port", <port>, "error", "timeout"
+ *
+ * The reader is told what to do over its pipe:
+ *
+ *     "SEND", data, timeout    queue data to send; no reply
+ *     "RECV", timeout          reply with the oldest frame, or "timeout"
+ *     "FLUSH", which           discard what's queued; reply with an error
+ *                              or ""
+ */
+
+typedef enum {
+  FRAME_NONE,       // a frame is whatever arrived together
+  FRAME_DELIMITER,  // frames end with the delimiter, which isn't included
+  FRAME_HEADER      // frames start with their length
+} framing_t;
+
+// the length headers, as for the socket plugin's `recv_frame`
+static const char *const header_formats[] = { "binary2", "binary4",   "ascii2", "ascii4", NULL };
+static const size_t header_sizes[]        = { 2,         4,           2,        4 };
+static const size_t header_limits[]       = { 0xffff,    0xffffffff,  99,       9999 };
+
+typedef struct {
+  char *name;          // as given to `open`
+  int com;             // the COM port, or -1 for a tty
+  int fd;              // the tty, or -1 for a COM port
+  framing_t framing;
+  char *delimiter;
+  size_t delimiter_len;
+  int header;          // which of the header formats
+  size_t max_size;     // of a frame
+  zactor_t *reader;
+  lua_State *owner;    // the main thread of the state which opened it
+  UT_hash_handle hh;
+} rs232_port_t;
+
+typedef struct buffer_s {
+  char *data;
+  size_t len;
+  size_t sent;         // for a write
+  int64_t deadline;    // for a write, or -1
+  struct buffer_s *prev, *next;
+} buffer_t;
+
+// the reader's own state
+typedef struct {
+  rs232_port_t *port;
+  zsock_t *pipe;
+  zsock_t *pub;
+  char *in;            // received data which isn't a whole frame yet
+  size_t in_len;
+  size_t in_cap;
+  buffer_t *frames;    // kept for `recv`, oldest first
+  int num_frames;
+  buffer_t *writes;    // queued to be sent, oldest first
+  bool recv_waiting;   // a `recv` is waiting for a frame
+  int64_t recv_deadline; // when it gives up, or -1
+  bool terminated;
+} reader_t;
+
+// the ports open in every Lua state. Each can only be used by the state
+// which opened it, and is closed when that state shuts down.
+static rs232_port_t *ports = NULL;
+static pthread_mutex_t ports_lock = PTHREAD_MUTEX_INITIALIZER;
+
 int check_rs232_err(lua_State *L, int err) {
   #if HAVE_CTOS
     switch(err) {
@@ -31,7 +122,12 @@ int check_rs232_err(lua_State *L, int err) {
   return 0;
 }
 
+/*
+ * Returns the COM port named `port`, or -2 if it names a tty device, such
+ * as "/dev/ttyS0" or the slave side of a pseudo-terminal, instead.
+ */
 int decode_port(lua_State *L, const char *port) {
+  if (port && port[0] == '/') return -2;
   #if HAVE_CTOS
     if (!strcmp(port, "com1") || !strcmp(port, "COM1") || !strcmp(port, "1")) {
       return d_COM1;
@@ -45,29 +141,409 @@ int decode_port(lua_State *L, const char *port) {
   return -1;
 }
 
+static lua_State *main_thread(lua_State *L) {
+  lua_State *main;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+  main = lua_tothread(L, -1);
+  lua_pop(L, 1);
+  return main;
+}
+
+// returns the port named by the first argument, if this state opened it,
+// or NULL
+static rs232_port_t *find_port(lua_State *L) {
+  const char *name = luaL_checkstring(L, 1);
+  rs232_port_t *port = NULL;
+  pthread_mutex_lock(&ports_lock);
+  HASH_FIND_STR(ports, name, port);
+  if (port && port->owner != main_thread(L)) port = NULL;
+  pthread_mutex_unlock(&ports_lock);
+  return port;
+}
+
+static void free_buffer(buffer_t *buffer) {
+  free(buffer->data);
+  free(buffer);
+}
+
+static void publish(reader_t *r, const char *event, const char *key, const char *value, size_t len) {
+  zsock_send(r->pub, "sssssb", "rs232", event, "port", r->port->name, key, value, len);
+}
+
+/*
+ * Adds a complete frame: publishes it, and keeps it for `recv`, answering
+ * the one waiting if there is one.
+ */
+static void add_frame(reader_t *r, const char *data, size_t len) {
+  buffer_t *frame;
+
+  publish(r, "frame-received", "data", data, len);
+  if (r->recv_waiting) {
+    zsock_send(r->pipe, "sb", "", data, len);
+    r->recv_waiting = false;
+    return;
+  }
+  if (r->num_frames == MAX_QUEUED_FRAMES) {
+    frame = r->frames;
+    DL_DELETE(r->frames, frame);
+    free_buffer(frame);
+    r->num_frames--;
+    LDEBUG("rs232: %s: dropped a frame nobody received", r->port->name);
+  }
+  frame = (buffer_t *) calloc(1, sizeof(buffer_t));
+  frame->data = (char *) malloc(len ? len : 1);
+  memcpy(frame->data, data, len);
+  frame->len = len;
+  DL_APPEND(r->frames, frame);
+  r->num_frames++;
+}
+
+// memmem(), which isn't available everywhere
+static const char *find_bytes(const char *data, size_t len, const char *what, size_t what_len) {
+  const char *p = data, *last = data + len - what_len;
+  if (len < what_len) return NULL;
+  while ((p = memchr(p, what[0], last - p + 1))) {
+    if (!memcmp(p, what, what_len)) return p;
+    p++;
+  }
+  return NULL;
+}
+
+/*
+ * Takes as many frames as are complete from the start of what's been
+ * received. What can never become a valid frame is thrown away.
+ */
+static void take_frames(reader_t *r) {
+  rs232_port_t *port = r->port;
+  size_t start = 0, header, len, i;
+  const char *end;
+
+  while (start < r->in_len) {
+    const char *data = r->in + start;
+    size_t avail = r->in_len - start;
+
+    if (port->framing == FRAME_NONE) {
+      add_frame(r, data, avail);
+      start = r->in_len;
+    } else if (port->framing == FRAME_DELIMITER) {
+      if (!(end = find_bytes(data, avail, port->delimiter, port->delimiter_len))) {
+        if (avail > port->max_size) {
+          LWARN("rs232: %s: discarding %zu bytes without a delimiter", port->name, avail);
+          start = r->in_len;
+        }
+        break;
+      }
+      add_frame(r, data, end - data);
+      start += end - data + port->delimiter_len;
+    } else {
+      header = header_sizes[port->header];
+      if (avail < header) break;
+      for (i = 0, len = 0; i < header; i++) {
+        if (port->header < 2) {
+          len = len * 256 + (unsigned char) data[i];
+        } else if (data[i] >= '0' && data[i] <= '9') {
+          len = len * 10 + data[i] - '0';
+        } else {
+          len = (size_t) -1;
+          break;
+        }
+      }
+      if (len > port->max_size) {
+        LWARN("rs232: %s: discarding %zu bytes after an invalid length header", port->name, avail);
+        start = r->in_len;
+        break;
+      }
+      if (avail < header + len) break;
+      add_frame(r, data + header, len);
+      start += header + len;
+    }
+  }
+
+  memmove(r->in, r->in + start, r->in_len - start);
+  r->in_len -= start;
+}
+
+/*
+ * Reads whatever has arrived at the port. Returns -1 if the port failed.
+ */
+static int read_port(reader_t *r) {
+  rs232_port_t *port = r->port;
+  ssize_t n;
+
+  while (true) {
+    if (r->in_cap - r->in_len < RECV_CHUNK) {
+      r->in_cap = r->in_len + RECV_CHUNK;
+      r->in = (char *) realloc(r->in, r->in_cap);
+    }
+    if (port->fd >= 0) {
+      n = read(port->fd, r->in + r->in_len, RECV_CHUNK);
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) break;
+      if (n == 0) errno = EIO;
+      if (n <= 0) return -1;
+    } else {
+      #if HAVE_CTOS
+        USHORT len = 0;
+        if (CTOS_RS232RxReady((BYTE) port->com, &len) != d_OK || len == 0) break;
+        if (len > RECV_CHUNK) len = RECV_CHUNK;
+        if (CTOS_RS232RxData((BYTE) port->com, (BYTE *) r->in + r->in_len, &len) != d_OK) return -1;
+        n = len;
+      #else
+        break;
+      #endif
+    }
+    r->in_len += n;
+  }
+  if (r->in_len > 0) take_frames(r);
+  return 0;
+}
+
+/*
+ * Writes as much of what's queued as the port will take.
+ */
+static void write_port(reader_t *r) {
+  rs232_port_t *port = r->port;
+  buffer_t *pending;
+  ssize_t n;
+
+  while ((pending = r->writes)) {
+    if (port->fd >= 0) {
+      n = write(port->fd, pending->data + pending->sent, pending->len - pending->sent);
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+      if (n < 0) {
+        publish(r, "send-failed", "error", strerror(errno), strlen(strerror(errno)));
+        n = pending->len - pending->sent;
+      }
+    } else {
+      #if HAVE_CTOS
+        if (CTOS_RS232TxReady((BYTE) port->com) != d_OK) return;
+        if (CTOS_RS232TxData((BYTE) port->com, (BYTE *) pending->data + pending->sent,
+                             pending->len - pending->sent) != d_OK) {
+          publish(r, "send-failed", "error", "hardware fault", 14);
+        }
+      #endif
+      n = pending->len - pending->sent;
+    }
+    pending->sent += n;
+    if (pending->sent < pending->len) return;
+    DL_DELETE(r->writes, pending);
+    free_buffer(pending);
+  }
+}
+
+/*
+ * Gives up on the writes and the `recv` whose time has run out.
+ */
+static void expire(reader_t *r) {
+  int64_t now = zclock_mono();
+  buffer_t *write, *tmp;
+
+  DL_FOREACH_SAFE(r->writes, write, tmp) {
+    // one which has started has to finish, or the peer sees half of it
+    if (write->deadline < 0 || write->deadline > now || write->sent > 0) continue;
+    DL_DELETE(r->writes, write);
+    free_buffer(write);
+    LWARN("rs232: %s: couldn't send in time", r->port->name);
+    publish(r, "send-failed", "error", "timeout", 7);
+  }
+  if (r->recv_waiting && r->recv_deadline >= 0 && r->recv_deadline <= now) {
+    zsock_send(r->pipe, "sb", "timeout", NULL, (size_t) 0);
+    r->recv_waiting = false;
+  }
+}
+
+static void flush_port(reader_t *r, const char *which) {
+  rs232_port_t *port = r->port;
+  bool recv = !*which || !strcmp(which, "recv");
+  bool send = !*which || !strcmp(which, "send");
+  buffer_t *buffer, *tmp;
+  int err = 0;
+
+  if (recv) {
+    DL_FOREACH_SAFE(r->frames, buffer, tmp) {
+      DL_DELETE(r->frames, buffer);
+      free_buffer(buffer);
+    }
+    r->num_frames = 0;
+    r->in_len = 0;
+  }
+  if (send) {
+    DL_FOREACH_SAFE(r->writes, buffer, tmp) {
+      DL_DELETE(r->writes, buffer);
+      free_buffer(buffer);
+    }
+  }
+
+  if (port->fd >= 0) {
+    if (tcflush(port->fd, recv && send ? TCIOFLUSH : recv ? TCIFLUSH : TCOFLUSH)) err = errno;
+    zsock_send(r->pipe, "s", err ? strerror(err) : "");
+    return;
+  }
+  #if HAVE_CTOS
+    if (recv) err = CTOS_RS232FlushRxBuffer((BYTE) port->com);
+    if (send && err == d_OK) err = CTOS_RS232FlushTxBuffer((BYTE) port->com);
+  #endif
+  zsock_send(r->pipe, "s", err ? "hardware fault" : "");
+}
+
+static void handle_command(reader_t *r) {
+  zmsg_t *msg = zmsg_recv(r->pipe);
+  char *command;
+  buffer_t *buffer;
+  zframe_t *frame;
+
+  if (!msg) {
+    r->terminated = true;
+    return;
+  }
+  command = zmsg_popstr(msg);
+
+  if (!command || !strcmp(command, "$TERM")) {
+    r->terminated = true;
+  } else if (!strcmp(command, "SEND")) {
+    frame = zmsg_pop(msg);
+    buffer = (buffer_t *) calloc(1, sizeof(buffer_t));
+    buffer->len = frame ? zframe_size(frame) : 0;
+    buffer->data = (char *) malloc(buffer->len ? buffer->len : 1);
+    if (frame) memcpy(buffer->data, zframe_data(frame), buffer->len);
+    char *timeout = zmsg_popstr(msg);
+    buffer->deadline = timeout ? zclock_mono() + atoi(timeout) : -1;
+    free(timeout);
+    zframe_destroy(&frame);
+    DL_APPEND(r->writes, buffer);
+  } else if (!strcmp(command, "RECV")) {
+    char *timeout = zmsg_popstr(msg);
+    if ((buffer = r->frames)) {
+      zsock_send(r->pipe, "sb", "", buffer->data, buffer->len);
+      DL_DELETE(r->frames, buffer);
+      free_buffer(buffer);
+      r->num_frames--;
+    } else {
+      r->recv_waiting = true;
+      r->recv_deadline = timeout && atoi(timeout) >= 0 ? zclock_mono() + atoi(timeout) : -1;
+    }
+    free(timeout);
+  } else if (!strcmp(command, "FLUSH")) {
+    char *which = zmsg_popstr(msg);
+    flush_port(r, which ? which : "");
+    free(which);
+  }
+
+  free(command);
+  zmsg_destroy(&msg);
+}
+
+/*
+ * How long the reader can wait for something to happen, in milliseconds,
+ * or -1 if it can wait until it does.
+ */
+static long next_timeout(reader_t *r) {
+  int64_t wake_at = -1, now = zclock_mono();
+  buffer_t *write;
+
+  DL_FOREACH(r->writes, write) {
+    if (write->deadline >= 0 && write->sent == 0 && (wake_at < 0 || write->deadline < wake_at))
+      wake_at = write->deadline;
+  }
+  if (r->recv_waiting && r->recv_deadline >= 0 && (wake_at < 0 || r->recv_deadline < wake_at))
+    wake_at = r->recv_deadline;
+  // a COM port has to be polled
+  if (r->port->fd < 0 && (wake_at < 0 || now + 1000 / FREQUENCY < wake_at))
+    wake_at = now + 1000 / FREQUENCY;
+  if (wake_at < 0) return -1;
+  return wake_at > now ? (long) (wake_at - now) : 0;
+}
+
+static void port_reader(zsock_t *pipe, void *arg) {
+  reader_t r;
+  buffer_t *buffer, *tmp;
+
+  memset(&r, 0, sizeof(r));
+  r.port = (rs232_port_t *) arg;
+  r.pipe = pipe;
+  r.pub = zsock_new_pub(">" EVENTS_PUB_ENDPOINT);
+  zsock_signal(pipe, 0);
+  LDEBUG("rs232: %s: reader started", r.port->name);
+
+  while (!r.terminated) {
+    zmq_pollitem_t items[] = {
+      { zsock_resolve(pipe), 0,           ZMQ_POLLIN, 0 },
+      { NULL,                r.port->fd,  ZMQ_POLLIN, 0 }
+    };
+    if (r.writes) items[1].events |= ZMQ_POLLOUT;
+    if (zmq_poll(items, r.port->fd >= 0 ? 2 : 1, next_timeout(&r)) == -1) {
+      if (errno == EINTR) continue;
+      LWARN("rs232: %s: reader interrupted", r.port->name);
+      break;
+    }
+    if (items[0].revents & ZMQ_POLLIN) {
+      handle_command(&r);
+      if (r.terminated) break;
+    }
+    if (read_port(&r)) {
+      LERROR("rs232: %s: reading from the port failed: %s", r.port->name, strerror(errno));
+      publish(&r, "port-error", "error", strerror(errno), strlen(strerror(errno)));
+      break;
+    }
+    write_port(&r);
+    expire(&r);
+  }
+
+  // there's no more to receive, but `recv` must still be answered
+  while (!r.terminated) {
+    if (r.recv_waiting) zsock_send(pipe, "sb", "port failed", NULL, (size_t) 0);
+    r.recv_waiting = false;
+    handle_command(&r);
+  }
+
+  DL_FOREACH_SAFE(r.frames, buffer, tmp) { DL_DELETE(r.frames, buffer); free_buffer(buffer); }
+  DL_FOREACH_SAFE(r.writes, buffer, tmp) { DL_DELETE(r.writes, buffer); free_buffer(buffer); }
+  free(r.in);
+  zsock_destroy(&r.pub);
+  LDEBUG("rs232: %s: reader stopped", r.port->name);
+}
+
+static void free_port(rs232_port_t *port) {
+  if (port->reader) zactor_destroy(&port->reader);
+  if (port->fd >= 0) close(port->fd);
+  #if HAVE_CTOS
+    if (port->com >= 0) CTOS_RS232Close((BYTE) port->com);
+  #endif
+  free(port->delimiter);
+  free(port->name);
+  free(port);
+}
+
+// removes a port from those open, and closes it
+static void forget_port(rs232_port_t *port) {
+  pthread_mutex_lock(&ports_lock);
+  HASH_DEL(ports, port);
+  pthread_mutex_unlock(&ports_lock);
+  free_port(port);
+}
+
 /*
  * Close a COM port. Specify the COM port as the only argument ('COM1',
- * 'COM2', etc).
+ * 'COM2', etc). Whatever hasn't been sent yet is discarded.
  *
  * If an error occurs, a string will be returned. Otherwise the return value
  * is `nil`.
- * 
+ *
  * Examples:
- * 
+ *
  *     rs232 = require('rs232')
  *     err = rs232.close('COM1')
  *     if err then print(err) end
  *
  */
 int rs232_close(lua_State *L) {
-  int port = decode_port(L, lua_tostring(L, 1));
-  if (port == -1) return 1;
+  rs232_port_t *port = find_port(L);
+  if (!port) {
+    lua_pushstring(L, "port is not open");
+    return 1;
+  }
 
-  int err = 0;
-  #if HAVE_CTOS
-    err = CTOS_RS232Close((BYTE) port);
-  #endif
-  return check_rs232_err(L, err);
+  forget_port(port);
+  return 0;
 }
 
 /*
@@ -75,11 +551,16 @@ int rs232_close(lua_State *L) {
  * ('COM1', 'COM2', etc). Specify the data to send as the second argument.
  * Optionally, specify a timeout in milliseconds as the third argument.
  *
- * This function will block until all data has been sent, or an unrecoverable
- * error has occurred, or a timeout has occurred.
+ * This function doesn't wait for the data to be sent: it's queued, and sent
+ * in the background as soon as the port can take it. If it can't be sent
+ * before the timeout, it's dropped instead, and a "send-failed" event is
+ * published; see `open`.
  *
- * If an error occurs, it will be returned as a string. If a timeout occurs,
- * the string 'timeout' will be returned. Otherwise the return value is `nil`.
+ * If the port was opened with a delimiter, it's sent after the data; if it
+ * was opened with a length header, the header is sent before it.
+ *
+ * If an error occurs, it will be returned as a string. Otherwise the return
+ * value is `nil`.
  *
  * Examples:
  *
@@ -90,61 +571,56 @@ int rs232_close(lua_State *L) {
  *       err = rs232.send('COM1', 'this is some data')
  *       err = rs232.send('COM1', 'this is some data', 100)
  *     end
- * 
+ *
  */
 int rs232_send(lua_State *L) {
-  int port = decode_port(L, lua_tostring(L, 1));
-  if (port == -1) return 1;
-
-  size_t data_len;
-  const char *data = lua_tolstring(L, 1, &data_len);
-
-  long timeout_ns = -1;
-  if (!lua_isnil(L, 2)) timeout_ns = (long) lua_tonumber(L, 2) * 1000000;
-  struct timespec start_time;
-  struct timespec current_time;
-  if (clock_gettime(CLOCK_MONOTONIC, &start_time)) {
-    lua_pushstring(L, "could not initialize clock");
+  rs232_port_t *port = find_port(L);
+  size_t len, header = 0, i, n;
+  const char *data = luaL_checklstring(L, 2, &len);
+  lua_Integer timeout = luaL_optinteger(L, 3, -1);
+  char *frame;
+
+  if (!port) {
+    lua_pushstring(L, "port is not open");
     return 1;
   }
-
-  #if HAVE_CTOS
-    int err = CTOS_RS232GetCTS(port);
-    if (err != d_OK) return check_rs232_err(L, err);
-
-    while (CTOS_RS232TxReady(port) != d_OK) {
-      if (timeout_ns == -1) continue;
-
-      if (clock_gettime(CLOCK_MONOTONIC, &current_time)) {
-        lua_pushstring(L, "could not check for timeout");
-        return 1;
-      }
-
-      if ((current_time.tv_sec * 1e+9 + current_time.tv_nsec) -
-          (start_time.tv_sec * 1e+9   + start_time.tv_nsec) > timeout_ns) {
-        lua_pushstring(L, "timeout");
-        return 1;
-      }
+  if (port->framing == FRAME_HEADER) {
+    header = header_sizes[port->header];
+    if (len > header_limits[port->header]) {
+      lua_pushstring(L, "message is too long");
+      return 1;
     }
+  }
 
-    err = CTOS_RS232TxData(port, (BYTE *) data, data_len);
-    return check_rs232_err(L, err);
-  #else
-    (void) data;
-    (void) current_time;
-    (void) timeout_ns;
-    lua_pushstring(L, "not implemented");
-    return 1;
-  #endif
+  frame = (char *) malloc(header + len + port->delimiter_len + 1);
+  for (i = header, n = len; i-- > 0; n /= port->header < 2 ? 256 : 10)
+    frame[i] = port->header < 2 ? (char) (n & 0xff) : (char) ('0' + n % 10);
+  memcpy(frame + header, data, len);
+  if (port->framing == FRAME_DELIMITER)
+    memcpy(frame + header + len, port->delimiter, port->delimiter_len);
+  len += header + port->delimiter_len;
+
+  if (timeout >= 0) zsock_send(port->reader, "sbi", "SEND", frame, len, (int) timeout);
+  else              zsock_send(port->reader, "sb", "SEND", frame, len);
+  free(frame);
+  return 0;
 }
 
 /*
  * Receive some data over a COM port. Specify the COM port as the first
  * argument ('COM1', 'COM2', etc). Optionally, specify a timeout in
- * milliseconds as the second argument.
+ * milliseconds as the second argument, or -1 to wait forever.
+ *
+ * Returns the oldest frame received which hasn't been returned yet; see
+ * `open`. If there isn't one, this function will wait for one until the
+ * timeout. Without a timeout it doesn't wait at all: data arrives in the
+ * background whether or not anything is waiting for it, so this takes a
+ * frame only if there's one already.
  *
- * This function will block until data has been received, or an unrecoverable
- * error has occurred, or a timeout has occurred.
+ * Waiting here holds up the whole Lua state, reactor tasks included.
+ * Rather than waiting, scripts can subscribe to the "rs232" events, which
+ * carry the same frames as they arrive, on an lzmq socket, which reactor
+ * tasks can wait on without blocking.
  *
  * There are two return values for this function. The first will be `nil` on
  * success, or the string value 'timeout', or a string containing an error
@@ -159,70 +635,50 @@ int rs232_send(lua_State *L) {
  *       err, data = rs232.recv('COM1')
  *       err, data = rs232.recv('COM1', 100)
  *     end
- * 
+ *
  */
 int rs232_recv(lua_State *L) {
-  int port = decode_port(L, lua_tostring(L, 1));
-  if (port == -1) return 1;
-
-  long timeout_ns = -1;
-  if (!lua_isnil(L, 2)) timeout_ns = (long) lua_tonumber(L, 2) * 1000000;
-  struct timespec start_time;
-  struct timespec current_time;
-  if (clock_gettime(CLOCK_MONOTONIC, &start_time)) {
-    lua_pushstring(L, "could not initialize clock");
+  rs232_port_t *port = find_port(L);
+  lua_Integer timeout = luaL_optinteger(L, 2, 0);
+  char *err = NULL;
+  unsigned char *data = NULL;
+  size_t len = 0;
+
+  if (!port) {
+    lua_pushstring(L, "port is not open");
+    return 1;
+  }
+  if (zsock_send(port->reader, "si", "RECV", (int) timeout) ||
+      zsock_recv(port->reader, "sb", &err, &data, &len)) {
+    lua_pushstring(L, "interrupted");
     return 1;
   }
 
-  #if HAVE_CTOS
-    USHORT len = 0;
-    BYTE buf[65536];
-    while (len == 0) {
-      int err = CTOS_RS232RxReady(port, &len);
-      if (err != d_OK) return check_rs232_err(L, err);
-
-      if (len == 0) {
-        if (timeout_ns == -1) continue;
-
-        if (clock_gettime(CLOCK_MONOTONIC, &current_time)) {
-          lua_pushstring(L, "could not check for timeout");
-          return 1;
-        }
-
-        if ((current_time.tv_sec * 1e+9 + current_time.tv_nsec) -
-            (start_time.tv_sec   * 1e+9 + start_time.tv_nsec) > timeout_ns) {
-          lua_pushstring(L, "timeout");
-          return 1;
-        }
-
-        continue;
-      }
-
-      err = CTOS_RS232RxData(d_COM1, buf, &len);
-      if (err != d_OK) return check_rs232_err(L, err);
-    } 
-
-    lua_pushnil(L);
-    lua_pushlstring(L, (char *) buf, len);
-    return 2;
-  #else
-    (void) current_time;
-    (void) timeout_ns;
-    lua_pushstring(L, "not implemented");
+  if (*err) {
+    lua_pushstring(L, err);
+    free(err);
+    free(data);
     return 1;
-  #endif
+  }
+  lua_pushnil(L);
+  lua_pushlstring(L, (char *) data, len);
+  free(err);
+  free(data);
+  return 2;
 }
 
 /*
  * Flush the transmit (send) or receive (recv) buffer, or both. Specify the
  * COM port as the first argument (e.g. 'COM1'). Specify 'recv' or 'send' as
- * the second argument, or `nil` to flush both buffers.
+ * the second argument, or `nil` to flush both buffers. This also discards
+ * what's been queued to send, or what's been received but not yet returned
+ * by `recv`.
  *
  * If an error occurs, a string will be returned. Otherwise the return value
  * is `nil`.
- * 
+ *
  * Examples:
- * 
+ *
  *     rs232 = require('rs232')
  *     rs232.flush('COM1')
  *     rs232.flush('COM1', 'send')
@@ -230,30 +686,110 @@ int rs232_recv(lua_State *L) {
  *
  */
 int rs232_flush(lua_State *L) {
-  int port = decode_port(L, lua_tostring(L, 1));
-  if (port == -1) return 1;
+  rs232_port_t *port = find_port(L);
+  const char *which = luaL_optstring(L, 2, "");
+  char *err = NULL;
 
-  int err = 0;
-  if (lua_isnil(L, 2)) {
-    #if HAVE_CTOS
-      err = CTOS_RS232FlushRxBuffer(port);
-      if (err != d_OK) return check_rs232_err(L, err);
-      err = CTOS_RS232FlushTxBuffer(port);
-    #endif
-  } else if (!strcmp(lua_tostring(L, 2), "recv")) {
-    #if HAVE_CTOS
-      err = CTOS_RS232FlushRxBuffer(port);
-    #endif
-  } else if (!strcmp(lua_tostring(L, 2), "send")) {
-    #if HAVE_CTOS
-      err = CTOS_RS232FlushTxBuffer(port);
-    #endif
-  } else {
-    lua_pushfstring(L, "invalid buffer specification: %s", lua_tostring(L, 2));
+  if (!port) {
+    lua_pushstring(L, "port is not open");
+    return 1;
+  }
+  if (*which && strcmp(which, "recv") && strcmp(which, "send")) {
+    lua_pushfstring(L, "invalid buffer specification: %s", which);
     return 1;
   }
 
-  return check_rs232_err(L, err);
+  if (zsock_send(port->reader, "ss", "FLUSH", which) ||
+      zsock_recv(port->reader, "s", &err)) {
+    lua_pushstring(L, "interrupted");
+    return 1;
+  }
+  if (*err) lua_pushstring(L, err);
+  else      lua_pushnil(L);
+  free(err);
+  return 1;
+}
+
+/*
+ * Opens a tty device with the given settings, and returns its descriptor,
+ * or -1 with `errno` set.
+ */
+static int open_tty(const char *path, int baud, int parity, int data_bits, int stop_bits) {
+  struct termios tio;
+  speed_t speed;
+  int fd;
+
+  switch (baud) {
+    case 115200: speed = B115200; break;
+    case 57600:  speed = B57600;  break;
+    case 38400:  speed = B38400;  break;
+    case 19200:  speed = B19200;  break;
+    default:     speed = B9600;   break;
+  }
+
+  if ((fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) < 0) return -1;
+  if (tcgetattr(fd, &tio)) {
+    close(fd);
+    return -1;
+  }
+  cfmakeraw(&tio);
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  tio.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB);
+  tio.c_cflag |= (data_bits == 7 ? CS7 : CS8) | CLOCAL | CREAD;
+  if (parity != 'N') tio.c_cflag |= PARENB;
+  if (parity == 'O') tio.c_cflag |= PARODD;
+  if (stop_bits == 2) tio.c_cflag |= CSTOPB;
+  if (tcsetattr(fd, TCSANOW, &tio)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * Reads how the port's input is split into frames from the table at
+ * `index`, if there is one. Returns an error, or NULL.
+ */
+static const char *read_framing(lua_State *L, int index, rs232_port_t *port) {
+  const char *delimiter;
+  size_t len;
+  int i;
+
+  port->framing = FRAME_NONE;
+  port->max_size = MAX_FRAME_SIZE;
+  if (!lua_istable(L, index)) return NULL;
+
+  lua_getfield(L, index, "max_size");
+  if (lua_isinteger(L, -1) && lua_tointeger(L, -1) > 0) port->max_size = (size_t) lua_tointeger(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, index, "delimiter");
+  if ((delimiter = lua_tolstring(L, -1, &len))) {
+    if (len == 0) {
+      lua_pop(L, 1);
+      return "the delimiter is empty";
+    }
+    port->framing = FRAME_DELIMITER;
+    port->delimiter = (char *) malloc(len);
+    memcpy(port->delimiter, delimiter, len);
+    port->delimiter_len = len;
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, index, "header");
+  if (lua_isstring(L, -1)) {
+    for (i = 0; header_formats[i] && strcmp(header_formats[i], lua_tostring(L, -1)); i++);
+    lua_pop(L, 1);
+    if (!header_formats[i]) return "invalid header format (expected 'binary2', 'binary4', 'ascii2' or 'ascii4')";
+    if (port->framing == FRAME_DELIMITER) return "a port can't have both a delimiter and a header";
+    port->framing = FRAME_HEADER;
+    port->header = i;
+    if (port->max_size > header_limits[i]) port->max_size = header_limits[i];
+    return NULL;
+  }
+  lua_pop(L, 1);
+  return NULL;
 }
 
 /*
@@ -263,25 +799,58 @@ int rs232_flush(lua_State *L) {
  * data bits as the fourth argument (7 or 8). Specify the number of stop bits
  * as the fifth argument (1 or 2).
  *
+ * Instead of a COM port, the first argument can be the path of a tty device
+ * such as "/dev/ttyUSB0", or of the slave side of a pseudo-terminal, which
+ * is how the port can be tested without a device.
+ *
+ * From then on, the port is read in the background, and what arrives is
+ * split into frames. Each frame is published on the event bus as soon as
+ * it's complete, as
+ *
+ *     "rs232", "frame-received", "port", <port>, "data", <frame>
+ *
+ * and kept to be returned by `recv`. Optionally, the sixth argument can be
+ * a table which says how to find the frames:
+ *
+ *   - `delimiter`: each frame ends with this string, which isn't part of
+ *     the frame, such as "\r\n" or "\3".
+ *   - `header`: each frame starts with its length, as 'binary2' or
+ *     'binary4' (big-endian) or 'ascii2' or 'ascii4' (decimal digits).
+ *   - `max_size`: the longest frame expected; anything longer is thrown
+ *     away. 64 kB by default.
+ *
+ * Without either, each frame is whatever arrived together. `send` adds the
+ * same delimiter or header to what it sends.
+ *
  * If an error occurs, a string will be returned. Otherwise the return value
  * is `nil`.
- * 
+ *
  * Examples:
- * 
+ *
  *     rs232 = require('rs232')
  *     err = rs232.open('COM1', 9600, 'none', 8, 1)
  *     if err then print(err) end
  *
+ *     err = rs232.open('COM1', 9600, 'none', 8, 1, { delimiter = '\3' })
+ *     err = rs232.open('COM2', 115200, 'none', 8, 1, { header = 'binary2' })
+ *
+ *     zmq = require('lzmq')
+ *     events = zmq.sub('inproc://events/sub', 'rs232')
+ *     _, event, _, port, _, frame = events:recv(-1)
+ *
  */
 int rs232_open(lua_State *L) {
-  int port = decode_port(L, lua_tostring(L, 1));
+  const char *name = luaL_checkstring(L, 1);
+  int com = decode_port(L, name);
   int baud = atoi(lua_tostring(L, 2));
   const char *str_parity = lua_tostring(L, 3);
   int data_bits = atoi(lua_tostring(L, 4));
   int stop_bits = atoi(lua_tostring(L, 5));
   int parity;
+  rs232_port_t *port = NULL, *existing = NULL;
+  const char *err;
 
-  if (port == -1) return 1;
+  if (com == -1) return 1;
 
   switch(baud) {
     case 115200:
@@ -313,18 +882,55 @@ int rs232_open(lua_State *L) {
     return 1;
   }
 
+  port = (rs232_port_t *) calloc(1, sizeof(rs232_port_t));
+  port->name = strdup(name);
+  port->com = -1;
+  port->fd = -1;
+  port->owner = main_thread(L);
+  if ((err = read_framing(L, 6, port))) {
+    free_port(port);
+    lua_pushstring(L, err);
+    return 1;
+  }
 
-  int err = 0;
-  #if HAVE_CTOS
-    err = CTOS_RS232Open((BYTE) port, (ULONG) baud, (BYTE) parity,
-                         (BYTE) data_bits, (BYTE) stop_bits);
-    if (err != d_OK) return check_rs232_err(L, err);
-    // signal ready to send
-    err = CTOS_RS232SetRTS((BYTE) port, d_ON);
-  #else
-    (void) parity;
-  #endif
-  return check_rs232_err(L, err);
+  // claim the name before opening the device, so that no other state can
+  // open it meanwhile
+  pthread_mutex_lock(&ports_lock);
+  HASH_FIND_STR(ports, name, existing);
+  if (!existing) HASH_ADD_KEYPTR(hh, ports, port->name, strlen(port->name), port);
+  pthread_mutex_unlock(&ports_lock);
+  if (existing) {
+    free_port(port);
+    lua_pushstring(L, "port is already open");
+    return 1;
+  }
+
+  if (com == -2) {
+    if ((port->fd = open_tty(name, baud, parity, data_bits, stop_bits)) < 0) {
+      lua_pushstring(L, strerror(errno));
+      forget_port(port);
+      return 1;
+    }
+  } else {
+    #if HAVE_CTOS
+      int res = CTOS_RS232Open((BYTE) com, (ULONG) baud, (BYTE) parity,
+                               (BYTE) data_bits, (BYTE) stop_bits);
+      if (res != d_OK) {
+        forget_port(port);
+        return check_rs232_err(L, res);
+      }
+      port->com = com;
+      // signal ready to send
+      res = CTOS_RS232SetRTS((BYTE) com, d_ON);
+      if (res != d_OK) {
+        forget_port(port);
+        return check_rs232_err(L, res);
+      }
+    #endif
+  }
+
+  port->reader = zactor_new(port_reader, port);
+  return 0;
 }
 
 static const luaL_Reg rs232_methods[] = {
@@ -342,6 +948,16 @@ LUALIB_API int luaopen_rs232(lua_State *L) {
   return 1;
 }
 
+// closes the ports which this state opened, leaving those of other states
 void shutdown_rs232_lua(lua_State *L) {
-  (void) L;
+  lua_State *owner = main_thread(L);
+  rs232_port_t *port = NULL, *tmp = NULL;
+
+  pthread_mutex_lock(&ports_lock);
+  HASH_ITER(hh, ports, port, tmp) {
+    if (port->owner != owner) continue;
+    HASH_DEL(ports, port);
+    free_port(port);
+  }
+  pthread_mutex_unlock(&ports_lock);
 }
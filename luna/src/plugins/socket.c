@@ -1,8 +1,17 @@
 #define LUA_LIB
 #include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -11,20 +20,102 @@
 #include "lauxlib.h"
 #include "util/detokenize_template.h"
 #include "util/files.h"
+#include "util/resolver.h"
 #if HAVE_CTOS
 #include <ctosapi.h>
 #endif
 
+#define MAX_TLS_SESSIONS 32 // hosts remembered per TLS configuration
+#define RECV_CHUNK       4096 // the least room made in the buffer for each read
+#define MAX_MESSAGE_SIZE (1024 * 1024)
+#define ATTEMPT_DELAY    250  // ms before the next address is tried alongside
+#define LISTEN_BACKLOG   16
+
 extern char cacerts_bundle[PATH_MAX];
 
+typedef struct {
+  char *host;          // "host:port"
+  SSL_SESSION *session;
+  UT_hash_handle hh;
+} tls_session_t;
+
+/*
+ * A client context for each distinct TLS configuration, shared by all of the
+ * sockets which use it, so that the certificates are only loaded once, along
+ * with the last session negotiated with each host, so that connecting to it
+ * again can resume that session instead of doing a full handshake.
+ */
+typedef struct {
+  char *key;           // the CA bundle, certificate, private key and password
+  SSL_CTX *ctx;
+  int refs;            // open sockets using it
+  tls_session_t *sessions; // oldest first
+  UT_hash_handle hh;
+} tls_config_t;
+
+/*
+ * What a listening socket shares with the connections it accepts. It lasts
+ * as long as any of them are open, so that closing a connection after the
+ * listening socket can still be counted.
+ */
+typedef struct {
+  int refs;            // the listening socket's and each open connection's
+  int connections;     // accepted and still open
+  int max_connections; // or 0 for no limit
+  bool whitelisted_only; // turn away peers whose address isn't whitelisted
+} listener_t;
+
 typedef struct {
   char *human;
   int sockfd;
   SSL *ssl;
-  char *pem_password;
+  tls_config_t *config; // where the TLS session is remembered
+  char *host;          // "host:port", for TLS sockets
   bool is_secure;
+  bool connecting;     // the TCP connection hasn't been established yet
+  resolver_query_t *query; // while the host name is being looked up
+  resolver_addr_t addrs[RESOLVER_MAX_ADDRS]; // then, the addresses to try
+  int num_addrs;
+  int next_addr;
+  int port;
+  int attempts[RESOLVER_MAX_ADDRS]; // connections being attempted at once
+  int num_attempts;
+  int last_error;      // why the last attempt failed
+  long long next_attempt_at; // when to try the next address too, in ms; or -1
+  int epfd;            // watches the lookup and the attempts, while connecting
+  listener_t *listener; // for a listening socket and the connections it accepted
+  bool listening;
+  short waiting;       // POLLIN or POLLOUT while a call waits on the socket
+  long long deadline;  // when the current call times out, in ms; or -1
+  const char *out;     // what the current `send` has left to send
+  size_t out_len;
+  char *out_buffer;    // our own copy of what's being sent, if we made one
+  char *in;            // received data which hasn't been returned yet
+  size_t in_start;     // where it starts in the buffer
+  size_t in_len;
+  size_t in_cap;
+  size_t in_scanned;   // how much of it `recv_until` has already searched
 } lua_socket_t;
 
+// what each of the recv methods waits for
+typedef enum {
+  RECV_ANY,
+  RECV_EXACT,
+  RECV_UNTIL,
+  RECV_FRAME
+} recv_mode_t;
+
+// the length headers of `recv_frame` and `send_frame`
+static const char *const header_formats[] = { "binary2", "binary4",   "ascii2", "ascii4", NULL };
+static const size_t header_sizes[]        = { 2,         4,           2,        4 };
+static const size_t header_limits[]       = { 0xffff,    0xffffffff,  99,       9999 };
+
+typedef enum {
+  WAIT_READY,
+  WAIT_TIMEOUT,
+  WAIT_YIELD
+} wait_result_t;
+
 // Whitelist stuff copied from backend code. TODO remove duplication.
 //////////////////////////////////////////////////////////////////////////////
 typedef struct {
@@ -93,6 +184,267 @@ int pem_passwd_cb(char *buf, int size, int rwflag, void *password) {
   return strlen(buf);
 }
 
+// TLS contexts and sessions are shared by every Lua state.
+static tls_config_t *tls_configs = NULL;
+static pthread_mutex_t tls_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Returns the shared configuration for the given certificate, private key
+ * and password, any of which may be NULL, creating it if necessary, and
+ * takes a reference to it, which `release_tls_config()` gives back.
+ * `shutdown_socket_lua()` frees the configurations nobody is using.
+ */
+static tls_config_t *find_tls_config(const char *cert, const char *password, const char *privkey) {
+  tls_config_t *config = NULL;
+  char *key;
+
+  if (!cert)     cert = "";
+  if (!password) password = "";
+  if (!privkey)  privkey = "";
+  key = (char *) malloc(strlen(cacerts_bundle) + strlen(cert) + strlen(privkey) + strlen(password) + 4);
+  sprintf(key, "%s\n%s\n%s\n%s", cacerts_bundle, cert, privkey, password);
+
+  pthread_mutex_lock(&tls_lock);
+  HASH_FIND_STR(tls_configs, key, config);
+  if (config) {
+    config->refs++;
+    pthread_mutex_unlock(&tls_lock);
+    free(key);
+    return config;
+  }
+
+  SSL_CTX *ctx = SSL_CTX_new(TLSv1_2_method());
+  if (!ctx) {
+    pthread_mutex_unlock(&tls_lock);
+    free(key);
+    return NULL;
+  }
+  if (*cert)
+    SSL_CTX_use_certificate_file(ctx, cert, SSL_FILETYPE_PEM);
+  if (*password) {
+    SSL_CTX_set_default_passwd_cb(ctx, pem_passwd_cb);
+    SSL_CTX_set_default_passwd_cb_userdata(ctx, (void *) password);
+  }
+  if (*privkey)
+    SSL_CTX_use_PrivateKey_file(ctx, privkey, SSL_FILETYPE_PEM);
+  // the password is only needed while the key is loaded
+  SSL_CTX_set_default_passwd_cb_userdata(ctx, NULL);
+  SSL_CTX_load_verify_locations(ctx, cacerts_bundle, 0);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+
+  config = (tls_config_t *) calloc(1, sizeof(tls_config_t));
+  config->key = key;
+  config->ctx = ctx;
+  config->refs = 1;
+  HASH_ADD_KEYPTR(hh, tls_configs, config->key, strlen(config->key), config);
+  pthread_mutex_unlock(&tls_lock);
+  return config;
+}
+
+static void retain_tls_config(tls_config_t *config) {
+  pthread_mutex_lock(&tls_lock);
+  config->refs++;
+  pthread_mutex_unlock(&tls_lock);
+}
+
+static void release_tls_config(tls_config_t *config) {
+  pthread_mutex_lock(&tls_lock);
+  config->refs--;
+  pthread_mutex_unlock(&tls_lock);
+}
+
+static void free_tls_session(tls_config_t *config, tls_session_t *entry) {
+  HASH_DEL(config->sessions, entry);
+  SSL_SESSION_free(entry->session);
+  free(entry->host);
+  free(entry);
+}
+
+/*
+ * Offers the last session negotiated with the socket's host, if any, to
+ * resume in the handshake.
+ */
+static void offer_tls_session(lua_socket_t *lsock) {
+  tls_session_t *entry = NULL;
+  pthread_mutex_lock(&tls_lock);
+  HASH_FIND_STR(lsock->config->sessions, lsock->host, entry);
+  if (entry) SSL_set_session(lsock->ssl, entry->session);
+  pthread_mutex_unlock(&tls_lock);
+}
+
+/*
+ * Remembers the session negotiated by the handshake which just finished,
+ * or forgets the host's session if the handshake failed, so that it won't
+ * be offered again.
+ */
+static void keep_tls_session(lua_socket_t *lsock, bool succeeded) {
+  tls_session_t *entry = NULL;
+  // connections which were accepted have nothing to resume
+  if (!lsock->host) return;
+  pthread_mutex_lock(&tls_lock);
+  HASH_FIND_STR(lsock->config->sessions, lsock->host, entry);
+  if (succeeded && SSL_session_reused(lsock->ssl)) {
+    pthread_mutex_unlock(&tls_lock);
+    return;
+  }
+  if (entry) free_tls_session(lsock->config, entry);
+  if (succeeded) {
+    if (HASH_COUNT(lsock->config->sessions) >= MAX_TLS_SESSIONS)
+      free_tls_session(lsock->config, lsock->config->sessions);
+    entry = (tls_session_t *) calloc(1, sizeof(tls_session_t));
+    entry->host = strdup(lsock->host);
+    entry->session = SSL_get1_session(lsock->ssl);
+    HASH_ADD_KEYPTR(hh, lsock->config->sessions, entry->host, strlen(entry->host), entry);
+  }
+  pthread_mutex_unlock(&tls_lock);
+}
+
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long deadline_after(lua_Integer timeout) {
+  return timeout < 0 ? -1 : now_ms() + timeout;
+}
+
+static bool is_ready(int fd, short events) {
+  struct pollfd pfd = { fd, events, 0 };
+  return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * Returns what the socket must become ready for before a read or write which
+ * returned `n` can be retried: POLLIN, POLLOUT, or 0 if it failed. `events`
+ * is what a plain socket waits for; TLS may need the other direction.
+ */
+static short would_block(lua_socket_t *lsock, int n, short events) {
+  if (lsock->ssl) {
+    switch (SSL_get_error(lsock->ssl, n)) {
+      case SSL_ERROR_WANT_READ:  return POLLIN;
+      case SSL_ERROR_WANT_WRITE: return POLLOUT;
+      default:                   return 0;
+    }
+  }
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? events : 0;
+}
+
+/*
+ * The descriptor to wait on: while connecting, one which watches the host
+ * name lookup and every connection attempt at once.
+ */
+static int poll_fd(lua_socket_t *lsock) {
+  return lsock->epfd >= 0 ? lsock->epfd : lsock->sockfd;
+}
+
+/*
+ * When the socket next needs attention even if nothing happens to it: at
+ * the current call's deadline, or sooner if it's time to try connecting to
+ * another address. -1 if never.
+ */
+static long long wake_time(lua_socket_t *lsock) {
+  if (lsock->next_attempt_at >= 0 &&
+      (lsock->deadline < 0 || lsock->next_attempt_at < lsock->deadline))
+    return lsock->next_attempt_at;
+  return lsock->deadline;
+}
+
+/*
+ * Waits until the socket is ready for `events` or the current call's
+ * deadline passes. Inside a coroutine this never blocks: it returns
+ * WAIT_YIELD, and the caller yields with `yield_for()`.
+ */
+static wait_result_t wait_for(lua_State *L, lua_socket_t *lsock, short events) {
+  struct pollfd pfd = { poll_fd(lsock), events, 0 };
+  long long wake_at = wake_time(lsock), remaining;
+  int ret;
+
+  lsock->waiting = events;
+  if (lsock->deadline >= 0 && lsock->deadline <= now_ms()) return WAIT_TIMEOUT;
+  if (lua_isyieldable(L)) return WAIT_YIELD;
+  do {
+    remaining = wake_at < 0 ? -1 : wake_at - now_ms();
+    if (wake_at >= 0 && remaining < 0) remaining = 0;
+    ret = poll(&pfd, 1, (int) remaining);
+  } while (ret < 0 && errno == EINTR);
+  if (ret == 0 && lsock->deadline >= 0 && lsock->deadline <= now_ms()) return WAIT_TIMEOUT;
+  // on a poll error, let the read or write report what's wrong
+  return WAIT_READY;
+}
+
+/*
+ * Yields the socket at `index` and "read" or "write", for a scheduler to
+ * pass to `socket.wait()`. `k` carries on with the call once resumed.
+ */
+static int yield_for(lua_State *L, lua_socket_t *lsock, int index, lua_KContext ctx, lua_KFunction k) {
+  lua_pushvalue(L, index);
+  lua_pushstring(L, lsock->waiting == POLLIN ? "read" : "write");
+  return lua_yieldk(L, 2, ctx, k);
+}
+
+static void finish_call(lua_socket_t *lsock) {
+  if (lsock->out_buffer) free(lsock->out_buffer);
+  lsock->out_buffer = NULL;
+  lsock->out = NULL;
+  lsock->out_len = 0;
+  lsock->in_scanned = 0;
+  lsock->waiting = 0;
+  lsock->deadline = -1;
+}
+
+/*
+ * Gives up on the host name lookup and the connection attempts, if any.
+ */
+static void stop_connecting(lua_socket_t *lsock) {
+  int i;
+
+  if (lsock->epfd >= 0) {
+    close(lsock->epfd);
+    lsock->epfd = -1;
+  }
+  if (lsock->query) {
+    resolver_query_free(lsock->query);
+    lsock->query = NULL;
+  }
+  for (i = 0; i < lsock->num_attempts; i++) close(lsock->attempts[i]);
+  lsock->num_attempts = 0;
+  lsock->next_attempt_at = -1;
+}
+
+static void close_socket(lua_socket_t *lsock) {
+  finish_call(lsock);
+  if (lsock->in) {
+    free(lsock->in);
+    lsock->in = NULL;
+    lsock->in_start = lsock->in_len = lsock->in_cap = 0;
+  }
+  if (lsock->host) {
+    free(lsock->host);
+    lsock->host = NULL;
+  }
+  if (lsock->ssl) {
+    if (SSL_is_init_finished(lsock->ssl)) SSL_shutdown(lsock->ssl);
+    SSL_free(lsock->ssl);
+    lsock->ssl = NULL;
+  }
+  if (lsock->sockfd >= 0) {
+    close(lsock->sockfd);
+    lsock->sockfd = -1;
+  }
+  stop_connecting(lsock);
+  lsock->connecting = false;
+  if (lsock->listener) {
+    if (!lsock->listening) lsock->listener->connections--;
+    if (--lsock->listener->refs == 0) free(lsock->listener);
+    lsock->listener = NULL;
+  }
+  if (lsock->config) {
+    release_tls_config(lsock->config);
+    lsock->config = NULL;
+  }
+}
+
 /*
  * Closes the connection. Note that you don't have to do this explicitly,
  * because when the socket is garbage collected by Lua it will be closed.
@@ -109,18 +461,16 @@ int pem_passwd_cb(char *buf, int size, int rwflag, void *password) {
  */
 int socket_destroy(lua_State *L) {
   lua_socket_t *lsock = (lua_socket_t *) luaL_checkudata(L, 1, "LSocket");
-  if (lsock->pem_password) {
-    free(lsock->pem_password);
-    lsock->pem_password = NULL;
-  }
-  if (lsock->ssl) {
-    SSL_shutdown(lsock->ssl);
-    SSL_free(lsock->ssl);
-    lsock->ssl = NULL;
-  }
-  if (lsock->sockfd >= 0) {
-    close(lsock->sockfd);
-    lsock->sockfd = -1;
+  close_socket(lsock);
+  return 0;
+}
+
+static int socket_gc(lua_State *L) {
+  lua_socket_t *lsock = (lua_socket_t *) luaL_checkudata(L, 1, "LSocket");
+  close_socket(lsock);
+  if (lsock->human) {
+    free(lsock->human);
+    lsock->human = NULL;
   }
   return 0;
 }
@@ -131,12 +481,81 @@ int socket_tostring(lua_State *L) {
   return 1;
 }
 
+static int send_again(lua_State *L, int status, lua_KContext ctx) {
+  lua_socket_t *lsock = (lua_socket_t *) luaL_checkudata(L, 1, "LSocket");
+  short events;
+  int n;
+
+  while (lsock->out_len > 0) {
+    if (lsock->sockfd < 0) {
+      finish_call(lsock);
+      lua_pushstring(L, "socket is closed");
+      return 1;
+    }
+    if (lsock->ssl) n = SSL_write(lsock->ssl, lsock->out, lsock->out_len);
+    else            n = write(lsock->sockfd, lsock->out, lsock->out_len);
+    if (n > 0) {
+      lsock->out += n;
+      lsock->out_len -= n;
+      continue;
+    }
+
+    if (!(events = would_block(lsock, n, POLLOUT))) {
+      if (lsock->ssl) {
+        char errbuf[128];
+        memset(errbuf, 0, sizeof(errbuf));
+        lua_pushstring(L, ERR_error_string(SSL_get_error(lsock->ssl, n), errbuf));
+      } else {
+        lua_pushstring(L, strerror(errno));
+      }
+      finish_call(lsock);
+      return 1;
+    }
+    switch (wait_for(L, lsock, events)) {
+      case WAIT_READY:   break;
+      case WAIT_YIELD:   return yield_for(L, lsock, 1, 0, send_again);
+      case WAIT_TIMEOUT:
+        finish_call(lsock);
+        lua_pushstring(L, "timeout");
+        return 1;
+    }
+  }
+
+  finish_call(lsock);
+  return 0;
+}
+
+/*
+ * If the argument at `index` is an array of strings, replaces it with their
+ * concatenation, which costs far less than joining them up in Lua.
+ */
+static void join_parts(lua_State *L, int index) {
+  luaL_Buffer b;
+  lua_Integer i, n;
+
+  if (!lua_istable(L, index)) return;
+  n = luaL_len(L, index);
+  luaL_buffinit(L, &b);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, index, i);
+    if (!lua_isstring(L, -1)) luaL_error(L, "part %d is not a string", (int) i);
+    luaL_addvalue(&b);
+  }
+  luaL_pushresult(&b);
+  lua_replace(L, index);
+}
+
 /*
- * Sends data over the active TCP or TLS connection. If data can't immediately
- * be sent, this function will block until all of the data has been sent.
+ * Sends data over the active TCP or TLS connection. The data may be a
+ * string, or an array of strings to be sent one after the other. If data
+ * can't immediately be sent, this function will wait until all of the data
+ * has been sent, or for at most the number of milliseconds given as the
+ * second argument. Inside a coroutine it yields instead of blocking while
+ * it waits; see `socket.wait()`.
  *
- * If some unrecoverable error occurs, it will be returned as a string.
- * Otherwise `nil` is returned.
+ * If some unrecoverable error occurs, it will be returned as a string, or
+ * "timeout" if the time ran out, in which case some of the data may have
+ * been sent. Otherwise `nil` is returned.
  *
  * Examples:
  * 
@@ -145,222 +564,846 @@ int socket_tostring(lua_State *L) {
  *     err = sock:send("data")
  *
  *     sock = socket.tls('192.168.0.1', 8090)
- *     err = sock:send("data")
+ *     err = sock:send("data", 5000)
+ *     err = sock:send({ header, body, trailer }, 5000)
  *
  */
 int socket_send(lua_State *L) {
   lua_socket_t *lsock = (lua_socket_t *) luaL_checkudata(L, 1, "LSocket");
+  lua_Integer timeout = luaL_optinteger(L, 3, -1);
+  const char *buffer;
   size_t len;
-  const char *buffer = lua_tolstring(L, 2, &len);
-  char *detokenized = NULL;
+
+  join_parts(L, 2);
+  buffer = luaL_checklstring(L, 2, &len);
+  if (lsock->waiting) {
+    lua_pushstring(L, "socket is busy");
+    return 1;
+  }
   if (lsock->is_secure) {
-    detokenized = detokenize_template(buffer, &len);
-    buffer = detokenized;
-    if (!detokenized) {
+    lsock->out_buffer = detokenize_template(buffer, &len);
+    buffer = lsock->out_buffer;
+    if (!lsock->out_buffer) {
       lua_pushstring(L, "couldn't detokenize template");
       return 1;
     }
   }
 
-  while (len > 0) {
-    int n;
-    if (lsock->ssl) {
-      n = SSL_write(lsock->ssl, buffer, len);
-      if (n <= 0) {
-        if (detokenized) free(detokenized);
-        char errbuf[128];
-        memset(errbuf, 0, sizeof(errbuf));
-        lua_pushstring(L, ERR_error_string(SSL_get_error(lsock->ssl, n), errbuf));
-        return 1;
-      } else {
-        len -= n;
-        buffer += n;
-      }
-    } else {
-      n = write(lsock->sockfd, buffer, len);
-      if (n < 0) {
-        switch(errno) {
-          case EAGAIN:
-            break;
-          default:
-            if (detokenized) free(detokenized);
-            lua_pushstring(L, strerror(errno));
-            return 1;
-        }
-      } else {
-        len -= n;
-        buffer += n;
-      }
-    }
-  }
-
-  if (detokenized) free(detokenized);
-  return 0;
+  // the data stays on the stack, and so in place, until the call returns
+  lua_settop(L, 2);
+  lsock->out = buffer;
+  lsock->out_len = len;
+  lsock->deadline = deadline_after(timeout);
+  return send_again(L, 0, 0);
 }
 
 /*
- * Receives data over the active TCP or TLS connection. Blocks until data is
- * available if data is not initially available.
+ * Sends a message preceded by its length, as `recv_frame` receives it. The
+ * first argument is the format of the length header, and the others are as
+ * for `send`. The length is that of the message as it is sent: for a
+ * secure socket, after its tokens have been detokenized.
  *
- * If some unrecoverable error occurs while reading, it will be returned as
- * the second argument and the first argument will be `nil`.
- *
- * NOTE: Although this method will block until data is ready, it does not
- * make any guarantees about how much data will be returned. If only a portion
- * of an underlying message is available, then that portion will be returned
- * without waiting for the remainder of the message. This is because the
- * `recv` method does not know anything about the underlying messages that it
- * is receiving. For example, it does not know if it's dealing with JSON, XML
- * or line-buffered data. Up to 4096 bytes of data will be returned in a
- * single call, and you should always perform your own checks before assuming
- * that the data you received constitutes a complete message.
+ * If the message is too long for the header, or longer than the 1MB that
+ * `recv_frame` accepts, nothing is sent and the error is "message is too
+ * long".
  *
  * Examples:
- * 
- *     -- Holds unprocessed messages. Data will be accumulated here and then
- *     -- removed from here as message delimiters are discovered.
- *     buffered_messages = ''
- *     
- *     -- Reads 1 message, assuming each new line represents the end of a
- *     -- message. If a portion of another message is received, buffer it
- *     -- so that the rest can be received later. If a socket error occurs,
- *     -- `nil` is returned and the error is returned as a second argument.
- *     function recv_message(sock)
- *       while true do
- *         data, err = sock:recv()
- *         if err then
- *           return nil, err
- *         else
- *           buffered_messages = buffered_messages .. data
- *         end
- *         delimiter = data:find("\n")
- *         if delimeter > 0 then
- *           message = data:sub(1, delimiter)
- *           buffered_messages = data:sub(index + 1, #buffered_messages)
- *           return message
- *         end
- *       end
- *     end
  *
  *     socket = require('socket')
- *     sock = socket.tcp('www.google.com', 443)
- *     message, err = recv_message(sock)
+ *     sock = socket.tls('192.168.0.1', 8090)
+ *     err = sock:send_frame('binary2', { mti, bitmap, fields }, 5000)
  *
  */
-int socket_recv(lua_State *L) {
-  while (true) {
-    lua_socket_t *lsock = (lua_socket_t *) luaL_checkudata(L, 1, "LSocket");
-    char buf[4096];
-    ssize_t len;
-    if (lsock->ssl) {
-      len = SSL_read(lsock->ssl, buf, 4096);
-      if (len <= 0) {
-        lua_pushnil(L);
-        char errbuf[128];
-        memset(errbuf, 0, sizeof(errbuf));
-        lua_pushstring(L, ERR_error_string(SSL_get_error(lsock->ssl, len), errbuf));
-        return 2;
-      } else {
-        lua_pushlstring(L, buf, len);
+int socket_send_frame(lua_State *L) {
+  lua_socket_t *lsock = (lua_socket_t *) luaL_checkudata(L, 1, "LSocket");
+  int format = luaL_checkoption(L, 2, NULL, header_formats);
+  lua_Integer timeout = luaL_optinteger(L, 4, -1);
+  size_t header = header_sizes[format], len, n, i;
+  char *detokenized = NULL, *frame;
+  const char *data;
+
+  join_parts(L, 3);
+  data = luaL_checklstring(L, 3, &len);
+  if (lsock->waiting) {
+    lua_pushstring(L, "socket is busy");
+    return 1;
+  }
+  if (lsock->is_secure) {
+    if (!(detokenized = detokenize_template(data, &len))) {
+      lua_pushstring(L, "couldn't detokenize template");
+      return 1;
+    }
+    data = detokenized;
+  }
+  if (len > header_limits[format] || len > MAX_MESSAGE_SIZE) {
+    if (detokenized) free(detokenized);
+    lua_pushstring(L, "message is too long");
+    return 1;
+  }
+
+  frame = (char *) malloc(header + len);
+  for (i = header, n = len; i-- > 0; n /= format < 2 ? 256 : 10)
+    frame[i] = format < 2 ? (char) (n & 0xff) : (char) ('0' + n % 10);
+  memcpy(frame + header, data, len);
+  if (detokenized) free(detokenized);
+
+  lsock->out_buffer = frame;
+  lsock->out = frame;
+  lsock->out_len = header + len;
+  lsock->deadline = deadline_after(timeout);
+  return send_again(L, 0, 0);
+}
+
+// memmem(), which isn't available everywhere
+static const char *find_bytes(const char *data, size_t len, const char *what, size_t what_len) {
+  const char *p = data, *last;
+
+  if (len < what_len) return NULL;
+  last = data + len - what_len;
+  while ((p = memchr(p, what[0], last - p + 1))) {
+    if (!memcmp(p, what, what_len)) return p;
+    if (++p > last) break;
+  }
+  return NULL;
+}
+
+/*
+ * Looks for a whole message at the start of the received data, as the
+ * current recv call wants it: whatever there is, the number of bytes given
+ * as its argument, up to the delimiter given as its argument, or after a
+ * length header in the format given as its argument. Returns 1 and sets
+ * `skip`, `len` and `used` to where in the data the message starts, its
+ * length and how much of the data it and its header or delimiter take up;
+ * 0 if more data is needed; or -1 and sets `err` if the data can't be what
+ * was asked for.
+ */
+static int find_message(lua_State *L, lua_socket_t *lsock, recv_mode_t mode,
+                        size_t *skip, size_t *len, size_t *used, const char **err) {
+  const char *data = lsock->in + lsock->in_start, *found;
+  size_t have = lsock->in_len, delim_len, from, header, n, i;
+  const char *delim;
+  int format;
+
+  *skip = 0;
+  switch (mode) {
+    case RECV_ANY:
+      *len = *used = have;
+      return have > 0;
+
+    case RECV_EXACT:
+      *len = *used = (size_t) lua_tointeger(L, 2);
+      return have >= *len;
+
+    case RECV_UNTIL:
+      delim = lua_tolstring(L, 2, &delim_len);
+      // the delimiter may straddle what was searched and what has arrived since
+      from = lsock->in_scanned >= delim_len ? lsock->in_scanned - delim_len + 1 : 0;
+      if ((found = find_bytes(data + from, have - from, delim, delim_len))) {
+        *len = found - data;
+        *used = *len + delim_len;
         return 1;
       }
-    } else {
-      len = read(lsock->sockfd, buf, 4096);
-      if (len < 0) {
-        switch(errno) {
-          case EAGAIN:
-            break;
-          default:
-            lua_pushnil(L);
-            lua_pushstring(L, strerror(errno));
-            return 2;
+      lsock->in_scanned = have;
+      if (have >= MAX_MESSAGE_SIZE + delim_len) {
+        *err = "message is too long";
+        return -1;
+      }
+      return 0;
+
+    case RECV_FRAME:
+      format = (int) lua_tointeger(L, 2);
+      header = header_sizes[format];
+      if (have < header) return 0;
+      for (i = n = 0; i < header; i++) {
+        unsigned char c = (unsigned char) data[i];
+        if (format < 2) {
+          n = (n << 8) | c;
+        } else if (c >= '0' && c <= '9') {
+          n = n * 10 + (c - '0');
+        } else {
+          *err = "invalid length header";
+          return -1;
         }
-      } else {
-        lua_pushlstring(L, buf, len);
-        return 1;
       }
-    }
+      if (n > MAX_MESSAGE_SIZE) {
+        *err = "message is too long";
+        return -1;
+      }
+      *skip = header;
+      *len = n;
+      *used = header + n;
+      return have >= *used;
   }
+  return 0;
 }
 
 /*
- * Returns `true` if the socket is a TLS connection *and* the host to which it
- * is connected is present in the whitelist.
- *
- *     socket = require('socket')
- *     sock = socket.tls('www.google.com', 443)
- *     print(sock:is_secure())
- *
+ * Reads whatever has arrived into the receive buffer, after making room in
+ * it for at least RECV_CHUNK bytes. Returns what `read()` or `SSL_read()`
+ * did.
  */
-int socket_is_secure(lua_State *L) {
-  lua_socket_t *lsock = (lua_socket_t *) luaL_checkudata(L, 1, "LSocket");
-  lua_pushboolean(L, lsock->is_secure);
-  return 1;
-}
+static int fill_buffer(lua_socket_t *lsock) {
+  size_t end;
+  int n;
 
-lua_socket_t *lsocket_new_generic(lua_State *L) {
-  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (sockfd < 0) {
-    lua_pushnil(L);
-    lua_pushstring(L, strerror(errno));
-    return NULL;
+  if (lsock->in_start > 0 && lsock->in_cap - lsock->in_start - lsock->in_len < RECV_CHUNK) {
+    memmove(lsock->in, lsock->in + lsock->in_start, lsock->in_len);
+    lsock->in_start = 0;
   }
-
-  struct hostent *server = gethostbyname(lua_tostring(L, 1));
-  if (server == NULL) {
-    lua_pushnil(L);
-    lua_pushstring(L, "host not found");
-    close(sockfd);
-    return NULL;
+  if (lsock->in_cap - lsock->in_len < RECV_CHUNK) {
+    while (lsock->in_cap - lsock->in_len < RECV_CHUNK)
+      lsock->in_cap = lsock->in_cap ? lsock->in_cap * 2 : 4 * RECV_CHUNK;
+    lsock->in = (char *) realloc(lsock->in, lsock->in_cap);
   }
-  int portno = lua_tonumber(L, 2);
 
-  struct sockaddr_in serv_addr;
-  memset(&serv_addr, 0, sizeof(serv_addr));
-  serv_addr.sin_family = AF_INET;
-  memcpy(&serv_addr.sin_addr.s_addr, server->h_addr, server->h_length);
-  serv_addr.sin_port = htons(portno);
-  if (connect(sockfd,(struct sockaddr *) &serv_addr,sizeof(serv_addr)) < 0) {
-    lua_pushnil(L);
-    lua_pushfstring(L, "connect failed: %s", strerror(errno));
-    close(sockfd);
-    return NULL;
+  end = lsock->in_start + lsock->in_len;
+  if (lsock->ssl) n = SSL_read(lsock->ssl, lsock->in + end, (int) (lsock->in_cap - end));
+  else            n = read(lsock->sockfd, lsock->in + end, lsock->in_cap - end);
+  if (n > 0) lsock->in_len += n;
+  return n;
+}
+
+static void consume(lua_socket_t *lsock, size_t used) {
+  lsock->in_start += used;
+  lsock->in_len -= used;
+  if (lsock->in_len == 0) {
+    lsock->in_start = 0;
+    // don't hold on to the room that a long message needed
+    if (lsock->in_cap > 4 * RECV_CHUNK) {
+      free(lsock->in);
+      lsock->in = NULL;
+      lsock->in_cap = 0;
+    }
   }
+}
 
-  lua_socket_t *lsock = (lua_socket_t *) lua_newuserdata(L, sizeof(lua_socket_t));
-  lsock->human = malloc(strlen(lua_tostring(L, 1)) + strlen(lua_tostring(L, 2)) + 32);
-  lsock->sockfd = sockfd;
-  lsock->pem_password = NULL;
-  lsock->ssl = NULL;
-  lsock->is_secure = false;
-  sprintf(lsock->human, "<tcp %s:%s>", lua_tostring(L, 1), lua_tostring(L, 2));
+static int recv_failed(lua_State *L, lua_socket_t *lsock, const char *err) {
+  lua_pushnil(L);
+  lua_pushstring(L, err);
+  finish_call(lsock);
+  return 2;
+}
 
-  // Add the metatable to the stack.
-  luaL_getmetatable(L, "LSocket");
-  // Set the metatable on the userdata.
-  lua_setmetatable(L, -2);
+static int recv_again(lua_State *L, int status, lua_KContext mode) {
+  lua_socket_t *lsock = (lua_socket_t *) luaL_checkudata(L, 1, "LSocket");
+  size_t skip, len, used;
+  const char *err = NULL;
+  short events;
+  int n;
 
-  return lsock;
+  while (true) {
+    if (lsock->sockfd < 0) return recv_failed(L, lsock, "socket is closed");
+    switch (find_message(L, lsock, (recv_mode_t) mode, &skip, &len, &used, &err)) {
+      case 1:
+        lua_pushlstring(L, lsock->in + lsock->in_start + skip, len);
+        consume(lsock, used);
+        finish_call(lsock);
+        return 1;
+      case -1:
+        return recv_failed(L, lsock, err);
+    }
+
+    if ((n = fill_buffer(lsock)) > 0) continue;
+    if (n == 0) {
+      if (mode != RECV_ANY || lsock->ssl) return recv_failed(L, lsock, "closed");
+      // `recv` has always returned an empty string at the end of a TCP stream
+      finish_call(lsock);
+      lua_pushliteral(L, "");
+      return 1;
+    }
+
+    if (!(events = would_block(lsock, n, POLLIN))) {
+      if (lsock->ssl) {
+        char errbuf[128];
+        memset(errbuf, 0, sizeof(errbuf));
+        return recv_failed(L, lsock, ERR_error_string(SSL_get_error(lsock->ssl, n), errbuf));
+      }
+      return recv_failed(L, lsock, strerror(errno));
+    }
+    switch (wait_for(L, lsock, events)) {
+      case WAIT_READY:   break;
+      case WAIT_YIELD:   return yield_for(L, lsock, 1, mode, recv_again);
+      case WAIT_TIMEOUT: return recv_failed(L, lsock, "timeout");
+    }
+  }
 }
 
 /*
- * Creates a new TCP socket connection to the specified host and port. Note:
- * Raw TCP sockets are not a secure form of communication, so sensitive data
- * will not be transmitted.
- *
- * Returns `nil` if the socket cannot be created. A second return value
- * contains an error message as a string.
+ * Starts a recv call, whose argument, if it has one, is at index 2.
+ */
+static int start_recv(lua_State *L, int top, lua_Integer timeout, recv_mode_t mode) {
+  lua_socket_t *lsock = (lua_socket_t *) luaL_checkudata(L, 1, "LSocket");
+
+  if (lsock->waiting) {
+    lua_pushnil(L);
+    lua_pushstring(L, "socket is busy");
+    return 2;
+  }
+  lua_settop(L, top);
+  lsock->deadline = deadline_after(timeout);
+  return recv_again(L, 0, mode);
+}
+
+/*
+ * Receives data over the active TCP or TLS connection. Waits until data is
+ * available if data is not initially available, for at most the number of
+ * milliseconds given as the first argument, if any. Inside a coroutine it
+ * yields instead of blocking while it waits; see `socket.wait()`.
+ *
+ * If some unrecoverable error occurs while reading, it will be returned as
+ * the second argument and the first argument will be `nil`. If the time
+ * runs out, the second argument is "timeout". Once the other end has
+ * closed the connection, a TCP socket returns an empty string and a TLS
+ * socket returns "closed" as the error.
+ *
+ * NOTE: Although this method will wait until data is ready, it does not
+ * make any guarantees about how much data will be returned. It returns
+ * whatever has arrived, which may be part of a message or more than one.
+ * To receive whole messages, use `recv_exact`, `recv_until` or
+ * `recv_frame`, which wait for the rest of a message without the script
+ * having to piece it together.
+ *
+ * Examples:
+ * 
+ *     socket = require('socket')
+ *     sock = socket.tcp('192.168.0.1', 8090)
+ *     data, err = sock:recv()
+ *     data, err = sock:recv(5000)
+ *
+ */
+int socket_recv(lua_State *L) {
+  return start_recv(L, 1, luaL_optinteger(L, 2, -1), RECV_ANY);
+}
+
+/*
+ * Receives exactly the given number of bytes, waiting for at most the number
+ * of milliseconds given as the second argument, if any, for them all to
+ * arrive. Anything received after them is kept for the next call.
+ *
+ * Errors are returned as for `recv`, but if the connection is closed before
+ * all of the bytes arrive, the error is "closed". At most 1MB can be
+ * received at once.
+ *
+ * Examples:
+ *
+ *     socket = require('socket')
+ *     sock = socket.tls('192.168.0.1', 8090)
+ *     header, err = sock:recv_exact(12, 5000)
+ *
+ */
+int socket_recv_exact(lua_State *L) {
+  lua_Integer n = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, n >= 0 && n <= MAX_MESSAGE_SIZE, 2, "invalid length");
+  return start_recv(L, 2, luaL_optinteger(L, 3, -1), RECV_EXACT);
+}
+
+/*
+ * Receives everything up to the given delimiter, waiting for at most the
+ * number of milliseconds given as the second argument, if any. The data is
+ * returned without the delimiter, which is discarded; anything after it is
+ * kept for the next call.
+ *
+ * Errors are returned as for `recv_exact`. If no delimiter turns up in the
+ * first 1MB, the error is "message is too long".
+ *
+ * Examples:
+ *
+ *     socket = require('socket')
+ *     sock = socket.tcp('192.168.0.1', 8090)
+ *     line, err = sock:recv_until("\r\n", 5000)
+ *
+ */
+int socket_recv_until(lua_State *L) {
+  size_t len;
+  luaL_checklstring(L, 2, &len);
+  luaL_argcheck(L, len > 0, 2, "empty delimiter");
+  return start_recv(L, 2, luaL_optinteger(L, 3, -1), RECV_UNTIL);
+}
+
+/*
+ * Receives one message preceded by its length, as many hosts frame them,
+ * ISO8583 hosts among them. The first argument is the format of the length
+ * header:
+ *
+ *   * "binary2" - 2 bytes, big-endian
+ *   * "binary4" - 4 bytes, big-endian
+ *   * "ascii2"  - 2 decimal digits
+ *   * "ascii4"  - 4 decimal digits
+ *
+ * The message is returned without its header, after waiting for at most the
+ * number of milliseconds given as the second argument, if any.
+ *
+ * Errors are returned as for `recv_exact`. If the header isn't a valid
+ * length, the error is "invalid length header"; if it's longer than 1MB,
+ * "message is too long". There's no telling where the next message starts
+ * after either of those, so the connection should then be closed.
+ *
+ * See also `send_frame`.
+ *
+ * Examples:
+ *
+ *     socket = require('socket')
+ *     sock = socket.tls('192.168.0.1', 8090)
+ *     sock:send_frame('binary2', request)
+ *     response, err = sock:recv_frame('binary2', 30000)
+ *
+ */
+int socket_recv_frame(lua_State *L) {
+  int format = luaL_checkoption(L, 2, NULL, header_formats);
+  lua_pushinteger(L, format);
+  lua_replace(L, 2);
+  return start_recv(L, 2, luaL_optinteger(L, 3, -1), RECV_FRAME);
+}
+
+/*
+ * Returns `true` if the socket is a TLS connection *and* the host to which it
+ * is connected is present in the whitelist.
+ *
+ *     socket = require('socket')
+ *     sock = socket.tls('www.google.com', 443)
+ *     print(sock:is_secure())
+ *
+ */
+int socket_is_secure(lua_State *L) {
+  lua_socket_t *lsock = (lua_socket_t *) luaL_checkudata(L, 1, "LSocket");
+  lua_pushboolean(L, lsock->is_secure);
+  return 1;
+}
+
+/*
+ * Returns `true` if the socket is a TLS connection which resumed the session
+ * of an earlier connection to the same host, rather than doing a full
+ * handshake.
+ *
+ *     socket = require('socket')
+ *     socket.tls('www.google.com', 443):close()
+ *     sock = socket.tls('www.google.com', 443)
+ *     print(sock:is_resumed())
+ *
+ */
+int socket_is_resumed(lua_State *L) {
+  lua_socket_t *lsock = (lua_socket_t *) luaL_checkudata(L, 1, "LSocket");
+  lua_pushboolean(L, lsock->ssl && SSL_session_reused(lsock->ssl));
+  return 1;
+}
+
+/*
+ * Gives up on the call waiting on this socket, as though its time had run
+ * out, so that the socket can be used again: whatever a send hadn't written
+ * yet is dropped, and what a recv had read stays buffered for the next one.
+ * A socket which was still connecting is closed. This is how the reactor
+ * lets go of the socket when it cancels the task which was waiting on it;
+ * see `reactor.cancel()`.
+ *
+ *     socket = require('socket')
+ *     sock = socket.tcp('192.168.0.1', 8090)
+ *     sock:abandon()
+ *
+ */
+int socket_abandon(lua_State *L) {
+  lua_socket_t *lsock = (lua_socket_t *) luaL_checkudata(L, 1, "LSocket");
+
+  if (lsock->connecting || (lsock->ssl && !SSL_is_init_finished(lsock->ssl)))
+    close_socket(lsock);
+  else
+    finish_call(lsock);
+  return 0;
+}
+
+/*
+ * Returns what a scheduler polls to wait for this socket: its descriptor,
+ * "read" or "write", and the number of milliseconds before the call waiting
+ * on it needs attention anyway, or `nil` if there's no limit. Returns
+ * nothing once the socket is closed. This is how the reactor waits for the
+ * sockets which its tasks yield; see `reactor.spawn()`.
+ *
+ *     socket = require('socket')
+ *     sock = socket.tcp('192.168.0.1', 8090)
+ *     fd, what, timeout = sock:waitable()
+ *
+ */
+int socket_waitable(lua_State *L) {
+  lua_socket_t *lsock = (lua_socket_t *) luaL_checkudata(L, 1, "LSocket");
+  long long wake_at = wake_time(lsock), now;
+
+  if (poll_fd(lsock) < 0) return 0;
+  lua_pushinteger(L, poll_fd(lsock));
+  lua_pushstring(L, lsock->waiting == POLLOUT ? "write" : "read");
+  if (wake_at < 0) {
+    lua_pushnil(L);
+  } else {
+    now = now_ms();
+    lua_pushinteger(L, wake_at > now ? wake_at - now : 0);
+  }
+  return 3;
+}
+
+/*
+ * Waits until at least one of an array of sockets is ready for the call
+ * which is waiting on it, or until that call's time runs out, or for at
+ * most the number of milliseconds given as the second argument. Returns an
+ * array of those sockets, which may be empty if the time ran out. Sockets
+ * with no call waiting on them are returned straight away.
+ *
+ * Inside a coroutine, `socket.tcp()`, `socket.tls()`, `accept()`, `send()`
+ * and the `recv` methods never block. When they would, they yield the
+ * socket and "read" or "write" instead, and carry on when the coroutine is
+ * resumed. This is how a scheduler can run several conversations at once without busy
+ * waiting: it resumes a coroutine whenever `socket.wait()` returns the
+ * socket which that coroutine yielded. The reactor is such a scheduler, and
+ * waits on zmq sockets and timers alongside; see `reactor.spawn()`.
+ *
+ * Examples:
+ *
+ *     socket = require('socket')
+ *     waiting = {}   -- coroutines, by the socket they're waiting on
+ *
+ *     function run(co)
+ *       local ok, sock = assert(coroutine.resume(co))
+ *       if sock then waiting[sock] = co end
+ *     end
+ *
+ *     run(coroutine.create(function()
+ *       local sock = assert(socket.tcp('192.168.0.1', 8090, 5000))
+ *       sock:send("request", 5000)
+ *       print(sock:recv(5000))
+ *     end))
+ *
+ *     while next(waiting) do
+ *       local socks = {}
+ *       for sock in pairs(waiting) do socks[#socks + 1] = sock end
+ *       for _, sock in ipairs(socket.wait(socks)) do
+ *         local co = waiting[sock]
+ *         waiting[sock] = nil
+ *         run(co)
+ *       end
+ *     end
+ *
+ */
+int socket_wait(lua_State *L) {
+  lua_Integer timeout = luaL_optinteger(L, 2, -1);
+  long long wake_at = deadline_after(timeout), now;
+  struct pollfd *pfds;
+  lua_socket_t *lsock;
+  int n, i, ret, found = 0;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = (int) luaL_len(L, 1);
+  pfds = (struct pollfd *) lua_newuserdata(L, (n ? n : 1) * sizeof(struct pollfd));
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    lsock = (lua_socket_t *) luaL_checkudata(L, -1, "LSocket");
+    lua_pop(L, 1);
+    pfds[i].fd = lsock->waiting ? poll_fd(lsock) : -1;
+    pfds[i].events = lsock->waiting;
+    pfds[i].revents = 0;
+    if (!lsock->waiting) wake_at = 0;
+    else if (wake_time(lsock) >= 0 && (wake_at < 0 || wake_time(lsock) < wake_at))
+      wake_at = wake_time(lsock);
+  }
+
+  do {
+    now = now_ms();
+    ret = poll(pfds, n, wake_at < 0 ? -1 : wake_at > now ? (int) (wake_at - now) : 0);
+  } while (ret < 0 && errno == EINTR);
+
+  now = now_ms();
+  lua_newtable(L);
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    lsock = (lua_socket_t *) lua_touserdata(L, -1);
+    if (!lsock->waiting || pfds[i].revents ||
+        (wake_time(lsock) >= 0 && now >= wake_time(lsock)))
+      lua_rawseti(L, -2, ++found);
+    else
+      lua_pop(L, 1);
+  }
+  return 1;
+}
+
+/*
+ * Returns the connection timeout, in milliseconds, which may follow the
+ * other arguments, and removes it from the stack; or -1 if there isn't one.
+ */
+static lua_Integer pop_timeout(lua_State *L) {
+  int top = lua_gettop(L);
+  lua_Integer timeout = -1;
+  if (top > 2 && lua_type(L, top) == LUA_TNUMBER) {
+    timeout = lua_tointeger(L, top);
+    lua_settop(L, top - 1);
+  }
+  return timeout;
+}
+
+/*
+ * Orders the addresses so that IPv6 and IPv4 take turns, starting with
+ * whichever came first, as RFC 8305 recommends: if one family can't be
+ * reached, the next attempt uses the other.
+ */
+static void interleave_families(resolver_addr_t *addrs, int n) {
+  resolver_addr_t sorted[RESOLVER_MAX_ADDRS];
+  int used[RESOLVER_MAX_ADDRS] = { 0 }, family = addrs[0].family, i, j;
+
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < n && (used[j] || addrs[j].family != family); j++);
+    // once one family runs out, the rest are of the other
+    if (j == n) for (j = 0; used[j]; j++);
+    sorted[i] = addrs[j];
+    used[j] = 1;
+    family = addrs[j].family == AF_INET6 ? AF_INET : AF_INET6;
+  }
+  memcpy(addrs, sorted, n * sizeof(resolver_addr_t));
+}
+
+/*
+ * Starts connecting to the next address. Returns -1, with `last_error` set,
+ * if that failed straight away.
+ */
+static int start_attempt(lua_socket_t *lsock) {
+  resolver_addr_t *addr = &lsock->addrs[lsock->next_addr++];
+  struct epoll_event event = { EPOLLOUT, { 0 } };
+  struct sockaddr_storage sa;
+  struct sockaddr_in *sin = (struct sockaddr_in *) &sa;
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &sa;
+  socklen_t len;
+  int fd;
+
+  memset(&sa, 0, sizeof(sa));
+  if (addr->family == AF_INET6) {
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(lsock->port);
+    inet_pton(AF_INET6, addr->ip, &sin6->sin6_addr);
+    len = sizeof(*sin6);
+  } else {
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(lsock->port);
+    inet_pton(AF_INET, addr->ip, &sin->sin_addr);
+    len = sizeof(*sin);
+  }
+
+  if ((fd = socket(addr->family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+    lsock->last_error = errno;
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *) &sa, len) < 0 && errno != EINPROGRESS) {
+    lsock->last_error = errno;
+    close(fd);
+    return -1;
+  }
+  event.data.fd = fd;
+  epoll_ctl(lsock->epfd, EPOLL_CTL_ADD, fd, &event);
+  lsock->attempts[lsock->num_attempts++] = fd;
+  return 0;
+}
+
+/*
+ * Takes the connection attempt at `i` for the socket, and abandons the rest.
+ */
+static void use_attempt(lua_socket_t *lsock, int i) {
+  lsock->sockfd = lsock->attempts[i];
+  lsock->attempts[i] = lsock->attempts[--lsock->num_attempts];
+  stop_connecting(lsock);
+  lsock->connecting = false;
+}
+
+/*
+ * Moves the connection along as far as it can go without waiting: takes the
+ * addresses once the host name has been looked up, sees whether any of the
+ * attempts in progress has connected or failed, and starts the next when
+ * it's time, without waiting for the others to give up. Returns 1 once
+ * connected, 0 if there's nothing to do but wait, or -1 if there's nothing
+ * left to try, with the reason in `err`.
+ */
+static int advance_connect(lua_socket_t *lsock, char *err, size_t err_len) {
+  socklen_t len;
+  int i, n;
+
+  if (lsock->query) {
+    if ((n = resolver_query_result(lsock->query, lsock->addrs, RESOLVER_MAX_ADDRS)) < 0) return 0;
+    if (resolver_query_fd(lsock->query) >= 0)
+      epoll_ctl(lsock->epfd, EPOLL_CTL_DEL, resolver_query_fd(lsock->query), NULL);
+    resolver_query_free(lsock->query);
+    lsock->query = NULL;
+    if (n == 0) {
+      snprintf(err, err_len, "host not found");
+      return -1;
+    }
+    interleave_families(lsock->addrs, n);
+    lsock->num_addrs = n;
+    lsock->next_attempt_at = now_ms();
+  }
+
+  while (true) {
+    for (i = 0; i < lsock->num_attempts; ) {
+      if (!is_ready(lsock->attempts[i], POLLOUT)) {
+        i++;
+        continue;
+      }
+      len = sizeof(n);
+      if (getsockopt(lsock->attempts[i], SOL_SOCKET, SO_ERROR, &n, &len) < 0) n = errno;
+      if (!n) {
+        use_attempt(lsock, i);
+        return 1;
+      }
+      // the next address needn't wait for the delay, then
+      lsock->last_error = n;
+      close(lsock->attempts[i]);
+      lsock->attempts[i] = lsock->attempts[--lsock->num_attempts];
+      lsock->next_attempt_at = now_ms();
+    }
+
+    if (lsock->next_addr < lsock->num_addrs && now_ms() >= lsock->next_attempt_at) {
+      if (start_attempt(lsock) == 0) lsock->next_attempt_at = now_ms() + ATTEMPT_DELAY;
+      continue;
+    }
+    break;
+  }
+
+  if (lsock->next_addr >= lsock->num_addrs) {
+    lsock->next_attempt_at = -1;
+    if (lsock->num_attempts == 0) {
+      snprintf(err, err_len, "connect failed: %s", strerror(lsock->last_error));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Starts looking up the host given as the first argument, to connect to the
+ * port given as the second, and pushes the new socket; `socket_open()`
+ * finishes the job. On failure, pushes nil and an error instead, and
+ * returns NULL.
+ */
+lua_socket_t *lsocket_new_generic(lua_State *L, lua_Integer timeout) {
+  const char *host = luaL_checkstring(L, 1);
+  lua_Integer port = luaL_checkinteger(L, 2);
+  struct epoll_event event = { EPOLLIN, { 0 } };
+  int epfd;
+
+  if (port <= 0 || port > 65535) {
+    lua_pushnil(L);
+    lua_pushstring(L, "invalid port");
+    return NULL;
+  }
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    return NULL;
+  }
+
+  lua_socket_t *lsock = (lua_socket_t *) lua_newuserdata(L, sizeof(lua_socket_t));
+  memset(lsock, 0, sizeof(lua_socket_t));
+  lsock->human = malloc(strlen(host) + 32);
+  lsock->sockfd = -1;
+  lsock->epfd = epfd;
+  lsock->port = (int) port;
+  lsock->is_secure = false;
+  lsock->connecting = true;
+  lsock->deadline = deadline_after(timeout);
+  lsock->next_attempt_at = -1;
+  lsock->last_error = ECONNREFUSED;
+  sprintf(lsock->human, "<tcp %s:%d>", host, (int) port);
+
+  // Add the metatable to the stack.
+  luaL_getmetatable(L, "LSocket");
+  // Set the metatable on the userdata.
+  lua_setmetatable(L, -2);
+
+  lsock->query = resolver_query(host);
+  if (resolver_query_fd(lsock->query) >= 0) {
+    event.data.fd = resolver_query_fd(lsock->query);
+    epoll_ctl(epfd, EPOLL_CTL_ADD, event.data.fd, &event);
+  }
+  return lsock;
+}
+
+static int open_failed(lua_State *L, lua_socket_t *lsock, const char *err) {
+  lua_pushnil(L);
+  lua_pushstring(L, err);
+  close_socket(lsock);
+  return 2;
+}
+
+/*
+ * Waits for the socket at `index` to connect, and for its TLS handshake if
+ * it has one, then returns it; or nil and an error. Yields while it waits
+ * inside a coroutine, like `send()` and `recv()`.
+ */
+static int socket_open(lua_State *L, int status, lua_KContext index) {
+  lua_socket_t *lsock = (lua_socket_t *) lua_touserdata(L, (int) index);
+  char errbuf[128];
+  short events;
+  int n;
+
+  if (lsock->sockfd < 0 && !lsock->connecting) return open_failed(L, lsock, "socket is closed");
+  while (lsock->connecting) {
+    if ((n = advance_connect(lsock, errbuf, sizeof(errbuf))) < 0) return open_failed(L, lsock, errbuf);
+    if (n > 0) {
+      if (lsock->ssl && !SSL_set_fd(lsock->ssl, lsock->sockfd)) {
+        memset(errbuf, 0, sizeof(errbuf));
+        return open_failed(L, lsock, ERR_error_string(ERR_get_error(), errbuf));
+      }
+      break;
+    }
+    switch (wait_for(L, lsock, POLLIN)) {
+      case WAIT_READY:   break;
+      case WAIT_YIELD:   return yield_for(L, lsock, (int) index, index, socket_open);
+      case WAIT_TIMEOUT: return open_failed(L, lsock, "connect failed: timeout");
+    }
+  }
+
+  while (lsock->ssl && (n = SSL_do_handshake(lsock->ssl)) <= 0) {
+    if (!(events = would_block(lsock, n, POLLIN))) {
+      keep_tls_session(lsock, false);
+      memset(errbuf, 0, sizeof(errbuf));
+      return open_failed(L, lsock, ERR_error_string(ERR_get_error(), errbuf));
+    }
+    switch (wait_for(L, lsock, events)) {
+      case WAIT_READY:   break;
+      case WAIT_YIELD:   return yield_for(L, lsock, (int) index, index, socket_open);
+      case WAIT_TIMEOUT:
+        keep_tls_session(lsock, false);
+        return open_failed(L, lsock, "timeout");
+    }
+  }
+  if (lsock->ssl) keep_tls_session(lsock, true);
+
+  finish_call(lsock);
+  lua_pushvalue(L, (int) index);
+  return 1;
+}
+
+/*
+ * Creates a new TCP socket connection to the specified host and port. Note:
+ * Raw TCP sockets are not a secure form of communication, so sensitive data
+ * will not be transmitted.
+ *
+ * Optionally, the third argument can contain the number of milliseconds to
+ * wait for the connection. Inside a coroutine, this yields rather than
+ * blocking while it waits; see `socket.wait()`.
+ *
+ * Host names are looked up in the background, and the answers are kept for a
+ * few minutes. When a host has both IPv6 and IPv4 addresses they are tried
+ * in turn, each a quarter of a second after the last, and the first to
+ * connect is used.
+ *
+ * Returns `nil` if the socket cannot be created. A second return value
+ * contains an error message as a string.
  * 
  * Examples:
  * 
  *     socket = require('socket')
  *     sock, err = socket.tcp('192.168.0.1', 8090)
+ *     sock, err = socket.tcp('example.com', 8090)
+ *     sock, err = socket.tcp('192.168.0.1', 8090, 5000)
  *
  */
 int socket_tcp(lua_State *L) {
-  lua_socket_t *lsock = lsocket_new_generic(L);
+  lua_Integer timeout = pop_timeout(L);
+  lua_socket_t *lsock = lsocket_new_generic(L, timeout);
   if (!lsock) return 2;
-  return 1;
+  return socket_open(L, 0, lua_gettop(L));
 }
 
 /*
@@ -379,6 +1422,12 @@ int socket_tcp(lua_State *L) {
  *
  * Optionally, the fifth argument can contain a password for the private key.
  *
+ * Optionally, the last argument can be the number of milliseconds to wait
+ * for the connection and the TLS handshake. Inside a coroutine, this yields
+ * rather than blocking while it waits; see `socket.wait()`.
+ *
+ * Host names are resolved and connected to as by `socket.tcp()`.
+ *
  * Returns `nil` if the socket cannot be created. A second return value
  * contains an error message as a string.
  * 
@@ -396,64 +1445,455 @@ int socket_tcp(lua_State *L) {
  *                            'path/to/privkey.pem',
  *                            'privkey-decrypt-password')
  *
+ *     sock, err = socket.tls('192.168.0.1', 8090, 5000)
+ *
  */
 int socket_tls(lua_State *L) {
+  lua_Integer timeout = pop_timeout(L);
   int top = lua_gettop(L);
 
-  lua_socket_t *lsock = lsocket_new_generic(L);
+  lua_socket_t *lsock = lsocket_new_generic(L, timeout);
   if (!lsock) return 2;
 
-  // initialize ctx
-  const SSL_METHOD *method = TLSv1_2_method();
-  SSL_CTX *ctx = SSL_CTX_new(method);
-  if (top > 2)
-    SSL_CTX_use_certificate_file(ctx, lua_tostring(L, 3), SSL_FILETYPE_PEM);
-  if (top > 3) {
-    lsock->pem_password = strdup(lua_tostring(L, 4));
-    SSL_CTX_set_default_passwd_cb(ctx, pem_passwd_cb);
-    SSL_CTX_set_default_passwd_cb_userdata(ctx, lsock->pem_password);
-  }
-  if (top > 4)
-    SSL_CTX_use_PrivateKey_file(ctx, lua_tostring(L, 5), SSL_FILETYPE_PEM);
-  SSL_CTX_load_verify_locations(ctx, cacerts_bundle, 0);
-
-  lsock->ssl = SSL_new(ctx);
+  lsock->config = find_tls_config(top > 2 ? lua_tostring(L, 3) : NULL,
+                                  top > 3 ? lua_tostring(L, 4) : NULL,
+                                  top > 4 ? lua_tostring(L, 5) : NULL);
+  if (lsock->config == NULL) goto handle_err;
+  lsock->ssl = SSL_new(lsock->config->ctx);
   if (lsock->ssl == NULL) goto handle_err;
+  // a send which has to wait may be retried with the rest of its data
+  SSL_set_mode(lsock->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  SSL_set_connect_state(lsock->ssl);
+  // the descriptor is set once the connection is made
 
-  BIO *sbio = BIO_new_socket(lsock->sockfd, BIO_NOCLOSE);
-  if (sbio == NULL) goto handle_err;
-  SSL_set_bio(lsock->ssl, sbio, sbio);
-
-  int err = SSL_connect(lsock->ssl);
-  if (err <= 0) goto handle_err;
+  // the port is formatted from the number, as lua_tostring() would convert
+  // it to a string in place on the stack
+  lsock->host = (char *) malloc(strlen(lua_tostring(L, 1)) + 8);
+  sprintf(lsock->host, "%s:%d", lua_tostring(L, 1), lsock->port);
+  offer_tls_session(lsock);
 
   memcpy(lsock->human + 1, "tls", 3);
   if (is_whitelisted(lua_tostring(L, 1), strlen(lua_tostring(L, 1))))
     lsock->is_secure = true;
-  return 1;
+  return socket_open(L, 0, lua_gettop(L));
 
 handle_err:
-  lua_pop(L, -1);
-  lua_pushnil(L);
-  char errbuf[128];
-  memset(errbuf, 0, sizeof(errbuf));
-  lua_pushstring(L, ERR_error_string(ERR_get_error(), errbuf));
+  {
+    char errbuf[128];
+    memset(errbuf, 0, sizeof(errbuf));
+    return open_failed(L, lsock, ERR_error_string(ERR_get_error(), errbuf));
+  }
+}
+
+/*
+ * Writes the IP address and port of `sa` to `ip` and `port`, an IPv4
+ * address mapped to IPv6 as plain IPv4, so that it can be whitelisted.
+ */
+static void format_address(const struct sockaddr_storage *sa, char *ip, size_t ip_len, int *port) {
+  const struct sockaddr_in *sin = (const struct sockaddr_in *) sa;
+  const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) sa;
+
+  if (sa->ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+    inet_ntop(AF_INET, &sin6->sin6_addr.s6_addr[12], ip, ip_len);
+    *port = ntohs(sin6->sin6_port);
+  } else if (sa->ss_family == AF_INET6) {
+    inet_ntop(AF_INET6, &sin6->sin6_addr, ip, ip_len);
+    *port = ntohs(sin6->sin6_port);
+  } else {
+    inet_ntop(AF_INET, &sin->sin_addr, ip, ip_len);
+    *port = ntohs(sin->sin_port);
+  }
+}
+
+static int push_address(lua_State *L, int (*get)(int, struct sockaddr *, socklen_t *)) {
+  lua_socket_t *lsock = (lua_socket_t *) luaL_checkudata(L, 1, "LSocket");
+  struct sockaddr_storage sa;
+  socklen_t len = sizeof(sa);
+  char ip[INET6_ADDRSTRLEN];
+  int port;
+
+  if (lsock->sockfd < 0) {
+    lua_pushnil(L);
+    lua_pushstring(L, "socket is closed");
+    return 2;
+  }
+  if (get(lsock->sockfd, (struct sockaddr *) &sa, &len) < 0) {
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    return 2;
+  }
+  format_address(&sa, ip, sizeof(ip), &port);
+  lua_pushstring(L, ip);
+  lua_pushinteger(L, port);
   return 2;
 }
 
+/*
+ * Returns the IP address and port of this end of the connection, or of a
+ * listening socket, which is how to find the port it was given when it was
+ * asked to listen on port 0.
+ *
+ * Examples:
+ *
+ *     socket = require('socket')
+ *     listener = socket.listen_tcp(0)
+ *     ip, port = listener:local_address()
+ *
+ */
+int socket_local_address(lua_State *L) {
+  return push_address(L, getsockname);
+}
+
+/*
+ * Returns the IP address and port of the other end of the connection.
+ *
+ * Examples:
+ *
+ *     socket = require('socket')
+ *     sock = socket.listen_tcp(8090):accept()
+ *     ip, port = sock:peer_address()
+ *
+ */
+int socket_peer_address(lua_State *L) {
+  return push_address(L, getpeername);
+}
+
+/*
+ * Whether the connection from `ip` must be turned away, because the listener
+ * already has as many connections as it allows, or only takes them from
+ * addresses in the whitelist file and `ip` isn't one.
+ */
+static bool refuse_peer(lua_socket_t *listener, const char *ip) {
+  listener_t *l = listener->listener;
+
+  if (l->max_connections > 0 && l->connections >= l->max_connections) {
+    LWARN("socket: %s: refused connection from %s: too many connections", listener->human, ip);
+    return true;
+  }
+  if (l->whitelisted_only && !is_whitelisted(ip, strlen(ip))) {
+    LWARN("socket: %s: refused connection from %s: not whitelisted", listener->human, ip);
+    return true;
+  }
+  return false;
+}
+
+/*
+ * Pushes a socket for the connection `fd` accepted by `listener` from `ip`
+ * and `port`, which has what's left of the listener's deadline for its
+ * handshake, if it has one.
+ */
+static lua_socket_t *lsocket_new_accepted(lua_State *L, lua_socket_t *listener, int fd,
+                                          const char *ip, int port) {
+  lua_socket_t *lsock = (lua_socket_t *) lua_newuserdata(L, sizeof(lua_socket_t));
+  memset(lsock, 0, sizeof(lua_socket_t));
+  lsock->human = malloc(strlen(ip) + 32);
+  lsock->sockfd = fd;
+  lsock->epfd = -1;
+  lsock->port = port;
+  lsock->next_attempt_at = -1;
+  lsock->deadline = listener->deadline;
+  lsock->listener = listener->listener;
+  lsock->listener->refs++;
+  lsock->listener->connections++;
+  sprintf(lsock->human, "<%s %s:%d>", listener->config ? "tls" : "tcp", ip, port);
+  luaL_getmetatable(L, "LSocket");
+  lua_setmetatable(L, -2);
+
+  if (listener->config) {
+    retain_tls_config(listener->config);
+    lsock->config = listener->config;
+    if (!(lsock->ssl = SSL_new(lsock->config->ctx))) return lsock;
+    SSL_set_mode(lsock->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_set_accept_state(lsock->ssl);
+    SSL_set_fd(lsock->ssl, fd);
+    // the same policy as for the hosts we connect to
+    lsock->is_secure = is_whitelisted(ip, strlen(ip));
+  }
+  return lsock;
+}
+
+static int accept_again(lua_State *L, int status, lua_KContext ctx) {
+  lua_socket_t *listener = (lua_socket_t *) luaL_checkudata(L, 1, "LSocket");
+  lua_socket_t *lsock;
+  struct sockaddr_storage peer;
+  socklen_t len;
+  char ip[INET6_ADDRSTRLEN];
+  int fd, port;
+
+  while (true) {
+    if (listener->sockfd < 0) {
+      finish_call(listener);
+      lua_pushnil(L);
+      lua_pushstring(L, "socket is closed");
+      return 2;
+    }
+    len = sizeof(peer);
+    if ((fd = accept(listener->sockfd, (struct sockaddr *) &peer, &len)) >= 0) {
+      format_address(&peer, ip, sizeof(ip), &port);
+      if (!refuse_peer(listener, ip)) break;
+      close(fd);
+      continue;
+    }
+    // the peer gave up before we got to it
+    if (errno == ECONNABORTED || errno == EPROTO) continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      finish_call(listener);
+      lua_pushnil(L);
+      lua_pushstring(L, strerror(errno));
+      return 2;
+    }
+    switch (wait_for(L, listener, POLLIN)) {
+      case WAIT_READY:   break;
+      case WAIT_YIELD:   return yield_for(L, listener, 1, ctx, accept_again);
+      case WAIT_TIMEOUT:
+        finish_call(listener);
+        lua_pushnil(L);
+        lua_pushstring(L, "timeout");
+        return 2;
+    }
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  lsock = lsocket_new_accepted(L, listener, fd, ip, port);
+  finish_call(listener);
+  if (listener->config && !lsock->ssl) {
+    char errbuf[128];
+    memset(errbuf, 0, sizeof(errbuf));
+    return open_failed(L, lsock, ERR_error_string(ERR_get_error(), errbuf));
+  }
+  return socket_open(L, 0, lua_gettop(L));
+}
+
+/*
+ * Waits for a connection to a listening socket and returns a socket for it,
+ * which can do anything a socket from `socket.tcp()` or `socket.tls()` can.
+ * For a TLS listener the handshake is done before it's returned. Waits for
+ * at most the number of milliseconds given as the first argument, if any,
+ * for both. Inside a coroutine it yields the listening socket, and then the
+ * new one during the handshake, instead of blocking; see `socket.wait()`.
+ *
+ * Connections beyond the listener's limit, and from addresses which aren't
+ * whitelisted if it only takes whitelisted ones, are closed as soon as
+ * they're accepted, and the wait goes on.
+ *
+ * Returns `nil` and an error, which is "timeout" if the time ran out, if
+ * there's no connection.
+ *
+ * Examples:
+ *
+ *     socket = require('socket')
+ *     listener = socket.listen_tcp(8090)
+ *     sock, err = listener:accept()
+ *     sock, err = listener:accept(5000)
+ *
+ */
+int socket_accept(lua_State *L) {
+  lua_socket_t *listener = (lua_socket_t *) luaL_checkudata(L, 1, "LSocket");
+  lua_Integer timeout = luaL_optinteger(L, 2, -1);
+
+  if (!listener->listening) {
+    lua_pushnil(L);
+    lua_pushstring(L, "socket is not listening");
+    return 2;
+  }
+  if (listener->waiting) {
+    lua_pushnil(L);
+    lua_pushstring(L, "socket is busy");
+    return 2;
+  }
+  lua_settop(L, 1);
+  listener->deadline = deadline_after(timeout);
+  return accept_again(L, 0, 0);
+}
+
+/*
+ * Pushes a socket listening on the port given as the first argument, with
+ * the options in the table at `options`, if there is one. On failure,
+ * pushes nil and an error instead, and returns NULL.
+ */
+static lua_socket_t *lsocket_new_listener(lua_State *L, int options) {
+  lua_Integer port = luaL_checkinteger(L, 1);
+  const char *host = "0.0.0.0";
+  lua_Integer backlog = LISTEN_BACKLOG, max_connections = 0;
+  bool whitelisted_only = false;
+  struct sockaddr_storage sa;
+  struct sockaddr_in *sin = (struct sockaddr_in *) &sa;
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &sa;
+  socklen_t len;
+  int fd, one = 1;
+
+  if (options && lua_istable(L, options)) {
+    lua_getfield(L, options, "host");
+    if (lua_isstring(L, -1)) host = lua_tostring(L, -1);
+    lua_getfield(L, options, "backlog");
+    backlog = luaL_optinteger(L, -1, backlog);
+    lua_getfield(L, options, "max_connections");
+    max_connections = luaL_optinteger(L, -1, 0);
+    lua_getfield(L, options, "whitelisted_only");
+    whitelisted_only = lua_toboolean(L, -1);
+    // the host string stays on the stack until the function returns
+    lua_pop(L, 3);
+  }
+
+  if (port < 0 || port > 65535) {
+    lua_pushnil(L);
+    lua_pushstring(L, "invalid port");
+    return NULL;
+  }
+  memset(&sa, 0, sizeof(sa));
+  if (inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons((int) port);
+    len = sizeof(*sin);
+  } else if (inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons((int) port);
+    len = sizeof(*sin6);
+  } else {
+    lua_pushnil(L);
+    lua_pushstring(L, "invalid address");
+    return NULL;
+  }
+
+  if ((fd = socket(sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+      bind(fd, (struct sockaddr *) &sa, len) < 0 ||
+      listen(fd, (int) backlog) < 0) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "listen failed: %s", strerror(errno));
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+  // port 0 has been replaced with the one picked
+  len = sizeof(sa);
+  if (getsockname(fd, (struct sockaddr *) &sa, &len) == 0)
+    port = ntohs(sa.ss_family == AF_INET6 ? sin6->sin6_port : sin->sin_port);
+
+  lua_socket_t *lsock = (lua_socket_t *) lua_newuserdata(L, sizeof(lua_socket_t));
+  memset(lsock, 0, sizeof(lua_socket_t));
+  lsock->human = malloc(strlen(host) + 48);
+  lsock->sockfd = fd;
+  lsock->epfd = -1;
+  lsock->port = (int) port;
+  lsock->listening = true;
+  lsock->deadline = -1;
+  lsock->next_attempt_at = -1;
+  lsock->listener = (listener_t *) calloc(1, sizeof(listener_t));
+  lsock->listener->refs = 1;
+  lsock->listener->max_connections = (int) max_connections;
+  lsock->listener->whitelisted_only = whitelisted_only;
+  sprintf(lsock->human, "<tcp listener %s:%d>", host, (int) port);
+  luaL_getmetatable(L, "LSocket");
+  lua_setmetatable(L, -2);
+  return lsock;
+}
+
+/*
+ * Creates a socket listening for TCP connections on the specified port,
+ * which `accept()` takes them from. Port 0 picks a free port; see
+ * `local_address()`. Like connections made with `socket.tcp()`, those
+ * accepted are never used to transmit sensitive data.
+ *
+ * Optionally, the second argument can be a table of options:
+ *
+ *   - `host`: the IP address to listen on, "0.0.0.0" by default; "::"
+ *     listens on both IPv6 and IPv4, and "127.0.0.1" only to this device.
+ *   - `backlog`: how many connections may wait to be accepted.
+ *   - `max_connections`: how many connections accepted from it may be open
+ *     at once. Any more are closed as soon as they're accepted.
+ *   - `whitelisted_only`: if `true`, connections are only accepted from
+ *     IP addresses in the whitelist file.
+ *
+ * Returns `nil` if the socket cannot be created. A second return value
+ * contains an error message as a string.
+ *
+ * Examples:
+ *
+ *     socket = require('socket')
+ *     listener, err = socket.listen_tcp(8090)
+ *     listener, err = socket.listen_tcp(8090, { host = '127.0.0.1',
+ *                                               max_connections = 4 })
+ *
+ */
+int socket_listen_tcp(lua_State *L) {
+  if (!lsocket_new_listener(L, lua_gettop(L) > 1 ? 2 : 0)) return 2;
+  return 1;
+}
+
+/*
+ * Creates a socket listening for TLS connections on the specified port,
+ * which present the certificate given as the second argument, a path to a
+ * PEM file, and use the private key given as the third. Optionally, the
+ * fourth argument can contain a password for the private key. Options may
+ * follow, as for `socket.listen_tcp()`.
+ *
+ * The TLS handshake of each connection is done by `accept()`. A connection
+ * is secure, so that sensitive data may be transmitted over it, when the
+ * address it came from appears in the whitelist file, just as a connection
+ * made with `socket.tls()` is when its host name does.
+ *
+ * Returns `nil` if the socket cannot be created, or the certificate or key
+ * can't be loaded. A second return value contains an error message as a
+ * string.
+ *
+ * Examples:
+ *
+ *     socket = require('socket')
+ *     listener, err = socket.listen_tls(8090, 'path/to/cert.pem',
+ *                                       'path/to/privkey.pem')
+ *
+ *     listener, err = socket.listen_tls(8090, 'path/to/cert.pem',
+ *                                       'path/to/privkey.pem',
+ *                                       'privkey-decrypt-password',
+ *                                       { whitelisted_only = true })
+ *
+ */
+int socket_listen_tls(lua_State *L) {
+  const char *cert = luaL_checkstring(L, 2);
+  const char *privkey = luaL_checkstring(L, 3);
+  const char *password = lua_isstring(L, 4) ? lua_tostring(L, 4) : NULL;
+  int options = lua_istable(L, 4) ? 4 : lua_istable(L, 5) ? 5 : 0;
+  lua_socket_t *lsock = lsocket_new_listener(L, options);
+
+  if (!lsock) return 2;
+  lsock->config = find_tls_config(cert, password, privkey);
+  if (!lsock->config || SSL_CTX_check_private_key(lsock->config->ctx) != 1) {
+    lua_pushnil(L);
+    lua_pushstring(L, "couldn't load the certificate and private key");
+    close_socket(lsock);
+    return 2;
+  }
+  memcpy(lsock->human + 1, "tls", 3);
+  return 1;
+}
+
 static const luaL_Reg lsocket_methods[] = {
   { "send",       socket_send     },
+  { "send_frame", socket_send_frame},
   { "recv",       socket_recv     },
+  { "recv_exact", socket_recv_exact},
+  { "recv_until", socket_recv_until},
+  { "recv_frame", socket_recv_frame},
   { "is_secure",  socket_is_secure},
+  { "is_resumed", socket_is_resumed},
+  { "accept",     socket_accept   },
+  { "local_address", socket_local_address},
+  { "peer_address",  socket_peer_address},
+  { "waitable",   socket_waitable },
+  { "abandon",    socket_abandon  },
   { "close",      socket_destroy  },
-  { "__gc",       socket_destroy  },
+  { "__gc",       socket_gc       },
   { "__tostring", socket_tostring },
   {NULL,  NULL}
 };
 
 static const luaL_Reg lsocket_functions[] = {
-  {"tcp", socket_tcp},
-  {"tls", socket_tls},
+  {"tcp",  socket_tcp },
+  {"tls",  socket_tls },
+  {"listen_tcp", socket_listen_tcp},
+  {"listen_tls", socket_listen_tls},
+  {"wait", socket_wait},
   {NULL,  NULL}
 };
 
@@ -489,4 +1929,19 @@ void shutdown_socket_lua(lua_State *L) {
     free(entry->hostname);
     free(entry);
   }
+
+  tls_config_t *config = NULL, *tmp_config = NULL;
+  tls_session_t *session = NULL, *tmp_session = NULL;
+  pthread_mutex_lock(&tls_lock);
+  HASH_ITER(hh, tls_configs, config, tmp_config) {
+    // sockets still open in another Lua state keep theirs
+    if (config->refs > 0) continue;
+    HASH_ITER(hh, config->sessions, session, tmp_session)
+      free_tls_session(config, session);
+    HASH_DEL(tls_configs, config);
+    SSL_CTX_free(config->ctx);
+    free(config->key);
+    free(config);
+  }
+  pthread_mutex_unlock(&tls_lock);
 }
@@ -1,4 +1,5 @@
 #include "services.h"
+#include "util/admission.h"
 #include "util/api_request.h"
 #include "util/headers_parser.h"
 
@@ -28,7 +29,8 @@ static zactor_t *service = NULL;
     offset += parse_headers(&(request->request_headers), request_headers_and_body, request_size - offset);
     char *request_body = strndup(request_str + offset, request_size - offset);
     assert(strlen(request_body) == request_size - offset);
-    char *response_str = dispatch_request(verb, path, &(request->request_headers), request_body);
+    char *response_str = dispatch_request(ADMISSION_TRANSPORT_BLUETOOTH, verb, path,
+                                          &(request->request_headers), request_body);
     free(request_body);
     return response_str;
   }
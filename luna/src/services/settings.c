@@ -58,6 +58,18 @@ static void set_default_settings(sqlite3 *db, zsock_t *bcast) {
     set_default("webserver.beacon.port",     DEFAULT_WEBSERVER_BEACON_PORT);
     set_default("webserver.beacon.enabled",  DEFAULT_WEBSERVER_BEACON_ENABLED);
     set_default("webserver.port",            _str(DEFAULT_WEBSERVER_PORT));
+    set_default("backend.max_host_connections", DEFAULT_BACKEND_MAX_HOST_CONNECTIONS);
+    set_default("backend.max_connections",   DEFAULT_BACKEND_MAX_CONNECTIONS);
+    set_default("backend.max_active_requests", DEFAULT_BACKEND_MAX_ACTIVE_REQUESTS);
+    set_default("backend.max_queued_requests", DEFAULT_BACKEND_MAX_QUEUED_REQUESTS);
+    set_default("backend.max_body_size",     DEFAULT_BACKEND_MAX_BODY_SIZE);
+    set_default("backend.cache.max_memory",  DEFAULT_BACKEND_CACHE_MAX_MEMORY);
+    set_default("backend.cache.max_disk",    DEFAULT_BACKEND_CACHE_MAX_DISK);
+    set_default("backend.prewarm.interval",  DEFAULT_BACKEND_PREWARM_INTERVAL);
+    set_default("backend.prewarm.idle_close", DEFAULT_BACKEND_PREWARM_IDLE_CLOSE);
+    set_default("lua.memory_limit",          DEFAULT_LUA_MEMORY_LIMIT);
+    set_default("lua.gc_pause",              DEFAULT_LUA_GC_PAUSE);
+    set_default("lua.gc_stepmul",            DEFAULT_LUA_GC_STEPMUL);
 }
 
 static int emit_value(void *arg, int num_columns, char **values, char **names) {
@@ -307,6 +319,14 @@ void shutdown_settings_service(void) {
   }
 }
 
+/*
+ * Returns 1 if the settings service has been started, 0 otherwise. Without
+ * it, `settings_get` would wait forever for an answer.
+ */
+int settings_service_running(void) {
+  return service != NULL;
+}
+
 /*
 Example:
     settings_get(sock, 2, "setting1", "setting2", &s1val, &s2val);
@@ -2,6 +2,7 @@
 #include "config.h"
 #include <libgen.h>
 #include "services.h"
+#include "util/admission.h"
 #include "util/api_request.h"
 #include "util/headers_parser.h"
 #ifdef HAVE_CTOS
@@ -32,7 +33,8 @@ static char *process_request(const char *request_str, unsigned int request_size)
   offset += parse_headers(&(request->request_headers), request_headers_and_body, request_size - offset);
   char *request_body = strndup(request_str + offset, request_size - offset);
   assert(strlen(request_body) == request_size - offset);
-  char *response_str = dispatch_request(verb, path, &(request->request_headers), request_body);
+  char *response_str = dispatch_request(ADMISSION_TRANSPORT_USB, verb, path,
+                                        &(request->request_headers), request_body);
   free(request_body);
   return response_str;
 }
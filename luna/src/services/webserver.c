@@ -15,14 +15,31 @@
 #include "services.h"
 #include "util/machine_id.h"
 #include "util/files.h"
+#include "util/event_stream.h"
+#include "util/sessions.h"
+#include "util/utlist.h"
 
 #define FAIL    -1
 #define ACCEPT_TIMEOUT 10 // ms
 #define BEACON_BROADCAST_INTERVAL 3000 // ms
 
+// connections beyond this are closed without a TLS handshake; the API
+// itself admits requests more selectively (see util/admission.c)
+#define MAX_CONNECTIONS (8 + EVENT_STREAM_MAX_CLIENTS)
+
 // see https_request.c
 void https_api_handle_request(zsock_t *pipe, void *args);
 
+/*
+ * Requests which are still being processed. Most finish on their own, but
+ * long-lived ones such as event streams must be told to stop when the
+ * webserver is shutting down.
+ */
+typedef struct request_actor_t {
+    zactor_t *actor;
+    struct request_actor_t *prev, *next;
+} request_actor_t;
+
 static zactor_t *webserver_actor = NULL;
 
 /* used to restart the web server when settings change that require doing so */
@@ -201,6 +218,7 @@ static void webserver_service(zsock_t *pipe, void *args) {
     SSL_CTX *ctx = NULL;
     int server = -1;
     zpoller_t *requests_in_progress = zpoller_new(pipe, NULL);
+    request_actor_t *request_actors = NULL, *request_actor;
     int num_in_progress = 0;
     bool running = true;
     fd_set fdset;
@@ -216,11 +234,13 @@ static void webserver_service(zsock_t *pipe, void *args) {
     zsock_t *device_name_changed       = zsock_new_sub(SETTINGS_CHANGED_ENDPOINT, "device.name");
     zsock_t *broadcast_port_changed    = zsock_new_sub(SETTINGS_CHANGED_ENDPOINT, "webserver.beacon.port");
     zsock_t *broadcast_enabled_changed = zsock_new_sub(SETTINGS_CHANGED_ENDPOINT, "webserver.beacon.enabled");
+    zsock_t *credentials_changed       = zsock_new_sub(SETTINGS_CHANGED_ENDPOINT, "auth.");
     zpoller_t *settings_changed_poller = zpoller_new(device_name_changed,
                                                      broadcast_port_changed,
                                                      broadcast_enabled_changed,
                                                      wifi_connection_changed,
                                                      battery_events,
+                                                     credentials_changed,
                                                      NULL);
 
     settings_get(settings, 3, "device.name", "webserver.beacon.port", "webserver.beacon.enabled",
@@ -289,6 +309,13 @@ static void webserver_service(zsock_t *pipe, void *args) {
                 zsock_recv(broadcast_enabled_changed, "ss", &key, &val);
                 if (broadcast_enabled) free(broadcast_enabled);
                 broadcast_enabled = val;
+            } else if (active == credentials_changed) {
+                // sessions were created with the old credentials
+                zsock_recv(credentials_changed, "ss", &key, &val);
+                LINFO("webserver: setting '%s' changed, revoking sessions", key);
+                free(key);
+                free(val);
+                sessions_revoke_all();
             } else if (active == wifi_connection_changed) {
                 char *key, *state, *state_val, *ip, *ip_val,
                      *strength;
@@ -346,6 +373,11 @@ static void webserver_service(zsock_t *pipe, void *args) {
                     LDEBUG("webserver: a request was completed");
                     zsock_wait(active); // consume request-completed signal
                     zpoller_remove(requests_in_progress, active);
+                    DL_SEARCH_SCALAR(request_actors, request_actor, actor, actor);
+                    if (request_actor) {
+                        DL_DELETE(request_actors, request_actor);
+                        free(request_actor);
+                    }
                     zactor_destroy(&actor);
                     num_in_progress--;
                     LDEBUG("webserver: the request resources have been freed");
@@ -357,6 +389,10 @@ static void webserver_service(zsock_t *pipe, void *args) {
                 running = false;
                 break;
             }
+        } else if (num_in_progress >= MAX_CONNECTIONS) {
+            LWARN("webserver: refusing connection from %s:%d: %d requests already in progress",
+                  inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), num_in_progress);
+            close(client);
         } else {
             LINFO("webserver: received request: %s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
             int timeout = 5000; // 5 seconds
@@ -366,6 +402,9 @@ static void webserver_service(zsock_t *pipe, void *args) {
             SSL_set_fd(ssl, client);
             zactor_t *request = zactor_new(https_api_handle_request, ssl);
             zpoller_add(requests_in_progress, request);
+            request_actor = (request_actor_t *) calloc(1, sizeof(request_actor_t));
+            request_actor->actor = request;
+            DL_APPEND(request_actors, request_actor);
             num_in_progress++;
             LINFO("webserver: now processing request");
         }
@@ -381,9 +420,14 @@ shutdown:
     zsock_destroy(&device_name_changed);
     zsock_destroy(&broadcast_port_changed);
     zsock_destroy(&broadcast_enabled_changed);
+    zsock_destroy(&credentials_changed);
     zsock_destroy(&wifi_connection_changed);
     zsock_destroy(&battery_events);
     zpoller_remove(requests_in_progress, pipe);
+    DL_FOREACH(request_actors, request_actor) {
+        // ordinary requests never read this; event streams stop on it
+        zstr_send(request_actor->actor, "$TERM");
+    }
     while (num_in_progress > 0) {
         LDEBUG("webserver: waiting for %d requests still in progress", num_in_progress);
         void *sock = zpoller_wait(requests_in_progress, -1);
@@ -391,6 +435,11 @@ shutdown:
             zactor_t *actor = (zactor_t *) sock;
             zpoller_remove(requests_in_progress, sock);
             zsock_wait(sock); // consume request-complete signal
+            DL_SEARCH_SCALAR(request_actors, request_actor, actor, actor);
+            if (request_actor) {
+                DL_DELETE(request_actors, request_actor);
+                free(request_actor);
+            }
             zactor_destroy(&actor);
             num_in_progress--;
         }
@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "services.h"
+#include "util/admission.h"
+#include "util/api_request.h"
+#include "util/utlist.h"
+
+/*
+ * Admission control for requests headed to the API. Every transport shares
+ * the same Lua dispatcher, so without a limit a burst of requests from any
+ * one of them piles up behind a long-running operation (such as an EMV
+ * transaction) until each one times out individually.
+ *
+ * Instead, only ADMISSION_MAX_IN_FLIGHT requests are handed to the API at a
+ * time, and each of the slow transports is further limited so that it can't
+ * starve the others. Requests that can't be admitted immediately wait in a
+ * bounded queue, ordered by priority and then by arrival. When the queue is
+ * full, a new request either displaces the least urgent waiter (if it is
+ * more urgent itself) or is turned away immediately so that the transport
+ * can report that the device is busy.
+ */
+
+typedef struct waiter_t {
+    int transport;
+    int priority;
+    int status;    // ADMISSION_* once decided, 1 while still waiting
+    struct waiter_t *prev, *next;
+} waiter_t;
+
+// HTTPS carries most of the traffic, including event stream subscriptions
+// which are authorized while other requests are running, so it may use
+// every slot. USB and Bluetooth are slow serial links whose requests can
+// hold a slot for as long as it takes to read a response back to the host,
+// so each of them gets only one, which always leaves the other slot free.
+static const int transport_limits[ADMISSION_NUM_TRANSPORTS] = {
+    ADMISSION_MAX_IN_FLIGHT, // HTTPS
+    1,                       // USB
+    1                        // Bluetooth
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  changed = PTHREAD_COND_INITIALIZER;
+static int in_flight = 0;
+static int transport_in_flight[ADMISSION_NUM_TRANSPORTS] = { 0 };
+static int num_waiting = 0;
+static waiter_t *waiting = NULL;
+
+/*
+ * Classifies a request. Anything that changes a transaction is critical;
+ * reads (including reads of transaction status) are assumed to be polling.
+ */
+int admission_priority(const char *verb, const char *path) {
+    if (!strcmp(verb, "GET")) return ADMISSION_PRIORITY_POLLING;
+    if (api_path_is(path, "/transactions.json")) return ADMISSION_PRIORITY_CRITICAL;
+    if (strstr(path, "/transactions/")) return ADMISSION_PRIORITY_CRITICAL;
+    return ADMISSION_PRIORITY_NORMAL;
+}
+
+static int can_run(int transport) {
+    return in_flight < ADMISSION_MAX_IN_FLIGHT &&
+           transport_in_flight[transport] < transport_limits[transport];
+}
+
+static void admit(waiter_t *waiter) {
+    in_flight++;
+    transport_in_flight[waiter->transport]++;
+    waiter->status = ADMISSION_ADMITTED;
+}
+
+/*
+ * Hands free slots to waiters in queue order. A waiter whose transport is
+ * at its own limit is skipped so that it doesn't hold up other transports.
+ * Must be called with the lock held.
+ */
+static void admit_waiters(void) {
+    waiter_t *waiter, *tmp;
+    DL_FOREACH_SAFE(waiting, waiter, tmp) {
+        if (in_flight >= ADMISSION_MAX_IN_FLIGHT) break;
+        if (can_run(waiter->transport)) {
+            DL_DELETE(waiting, waiter);
+            num_waiting--;
+            admit(waiter);
+        }
+    }
+    pthread_cond_broadcast(&changed);
+}
+
+/*
+ * Inserts `waiter` behind every waiter of equal or greater urgency. If the
+ * queue is full, the last (least urgent, most recent) waiter is displaced
+ * if it is less urgent than `waiter`; otherwise `waiter` is refused.
+ * Returns 0 if queued. Must be called with the lock held.
+ */
+static int enqueue(waiter_t *waiter) {
+    waiter_t *pos;
+
+    if (num_waiting >= ADMISSION_MAX_QUEUED) {
+        waiter_t *last = waiting ? waiting->prev : NULL;
+        if (!last || last->priority <= waiter->priority) return -1;
+        DL_DELETE(waiting, last);
+        num_waiting--;
+        last->status = ADMISSION_BUSY;
+        pthread_cond_broadcast(&changed);
+    }
+
+    DL_FOREACH(waiting, pos)
+        if (pos->priority > waiter->priority) break;
+    if (pos) DL_PREPEND_ELEM(waiting, pos, waiter);
+    else     DL_APPEND(waiting, waiter);
+    num_waiting++;
+    return 0;
+}
+
+/*
+ * Waits for permission to dispatch a request from `transport`. Returns
+ * ADMISSION_ADMITTED, in which case admission_release() must be called when
+ * the API has responded; or ADMISSION_BUSY if the queue is full, or
+ * ADMISSION_TIMED_OUT if no slot became available within `timeout_ms`.
+ */
+int admission_acquire(int transport, int priority, int timeout_ms) {
+    waiter_t waiter;
+    struct timeval now;
+    struct timespec deadline;
+    int status;
+
+    assert(transport >= 0 && transport < ADMISSION_NUM_TRANSPORTS);
+    memset(&waiter, 0, sizeof(waiter));
+    waiter.transport = transport;
+    waiter.priority = priority;
+    waiter.status = 1;
+
+    gettimeofday(&now, NULL);
+    deadline.tv_sec  = now.tv_sec + timeout_ms / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000 + (long) (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&lock);
+    // Every waiter that could run was admitted when its slot came free, so
+    // anything still queued is held by its own transport's limit. If there
+    // is room for this one, it doesn't have to wait behind them.
+    if (can_run(transport)) {
+        admit(&waiter);
+    } else if (enqueue(&waiter)) {
+        waiter.status = ADMISSION_BUSY;
+    } else {
+        while (waiter.status == 1) {
+            if (pthread_cond_timedwait(&changed, &lock, &deadline) == ETIMEDOUT &&
+                waiter.status == 1) {
+                DL_DELETE(waiting, &waiter);
+                num_waiting--;
+                waiter.status = ADMISSION_TIMED_OUT;
+            }
+        }
+    }
+    status = waiter.status;
+    pthread_mutex_unlock(&lock);
+
+    if (status == ADMISSION_BUSY)
+        LWARN("admission: transport %d is busy, refusing request (priority %d)", transport, priority);
+    else if (status == ADMISSION_TIMED_OUT)
+        LWARN("admission: transport %d timed out waiting to dispatch request (priority %d)", transport, priority);
+    return status;
+}
+
+/*
+ * Returns the number of requests waiting to be admitted.
+ */
+int admission_waiting(void) {
+    int count;
+    pthread_mutex_lock(&lock);
+    count = num_waiting;
+    pthread_mutex_unlock(&lock);
+    return count;
+}
+
+void admission_release(int transport) {
+    pthread_mutex_lock(&lock);
+    in_flight--;
+    transport_in_flight[transport]--;
+    admit_waiters();
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <czmq.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "services.h"
+#include "util/admission.h"
+#include "util/api_request.h"
+#include "util/event_stream.h"
+#include "util/string_helpers.h"
+#include "util/utlist.h"
+
+/*
+ * Server-sent events. A client which issues
+ *
+ *     GET /v1/events?topics=contact-emv,keypad
+ *
+ * has its connection held open, and every message published to the events
+ * bus whose topic begins with one of the listed prefixes is written to it as
+ *
+ *     event: contact-emv
+ *     data: ["card-inserted"]
+ *
+ * where `data` is a JSON array of the remaining frames of the message. The
+ * request is first dispatched to the API like any other, so that the API
+ * implementation can authenticate the client and decide whether the
+ * subscription is allowed; the stream only begins if it answers with a 2xx
+ * status. Otherwise its response is relayed to the client as usual.
+ *
+ * Each client has a bounded queue. The client socket is written without
+ * blocking, so a client which cannot keep up simply sees its queue grow, and
+ * once it exceeds EVENT_STREAM_MAX_QUEUED events the client is disconnected
+ * rather than being allowed to consume more memory or stall the bus.
+ */
+
+typedef struct event_t {
+    char *data;
+    size_t len;
+    struct event_t *prev, *next;
+} event_t;
+
+static int num_streams = 0;
+static pthread_mutex_t num_streams_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *STREAM_HEADERS = "HTTP/1.1 200 OK\r\n"
+                                    "Content-type: text/event-stream\r\n"
+                                    "Cache-control: no-cache\r\n"
+                                    "\r\n";
+static const char *TOO_MANY_STREAMS = "HTTP/1.1 503 Service Unavailable\r\n"
+                                      "Content-type: application/json\r\n"
+                                      "Content-length: 34\r\n"
+                                      "\r\n"
+                                      "{\"error\":\"too many event streams\"}";
+static const char *NO_TOPICS = "HTTP/1.1 400 Bad Request\r\n"
+                               "Content-type: application/json\r\n"
+                               "Content-length: 36\r\n"
+                               "\r\n"
+                               "{\"error\":\"topics must be specified\"}";
+
+int is_event_stream_request(const char *verb, const char *path) {
+    return !strcmp(verb, "GET") && api_path_is(path, EVENT_STREAM_RESOURCE);
+}
+
+static int hexval(char ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Finds the `topics` query parameter in `path` and splits its
+ * comma-separated, URL-encoded value into `topics`. Returns the number of
+ * topics found. Each topic must be freed.
+ */
+static int parse_topics(const char *path, char **topics, int max_topics) {
+    const char *query = strchr(path, '?');
+    const char *ptr;
+    int count = 0;
+
+    if (!query) return 0;
+    ptr = query + 1;
+    while (ptr && strncmp(ptr, "topics=", 7)) {
+        ptr = strchr(ptr, '&');
+        if (ptr) ptr++;
+    }
+    if (!ptr) return 0;
+
+    ptr += 7;
+    while (*ptr && *ptr != '&' && count < max_topics) {
+        char *topic = (char *) calloc(strlen(ptr) + 1, sizeof(char));
+        char *out = topic;
+        while (*ptr && *ptr != '&' && *ptr != ',') {
+            if (*ptr == '%' && hexval(ptr[1]) >= 0 && hexval(ptr[2]) >= 0) {
+                *out++ = (char) (hexval(ptr[1]) * 16 + hexval(ptr[2]));
+                ptr += 3;
+            } else {
+                *out++ = (*ptr == '+' ? ' ' : *ptr);
+                ptr++;
+            }
+        }
+        if (*ptr == ',') ptr++;
+        if (strlen(topic) > 0) topics[count++] = topic;
+        else free(topic);
+    }
+
+    return count;
+}
+
+/*
+ * Formats a message received from the events bus as a single server-sent
+ * event. The first frame becomes the event name and the rest are emitted as
+ * a JSON array of strings.
+ */
+static event_t *format_event(zmsg_t *msg) {
+    event_t *event = (event_t *) calloc(1, sizeof(event_t));
+    zframe_t *frame = zmsg_first(msg);
+    size_t size = 64, i;
+    char *name, *ptr;
+
+    for (; frame; frame = zmsg_next(msg))
+        size += zframe_size(frame) * 6 + 4;
+    event->data = ptr = (char *) calloc(size, sizeof(char));
+
+    frame = zmsg_first(msg);
+    name = frame ? zframe_strdup(frame) : strdup("");
+    // a newline in the event name would let it inject fields of its own
+    for (i = 0; name[i]; i++)
+        if (name[i] == '\r' || name[i] == '\n') name[i] = ' ';
+    ptr += sprintf(ptr, "event: %s\ndata: [", name);
+    free(name);
+
+    for (i = 0, frame = zmsg_next(msg); frame; frame = zmsg_next(msg), i++) {
+        char *escaped = json_escape((const char *) zframe_data(frame), zframe_size(frame));
+        ptr += sprintf(ptr, "%s\"%s\"", i > 0 ? "," : "", escaped);
+        free(escaped);
+    }
+
+    ptr += sprintf(ptr, "]\n\n");
+    event->len = ptr - event->data;
+    return event;
+}
+
+static event_t *keepalive_event(void) {
+    event_t *event = (event_t *) calloc(1, sizeof(event_t));
+    event->data = strdup(": keepalive\n\n");
+    event->len = strlen(event->data);
+    return event;
+}
+
+static void free_event(event_t *event) {
+    free(event->data);
+    free(event);
+}
+
+static int acquire_stream(void) {
+    int ok;
+    pthread_mutex_lock(&num_streams_lock);
+    ok = num_streams < EVENT_STREAM_MAX_CLIENTS;
+    if (ok) num_streams++;
+    pthread_mutex_unlock(&num_streams_lock);
+    return ok;
+}
+
+static void release_stream(void) {
+    pthread_mutex_lock(&num_streams_lock);
+    num_streams--;
+    pthread_mutex_unlock(&num_streams_lock);
+}
+
+/*
+ * Runs the event stream on an already-accepted SSL connection, returning
+ * when the client disconnects, falls too far behind, or a message is
+ * received on `pipe` (which the webserver sends during shutdown).
+ */
+void stream_events(zsock_t *pipe, SSL *ssl, const char *verb, const char *path,
+                   header_t **headers) {
+    char *topics[EVENT_STREAM_MAX_TOPICS];
+    int num_topics, i, fd, flags;
+    char *response;
+    zsock_t *sub = NULL;
+    event_t *queue = NULL, *event, *tmp;
+    int queued = 0;
+    size_t written = 0;
+    int64_t last_write;
+    bool running = true, want_read = false;
+    char discard[256];
+
+    num_topics = parse_topics(path, topics, EVENT_STREAM_MAX_TOPICS);
+    if (num_topics == 0) {
+        SSL_write(ssl, NO_TOPICS, strlen(NO_TOPICS));
+        return;
+    }
+
+    // let the API decide whether this client may subscribe at all
+    response = dispatch_request(ADMISSION_TRANSPORT_HTTPS, verb, path, headers, NULL);
+    if (strncmp(response, "HTTP/1.1 2", 10)) {
+        LINFO("https-request: event stream was refused by the API");
+        SSL_write(ssl, response, strlen(response));
+        free(response);
+        goto cleanup;
+    }
+    free(response);
+
+    if (!acquire_stream()) {
+        LWARN("https-request: refusing event stream: %d streams already open", EVENT_STREAM_MAX_CLIENTS);
+        SSL_write(ssl, TOO_MANY_STREAMS, strlen(TOO_MANY_STREAMS));
+        goto cleanup;
+    }
+
+    if (SSL_write(ssl, STREAM_HEADERS, strlen(STREAM_HEADERS)) <= 0) {
+        LWARN("https-request: event stream: could not write response headers");
+        release_stream();
+        goto cleanup;
+    }
+
+    sub = zsock_new(ZMQ_SUB);
+    // bound the backlog held by zmq as well as our own queue
+    zsock_set_rcvhwm(sub, EVENT_STREAM_MAX_QUEUED);
+    for (i = 0; i < num_topics; i++) {
+        LDEBUG("https-request: event stream: subscribing to '%s'", topics[i]);
+        zsock_set_subscribe(sub, topics[i]);
+    }
+    zsock_connect(sub, "%s", EVENTS_SUB_ENDPOINT);
+
+    fd = SSL_get_fd(ssl);
+    flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    last_write = zclock_mono();
+    LINFO("https-request: event stream started with %d topics", num_topics);
+
+    while (running) {
+        zmq_pollitem_t items[] = {
+            { zsock_resolve(pipe), 0,  ZMQ_POLLIN, 0 },
+            { zsock_resolve(sub),  0,  ZMQ_POLLIN, 0 },
+            { NULL,                fd, ZMQ_POLLIN, 0 }
+        };
+        long timeout = (long) (last_write + EVENT_STREAM_KEEPALIVE - zclock_mono());
+
+        if (queue && !want_read) items[2].events |= ZMQ_POLLOUT;
+        if (timeout < 0) timeout = 0;
+        if (zmq_poll(items, 3, queue ? -1 : timeout) == -1) {
+            LWARN("https-request: event stream interrupted");
+            break;
+        }
+
+        if (items[0].revents & ZMQ_POLLIN) {
+            LDEBUG("https-request: event stream: received shutdown signal");
+            break;
+        }
+
+        while (zsock_events(sub) & ZMQ_POLLIN) {
+            zmsg_t *msg = zmsg_recv(sub);
+            if (!msg) break;
+            event = format_event(msg);
+            zmsg_destroy(&msg);
+            DL_APPEND(queue, event);
+            if (++queued > EVENT_STREAM_MAX_QUEUED) {
+                LWARN("https-request: event stream: client is not keeping up, disconnecting it");
+                running = false;
+                break;
+            }
+        }
+
+        if (!queue && zclock_mono() - last_write >= EVENT_STREAM_KEEPALIVE) {
+            DL_APPEND(queue, keepalive_event());
+            queued++;
+        }
+
+        // the client isn't expected to send anything, but reading is how we
+        // notice that it has gone away
+        if (running && (items[2].revents & ZMQ_POLLIN)) {
+            int bytes = SSL_read(ssl, discard, sizeof(discard));
+            if (bytes <= 0) {
+                int err = SSL_get_error(ssl, bytes);
+                if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+                    LDEBUG("https-request: event stream: client disconnected");
+                    break;
+                }
+            }
+            want_read = false;
+        }
+
+        while (running && queue) {
+            int bytes = SSL_write(ssl, queue->data + written, (int) (queue->len - written));
+            if (bytes <= 0) {
+                int err = SSL_get_error(ssl, bytes);
+                if (err == SSL_ERROR_WANT_READ) want_read = true;
+                else if (err != SSL_ERROR_WANT_WRITE) {
+                    LDEBUG("https-request: event stream: write failed, closing stream");
+                    running = false;
+                }
+                break;
+            }
+            last_write = zclock_mono();
+            written += bytes;
+            if (written == queue->len) {
+                event = queue;
+                DL_DELETE(queue, event);
+                free_event(event);
+                queued--;
+                written = 0;
+            }
+        }
+    }
+
+    LINFO("https-request: event stream ended");
+    DL_FOREACH_SAFE(queue, event, tmp) {
+        DL_DELETE(queue, event);
+        free_event(event);
+    }
+    zsock_destroy(&sub);
+    fcntl(fd, F_SETFL, flags);
+    release_stream();
+
+cleanup:
+    for (i = 0; i < num_topics; i++)
+        free(topics[i]);
+}
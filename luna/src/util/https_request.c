@@ -3,11 +3,14 @@
 #include <unistd.h>
 #include <memory.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <resolv.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/sha.h>
+#include <openssl/crypto.h>
 #include "io/signals.h"
 #include "rest_api.h"
 #include "util/params_parser.h"
@@ -15,6 +18,12 @@
 #include "services.h"
 #include "util/api_request.h"
 #include "util/string_helpers.h"
+#include "util/event_stream.h"
+#include "util/admission.h"
+#include "util/jsmn_helpers.h"
+#include "util/sessions.h"
+#include "util/base64_helpers.h"
+#include "util/lua_memory.h"
 
 #define FAIL                 -1
 #define ABORT_REQUEST        -4
@@ -99,6 +108,28 @@ unsigned int scan_http_path(const char *request,
 #undef STATE_HAVE_PATH
 }
 
+/*
+ * Returns 1 if `path` names `resource` under any API version prefix, such as
+ * /v1 or /latest, ignoring any query string. For example, both
+ * "/v1/events?topics=keypad" and "/latest/events" name the resource
+ * "/events". Returns 0 otherwise.
+ */
+int api_path_is(const char *path, const char *resource) {
+    const char *ptr = path;
+    size_t len = strlen(resource);
+
+    if (!strncmp(ptr, "/latest", 7)) {
+        ptr += 7;
+    } else if (ptr[0] == '/' && ptr[1] == 'v' && isdigit(ptr[2])) {
+        ptr += 2;
+        while (isdigit(*ptr)) ptr++;
+    } else {
+        return 0;
+    }
+
+    return !strncmp(ptr, resource, len) && (ptr[len] == '\0' || ptr[len] == '?');
+}
+
 static void dump_certs(SSL* ssl) {
     X509 *cert;
     char *line;
@@ -159,32 +190,14 @@ static bool flush_then_close(int fd, double timeout) {
 }
 
 /*
- * Dispatches a single request by connecting to the internal socket and
- * sending the request data to the socket. The reason the socket is used is
- * to maximize the freedom of the actual API implementation. At time of
- * writing, the API implementation is likely to be running in Lua on the main
- * thread. Not only is a zeromq socket a convenient way to share data with
- * the API, it also allows the API to evolve in virtually any way as long as
- * it communicates via ZMQ.
+ * Returns the given headers in the form expected by the API: each header on
+ * its own line, preceded by a newline. The string must be freed.
  */
-char *dispatch_request(const char *verb, const char *path,
-                       header_t **headers, const char *request_body) {
+static char *headers_to_string(header_t *headers) {
     char *headers_str = (char *) calloc(4, sizeof(char));
-    zsock_t *sock = zsock_new_req("inproc://api");
     header_t *header, *tmp;
-    zmsg_t *msg = zmsg_new();
-    zpoller_t *poller = NULL;
-    char *response_status = NULL,
-         *response_headers = NULL,
-         *response_body = NULL,
-         *response = NULL;
-         // *strtmp = NULL;
-    void *in = NULL;
-
-    assert(sock);
-    poller = zpoller_new(sock, NULL);
 
-    HASH_ITER(hh, *headers, header, tmp) {
+    HASH_ITER(hh, headers, header, tmp) {
         int len1 = strlen(headers_str);
         int len2 = strlen(header->name);
         int len3 = strlen(header->value);
@@ -194,6 +207,28 @@ char *dispatch_request(const char *verb, const char *path,
         headers_str = str;
     }
 
+    return headers_str;
+}
+
+static zmsg_t *error_reply(const char *status, const char *headers, const char *body) {
+    zmsg_t *msg = zmsg_new();
+    zmsg_addstr(msg, status);
+    zmsg_addstr(msg, headers);
+    zmsg_addstr(msg, body);
+    return msg;
+}
+
+/*
+ * Sends a request to the API on a new socket and returns the socket, which
+ * is to be passed to recv_from_api() to get the response. Splitting the two
+ * lets several requests be in flight at once.
+ */
+static zsock_t *send_to_api(const char *verb, const char *path,
+                            const char *headers_str, const char *request_body) {
+    zsock_t *sock = zsock_new_req("inproc://api");
+    zmsg_t *msg = zmsg_new();
+
+    assert(sock);
     zmsg_addstr(msg, verb);
     zmsg_addstr(msg, "path");
     zmsg_addstr(msg, path);
@@ -202,29 +237,695 @@ char *dispatch_request(const char *verb, const char *path,
     zmsg_addstr(msg, "body");
     zmsg_addstr(msg, request_body == NULL ? "" : request_body);
     zmsg_send(&msg, sock);
+    return sock;
+}
+
+/*
+ * Waits up to `timeout` ms for the API to respond to the request sent on
+ * `sock`, then destroys the socket. The response always has exactly 3
+ * frames: status, headers and body.
+ */
+static zmsg_t *recv_from_api(zsock_t **sock, int timeout) {
+    zpoller_t *poller = zpoller_new(*sock, NULL);
+    zmsg_t *msg = NULL;
 
-    in = zpoller_wait(poller, 5000); // 5 second timeout
-    if (in == NULL) {
+    if (zpoller_wait(poller, timeout > 0 ? timeout : 0) == NULL) {
         LERROR("https-request: timed out or interrupted while waiting for API response");
-        msg = zmsg_new();
-        zmsg_addstr(msg, "503 Gateway Unavailable");
-        zmsg_addstr(msg, "Content-type: application/json");
-        zmsg_addstr(msg, "{\"error\":\"gateway unavailable\"}");
+        msg = error_reply("503 Gateway Unavailable", "Content-type: application/json",
+                          "{\"error\":\"gateway unavailable\"}");
     } else {
-        msg = zmsg_recv(sock);
+        msg = zmsg_recv(*sock);
     }
-        
-    if (zmsg_size(msg) != 3) {
-        LERROR("https-request: expected response to have exactly 3 frames but it had %ld", zmsg_size(msg));
-        response_status = strdup("500 Internal Server Error");
-        response_headers = strdup("Content-type: application/json");
-        response_body = strdup("{\"error\":\"internal server error\"}");
+
+    if (msg == NULL || zmsg_size(msg) != 3) {
+        LERROR("https-request: expected response to have exactly 3 frames but it had %ld",
+               msg ? (long) zmsg_size(msg) : 0L);
+        zmsg_destroy(&msg);
+        msg = error_reply("500 Internal Server Error", "Content-type: application/json",
+                          "{\"error\":\"internal server error\"}");
+    }
+
+    zpoller_destroy(&poller);
+    zsock_destroy(sock);
+    return msg;
+}
+
+/*
+ * Batch requests. The body of
+ *
+ *     POST /v1/batch.json
+ *
+ * is either an array of sub-requests, or an object in the form
+ * {"parallel": true, "requests": [...]}, where each sub-request is an object
+ * with "method", "path" and optionally "headers" (an object) and "body" (a
+ * string, or any other JSON value which is passed along as JSON text).
+ * Headers of the batch request itself, such as Authorization, are inherited
+ * by every sub-request unless overridden.
+ *
+ * Sub-requests are sent to the API in order, one at a time. If "parallel" is
+ * true and every sub-request is a GET, they are all sent at once instead.
+ * The response is an array with one {"status", "headers", "body"} object
+ * per sub-request, in the same order. Sub-requests for the resources that
+ * are answered here rather than by the API, such as /sessions.json, are
+ * answered just as they would be if they were sent on their own.
+ *
+ * The whole batch holds a single admission slot, so it gets BATCH_TIMEOUT
+ * ms in all rather than API_TIMEOUT for each sub-request. Sub-requests
+ * still waiting when it runs out fail with a 503, and those not yet sent
+ * aren't sent at all.
+ */
+typedef struct {
+    char *verb;
+    char *path;
+    char *body;
+    header_t *headers;
+    zsock_t *sock;
+    zmsg_t *response;
+} batch_entry_t;
+
+typedef struct {
+    batch_entry_t entries[BATCH_MAX_REQUESTS];
+    int count;
+    int parallel;
+    const char *json;
+} batch_t;
+
+/*
+ * Copies the string value of `token`, decoding JSON escape sequences. Any
+ * other kind of value is copied verbatim.
+ */
+static char *json_token_strdup(const char *json, jsmntok_t *token) {
+    const char *ptr = json + token->start, *end = json + token->end;
+    char *str = (char *) calloc(token->end - token->start + 1, sizeof(char));
+    char *out = str;
+
+    if (token->type != JSMN_STRING) {
+        memcpy(str, ptr, end - ptr);
+        return str;
+    }
+
+    for (; ptr < end; ptr++) {
+        if (*ptr != '\\' || ptr + 1 >= end) {
+            *out++ = *ptr;
+            continue;
+        }
+        switch(*++ptr) {
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u':
+                if (ptr + 4 < end) {
+                    unsigned int cp = 0, low = 0;
+                    sscanf(ptr + 1, "%4x", &cp);
+                    ptr += 4;
+                    // a high surrogate followed by a low one is a single
+                    // character outside the BMP; a surrogate on its own
+                    // can't be encoded, so it becomes U+FFFD
+                    if (cp >= 0xd800 && cp < 0xdc00 && ptr + 6 < end &&
+                        ptr[1] == '\\' && ptr[2] == 'u' &&
+                        sscanf(ptr + 3, "%4x", &low) == 1 && low >= 0xdc00 && low < 0xe000) {
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                        ptr += 6;
+                    } else if (cp >= 0xd800 && cp < 0xe000) {
+                        cp = 0xfffd;
+                    }
+                    // encode as UTF-8
+                    if (cp < 0x80) {
+                        *out++ = (char) cp;
+                    } else if (cp < 0x800) {
+                        *out++ = (char) (0xc0 | (cp >> 6));
+                        *out++ = (char) (0x80 | (cp & 0x3f));
+                    } else if (cp < 0x10000) {
+                        *out++ = (char) (0xe0 | (cp >> 12));
+                        *out++ = (char) (0x80 | ((cp >> 6) & 0x3f));
+                        *out++ = (char) (0x80 | (cp & 0x3f));
+                    } else {
+                        *out++ = (char) (0xf0 | (cp >> 18));
+                        *out++ = (char) (0x80 | ((cp >> 12) & 0x3f));
+                        *out++ = (char) (0x80 | ((cp >> 6) & 0x3f));
+                        *out++ = (char) (0x80 | (cp & 0x3f));
+                    }
+                }
+                break;
+            default: *out++ = *ptr; // \" \\ \/
+        }
+    }
+
+    return str;
+}
+
+static int json_token_is(const char *json, jsmntok_t *token, const char *str) {
+    return (int) strlen(str) == token->end - token->start &&
+           !strncmp(json + token->start, str, token->end - token->start);
+}
+
+static void set_header(header_t **headers, const char *name, const char *value) {
+    header_t *header;
+    char *lower = strdup(name);
+    int i;
+
+    for (i = 0; lower[i]; i++) lower[i] = tolower(lower[i]);
+    HASH_FIND_STR(*headers, lower, header);
+    if (header) {
+        free(lower);
+        free(header->value);
+    } else {
+        header = (header_t *) calloc(1, sizeof(header_t));
+        header->name = lower;
+        HASH_ADD_KEYPTR(hh, *headers, header->name, strlen(header->name), header);
+    }
+    header->value = strdup(value);
+}
+
+static int parse_batch_header(const char *json, jsmntok_t *key, jsmntok_t *value, void *arg) {
+    batch_entry_t *entry = (batch_entry_t *) arg;
+    char *name = json_token_strdup(json, key);
+    char *val = json_token_strdup(json, value);
+    set_header(&(entry->headers), name, val);
+    free(name);
+    free(val);
+    return 0;
+}
+
+static int parse_batch_entry_field(const char *json, jsmntok_t *key, jsmntok_t *value, void *arg) {
+    batch_entry_t *entry = (batch_entry_t *) arg;
+
+    if (json_token_is(json, key, "method") || json_token_is(json, key, "verb")) {
+        if (entry->verb) free(entry->verb);
+        entry->verb = json_token_strdup(json, value);
+    } else if (json_token_is(json, key, "path")) {
+        if (entry->path) free(entry->path);
+        entry->path = json_token_strdup(json, value);
+    } else if (json_token_is(json, key, "body")) {
+        if (entry->body) free(entry->body);
+        entry->body = json_token_strdup(json, value);
+    } else if (json_token_is(json, key, "headers")) {
+        if (value->type != JSMN_OBJECT) return -1;
+        return jsmn_object_iter(json, value, parse_batch_header, entry);
+    }
+    return 0;
+}
+
+static int parse_batch_entry(const char *json, jsmntok_t *token, void *arg) {
+    batch_t *batch = (batch_t *) arg;
+    batch_entry_t *entry;
+
+    if (batch->count >= BATCH_MAX_REQUESTS) return -1;
+    entry = &(batch->entries[batch->count++]);
+    if (token->type != JSMN_OBJECT) return 0; // reported as a bad sub-request
+    return jsmn_object_iter(json, token, parse_batch_entry_field, entry);
+}
+
+static int parse_batch_option(const char *json, jsmntok_t *key, jsmntok_t *value, void *arg) {
+    batch_t *batch = (batch_t *) arg;
+
+    if (json_token_is(json, key, "parallel")) {
+        batch->parallel = json_token_is(json, value, "true");
+    } else if (json_token_is(json, key, "requests")) {
+        return jsmn_array_iter(json, value, parse_batch_entry, batch);
+    }
+    return 0;
+}
+
+/*
+ * Appends one element of the batch response to `out`, which is grown as
+ * needed. The API's response headers are given as lines of "Name: value".
+ */
+static char *append_batch_response(char *out, zmsg_t *msg, int first) {
+    char *status = zmsg_popstr(msg);
+    char *headers = zmsg_popstr(msg);
+    char *body = zmsg_popstr(msg);
+    char *escaped_body = json_escape(body, strlen(body));
+    char *line, *save = NULL;
+    size_t len = strlen(out);
+
+    out = (char *) realloc(out, len + strlen(escaped_body) + strlen(headers) * 6 + 64);
+    len += sprintf(out + len, "%s{\"status\":%d,\"headers\":{", first ? "" : ",", atoi(status));
+
+    first = 1;
+    for (line = strtok_r(headers, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char *colon = strchr(line, ':');
+        char *name, *value;
+        if (!colon) continue;
+        *colon = '\0';
+        name = json_escape(trim(line), strlen(trim(line)));
+        value = json_escape(trim(colon + 1), strlen(trim(colon + 1)));
+        len += sprintf(out + len, "%s\"%s\":\"%s\"", first ? "" : ",", name, value);
+        free(name);
+        free(value);
+        first = 0;
+    }
+
+    sprintf(out + len, "},\"body\":\"%s\"}", escaped_body);
+    free(escaped_body);
+    free(status);
+    free(headers);
+    free(body);
+    return out;
+}
+
+static void remove_header(header_t **headers, const char *name) {
+    header_t *header;
+    HASH_FIND_STR(*headers, name, header);
+    if (header) {
+        HASH_DEL(*headers, header);
+        free(header->name);
+        free(header->value);
+        free(header);
+    }
+}
+
+/*
+ * Returns the value of the authorization header if it uses the given
+ * scheme (such as "Basic"), skipping past the scheme name, or NULL.
+ */
+static const char *authorization_value(header_t *headers, const char *scheme) {
+    header_t *header;
+    size_t len = strlen(scheme);
+
+    HASH_FIND_STR(headers, "authorization", header);
+    if (!header || strncasecmp(header->value, scheme, len) || header->value[len] != ' ')
+        return NULL;
+    return header->value + len + 1;
+}
+
+static int is_base64(const char *str) {
+    size_t len = strlen(str), i;
+    if (len < 4 || len % 4) return 0;
+    for (i = 0; i < len; i++)
+        if (!isalnum(str[i]) && str[i] != '+' && str[i] != '/' &&
+            !(str[i] == '=' && (i == len - 1 || (i == len - 2 && str[len - 1] == '='))))
+            return 0;
+    return 1;
+}
+
+/*
+ * Checks HTTP basic credentials against the auth.user and auth.password
+ * settings, the latter being the hex-encoded SHA-256 digest of the password.
+ * Returns the user name, which must be freed, if they match; else NULL.
+ */
+static char *check_basic_credentials(header_t *headers) {
+    const char *b64 = authorization_value(headers, "Basic");
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    char *decoded = NULL, *password, *digest_hex;
+    char *user = NULL, *expected_digest = NULL;
+    size_t decoded_len;
+    zsock_t *settings;
+    int ok;
+
+    if (!b64 || !is_base64(b64)) return NULL;
+    base64_decode(b64, &decoded, &decoded_len);
+    password = memchr(decoded, ':', decoded_len);
+    if (!password) {
+        free(decoded);
+        return NULL;
+    }
+    *password++ = '\0';
+
+    settings = zsock_new_req(SETTINGS_ENDPOINT);
+    settings_get(settings, 2, "auth.user", "auth.password", &user, &expected_digest);
+    zsock_destroy(&settings);
+
+    SHA256((const unsigned char *) password, decoded_len - (password - decoded), digest);
+    digest_hex = bytes2hex((const char *) digest, sizeof(digest));
+    ok = user && expected_digest &&
+         strlen(user) == strlen(decoded) &&
+         strlen(expected_digest) == strlen(digest_hex);
+    // evaluate both comparisons regardless, to keep timing uniform
+    ok = !CRYPTO_memcmp(user ? user : "", decoded, ok ? strlen(decoded) : 0) &
+         !CRYPTO_memcmp(expected_digest ? expected_digest : "", digest_hex, ok ? strlen(digest_hex) : 0) &
+         ok;
+
+    OPENSSL_cleanse(decoded, decoded_len);
+    free(decoded);
+    free(digest_hex);
+    if (expected_digest) free(expected_digest);
+    if (!ok && user) {
+        free(user);
+        user = NULL;
+    }
+    return user;
+}
+
+/*
+ * Sessions let a client authenticate once and then use a short-lived token
+ * in place of its credentials:
+ *
+ *     POST   /v1/sessions.json   (with HTTP basic auth) creates a session
+ *     DELETE /v1/sessions.json   (with the session token) ends it
+ *
+ * Tokens are sent as "Authorization: Bearer <token>". They are checked here
+ * rather than by the API: for a valid token, the authorization header is
+ * replaced with SESSION_USER_HEADER naming the authenticated user, so the
+ * API need not check credentials again. That header is always removed from
+ * incoming requests, so only a valid session can supply it.
+ */
+static zmsg_t *dispatch_sessions(const char *verb, header_t **headers) {
+    const char *token;
+    char *user, *body;
+    zmsg_t *msg;
+
+    if (!strcmp(verb, "POST")) {
+        if (!(user = check_basic_credentials(*headers))) {
+            LINFO("https-request: session refused: invalid credentials");
+            return error_reply("401 Unauthorized", "Content-type: application/json",
+                               "{\"error\":\"invalid credentials\"}");
+        }
+        token = session_create(user, SESSION_TTL);
+        free(user);
+        if (!token)
+            return error_reply("500 Internal Server Error", "Content-type: application/json",
+                               "{\"error\":\"internal server error\"}");
+        body = (char *) calloc(strlen(token) + 64, sizeof(char));
+        sprintf(body, "{\"token\":\"%s\",\"expires_in\":%d}", token, SESSION_TTL);
+        msg = error_reply("201 Created", "Content-type: application/json", body);
+        free((char *) token);
+        free(body);
+        return msg;
+    } else if (!strcmp(verb, "DELETE")) {
+        if ((token = authorization_value(*headers, "Bearer")))
+            session_revoke(token);
+        return error_reply("204 No Content", "", "");
+    }
+
+    return error_reply("405 Method Not Allowed", "Content-type: application/json",
+                       "{\"error\":\"method not allowed\"}");
+}
+
+/*
+ * Replaces a session token in `headers` with the name of the session's
+ * user. Returns 0 if there was no token or it was valid, -1 otherwise.
+ */
+static int apply_session(header_t **headers) {
+    const char *token;
+    char *user = NULL;
+
+    remove_header(headers, SESSION_USER_HEADER);
+    if (!(token = authorization_value(*headers, "Bearer"))) return 0;
+    if (!session_lookup(token, &user)) return -1;
+
+    remove_header(headers, "authorization");
+    set_header(headers, SESSION_USER_HEADER, user);
+    free(user);
+    return 0;
+}
+
+static zmsg_t *dispatch_local(const char *verb, const char *path, header_t **headers);
+
+static zmsg_t *dispatch_batch(header_t **headers, const char *request_body) {
+    jsmn_parser parser;
+    jsmntok_t *tokens = NULL;
+    batch_t *batch = (batch_t *) calloc(1, sizeof(batch_t));
+    int num_tokens, err = 0, i, all_reads = 1;
+    header_t *header, *tmp;
+    char *out;
+    int64_t deadline;
+    zmsg_t *msg;
+
+    if (!request_body) request_body = "";
+    jsmn_init(&parser);
+    num_tokens = jsmn_parse(&parser, request_body, strlen(request_body), NULL, 0);
+    if (num_tokens > 0) {
+        tokens = (jsmntok_t *) calloc(num_tokens, sizeof(jsmntok_t));
+        jsmn_init(&parser);
+        jsmn_parse(&parser, request_body, strlen(request_body), tokens, num_tokens);
+        if (tokens->type == JSMN_ARRAY)
+            err = jsmn_array_iter(request_body, tokens, parse_batch_entry, batch);
+        else if (tokens->type == JSMN_OBJECT)
+            err = jsmn_object_iter(request_body, tokens, parse_batch_option, batch);
+        else
+            err = -1;
+    }
+
+    if (num_tokens <= 0 || err || batch->count == 0) {
+        LWARN("https-request: batch: rejecting malformed batch request");
+        msg = error_reply("400 Bad Request", "Content-type: application/json",
+                          batch->count >= BATCH_MAX_REQUESTS
+                          ? "{\"error\":\"too many requests in batch\"}"
+                          : "{\"error\":\"expected an array of requests\"}");
+        goto cleanup;
+    }
+
+    for (i = 0; i < batch->count; i++) {
+        batch_entry_t *entry = &(batch->entries[i]);
+        header_t *inherited;
+        int unauthorized = 0;
+        // like a request of its own, a sub-request for a session keeps its
+        // token so that it can be revoked
+        if (!entry->path || !api_path_is(entry->path, SESSIONS_RESOURCE))
+            unauthorized = apply_session(&(entry->headers));
+        // sub-requests inherit the batch's own headers, apart from those
+        // that describe the batch body
+        HASH_ITER(hh, *headers, header, tmp) {
+            if (!strcmp(header->name, "content-length") || !strcmp(header->name, "content-type"))
+                continue;
+            HASH_FIND_STR(entry->headers, header->name, inherited);
+            if (!inherited) set_header(&(entry->headers), header->name, header->value);
+        }
+        if (unauthorized)
+            entry->response = error_reply("401 Unauthorized", "Content-type: application/json",
+                                          "{\"error\":\"invalid or expired session\"}");
+        else if (!entry->verb || !entry->path || entry->path[0] != '/' ||
+            strlen(entry->verb) >= MAX_HTTP_VERB_LENGTH || api_path_is(entry->path, BATCH_RESOURCE))
+            entry->response = error_reply("400 Bad Request", "Content-type: application/json",
+                                          "{\"error\":\"invalid request in batch\"}");
+        else if (strcmp(entry->verb, "GET"))
+            all_reads = 0;
+    }
+
+    if (batch->parallel && !all_reads) {
+        LDEBUG("https-request: batch: not all requests are reads, running them in order");
+        batch->parallel = 0;
+    }
+    LINFO("https-request: batch: dispatching %d requests%s", batch->count, batch->parallel ? " in parallel" : "");
+
+    deadline = zclock_mono() + BATCH_TIMEOUT;
+    for (i = 0; i < batch->count; i++) {
+        batch_entry_t *entry = &(batch->entries[i]);
+        char *headers_str;
+        if (entry->response) continue;
+        if (zclock_mono() >= deadline) {
+            LWARN("https-request: batch: timed out before sending request %d of %d", i + 1, batch->count);
+            entry->response = error_reply("503 Service Unavailable", "Content-type: application/json",
+                                          "{\"error\":\"batch timed out\"}");
+            continue;
+        }
+        if ((entry->response = dispatch_local(entry->verb, entry->path, &(entry->headers))))
+            continue;
+        headers_str = headers_to_string(entry->headers);
+        entry->sock = send_to_api(entry->verb, entry->path, headers_str, entry->body);
+        free(headers_str);
+        if (!batch->parallel)
+            entry->response = recv_from_api(&(entry->sock), (int) (deadline - zclock_mono()));
+    }
+
+    out = strdup("[");
+    for (i = 0; i < batch->count; i++) {
+        batch_entry_t *entry = &(batch->entries[i]);
+        if (!entry->response)
+            entry->response = recv_from_api(&(entry->sock), (int) (deadline - zclock_mono()));
+        out = append_batch_response(out, entry->response, i == 0);
+    }
+    out = (char *) realloc(out, strlen(out) + 2);
+    strcat(out, "]");
+
+    msg = error_reply("200 OK", "Content-type: application/json", out);
+    free(out);
+
+cleanup:
+    for (i = 0; i < batch->count; i++) {
+        batch_entry_t *entry = &(batch->entries[i]);
+        if (entry->verb)     free(entry->verb);
+        if (entry->path)     free(entry->path);
+        if (entry->body)     free(entry->body);
+        if (entry->response) zmsg_destroy(&(entry->response));
+        free_headers(&(entry->headers));
+    }
+    if (tokens) free(tokens);
+    free(batch);
+    return msg;
+}
+
+/*
+ * Histograms of how long recent backend requests to each host took:
+ *
+ *     GET /v1/backend/timings.json
+ *
+ * The backend service's "timings" reply is turned into JSON of the form
+ * {"bounds": [1, 5, ...], "hosts": {"example.com": {"samples": 42,
+ * "dns": [...], "connect": [...], ...}}}. See "Timing" in the backend
+ * plugin for what the numbers mean.
+ */
+static zmsg_t *dispatch_backend_timings(void) {
+    zsock_t *sock = zsock_new_req(BACKEND_ENDPOINT);
+    zpoller_t *poller = zpoller_new(sock, NULL);
+    zmsg_t *reply = NULL, *msg;
+    char *key, *value, *out = NULL, *ptr;
+    size_t out_len = 0;
+    FILE *json;
+    int hosts = 0, fields = 0;
+
+    if (!zsock_send(sock, "s", "timings") && zpoller_wait(poller, 5000))
+        reply = zmsg_recv(sock);
+    zpoller_destroy(&poller);
+    zsock_destroy(&sock);
+    if (reply == NULL) {
+        LERROR("https-request: no answer from the backend service");
+        return error_reply("503 Service Unavailable", "Content-type: application/json",
+                           "{\"error\":\"backend unavailable\"}");
+    }
+
+    json = open_memstream(&out, &out_len);
+    free(zmsg_popstr(reply));
+    fprintf(json, "{");
+    while ((key = zmsg_popstr(reply)) != NULL) {
+        if ((value = zmsg_popstr(reply)) == NULL) {
+            free(key);
+            break;
+        }
+        // the counts are space-separated
+        for (ptr = value; *ptr; ptr++)
+            if (*ptr == ' ') *ptr = ',';
+        if (!strcmp(key, "host")) {
+            fprintf(json, "%s\"%s\":{", hosts ? "}," : "\"hosts\":{", value);
+            hosts++;
+            fields = 0;
+        } else if (!strcmp(key, "bounds")) {
+            fprintf(json, "\"bounds\":[%s],", value);
+        } else if (!strcmp(key, "samples")) {
+            fprintf(json, "%s\"samples\":%s", fields++ ? "," : "", value);
+        } else {
+            fprintf(json, "%s\"%s\":[%s]", fields++ ? "," : "", key, value);
+        }
+        free(key);
+        free(value);
+    }
+    fputs(hosts ? "}}}" : "\"hosts\":{}}", json);
+    fclose(json);
+    zmsg_destroy(&reply);
+
+    msg = error_reply("200 OK", "Content-type: application/json", out);
+    free(out);
+    return msg;
+}
+
+/*
+ * How much memory the Lua scripts which are running are using:
+ *
+ *     GET /v1/lua/memory.json
+ *
+ * The reply is JSON of the form {"live": 123456, "pooled": 163840,
+ * "states": [{"live": 123456, "peak": 234567, "limit": 0, "pooled": 163840,
+ * "allocations": 4567, "failures": 0}]}, with an entry in "states" for each
+ * Lua state; "live" and "pooled" are their totals. See
+ * src/bindings/lua/memory.c for what the numbers mean.
+ */
+static zmsg_t *dispatch_lua_memory(void) {
+    lua_memory_stats_t stats[LUA_MEMORY_MAX_STATES];
+    size_t live = 0, pooled = 0;
+    char *out = NULL;
+    size_t out_len = 0;
+    FILE *json;
+    zmsg_t *msg;
+    int count, i;
+
+    count = lua_memory_stats(stats, LUA_MEMORY_MAX_STATES);
+    if (count > LUA_MEMORY_MAX_STATES) count = LUA_MEMORY_MAX_STATES;
+    for (i = 0; i < count; i++) {
+        live += stats[i].live;
+        pooled += stats[i].pooled;
+    }
+
+    json = open_memstream(&out, &out_len);
+    fprintf(json, "{\"live\":%lu,\"pooled\":%lu,\"states\":[",
+            (unsigned long) live, (unsigned long) pooled);
+    for (i = 0; i < count; i++) {
+        fprintf(json, "%s{\"live\":%lu,\"peak\":%lu,\"limit\":%lu,\"pooled\":%lu,"
+                      "\"allocations\":%lu,\"failures\":%lu}", i ? "," : "",
+                (unsigned long) stats[i].live,   (unsigned long) stats[i].peak,
+                (unsigned long) stats[i].limit,  (unsigned long) stats[i].pooled,
+                stats[i].allocations,            stats[i].failures);
+    }
+    fputs("]}", json);
+    fclose(json);
+
+    msg = error_reply("200 OK", "Content-type: application/json", out);
+    free(out);
+    return msg;
+}
+
+/*
+ * Answers the requests for resources which are served here rather than by
+ * the API. Returns NULL for a request which is to be sent to the API.
+ * Requests in a batch are routed through here too, so that they are
+ * answered just as they would be on their own.
+ */
+static zmsg_t *dispatch_local(const char *verb, const char *path, header_t **headers) {
+    if (api_path_is(path, SESSIONS_RESOURCE))
+        return dispatch_sessions(verb, headers);
+    if (!strcmp(verb, "GET") && api_path_is(path, BACKEND_TIMINGS_RESOURCE))
+        return dispatch_backend_timings();
+    if (!strcmp(verb, "GET") && api_path_is(path, LUA_MEMORY_RESOURCE))
+        return dispatch_lua_memory();
+    return NULL;
+}
+
+/*
+ * Dispatches a single request by connecting to the internal socket and
+ * sending the request data to the socket. The reason the socket is used is
+ * to maximize the freedom of the actual API implementation. At time of
+ * writing, the API implementation is likely to be running in Lua on the main
+ * thread. Not only is a zeromq socket a convenient way to share data with
+ * the API, it also allows the API to evolve in virtually any way as long as
+ * it communicates via ZMQ.
+ *
+ * `transport` is one of the ADMISSION_TRANSPORT_* constants. The request
+ * must be admitted before it is sent to the API; if it can't be, a 503
+ * response is returned straight away. Session tokens are resolved before
+ * admission, so a request with an invalid token never reaches the API.
+ */
+char *dispatch_request(int transport, const char *verb, const char *path,
+                       header_t **headers, const char *request_body) {
+    zmsg_t *msg = NULL;
+    char *response_status = NULL,
+         *response_headers = NULL,
+         *response_body = NULL,
+         *response = NULL;
+    int admission;
+
+    if (api_path_is(path, SESSIONS_RESOURCE)) {
+        msg = dispatch_sessions(verb, headers);
+        goto respond;
+    }
+    if (apply_session(headers)) {
+        msg = error_reply("401 Unauthorized", "Content-type: application/json",
+                          "{\"error\":\"invalid or expired session\"}");
+        goto respond;
+    }
+
+    admission = admission_acquire(transport, admission_priority(verb, path), ADMISSION_MAX_WAIT);
+    if (admission != ADMISSION_ADMITTED) {
+        msg = error_reply("503 Service Unavailable", "Content-type: application/json\nRetry-after: 1",
+                          "{\"error\":\"busy\"}");
     } else {
-        response_status = zmsg_popstr(msg);
-        response_headers = zmsg_popstr(msg);
-        response_body = zmsg_popstr(msg);
+        if (!strcmp(verb, "POST") && api_path_is(path, BATCH_RESOURCE)) {
+            msg = dispatch_batch(headers, request_body);
+        } else if (!(msg = dispatch_local(verb, path, headers))) {
+            char *headers_str = headers_to_string(*headers);
+            zsock_t *sock = send_to_api(verb, path, headers_str, request_body);
+            msg = recv_from_api(&sock, API_TIMEOUT);
+            free(headers_str);
+        }
+        admission_release(transport);
     }
 
+respond:
+    response_status = zmsg_popstr(msg);
+    response_headers = zmsg_popstr(msg);
+    response_body = zmsg_popstr(msg);
+
     (void) trim(response_headers);
     response = (char *) calloc(strlen(response_status) +
                                strlen(response_headers) +
@@ -246,10 +947,7 @@ char *dispatch_request(const char *verb, const char *path,
     free(response_status);
     free(response_headers);
     free(response_body);
-    free(headers_str);
-    zpoller_destroy(&poller);
     zmsg_destroy(&msg);
-    zsock_destroy(&sock);
     
     return response;
 }
@@ -343,10 +1041,15 @@ void https_api_handle_request(zsock_t *pipe, void *args) {
                 }
             }
 
-            char *response = dispatch_request(verb, path, &(request->request_headers), request_body);
-            SSL_write(ssl, response, strlen(response));
-            LDEBUG("https-request: response has been sent");
-            free(response);
+            if (is_event_stream_request(verb, path)) {
+                stream_events(pipe, ssl, verb, path, &(request->request_headers));
+            } else {
+                char *response = dispatch_request(ADMISSION_TRANSPORT_HTTPS, verb, path,
+                                                  &(request->request_headers), request_body);
+                SSL_write(ssl, response, strlen(response));
+                LDEBUG("https-request: response has been sent");
+                free(response);
+            }
 
             if (request_body) free(request_body);
             LDEBUG("https-request: freeing request headers");
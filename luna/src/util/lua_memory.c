@@ -0,0 +1,49 @@
+#include <pthread.h>
+#include "util/lua_memory.h"
+#include "util/utlist.h"
+
+/*
+ * The memory accounting of every Lua state which is running, so that the
+ * REST API can report it without reaching into the Lua bindings. The list
+ * is guarded by a lock, and the counters in each account are read with
+ * atomic loads since the state's own thread keeps updating them.
+ */
+
+static lua_memory_account_t *accounts = NULL;
+static pthread_mutex_t accounts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void lua_memory_account_add(lua_memory_account_t *account) {
+    pthread_mutex_lock(&accounts_lock);
+    DL_APPEND(accounts, account);
+    pthread_mutex_unlock(&accounts_lock);
+}
+
+void lua_memory_account_remove(lua_memory_account_t *account) {
+    pthread_mutex_lock(&accounts_lock);
+    DL_DELETE(accounts, account);
+    pthread_mutex_unlock(&accounts_lock);
+}
+
+/*
+ * Copies the accounting of up to `max` states into `stats`, returning how
+ * many states there are.
+ */
+int lua_memory_stats(lua_memory_stats_t *stats, int max) {
+    lua_memory_account_t *account;
+    int count = 0;
+
+    pthread_mutex_lock(&accounts_lock);
+    DL_FOREACH(accounts, account) {
+        if (count < max) {
+            stats[count].live        = __atomic_load_n(&account->live,        __ATOMIC_RELAXED);
+            stats[count].peak        = __atomic_load_n(&account->peak,        __ATOMIC_RELAXED);
+            stats[count].limit       = __atomic_load_n(&account->limit,       __ATOMIC_RELAXED);
+            stats[count].pooled      = __atomic_load_n(&account->pooled,      __ATOMIC_RELAXED);
+            stats[count].allocations = __atomic_load_n(&account->allocations, __ATOMIC_RELAXED);
+            stats[count].failures    = __atomic_load_n(&account->failures,    __ATOMIC_RELAXED);
+        }
+        count++;
+    }
+    pthread_mutex_unlock(&accounts_lock);
+    return count;
+}
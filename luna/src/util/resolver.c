@@ -0,0 +1,368 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "util/resolver.h"
+#include "util/uthash.h"
+#include "util/utlist.h"
+
+/*
+ * Host name resolution which never blocks the caller. Lookups run
+ * getaddrinfo() on up to RESOLVER_MAX_LOOKUPS threads of their own, and
+ * wait their turn beyond that, so a slow or unreachable DNS server holds up
+ * nothing but the connections waiting for its hosts, and the
+ * answers, IPv4 and IPv6 alike, are kept for RESOLVER_TTL seconds in one
+ * cache for the whole process. The socket plugin resolves through it, and
+ * the backend hands what it finds there to curl.
+ *
+ * A query is started with `resolver_query()`. If the answer is already
+ * known (the host is cached, or is an IP address) `resolver_query_result()`
+ * returns it straight away; otherwise it returns -1 until the lookup is
+ * done, and the descriptor from `resolver_query_fd()` becomes readable when
+ * it is. Callers asking for the same host while its lookup runs share it.
+ * Failed lookups aren't cached.
+ *
+ * `resolver_set_lookup()` replaces getaddrinfo(), so that tests can resolve
+ * names from a table of their own without touching the network.
+ */
+
+struct resolver_query_t {
+    char *host;
+    resolver_lookup_fn lookup;
+    int fds[2];        // the lookup writes to fds[1] when it's done, if it runs
+    int done;
+    int n;
+    resolver_addr_t addrs[RESOLVER_MAX_ADDRS];
+    int refs;          // the callers', the cache's and the lookup's
+    struct resolver_query_t *next; // while waiting for a thread
+};
+
+typedef struct {
+    char *host;
+    resolver_addr_t addrs[RESOLVER_MAX_ADDRS];
+    int n;
+    time_t expires_at;          // in seconds of the monotonic clock
+    resolver_query_t *pending;  // the lookup running for it, if any
+    UT_hash_handle hh;
+} cache_entry_t;
+
+static int lookup_with_getaddrinfo(const char *host, resolver_addr_t *addrs, int max);
+
+static cache_entry_t *cache = NULL;
+static resolver_lookup_fn lookup = lookup_with_getaddrinfo;
+static resolver_query_t *waiting = NULL; // lookups for the threads to run
+static int num_threads = 0;
+static pthread_mutex_t resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static int lookup_with_getaddrinfo(const char *host, resolver_addr_t *addrs, int max) {
+    struct addrinfo hints, *res, *ai;
+    void *addr;
+    int n = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &res)) return 0;
+    for (ai = res; ai && n < max; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET)
+            addr = &((struct sockaddr_in *) ai->ai_addr)->sin_addr;
+        else if (ai->ai_family == AF_INET6)
+            addr = &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr;
+        else
+            continue;
+        if (!inet_ntop(ai->ai_family, addr, addrs[n].ip, sizeof(addrs[n].ip))) continue;
+        addrs[n++].family = ai->ai_family;
+    }
+    freeaddrinfo(res);
+    return n;
+}
+
+/* an IP address needs no lookup; returns 1 if `host` is one */
+static int numeric_address(const char *host, resolver_addr_t *addr) {
+    unsigned char buf[sizeof(struct in6_addr)];
+
+    if (inet_pton(AF_INET, host, buf) == 1)       addr->family = AF_INET;
+    else if (inet_pton(AF_INET6, host, buf) == 1) addr->family = AF_INET6;
+    else return 0;
+    snprintf(addr->ip, sizeof(addr->ip), "%s", host);
+    return 1;
+}
+
+/* must be called with the lock held */
+static resolver_query_t *new_query(const char *host) {
+    resolver_query_t *query = (resolver_query_t *) calloc(1, sizeof(resolver_query_t));
+    query->host = strdup(host);
+    query->lookup = lookup;
+    query->fds[0] = query->fds[1] = -1;
+    query->refs = 1;
+    return query;
+}
+
+/* must be called with the lock held */
+static void release_query(resolver_query_t *query) {
+    if (--query->refs > 0) return;
+    if (query->fds[0] >= 0) close(query->fds[0]);
+    if (query->fds[1] >= 0) close(query->fds[1]);
+    free(query->host);
+    free(query);
+}
+
+/* must be called with the lock held */
+static void free_entry(cache_entry_t *entry) {
+    HASH_DEL(cache, entry);
+    if (entry->pending) release_query(entry->pending);
+    free(entry->host);
+    free(entry);
+}
+
+/* must be called with the lock held; returns the entry if it's fresh */
+static cache_entry_t *find_fresh(const char *host) {
+    cache_entry_t *entry = NULL;
+    HASH_FIND_STR(cache, host, entry);
+    return entry && entry->n > 0 && entry->expires_at > now_s() ? entry : NULL;
+}
+
+/* must be called with the lock held */
+static void make_room(void) {
+    cache_entry_t *entry, *tmp;
+    time_t now = now_s();
+
+    if (HASH_COUNT(cache) < RESOLVER_MAX_HOSTS) return;
+    HASH_ITER(hh, cache, entry, tmp) {
+        if (!entry->pending && entry->expires_at <= now) free_entry(entry);
+    }
+    // then the oldest, if that wasn't enough
+    HASH_ITER(hh, cache, entry, tmp) {
+        if (HASH_COUNT(cache) < RESOLVER_MAX_HOSTS) break;
+        if (!entry->pending) free_entry(entry);
+    }
+}
+
+/* must be called with the lock held */
+static void finish_lookup(resolver_query_t *query, resolver_addr_t *addrs, int n) {
+    cache_entry_t *entry = NULL;
+    char done = 1;
+
+    memcpy(query->addrs, addrs, n * sizeof(resolver_addr_t));
+    query->n = n;
+    query->done = 1;
+    HASH_FIND_STR(cache, query->host, entry);
+    if (entry && entry->pending == query) {
+        entry->pending = NULL;
+        release_query(query);
+        if (n > 0) {
+            memcpy(entry->addrs, addrs, n * sizeof(resolver_addr_t));
+            entry->n = n;
+            entry->expires_at = now_s() + RESOLVER_TTL;
+        } else {
+            free_entry(entry);
+        }
+    }
+    if (write(query->fds[1], &done, 1) < 0) {} // it stays readable for every waiter
+    release_query(query);
+}
+
+/* runs lookups until there are none waiting */
+static void *run_lookups(void *arg) {
+    resolver_query_t *query = (resolver_query_t *) arg;
+    resolver_addr_t addrs[RESOLVER_MAX_ADDRS];
+    int n;
+
+    while (query) {
+        n = query->lookup(query->host, addrs, RESOLVER_MAX_ADDRS);
+        pthread_mutex_lock(&resolver_lock);
+        finish_lookup(query, addrs, n);
+        if ((query = waiting)) LL_DELETE(waiting, query);
+        else num_threads--;
+        pthread_mutex_unlock(&resolver_lock);
+    }
+    return NULL;
+}
+
+/*
+ * Must be called with the lock held. Runs `query` on a thread of its own,
+ * or has it wait for one if RESOLVER_MAX_LOOKUPS are already running.
+ * Returns 0 if it will be run.
+ */
+static int schedule_lookup(resolver_query_t *query) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    int started = 0;
+
+    if (num_threads < RESOLVER_MAX_LOOKUPS) {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        started = !pthread_create(&thread, &attr, run_lookups, query);
+        pthread_attr_destroy(&attr);
+        if (started) num_threads++;
+    }
+    if (!started) {
+        // a running thread picks it up when it's done
+        if (num_threads == 0) return -1;
+        LL_APPEND(waiting, query);
+    }
+    return 0;
+}
+
+/*
+ * Must be called with the lock held. Returns the lookup running for `host`,
+ * starting one if there isn't one, or NULL if it couldn't be started.
+ */
+static resolver_query_t *start_lookup(const char *host) {
+    cache_entry_t *entry = NULL;
+    resolver_query_t *query;
+
+    HASH_FIND_STR(cache, host, entry);
+    if (entry && entry->pending) return entry->pending;
+
+    query = new_query(host);
+    if (pipe(query->fds)) {
+        query->fds[0] = query->fds[1] = -1;
+        release_query(query);
+        return NULL;
+    }
+    query->refs = 2; // the cache's and the lookup's
+    if (schedule_lookup(query)) {
+        query->refs = 1;
+        release_query(query);
+        return NULL;
+    }
+
+    if (!entry) {
+        make_room();
+        entry = (cache_entry_t *) calloc(1, sizeof(cache_entry_t));
+        entry->host = strdup(host);
+        HASH_ADD_KEYPTR(hh, cache, entry->host, strlen(entry->host), entry);
+    }
+    entry->pending = query;
+    return query;
+}
+
+/*
+ * Starts resolving `host`, unless the answer is already known. The query
+ * must be freed with `resolver_query_free()`.
+ */
+resolver_query_t *resolver_query(const char *host) {
+    resolver_query_t *query, *pending = NULL;
+    cache_entry_t *entry;
+
+    pthread_mutex_lock(&resolver_lock);
+    query = new_query(host);
+    if ((query->n = numeric_address(host, query->addrs))) {
+        query->done = 1;
+    } else if ((entry = find_fresh(host))) {
+        memcpy(query->addrs, entry->addrs, entry->n * sizeof(resolver_addr_t));
+        query->n = entry->n;
+        query->done = 1;
+    } else if ((pending = start_lookup(host))) {
+        release_query(query);
+        query = pending;
+        query->refs++;
+    }
+    pthread_mutex_unlock(&resolver_lock);
+
+    // without a thread to run it on, look it up here and now
+    if (query != pending && !query->done) {
+        query->n = query->lookup(host, query->addrs, RESOLVER_MAX_ADDRS);
+        query->done = 1;
+    }
+    return query;
+}
+
+/*
+ * Returns a descriptor which becomes readable when the query's lookup is
+ * done, or -1 if it was done from the start.
+ */
+int resolver_query_fd(resolver_query_t *query) {
+    return query->fds[0];
+}
+
+/*
+ * Copies at most `max` of the addresses found into `addrs` and returns how
+ * many there were, 0 if the host wasn't found, or -1 if the lookup is still
+ * running.
+ */
+int resolver_query_result(resolver_query_t *query, resolver_addr_t *addrs, int max) {
+    int n = -1;
+
+    pthread_mutex_lock(&resolver_lock);
+    if (query->done) {
+        n = query->n < max ? query->n : max;
+        memcpy(addrs, query->addrs, n * sizeof(resolver_addr_t));
+    }
+    pthread_mutex_unlock(&resolver_lock);
+    return n;
+}
+
+void resolver_query_free(resolver_query_t *query) {
+    pthread_mutex_lock(&resolver_lock);
+    release_query(query);
+    pthread_mutex_unlock(&resolver_lock);
+}
+
+/*
+ * Copies at most `max` of the cached addresses of `host` into `addrs` and
+ * returns how many there were, or 0 if there's no fresh answer for it.
+ */
+int resolver_cached(const char *host, resolver_addr_t *addrs, int max) {
+    cache_entry_t *entry;
+    int n = 0;
+
+    if (max > 0 && numeric_address(host, addrs)) return 1;
+    pthread_mutex_lock(&resolver_lock);
+    if ((entry = find_fresh(host))) {
+        n = entry->n < max ? entry->n : max;
+        memcpy(addrs, entry->addrs, n * sizeof(resolver_addr_t));
+    }
+    pthread_mutex_unlock(&resolver_lock);
+    return n;
+}
+
+/*
+ * Starts resolving `host` in the background, if it isn't cached, so that
+ * the answer is there when it's next asked for.
+ */
+void resolver_prefetch(const char *host) {
+    resolver_addr_t addr;
+
+    if (numeric_address(host, &addr)) return;
+    pthread_mutex_lock(&resolver_lock);
+    if (!find_fresh(host)) start_lookup(host);
+    pthread_mutex_unlock(&resolver_lock);
+}
+
+/*
+ * Resolves host names with `fn` from now on, or with getaddrinfo() again if
+ * it's NULL, and forgets everything resolved so far.
+ */
+void resolver_set_lookup(resolver_lookup_fn fn) {
+    pthread_mutex_lock(&resolver_lock);
+    lookup = fn ? fn : lookup_with_getaddrinfo;
+    pthread_mutex_unlock(&resolver_lock);
+    resolver_flush();
+}
+
+/*
+ * Forgets everything resolved so far. Lookups still running finish, but
+ * their answers aren't kept.
+ */
+void resolver_flush(void) {
+    cache_entry_t *entry, *tmp;
+
+    pthread_mutex_lock(&resolver_lock);
+    HASH_ITER(hh, cache, entry, tmp) {
+        free_entry(entry);
+    }
+    pthread_mutex_unlock(&resolver_lock);
+}
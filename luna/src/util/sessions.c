@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include "services.h"
+#include "util/sessions.h"
+#include "util/string_helpers.h"
+#include "util/uthash.h"
+
+/*
+ * Table of authenticated sessions. A session is created after a client has
+ * presented valid credentials once, and is identified by a random token
+ * which the client then sends in place of its credentials until the session
+ * expires or is revoked.
+ *
+ * The table is keyed by the SHA-256 digest of each token rather than the
+ * token itself, so that neither the lookup nor the final comparison can
+ * reveal anything about valid tokens through timing, and so that a memory
+ * dump doesn't contain usable tokens.
+ */
+
+#define TOKEN_BYTES 32
+
+typedef struct {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    char *user;
+    time_t expires_at;
+    UT_hash_handle hh;
+} session_t;
+
+static session_t *sessions = NULL;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void token_digest(const char *token, unsigned char *digest) {
+    SHA256((const unsigned char *) token, strlen(token), digest);
+}
+
+/* must be called with the lock held */
+static void free_session(session_t *session) {
+    HASH_DEL(sessions, session);
+    free(session->user);
+    free(session);
+}
+
+/* must be called with the lock held */
+static void prune_expired(time_t now) {
+    session_t *session, *tmp;
+    HASH_ITER(hh, sessions, session, tmp) {
+        if (session->expires_at <= now) free_session(session);
+    }
+}
+
+/* must be called with the lock held */
+static session_t *find_session(const char *token) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    session_t *session = NULL;
+
+    token_digest(token, digest);
+    HASH_FIND(hh, sessions, digest, sizeof(digest), session);
+    if (session && CRYPTO_memcmp(session->digest, digest, sizeof(digest)))
+        session = NULL;
+    return session;
+}
+
+/*
+ * Creates a new session for `user` which expires after `ttl` seconds, and
+ * returns its token, which must be freed. If SESSION_MAX sessions are
+ * already active, the one closest to expiring is revoked to make room.
+ * Returns NULL if no token could be generated.
+ */
+char *session_create(const char *user, int ttl) {
+    unsigned char bytes[TOKEN_BYTES];
+    session_t *session, *tmp, *oldest = NULL;
+    time_t now = time(NULL);
+    char *token;
+
+    if (RAND_bytes(bytes, sizeof(bytes)) != 1) {
+        LERROR("sessions: could not generate a session token");
+        return NULL;
+    }
+    token = bytes2hex((const char *) bytes, sizeof(bytes));
+    OPENSSL_cleanse(bytes, sizeof(bytes));
+
+    pthread_mutex_lock(&sessions_lock);
+    prune_expired(now);
+    if (HASH_COUNT(sessions) >= SESSION_MAX) {
+        HASH_ITER(hh, sessions, session, tmp) {
+            if (!oldest || session->expires_at < oldest->expires_at) oldest = session;
+        }
+        LINFO("sessions: %d sessions are active, revoking the oldest", SESSION_MAX);
+        free_session(oldest);
+    }
+
+    session = (session_t *) calloc(1, sizeof(session_t));
+    token_digest(token, session->digest);
+    session->user = strdup(user);
+    session->expires_at = now + ttl;
+    HASH_ADD(hh, sessions, digest, sizeof(session->digest), session);
+    pthread_mutex_unlock(&sessions_lock);
+
+    LDEBUG("sessions: created session for '%s', expires in %d seconds", user, ttl);
+    return token;
+}
+
+/*
+ * Returns 1 if `token` identifies an active session, in which case `user`,
+ * if not NULL, is set to a copy of the session's user name which must be
+ * freed. Returns 0 otherwise.
+ */
+int session_lookup(const char *token, char **user) {
+    session_t *session;
+    int found = 0;
+
+    pthread_mutex_lock(&sessions_lock);
+    session = find_session(token);
+    if (session && session->expires_at <= time(NULL)) {
+        free_session(session);
+        session = NULL;
+    }
+    if (session) {
+        found = 1;
+        if (user) *user = strdup(session->user);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    return found;
+}
+
+void session_revoke(const char *token) {
+    session_t *session;
+
+    pthread_mutex_lock(&sessions_lock);
+    session = find_session(token);
+    if (session) free_session(session);
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+void sessions_revoke_all(void) {
+    session_t *session, *tmp;
+    int count;
+
+    pthread_mutex_lock(&sessions_lock);
+    count = HASH_COUNT(sessions);
+    HASH_ITER(hh, sessions, session, tmp) {
+        free_session(session);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    if (count > 0) LINFO("sessions: revoked %d sessions", count);
+}
+
+int sessions_count(void) {
+    int count;
+    pthread_mutex_lock(&sessions_lock);
+    prune_expired(time(NULL));
+    count = HASH_COUNT(sessions);
+    pthread_mutex_unlock(&sessions_lock);
+    return count;
+}
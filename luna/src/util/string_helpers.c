@@ -98,3 +98,30 @@ invalid_hex:
   free(result);
   return NULL;
 }
+
+/*
+ * Returns a NULL-terminated copy of the first `len` bytes of `data`, escaped
+ * so that it can be placed between double quotes in a JSON document. Control
+ * characters and DEL are emitted as \u00XX escapes; other bytes, including
+ * those of multibyte UTF-8 characters, are passed through unchanged. The
+ * string must be freed.
+ */
+char *json_escape(const char *data, size_t len) {
+  char *str = calloc(1, (len * 6 + 1) * sizeof(char));
+  char *out = str;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    unsigned char ch = (unsigned char) data[i];
+    switch(ch) {
+      case '"':  *out++ = '\\'; *out++ = '"';  break;
+      case '\\': *out++ = '\\'; *out++ = '\\'; break;
+      case '\n': *out++ = '\\'; *out++ = 'n';  break;
+      case '\r': *out++ = '\\'; *out++ = 'r';  break;
+      case '\t': *out++ = '\\'; *out++ = 't';  break;
+      default:
+        if (ch < 0x20 || ch == 0x7f) out += sprintf(out, "\\u%04x", ch);
+        else *out++ = (char) ch;
+    }
+  }
+  return str;
+}
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "services.h"
+#include "util/admission.h"
+
+#define NUM_POLLERS ADMISSION_MAX_QUEUED
+#define WAIT        10000 // ms; long enough never to run out in these tests
+
+typedef struct {
+  int id;
+  int transport;
+  int priority;
+  int result;
+} request_t;
+
+// ids of the requests, in the order they were admitted
+static int order[NUM_POLLERS + 1];
+static int num_admitted = 0;
+static pthread_mutex_t results_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *request(void *arg) {
+  request_t *req = (request_t *) arg;
+  req->result = admission_acquire(req->transport, req->priority, WAIT);
+  if (req->result == ADMISSION_ADMITTED) {
+    pthread_mutex_lock(&results_lock);
+    order[num_admitted++] = req->id;
+    pthread_mutex_unlock(&results_lock);
+    admission_release(req->transport);
+  }
+  return NULL;
+}
+
+/* starts `req` on its own thread, returning once it has been queued */
+static void start_waiting(pthread_t *thread, request_t *req) {
+  int queued = admission_waiting();
+  pthread_create(thread, NULL, request, req);
+  while (admission_waiting() == queued) usleep(1000);
+}
+
+static void test_priorities(void) {
+  assert(admission_priority("GET",    "/v1/settings.json")       == ADMISSION_PRIORITY_POLLING);
+  assert(admission_priority("GET",    "/v1/transactions/1.json") == ADMISSION_PRIORITY_POLLING);
+  assert(admission_priority("POST",   "/v1/transactions/1.json") == ADMISSION_PRIORITY_CRITICAL);
+  assert(admission_priority("DELETE", "/latest/transactions.json") == ADMISSION_PRIORITY_CRITICAL);
+  assert(admission_priority("PUT",    "/v1/settings.json")       == ADMISSION_PRIORITY_NORMAL);
+}
+
+/*
+ * HTTPS may take every slot, but the slow transports can take only one.
+ */
+static void test_transport_limits(void) {
+  assert(admission_acquire(ADMISSION_TRANSPORT_HTTPS, ADMISSION_PRIORITY_CRITICAL, 0) == ADMISSION_ADMITTED);
+  assert(admission_acquire(ADMISSION_TRANSPORT_HTTPS, ADMISSION_PRIORITY_CRITICAL, 0) == ADMISSION_ADMITTED);
+  // every slot is taken now, so nothing more can run
+  assert(admission_acquire(ADMISSION_TRANSPORT_USB,   ADMISSION_PRIORITY_CRITICAL, 0) == ADMISSION_TIMED_OUT);
+  admission_release(ADMISSION_TRANSPORT_HTTPS);
+  admission_release(ADMISSION_TRANSPORT_HTTPS);
+
+  assert(admission_acquire(ADMISSION_TRANSPORT_USB,   ADMISSION_PRIORITY_CRITICAL, 0) == ADMISSION_ADMITTED);
+  assert(admission_acquire(ADMISSION_TRANSPORT_USB,   ADMISSION_PRIORITY_CRITICAL, 0) == ADMISSION_TIMED_OUT);
+  assert(admission_acquire(ADMISSION_TRANSPORT_HTTPS, ADMISSION_PRIORITY_POLLING,  0) == ADMISSION_ADMITTED);
+  admission_release(ADMISSION_TRANSPORT_HTTPS);
+  admission_release(ADMISSION_TRANSPORT_USB);
+  assert(admission_waiting() == 0);
+}
+
+/*
+ * A request whose transport has room runs at once, even with requests
+ * waiting on a transport that has none.
+ */
+static void test_skips_blocked_waiters(void) {
+  request_t waiter = { 0, ADMISSION_TRANSPORT_BLUETOOTH, ADMISSION_PRIORITY_CRITICAL, 1 };
+  pthread_t thread;
+
+  num_admitted = 0;
+  assert(admission_acquire(ADMISSION_TRANSPORT_BLUETOOTH, ADMISSION_PRIORITY_NORMAL, 0) == ADMISSION_ADMITTED);
+  start_waiting(&thread, &waiter);
+  assert(admission_acquire(ADMISSION_TRANSPORT_USB, ADMISSION_PRIORITY_POLLING, 0) == ADMISSION_ADMITTED);
+  admission_release(ADMISSION_TRANSPORT_USB);
+  assert(num_admitted == 0);
+
+  // the waiter runs as soon as its transport has room
+  admission_release(ADMISSION_TRANSPORT_BLUETOOTH);
+  pthread_join(thread, NULL);
+  assert(waiter.result == ADMISSION_ADMITTED);
+  assert(num_admitted == 1 && order[0] == 0);
+  assert(admission_waiting() == 0);
+}
+
+/*
+ * Waiters are admitted by priority and then in order of arrival. When the
+ * queue is full, requests of equal priority are turned away, and a more
+ * urgent one displaces the most recent of the least urgent waiters.
+ */
+static void test_queue_order(void) {
+  request_t pollers[NUM_POLLERS], payment;
+  pthread_t poller_threads[NUM_POLLERS], payment_thread;
+  int i;
+
+  num_admitted = 0;
+  // occupy every slot
+  assert(admission_acquire(ADMISSION_TRANSPORT_HTTPS, ADMISSION_PRIORITY_NORMAL, 0) == ADMISSION_ADMITTED);
+  assert(admission_acquire(ADMISSION_TRANSPORT_USB,   ADMISSION_PRIORITY_NORMAL, 0) == ADMISSION_ADMITTED);
+
+  // fill the queue with status polls. These share a transport with the
+  // payment request below, so only one of them can run at a time.
+  for (i = 0; i < NUM_POLLERS; i++) {
+    pollers[i] = (request_t) { i, ADMISSION_TRANSPORT_BLUETOOTH, ADMISSION_PRIORITY_POLLING, 1 };
+    start_waiting(&poller_threads[i], &pollers[i]);
+  }
+  assert(admission_waiting() == NUM_POLLERS);
+
+  // a full queue turns away requests of equal priority immediately
+  assert(admission_acquire(ADMISSION_TRANSPORT_USB, ADMISSION_PRIORITY_POLLING, WAIT) == ADMISSION_BUSY);
+
+  // but a payment request displaces the last poll and goes to the front
+  payment = (request_t) { NUM_POLLERS, ADMISSION_TRANSPORT_BLUETOOTH, ADMISSION_PRIORITY_CRITICAL, 1 };
+  pthread_create(&payment_thread, NULL, request, &payment);
+  pthread_join(poller_threads[NUM_POLLERS - 1], NULL);
+  assert(pollers[NUM_POLLERS - 1].result == ADMISSION_BUSY);
+  assert(admission_waiting() == NUM_POLLERS);
+  assert(num_admitted == 0);
+
+  admission_release(ADMISSION_TRANSPORT_HTTPS);
+  pthread_join(payment_thread, NULL);
+  for (i = 0; i < NUM_POLLERS - 1; i++)
+    pthread_join(poller_threads[i], NULL);
+  admission_release(ADMISSION_TRANSPORT_USB);
+
+  assert(payment.result == ADMISSION_ADMITTED);
+  assert(num_admitted == NUM_POLLERS);
+  assert(order[0] == NUM_POLLERS);
+  for (i = 0; i < NUM_POLLERS - 1; i++) {
+    assert(pollers[i].result == ADMISSION_ADMITTED);
+    assert(order[i + 1] == i);
+  }
+  assert(admission_waiting() == 0);
+}
+
+int main(int argc, char **argv) {
+  init_logger_service(LOG_LEVEL_DEBUG);
+  test_priorities();
+  test_transport_limits();
+  test_skips_blocked_waiters();
+  test_queue_order();
+  shutdown_logger_service();
+  return 0;
+}
@@ -0,0 +1,264 @@
+/*
+ * Benchmark for backend requests sent over HTTP/1.1 and over HTTP/2.
+ *
+ * Loads the backend plugin and sends it batches of concurrent GET requests
+ * for the same URL, first with "backend.http2_hosts" set to "*", so that
+ * they are multiplexed over one connection, then with it empty, so that
+ * each request in a batch needs a connection of its own. HTTP/2 goes first
+ * because curl would otherwise reuse the idle HTTP/1.1 connections for it,
+ * whereas an HTTP/2 connection is never used for an HTTP/1.1 request.
+ *
+ * For each round it reports how many connections were opened, which HTTP
+ * versions the server answered with and the latency of the requests, as
+ * the caller sees it.
+ *
+ * This is not run by `make check`. It needs a local server which speaks
+ * both HTTP/1.1 and HTTP/2 over TLS, for instance nghttpx in front of a
+ * cleartext nghttpd, using the test certificate:
+ *
+ *     nghttpd --no-tls -d . 8080 &
+ *     nghttpx -f'127.0.0.1,8443' -b'127.0.0.1,8080;;proto=h2' \
+ *             ../resources/server.key ../resources/server.crt &
+ *
+ * Then run it from the test directory:
+ *
+ *     READ_PATHS=./fs_data:.. WRITE_PATHS=. PLUGINS_PATH=.libs \
+ *         bin/backend_bench -c 16 -n 800 -u https://localhost:8443/
+ *
+ * A server which only speaks HTTP/2, like nghttpd on its own, fails every
+ * HTTP/1.1 request; use -2 to skip that round.
+ */
+#define _GNU_SOURCE
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <curl/curl.h>
+
+#include "services.h"
+#include "ssl_locks.h"
+
+#define DEFAULT_CONCURRENCY 16
+#define DEFAULT_REQUESTS    800
+#define DEFAULT_URL         "https://localhost:8443/"
+#define RESULT_TIMEOUT      30000 // ms
+
+bool ALLOW_DISABLE_SSL_VERIFICATION = true;
+char cacerts_bundle[PATH_MAX];
+
+typedef struct {
+  int concurrency;
+  int num_requests;
+  int http2_only;
+  const char *url;
+} options_t;
+
+typedef struct {
+  double *latencies; // in microseconds, of the requests which succeeded
+  int completed;
+  int failed;
+  int http1;         // answered over HTTP/1.x
+  int http2;         // answered over HTTP/2
+  long connections;  // opened by the backend during the round
+} round_t;
+
+static options_t options;
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+static long get_stat(zsock_t *req, const char *stat) {
+  zmsg_t *msg;
+  char *name, *value;
+  long n = -1;
+
+  if (zsock_send(req, "s", "stats") || !(msg = zmsg_recv(req))) return -1;
+  free(zmsg_popstr(msg));
+  while ((name = zmsg_popstr(msg))) {
+    value = zmsg_popstr(msg);
+    if (value && !strcmp(name, stat)) n = atol(value);
+    free(name);
+    free(value);
+  }
+  zmsg_destroy(&msg);
+  return n;
+}
+
+/*
+ * Reads one result from the dealer, after the frame with its ID that
+ * precedes it, and adds it to the round. Returns -1 if none arrived in time.
+ */
+static int read_result(zsock_t *dealer, round_t *round, double sent) {
+  zmsg_t *msg;
+  char *name, *value, *result = NULL, *version = NULL;
+
+  if (!(msg = zmsg_recv(dealer))) return -1; // the ID
+  zmsg_destroy(&msg);
+  if (!(msg = zmsg_recv(dealer))) return -1;
+
+  free(zmsg_popstr(msg)); // "backend-complete"
+  free(zmsg_popstr(msg)); // the ID again
+  while ((name = zmsg_popstr(msg))) {
+    value = zmsg_popstr(msg);
+    if (value && !strcmp(name, "result"))       { result  = value; value = NULL; }
+    if (value && !strcmp(name, "http_version")) { version = value; value = NULL; }
+    free(name);
+    free(value);
+  }
+  zmsg_destroy(&msg);
+
+  if (result && !strcmp(result, "success")) {
+    round->latencies[round->completed++] = now_us() - sent;
+    if (version && !strcmp(version, "2")) round->http2++;
+    else round->http1++;
+  } else {
+    round->failed++;
+  }
+  free(result);
+  free(version);
+  return 0;
+}
+
+static int run_round(zsock_t *req, zsock_t *settings, const char *http2_hosts, round_t *round) {
+  zsock_t *dealer = zsock_new_dealer("inproc://backend/router");
+  long opened;
+  double sent;
+  int sent_count = 0, batch, i;
+
+  settings_set(settings, 1, "backend.http2_hosts", http2_hosts);
+  // the backend picks up the change from the settings bus
+  zclock_sleep(100);
+
+  zsock_set_rcvtimeo(dealer, RESULT_TIMEOUT);
+  memset(round, 0, sizeof(*round));
+  round->latencies = (double *) calloc(options.num_requests, sizeof(double));
+  opened = get_stat(req, "connections_opened");
+
+  while (sent_count < options.num_requests) {
+    batch = options.num_requests - sent_count;
+    if (batch > options.concurrency) batch = options.concurrency;
+
+    sent = now_us();
+    for (i = 0; i < batch; i++)
+      zsock_send(dealer, "ssss", "url", options.url, "validate_ssl_certificates", "false");
+    for (i = 0; i < batch; i++) {
+      if (read_result(dealer, round, sent)) {
+        fprintf(stderr, "timed out waiting for a result\n");
+        zsock_destroy(&dealer);
+        return -1;
+      }
+    }
+    sent_count += batch;
+  }
+
+  round->connections = get_stat(req, "connections_opened") - opened;
+  zsock_destroy(&dealer);
+  return 0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, int n, double p) {
+  int i = (int) (p * n + 0.5) - 1;
+  if (i < 0) i = 0;
+  if (i >= n) i = n - 1;
+  return sorted[i];
+}
+
+static void report(const char *name, round_t *round) {
+  int n = round->completed;
+
+  printf("%s\n", name);
+  printf("  requests:     %d completed, %d failed\n", n, round->failed);
+  printf("  connections:  %ld opened\n", round->connections);
+  printf("  answered:     %d over HTTP/1.x, %d over HTTP/2\n", round->http1, round->http2);
+  if (n > 0) {
+    qsort(round->latencies, n, sizeof(double), compare_doubles);
+    printf("  latency (ms): p50 %.3f  p99 %.3f  max %.3f\n",
+           percentile(round->latencies, n, 0.50) / 1000.0,
+           percentile(round->latencies, n, 0.99) / 1000.0,
+           round->latencies[n - 1] / 1000.0);
+  }
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-c concurrency] [-n requests] [-u url] [-2] [-v]\n"
+                  "  -c  number of requests sent at once (default %d)\n"
+                  "  -n  total number of requests per round (default %d)\n"
+                  "  -u  URL to request (default %s)\n"
+                  "  -2  only run the HTTP/2 round\n"
+                  "  -v  log at debug level\n",
+          name, DEFAULT_CONCURRENCY, DEFAULT_REQUESTS, DEFAULT_URL);
+}
+
+int main(int argc, char **argv) {
+  int log_level = LOG_LEVEL_WARN, opt, err = 0;
+  zsock_t *req = NULL, *settings = NULL;
+  round_t http1, http2;
+  char *cwd;
+
+  options.concurrency = DEFAULT_CONCURRENCY;
+  options.num_requests = DEFAULT_REQUESTS;
+  options.url = DEFAULT_URL;
+
+  while ((opt = getopt(argc, argv, "c:n:u:2vh")) != -1) {
+    switch (opt) {
+      case 'c': options.concurrency  = atoi(optarg); break;
+      case 'n': options.num_requests = atoi(optarg); break;
+      case 'u': options.url          = optarg;       break;
+      case '2': options.http2_only   = 1;            break;
+      case 'v': log_level = LOG_LEVEL_DEBUG;         break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if (options.concurrency < 1 || options.num_requests < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  curl_global_init(CURL_GLOBAL_ALL);
+  cwd = get_current_dir_name();
+  sprintf(cacerts_bundle, "%s/fs_data/cacerts.pem", cwd);
+  free(cwd);
+
+  init_ssl_locks();
+  if ((err = init_logger_service(log_level)))   return err;
+  if ((err = init_tokenizer_service()))         goto shutdown;
+  if ((err = init_settings_service()))          goto shutdown;
+  if ((err = init_events_proxy_service()))      goto shutdown;
+  if ((err = init_plugins(NULL, argc, argv)))   goto shutdown;
+
+  req = zsock_new_req("inproc://backend");
+  settings = zsock_new_req(SETTINGS_ENDPOINT);
+
+  if ((err = run_round(req, settings, "*", &http2))) goto shutdown;
+  report("HTTP/2", &http2);
+  free(http2.latencies);
+  if (!options.http2_only) {
+    if ((err = run_round(req, settings, "", &http1))) goto shutdown;
+    report("HTTP/1.1", &http1);
+    free(http1.latencies);
+  }
+
+shutdown:
+  if (settings) zsock_destroy(&settings);
+  if (req)      zsock_destroy(&req);
+  shutdown_plugins();
+  shutdown_events_proxy_service();
+  shutdown_settings_service();
+  shutdown_tokenizer_service();
+  shutdown_logger_service();
+  shutdown_ssl_locks();
+  curl_global_cleanup();
+  return err;
+}
@@ -2,13 +2,21 @@
 #include "config.h"
 #include <unistd.h>
 #include <curl/curl.h>
+#include <dirent.h>
 #include <execinfo.h>
 #include <libxml/xpath.h>
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/socket.h>
+#include "bindings.h"
 #include "services.h"
 #include "ssl_locks.h"
+#include "util/files.h"
 
 bool ALLOW_DISABLE_SSL_VERIFICATION = true;
 char cacerts_bundle[PATH_MAX];
@@ -18,11 +26,13 @@ void api_server(zsock_t *pipe, void *arg) {
   zsock_t *api = zsock_new_rep("inproc://api");
   zpoller_t *poller = zpoller_new(pipe, api, NULL);
   void *in;
+  int hits = 0;
   zsock_signal(pipe, 0);
   LINFO("backend-test-api-server: initialized");
 
   while ((in = zpoller_wait(poller, -1)) != pipe) {
     char *verb, *pkey, *path, *hkey, *headers, *bkey, *body, *response;
+    const char *status = "200", *response_headers = "Content-type: text/plain";
     zmsg_t *msg = zmsg_recv(api);
     verb = zmsg_popstr(msg);
     pkey = zmsg_popstr(msg);
@@ -31,13 +41,26 @@ void api_server(zsock_t *pipe, void *arg) {
     headers = zmsg_popstr(msg);
     bkey = zmsg_popstr(msg);
     body = zmsg_popstr(msg);
+    hits++;
     if (strstr(headers, "echo-headers")) {
       response = strdup(headers);
+    } else if (!strncmp(path, "/cached", 7)) {
+      // the hit count shows whether the response came from the cache
+      response_headers = "Content-type: text/plain\r\nCache-Control: max-age=60";
+      if (asprintf(&response, "%s #%d", path, hits) < 0) response = NULL;
+    } else if (!strncmp(path, "/revalidated", 12)) {
+      response_headers = "Content-type: text/plain\r\nCache-Control: no-cache\r\nETag: \"v1\"";
+      if (strcasestr(headers, "If-None-Match: \"v1\"")) {
+        status = "304 Not Modified";
+        response = strdup("");
+      } else if (asprintf(&response, "%s #%d", path, hits) < 0) {
+        response = NULL;
+      }
     } else {
       response = (char *) calloc(strlen(verb) + strlen(body) + strlen(path) + 8, sizeof(char));
       sprintf(response, "%s\n%s\n%s", verb, path, body);
     }
-    zsock_send(api, "sss", "200", "Content-type: text/plain", response);
+    zsock_send(api, "sss", status, response_headers, response);
     free(verb);
     free(pkey);
     free(path);
@@ -58,16 +81,16 @@ void api_server(zsock_t *pipe, void *arg) {
        *duration = NULL;                                                     \
   int code, bsize;
 #define freeall()                                                            \
-  if (rid)      free(rid);                                                   \
-  if (rid2)     free(rid2);                                                  \
-  if (rkey)     free(rkey);                                                  \
-  if (result)   free(result);                                                \
-  if (ckey)     free(ckey);                                                  \
-  if (bkey)     free(bkey);                                                  \
-  if (body)     free(body);                                                  \
-  if (dkey)     free(dkey);                                                  \
-  if (duration) free(duration);                                              \
-  if (rtopic)   free(rtopic);
+  if (rid)      { free(rid);      rid      = NULL; }                         \
+  if (rid2)     { free(rid2);     rid2     = NULL; }                         \
+  if (rkey)     { free(rkey);     rkey     = NULL; }                         \
+  if (result)   { free(result);   result   = NULL; }                         \
+  if (ckey)     { free(ckey);     ckey     = NULL; }                         \
+  if (bkey)     { free(bkey);     bkey     = NULL; }                         \
+  if (body)     { free(body);     body     = NULL; }                         \
+  if (dkey)     { free(dkey);     dkey     = NULL; }                         \
+  if (duration) { free(duration); duration = NULL; }                         \
+  if (rtopic)   { free(rtopic);   rtopic   = NULL; }
 #define test_req(a...)                                                       \
   assert(!zsock_send(req, a));                                               \
   assert(!zsock_recv(req, "ss", &rkey, &rid));                               \
@@ -79,10 +102,10 @@ void api_server(zsock_t *pipe, void *arg) {
 #define Green   "\x1b[32m"
 #define Regular "\x1b[0m"
 #define Assert(x)                                                            \
-  if (!x) { LDEBUG(Red "Assert: FAIL: %s" Regular, #x); assert(0); }         \
+  if (!(x)) { LDEBUG(Red "Assert: FAIL: %s" Regular, #x); assert(0); }       \
   else { LDEBUG(Green "Assert: %s" Regular, #x); }
 #define Assert2(x, y) \
-  if (!x) { LDEBUG(Red "Assert: FAIL: (%s) : \%{%s}" Regular, #x, y); assert(0); } \
+  if (!(x)) { LDEBUG(Red "Assert: FAIL: (%s) : \%{%s}" Regular, #x, y); assert(0); } \
   else { LDEBUG(Green "Assert: %s" Regular, #x); }
 
 /*
@@ -331,6 +354,916 @@ void test_reuse_resources_without_leaking_data(zsock_t *req) {
   freeall();
 }
 
+/*
+ * A loopback HTTPS server which holds on to every request until `expected`
+ * of them are in flight at once, then notes how many threads and how much
+ * memory the process is using before answering them all.
+ */
+#define LOOPBACK_PORT 44444
+#define LOOPBACK_MAX_CLIENTS 128
+
+typedef struct {
+  int listener;
+  int expected;
+  int received;
+  int threads_in_flight;
+  long rss_in_flight;
+} loopback_t;
+
+static int count_threads(void) {
+  DIR *dir = opendir("/proc/self/task");
+  struct dirent *entry;
+  int n = 0;
+  while ((entry = readdir(dir)))
+    if (entry->d_name[0] != '.') n++;
+  closedir(dir);
+  return n;
+}
+
+static long resident_kb(void) {
+  FILE *in = fopen("/proc/self/status", "r");
+  char line[256];
+  long kb = 0;
+  while (fgets(line, sizeof(line), in))
+    if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) break;
+  fclose(in);
+  return kb;
+}
+
+static void *loopback_server(void *arg) {
+  loopback_t *lb = (loopback_t *) arg;
+  SSL_CTX *ctx = SSL_CTX_new(SSLv23_server_method());
+  SSL *clients[LOOPBACK_MAX_CLIENTS];
+  char *crt = find_readable_file(NULL, "server.crt");
+  char *key = find_readable_file(NULL, "server.key");
+  const char *response = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok";
+  int i;
+
+  assert(SSL_CTX_use_certificate_chain_file(ctx, crt) == 1);
+  assert(SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) == 1);
+  free(crt);
+  free(key);
+
+  for (lb->received = 0; lb->received < lb->expected; lb->received++) {
+    char buf[1024];
+    int len = 0, bytes, fd = accept(lb->listener, NULL, NULL);
+    if (fd == -1) break; // timed out; the backend isn't running them concurrently
+    clients[lb->received] = SSL_new(ctx);
+    SSL_set_fd(clients[lb->received], fd);
+    assert(SSL_accept(clients[lb->received]) == 1);
+    do {
+      bytes = SSL_read(clients[lb->received], buf + len, sizeof(buf) - 1 - len);
+      if (bytes > 0) len += bytes;
+      buf[len] = '\0';
+    } while (bytes > 0 && !strstr(buf, "\r\n\r\n"));
+  }
+
+  lb->threads_in_flight = count_threads();
+  lb->rss_in_flight = resident_kb();
+
+  for (i = 0; i < lb->received; i++) {
+    int fd = SSL_get_fd(clients[i]);
+    SSL_write(clients[i], response, strlen(response));
+    SSL_shutdown(clients[i]);
+    SSL_free(clients[i]);
+    close(fd);
+  }
+  SSL_CTX_free(ctx);
+  return NULL;
+}
+
+/*
+ * Every request runs on the backend service's own thread, so sending many of
+ * them at once must not start any more threads, and memory should only grow
+ * by what each connection needs.
+ */
+void test_concurrent_requests(zsock_t *req, int concurrency) {
+  zsock_t *settings = zsock_new_req(SETTINGS_ENDPOINT);
+  struct sockaddr_in addr;
+  struct timeval timeout = { 10, 0 };
+  loopback_t lb;
+  pthread_t server;
+  int i, one = 1, threads_before;
+  long rss_before;
+
+  // the server won't answer until all of them have connected
+  settings_set(settings, 2, "backend.max_host_connections", "0", "backend.max_active_requests", "0");
+
+  memset(&lb, 0, sizeof(lb));
+  lb.expected = concurrency;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(LOOPBACK_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  lb.listener = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(lb.listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(lb.listener, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  assert(!bind(lb.listener, (struct sockaddr *) &addr, sizeof(addr)));
+  assert(!listen(lb.listener, LOOPBACK_MAX_CLIENTS));
+  assert(!pthread_create(&server, NULL, loopback_server, &lb));
+
+  threads_before = count_threads();
+  rss_before = resident_kb();
+
+  for (i = 0; i < concurrency; i++) {
+    char *rkey, *rid;
+    assert(!zsock_send(req, "ssssss", "verb", "GET", "url", "https://127.0.0.1:44444/",
+                                      "validate_ssl_certificates", "false"));
+    assert(!zsock_recv(req, "ss", &rkey, &rid));
+    free(rkey);
+    free(rid);
+  }
+
+  for (i = 0; i < concurrency; i++) {
+    test_defn;
+    assert(!zsock_recv(bcast, "sssssisbss", &rtopic, &rid2, &rkey, &result, &ckey, &code,
+                                            &bkey, &body, &bsize, &dkey, &duration));
+    Assert2(!strcmp(result, "success"), result);
+    Assert(code == 200);
+    freeall();
+  }
+
+  pthread_join(server, NULL);
+  close(lb.listener);
+
+  LINFO("backend-test: %d concurrent requests: threads %d -> %d, resident memory %ld -> %ld kB",
+        concurrency, threads_before, lb.threads_in_flight, rss_before, lb.rss_in_flight);
+  Assert(lb.received == concurrency);
+  Assert(lb.threads_in_flight <= threads_before);
+
+  settings_set(settings, 2, "backend.max_host_connections", DEFAULT_BACKEND_MAX_HOST_CONNECTIONS,
+                           "backend.max_active_requests",  DEFAULT_BACKEND_MAX_ACTIVE_REQUESTS);
+  zsock_destroy(&settings);
+}
+
+/*
+ * Listens on port 44445 but never accepts, so that requests to it hang.
+ */
+static int listen_without_answering(void) {
+  struct sockaddr_in addr;
+  int one = 1, listener = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(44445);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  assert(!bind(listener, (struct sockaddr *) &addr, sizeof(addr)));
+  assert(!listen(listener, 16));
+  return listener;
+}
+
+static char *send_to_unresponsive_server(zsock_t *req, const char *priority, const char *timeout) {
+  char *rkey, *rid;
+  assert(!zsock_send(req, "ssssssss", "url", "https://127.0.0.1:44445/", "priority", priority,
+                                      "timeout", timeout, "validate_ssl_certificates", "false"));
+  assert(!zsock_recv(req, "ss", &rkey, &rid));
+  LDEBUG("backend-test: %s request: %s %s", priority, rkey, rid);
+  free(rkey);
+  return rid;
+}
+
+static void expect_error(const char *id, int expected_code, const char *expected_body) {
+  test_defn;
+  assert(!zsock_recv(bcast, "sssssisbss", &rtopic, &rid2, &rkey, &result, &ckey, &code,
+                                          &bkey, &body, &bsize, &dkey, &duration));
+  body = realloc(body, bsize + 1);
+  body[bsize] = '\0';
+  Assert2(!strcmp(rid2, id), rid2);
+  Assert2(!strcmp(result, "error"), result);
+  Assert(code == expected_code);
+  if (expected_body) { Assert2(!strcmp(body, expected_body), body); }
+  freeall();
+}
+
+/*
+ * With room for two requests to run and two to wait, against a server which
+ * accepts connections but never answers: background requests only get half
+ * of the running slots, a full queue refuses new requests, and requests can
+ * be cancelled or time out whether they are waiting or running.
+ */
+void test_queue_limits_and_cancellation(zsock_t *req) {
+  zsock_t *settings = zsock_new_req(SETTINGS_ENDPOINT);
+  int listener = listen_without_answering();
+  char *bulk1, *bulk2, *auth, *telemetry, *refused, *expiring, *rkey, *rid;
+
+  settings_set(settings, 2, "backend.max_active_requests", "2", "backend.max_queued_requests", "2");
+
+  bulk1     = send_to_unresponsive_server(req, "bulk",          "5000"); // runs
+  bulk2     = send_to_unresponsive_server(req, "bulk",          "5000"); // waits
+  auth      = send_to_unresponsive_server(req, "authorization", "500");  // runs
+  telemetry = send_to_unresponsive_server(req, "telemetry",     "2000"); // waits
+  refused   = send_to_unresponsive_server(req, "reversal",      "5000");
+  Assert2(!strcmp(refused, "overloaded"), refused);
+
+  assert(!zsock_send(req, "ss", "cancel", bulk2));
+  assert(!zsock_recv(req, "ss", &rkey, &rid));
+  Assert2(!strcmp(rkey, "cancelled"), rkey);
+  Assert2(!strcmp(rid, bulk2), rid);
+  free(rkey);
+  free(rid);
+  expect_error(bulk2, -7, "cancelled");
+
+  assert(!zsock_send(req, "ss", "cancel", bulk2));
+  assert(!zsock_recv(req, "ss", &rkey, &rid));
+  Assert2(!strcmp(rkey, "error"), rkey);
+  free(rkey);
+  free(rid);
+
+  // the authorization request runs out of time on the server, and this one
+  // while it waits behind it
+  expiring = send_to_unresponsive_server(req, "reversal", "100");
+  expect_error(expiring, -6, NULL);
+  expect_error(auth, CURLE_OPERATION_TIMEDOUT, NULL);
+
+  // cancelling the running bulk request makes room for the telemetry
+  assert(!zsock_send(req, "ss", "cancel", bulk1));
+  assert(!zsock_recv(req, "ss", &rkey, &rid));
+  Assert2(!strcmp(rkey, "cancelled"), rkey);
+  free(rkey);
+  free(rid);
+  expect_error(bulk1, -7, "cancelled");
+  expect_error(telemetry, CURLE_OPERATION_TIMEDOUT, NULL);
+
+  settings_set(settings, 2, "backend.max_active_requests", DEFAULT_BACKEND_MAX_ACTIVE_REQUESTS,
+                            "backend.max_queued_requests", DEFAULT_BACKEND_MAX_QUEUED_REQUESTS);
+  zsock_destroy(&settings);
+  close(listener);
+  free(bulk1);
+  free(bulk2);
+  free(auth);
+  free(telemetry);
+  free(refused);
+  free(expiring);
+}
+
+static void cancel_request(zsock_t *req, const char *id) {
+  char *rkey, *rid;
+  assert(!zsock_send(req, "ss", "cancel", id));
+  assert(!zsock_recv(req, "ss", &rkey, &rid));
+  Assert2(!strcmp(rkey, "cancelled"), rkey);
+  free(rkey);
+  free(rid);
+  expect_error(id, -7, "cancelled");
+}
+
+/*
+ * Whether a full queue refuses a request depends on whether that request
+ * could start itself: once background work has filled the queue, more of
+ * it is refused even though an authorization would still be started.
+ */
+void test_queue_full_of_background_work(zsock_t *req) {
+  zsock_t *settings = zsock_new_req(SETTINGS_ENDPOINT);
+  int listener = listen_without_answering();
+  char *bulk1, *bulk2, *telemetry, *refused, *auth;
+
+  settings_set(settings, 2, "backend.max_active_requests", "2", "backend.max_queued_requests", "2");
+
+  bulk1     = send_to_unresponsive_server(req, "bulk",          "5000"); // runs
+  bulk2     = send_to_unresponsive_server(req, "bulk",          "5000"); // waits
+  telemetry = send_to_unresponsive_server(req, "telemetry",     "5000"); // waits
+  refused   = send_to_unresponsive_server(req, "bulk",          "5000");
+  Assert2(!strcmp(refused, "overloaded"), refused);
+  auth      = send_to_unresponsive_server(req, "authorization", "200");  // runs
+  Assert2(strcmp(auth, "overloaded"), auth);
+  expect_error(auth, CURLE_OPERATION_TIMEDOUT, NULL);
+
+  cancel_request(req, bulk2);
+  cancel_request(req, telemetry);
+  cancel_request(req, bulk1);
+
+  settings_set(settings, 2, "backend.max_active_requests", DEFAULT_BACKEND_MAX_ACTIVE_REQUESTS,
+                            "backend.max_queued_requests", DEFAULT_BACKEND_MAX_QUEUED_REQUESTS);
+  zsock_destroy(&settings);
+  close(listener);
+  free(bulk1);
+  free(bulk2);
+  free(telemetry);
+  free(refused);
+  free(auth);
+}
+
+/*
+ * A request sent on the router is answered only to its sender. The bus just
+ * gets a notice, without the body, and only when asked for.
+ */
+void test_direct_reply(zsock_t *req) {
+  zsock_t *dealer = zsock_new_dealer("inproc://backend/router");
+  zsock_t *notices = zsock_new_sub(">" EVENTS_SUB_ENDPOINT, "backend-notice");
+  char *rkey, *rid, *ntopic, *nid, *nrkey, *nresult, *nckey, *ndkey, *nduration;
+  int ncode;
+  test_defn;
+
+  assert(!zsock_send(dealer, "ssssssss", "verb", "POST", "url", "https://localhost:44443/",
+                                         "body", "direct", "validate_ssl_certificates", "false"));
+  assert(!zsock_recv(dealer, "ss", &rkey, &rid));
+  Assert2(!strcmp(rkey, "broadcast_id"), rkey);
+  free(rkey);
+  assert(!zsock_recv(dealer, "sssssisbss", &rtopic, &rid2, &rkey, &result, &ckey, &code,
+                                           &bkey, &body, &bsize, &dkey, &duration));
+  body = realloc(body, bsize + 1);
+  body[bsize] = '\0';
+  Assert2(!strcmp(rtopic, "backend-complete"), rtopic);
+  Assert2(!strcmp(rid2, rid), rid2);
+  Assert2(!strcmp(result, "success"), result);
+  Assert2(!strcmp(body, "POST\n/\ndirect"), body);
+  freeall();
+
+  // nothing was broadcast, so that's all; now ask for a notice
+  zsock_set_rcvtimeo(bcast, 250);
+  Assert(zsock_recv(bcast, "s", &rtopic) == -1);
+  zsock_set_rcvtimeo(bcast, -1);
+
+  assert(!zsock_send(dealer, "ssssss", "url", "https://localhost:44443/", "notify", "true",
+                                       "validate_ssl_certificates", "false"));
+  assert(!zsock_recv(dealer, "ss", &rkey, &rid));
+  free(rkey);
+  assert(!zsock_recv(notices, "sssssiss", &ntopic, &nid, &nrkey, &nresult, &nckey, &ncode,
+                                          &ndkey, &nduration));
+  Assert2(!strcmp(nid, rid), nid);
+  Assert2(!strcmp(nresult, "success"), nresult);
+  Assert(ncode == 200);
+  free(rid);
+  free(ntopic);
+  free(nid);
+  free(nrkey);
+  free(nresult);
+  free(nckey);
+  free(ndkey);
+  free(nduration);
+
+  zsock_destroy(&notices);
+  zsock_destroy(&dealer);
+}
+
+/*
+ * Several requests made from Lua run at once while their coroutines wait for
+ * them, and one which is cancelled reports that.
+ */
+void test_lua_futures(void) {
+  int listener = listen_without_answering();
+  Assert(!lua_run_script(
+    "local backend = require('backend')"                                            "\n"
+    "local results = {}"                                                            "\n"
+    "local coroutines = {}"                                                         "\n"
+    "for i = 1, 4 do"                                                               "\n"
+    "  coroutines[i] = coroutine.create(function()"                                 "\n"
+    "    local future = assert(backend.request{url = 'https://localhost:44443/',"   "\n"
+    "                                          method = 'PUT', body = 'lua ' .. i," "\n"
+    "                                          validate_ssl_certificates = false})" "\n"
+    "    results[i] = future:await()"                                               "\n"
+    "  end)"                                                                        "\n"
+    "end"                                                                           "\n"
+    "local running = #coroutines"                                                   "\n"
+    "while running > 0 do"                                                          "\n"
+    "  running = 0"                                                                 "\n"
+    "  for _, co in ipairs(coroutines) do"                                          "\n"
+    "    if coroutine.status(co) ~= 'dead' then"                                    "\n"
+    "      assert(coroutine.resume(co))"                                            "\n"
+    "      running = running + 1"                                                   "\n"
+    "    end"                                                                       "\n"
+    "  end"                                                                         "\n"
+    "end"                                                                           "\n"
+    "for i = 1, 4 do"                                                               "\n"
+    "  assert(results[i].result == 'success', results[i].body)"                     "\n"
+    "  assert(results[i].code == 200)"                                              "\n"
+    "  assert(results[i].body == 'PUT\\n/\\nlua ' .. i, results[i].body)"           "\n"
+    "end"                                                                           "\n"
+    "local slow = assert(backend.request{url = 'https://127.0.0.1:44445/',"         "\n"
+    "                                    validate_ssl_certificates = false})"       "\n"
+    "assert(not slow:ready())"                                                      "\n"
+    "assert(slow:cancel())"                                                         "\n"
+    "local response = slow:wait(1000)"                                              "\n"
+    "assert(response and response.body == 'cancelled', response and response.body)" "\n"
+  ));
+  close(listener);
+}
+
+/*
+ * Reactor tasks wait for their futures in `reactor.run()` rather than
+ * polling them, and one whose request times out gets the service's answer.
+ */
+void test_lua_futures_in_reactor(void) {
+  int listener = listen_without_answering();
+  Assert(!lua_run_script(
+    "local reactor = require('reactor')"                                            "\n"
+    "local backend = require('backend')"                                            "\n"
+    "local results, slow = {}, nil"                                                 "\n"
+    "for i = 1, 3 do"                                                               "\n"
+    "  reactor.spawn(function()"                                                    "\n"
+    "    local future = assert(backend.request{url = 'https://localhost:44443/',"   "\n"
+    "                                          method = 'PUT', body = 'lua ' .. i," "\n"
+    "                                          validate_ssl_certificates = false})" "\n"
+    "    results[i] = future:await()"                                               "\n"
+    "  end)"                                                                        "\n"
+    "end"                                                                           "\n"
+    "reactor.spawn(function()"                                                      "\n"
+    "  local future = assert(backend.request{url = 'https://127.0.0.1:44445/',"     "\n"
+    "                                        timeout = 300,"                        "\n"
+    "                                        validate_ssl_certificates = false})"   "\n"
+    "  local handle, what, timeout = future:waitable()"                             "\n"
+    "  assert(type(handle) == 'userdata' and what == 'read', what)"                 "\n"
+    "  assert(timeout > 300 and timeout <= 5300, timeout)"                          "\n"
+    "  slow = future:await()"                                                       "\n"
+    "end)"                                                                          "\n"
+    "assert(reactor.run(10000) == 0)"                                               "\n"
+    "for i = 1, 3 do"                                                               "\n"
+    "  assert(results[i].code == 200, results[i].body)"                             "\n"
+    "  assert(results[i].body == 'PUT\\n/\\nlua ' .. i, results[i].body)"           "\n"
+    "end"                                                                           "\n"
+    "assert(slow and slow.result == 'error', slow and slow.result)"                 "\n"
+    "assert(reactor.stats().wakeups < 20, reactor.stats().wakeups)"                 "\n"
+  ));
+  close(listener);
+}
+
+/*
+ * A streamed body arrives in numbered chunks ahead of an empty result, a
+ * saved one is written to a file, and one over its limit fails.
+ */
+void test_large_responses(zsock_t *req) {
+  zsock_t *dealer = zsock_new_dealer("inproc://backend/router");
+  char large[12001], *expected, *rkey, *rid, *topic, *seq, *saved_body;
+  char *received = NULL;
+  size_t received_len = 0;
+  long chunks = 0, saved_len = 0;
+  int i;
+  zmsg_t *msg;
+  FILE *saved;
+  test_defn;
+
+  memset(large, 'x', sizeof(large) - 1);
+  large[sizeof(large) - 1] = '\0';
+  assert(asprintf(&expected, "POST\n/\n%s", large) > 0);
+
+  assert(!zsock_send(dealer, "ssssssssss", "verb", "POST", "url", "https://localhost:44443/",
+                                           "body", large, "stream", "true",
+                                           "validate_ssl_certificates", "false"));
+  assert(!zsock_recv(dealer, "ss", &rkey, &rid));
+  free(rkey);
+  while ((msg = zmsg_recv(dealer)) && zframe_streq(zmsg_first(msg), "backend-chunk")) {
+    zframe_t *data;
+    assert(zmsg_size(msg) == 6);
+    free(zmsg_popstr(msg));
+    topic = zmsg_popstr(msg);
+    Assert2(!strcmp(topic, rid), topic);
+    free(topic);
+    free(zmsg_popstr(msg));
+    seq = zmsg_popstr(msg);
+    Assert2(atol(seq) == ++chunks, seq);
+    free(seq);
+    free(zmsg_popstr(msg));
+    data = zmsg_pop(msg);
+    received = realloc(received, received_len + zframe_size(data) + 1);
+    memcpy(received + received_len, zframe_data(data), zframe_size(data));
+    received_len += zframe_size(data);
+    received[received_len] = '\0';
+    zframe_destroy(&data);
+    zmsg_destroy(&msg);
+  }
+  assert(msg);
+  Assert(chunks > 0);
+  Assert(received && !strcmp(received, expected));
+  // then the result, with an empty body and the timing keys
+  Assert(zmsg_size(msg) == 30);
+  for (i = 0; i < 8; i++) {
+    topic = zmsg_popstr(msg);
+    if (i == 3) Assert2(!strcmp(topic, "success"), topic);
+    if (i == 7) Assert2(!strcmp(topic, ""), topic);
+    free(topic);
+  }
+  zmsg_destroy(&msg);
+  free(received);
+  free(rid);
+
+  // saved to a file; the result says where
+  test_req("ssssssssss", "verb", "POST", "url", "https://localhost:44443/", "body", large,
+                         "save_to", "backend-test/large.txt", "validate_ssl_certificates", "false");
+  Assert2(!strcmp(result, "success"), body);
+  Assert2(strstr(body, "backend-test/large.txt") != NULL, body);
+  assert(saved = fopen(body, "rb"));
+  saved_body = calloc(strlen(expected) + 2, 1);
+  saved_len = (long) fread(saved_body, 1, strlen(expected) + 1, saved);
+  fclose(saved);
+  Assert(saved_len == (long) strlen(expected) && !strcmp(saved_body, expected));
+  unlink(body);
+  free(saved_body);
+  freeall();
+
+  // too large for the request's limit
+  test_req("ssssssssss", "verb", "POST", "url", "https://localhost:44443/", "body", large,
+                         "max_body_size", "1000", "validate_ssl_certificates", "false");
+  Assert2(!strcmp(result, "error"), result);
+  Assert(code == CURLE_FILESIZE_EXCEEDED);
+  freeall();
+
+  free(expected);
+  zsock_destroy(&dealer);
+}
+
+/*
+ * Deferred requests to the same destination are delivered in order. One
+ * which can't be delivered stays in the outbox until it is cancelled.
+ */
+void test_outbox(zsock_t *req) {
+  char *rkey, *first, *second, *stuck, *name, *value;
+  int listener = listen_without_answering();
+  long pending = -1;
+  zmsg_t *msg;
+  test_defn;
+
+  assert(!zsock_send(req, "ssssssss", "verb", "POST", "url", "https://localhost:44443/outbox",
+                                      "body", "first", "defer", "true",
+                                      "validate_ssl_certificates", "false"));
+  assert(!zsock_recv(req, "ss", &rkey, &first));
+  Assert2(!strcmp(rkey, "broadcast_id"), rkey);
+  Assert2(!strncmp(first, "outbox:", 7), first);
+  free(rkey);
+  assert(!zsock_send(req, "ssssssss", "verb", "POST", "url", "https://localhost:44443/outbox",
+                                      "body", "second", "defer", "true",
+                                      "validate_ssl_certificates", "false"));
+  assert(!zsock_recv(req, "ss", &rkey, &second));
+  free(rkey);
+
+  assert(!zsock_recv(bcast, "sssssisbss", &rtopic, &rid2, &rkey, &result, &ckey, &code,
+                                          &bkey, &body, &bsize, &dkey, &duration));
+  body = realloc(body, bsize + 1);
+  body[bsize] = '\0';
+  Assert2(!strcmp(rid2, first), rid2);
+  Assert2(!strcmp(body, "POST\n/outbox\nfirst"), body);
+  freeall();
+  assert(!zsock_recv(bcast, "sssssisbss", &rtopic, &rid2, &rkey, &result, &ckey, &code,
+                                          &bkey, &body, &bsize, &dkey, &duration));
+  body = realloc(body, bsize + 1);
+  body[bsize] = '\0';
+  Assert2(!strcmp(rid2, second), rid2);
+  Assert2(!strcmp(body, "POST\n/outbox\nsecond"), body);
+  freeall();
+
+  assert(!zsock_send(req, "ssssssss", "url", "https://127.0.0.1:44445/", "timeout", "200",
+                                      "defer", "true", "validate_ssl_certificates", "false"));
+  assert(!zsock_recv(req, "ss", &rkey, &stuck));
+  free(rkey);
+  zclock_sleep(500);
+  assert(!zsock_send(req, "s", "stats"));
+  assert(msg = zmsg_recv(req));
+  free(zmsg_popstr(msg));
+  while ((name = zmsg_popstr(msg))) {
+    value = zmsg_popstr(msg);
+    if (!strcmp(name, "outbox")) pending = atol(value);
+    free(name);
+    free(value);
+  }
+  zmsg_destroy(&msg);
+  Assert(pending == 1);
+
+  assert(!zsock_send(req, "ss", "cancel", stuck));
+  assert(!zsock_recv(req, "ss", &rkey, &value));
+  Assert2(!strcmp(rkey, "cancelled"), rkey);
+  free(rkey);
+  free(value);
+  expect_error(stuck, -7, "cancelled");
+
+  close(listener);
+  free(first);
+  free(second);
+  free(stuck);
+}
+
+/*
+ * Opted-in GET responses are answered from the cache while they're fresh,
+ * and revalidated once they're not. Requests with tokens are never cached.
+ */
+void test_response_cache(zsock_t *req) {
+  char url[64], *first, *tokenized;
+  zsock_t *tok_sock = zsock_new_req(TOKENS_ENDPOINT);
+  char tok_data[] = { '1', '2', '3', '4', '\0' };
+  token_id tok_id;
+  long revalidated = -1;
+  zmsg_t *msg;
+  test_defn;
+
+  // different each run, since the cache is kept on disk
+  sprintf(url, "https://localhost:44443/cached/%d", (int) getpid());
+  test_req("ssssss", "url", url, "cache", "true", "validate_ssl_certificates", "false");
+  Assert2(!strcmp(result, "success"), result);
+  first = strdup(body);
+  freeall();
+  test_req("ssssss", "url", url, "cache", "true", "validate_ssl_certificates", "false");
+  Assert2(!strcmp(body, first), body);
+  freeall();
+
+  // only if asked for
+  test_req("ssss", "url", url, "validate_ssl_certificates", "false");
+  Assert2(strcmp(body, first), body);
+  freeall();
+
+  // or without tokens
+  assert(!zsock_send(tok_sock, "bs", tok_data, sizeof(tok_data), "tokdata"));
+  assert(!zsock_recv(tok_sock, "u", &tok_id));
+  zsock_destroy(&tok_sock);
+  assert(asprintf(&tokenized, "%s%u%s", TOKEN_PREFIX, tok_id, TOKEN_SUFFIX) > 0);
+  test_req("ssssssss", "url", url, "Authorization", tokenized, "cache", "true",
+                       "validate_ssl_certificates", "false");
+  Assert2(strcmp(body, first), body);
+  freeall();
+  free(tokenized);
+  free_token(tok_id);
+  free(first);
+
+  // a 304 is answered with what was cached
+  sprintf(url, "https://localhost:44443/revalidated/%d", (int) getpid());
+  test_req("ssssss", "url", url, "cache", "true", "validate_ssl_certificates", "false");
+  first = strdup(body);
+  freeall();
+  test_req("ssssss", "url", url, "cache", "true", "validate_ssl_certificates", "false");
+  Assert2(!strcmp(result, "success"), result);
+  Assert(code == 200);
+  Assert2(!strcmp(body, first), body);
+  freeall();
+  free(first);
+
+  assert(!zsock_send(req, "s", "stats"));
+  assert(msg = zmsg_recv(req));
+  free(zmsg_popstr(msg));
+  while ((first = zmsg_popstr(msg))) {
+    char *value = zmsg_popstr(msg);
+    if (!strcmp(first, "cache_revalidated")) revalidated = atol(value);
+    free(first);
+    free(value);
+  }
+  zmsg_destroy(&msg);
+  Assert(revalidated == 1);
+}
+
+/*
+ * Each result says how long each phase of the request took, and the
+ * histograms for its host count it.
+ */
+void test_request_timing(zsock_t *req) {
+  zsock_t *dealer = zsock_new_dealer("inproc://backend/router");
+  long long lookup = -1, connect = -1, start = -1, total = -1, sent = -1, received = -1;
+  long samples = -1;
+  char *name, *value, *host = NULL, *reused = NULL;
+  zmsg_t *msg;
+
+  assert(!zsock_send(dealer, "ssssssss", "verb", "POST", "url", "https://localhost:44443/",
+                                         "body", "timed", "validate_ssl_certificates", "false"));
+  assert(msg = zmsg_recv(dealer)); // the ID
+  zmsg_destroy(&msg);
+  assert(msg = zmsg_recv(dealer));
+  free(zmsg_popstr(msg));
+  free(zmsg_popstr(msg));
+  while ((name = zmsg_popstr(msg))) {
+    value = zmsg_popstr(msg);
+    assert(value);
+    if (!strcmp(name, "name_lookup_us"))    lookup   = atoll(value);
+    if (!strcmp(name, "connect_us"))        connect  = atoll(value);
+    if (!strcmp(name, "start_transfer_us")) start    = atoll(value);
+    if (!strcmp(name, "total_us"))          total    = atoll(value);
+    if (!strcmp(name, "bytes_sent"))        sent     = atoll(value);
+    if (!strcmp(name, "bytes_received"))    received = atoll(value);
+    if (!strcmp(name, "reused"))            reused   = strdup(value);
+    free(name);
+    free(value);
+  }
+  zmsg_destroy(&msg);
+  zsock_destroy(&dealer);
+  Assert(lookup >= 0 && connect >= lookup && start >= connect && total >= start && total > 0);
+  Assert(sent > (long long) strlen("timed") && received > 0);
+  Assert2(reused && (!strcmp(reused, "true") || !strcmp(reused, "false")), reused);
+  free(reused);
+
+  assert(!zsock_send(req, "s", "timings"));
+  assert(msg = zmsg_recv(req));
+  name = zmsg_popstr(msg);
+  Assert2(!strcmp(name, "timings"), name);
+  free(name);
+  while ((name = zmsg_popstr(msg))) {
+    value = zmsg_popstr(msg);
+    assert(value);
+    if (!strcmp(name, "host")) {
+      free(host);
+      host = strdup(value);
+    }
+    if (!strcmp(name, "samples") && host && !strcmp(host, "localhost")) samples = atol(value);
+    free(name);
+    free(value);
+  }
+  zmsg_destroy(&msg);
+  free(host);
+  Assert(samples > 0);
+
+  Assert(!lua_run_script(
+    "local timings = assert(require('backend').timings())"                          "\n"
+    "local localhost = assert(timings.hosts.localhost)"                             "\n"
+    "assert(#localhost.total == #timings.bounds + 1)"                               "\n"
+    "local counted = 0"                                                             "\n"
+    "for _, n in ipairs(localhost.total) do counted = counted + n end"              "\n"
+    "assert(counted == localhost.samples)"                                          "\n"
+  ));
+}
+
+/*
+ * A loopback HTTPS server which, unlike the webserver, keeps each connection
+ * open for the next request, and counts the connections it accepts.
+ */
+#define KEEP_ALIVE_PORT 44446
+#define KEEP_ALIVE_MAX_CLIENTS 8
+
+typedef struct {
+  int listener;
+  volatile int stop;
+  volatile int connections;
+} keep_alive_t;
+
+static void *keep_alive_server(void *arg) {
+  keep_alive_t *ka = (keep_alive_t *) arg;
+  SSL_CTX *ctx = SSL_CTX_new(SSLv23_server_method());
+  SSL *clients[KEEP_ALIVE_MAX_CLIENTS];
+  struct pollfd fds[KEEP_ALIVE_MAX_CLIENTS + 1];
+  char *crt = find_readable_file(NULL, "server.crt");
+  char *key = find_readable_file(NULL, "server.key");
+  const char *response;
+  int num_clients = 0, i;
+
+  assert(SSL_CTX_use_certificate_chain_file(ctx, crt) == 1);
+  assert(SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) == 1);
+  free(crt);
+  free(key);
+
+  while (!ka->stop) {
+    fds[0].fd = ka->listener;
+    fds[0].events = POLLIN;
+    for (i = 0; i < num_clients; i++) {
+      fds[i + 1].fd = SSL_get_fd(clients[i]);
+      fds[i + 1].events = POLLIN;
+    }
+    if (poll(fds, num_clients + 1, 100) <= 0) continue;
+
+    // last first, so that closing one doesn't disturb those still to come
+    for (i = num_clients - 1; i >= 0; i--) {
+      char buf[1024];
+      int len = 0, bytes;
+      if (!fds[i + 1].revents) continue;
+      do {
+        bytes = SSL_read(clients[i], buf + len, sizeof(buf) - 1 - len);
+        if (bytes > 0) len += bytes;
+        buf[len] = '\0';
+      } while (bytes > 0 && !strstr(buf, "\r\n\r\n"));
+      if (bytes <= 0) {
+        int fd = SSL_get_fd(clients[i]);
+        SSL_free(clients[i]);
+        close(fd);
+        clients[i] = clients[--num_clients];
+        continue;
+      }
+      response = strncmp(buf, "HEAD ", 5) ? "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok" :
+                                            "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\n";
+      SSL_write(clients[i], response, strlen(response));
+    }
+
+    if ((fds[0].revents & POLLIN) && num_clients < KEEP_ALIVE_MAX_CLIENTS) {
+      int fd = accept(ka->listener, NULL, NULL);
+      clients[num_clients] = SSL_new(ctx);
+      SSL_set_fd(clients[num_clients], fd);
+      assert(SSL_accept(clients[num_clients]) == 1);
+      num_clients++;
+      ka->connections++;
+    }
+  }
+
+  for (i = 0; i < num_clients; i++) {
+    int fd = SSL_get_fd(clients[i]);
+    SSL_shutdown(clients[i]);
+    SSL_free(clients[i]);
+    close(fd);
+  }
+  SSL_CTX_free(ctx);
+  return NULL;
+}
+
+static long get_stat(zsock_t *req, const char *stat) {
+  zmsg_t *msg;
+  char *name, *value;
+  long n = -1;
+
+  assert(!zsock_send(req, "s", "stats"));
+  assert(msg = zmsg_recv(req));
+  free(zmsg_popstr(msg));
+  while ((name = zmsg_popstr(msg))) {
+    value = zmsg_popstr(msg);
+    if (!strcmp(name, stat)) n = atol(value);
+    free(name);
+    free(value);
+  }
+  zmsg_destroy(&msg);
+  return n;
+}
+
+/*
+ * A prewarmed connection is held open, so that the request which follows
+ * doesn't have to open one of its own.
+ */
+void test_prewarm(zsock_t *req) {
+  zsock_t *dealer = zsock_new_dealer("inproc://backend/router");
+  struct sockaddr_in addr;
+  keep_alive_t ka;
+  pthread_t server;
+  char *status = NULL, *value = NULL, *name, *reused = NULL;
+  long requests, code = 0;
+  int one = 1, waited;
+  zmsg_t *msg;
+
+  memset(&ka, 0, sizeof(ka));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(KEEP_ALIVE_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ka.listener = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(ka.listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  assert(!bind(ka.listener, (struct sockaddr *) &addr, sizeof(addr)));
+  assert(!listen(ka.listener, KEEP_ALIVE_MAX_CLIENTS));
+  assert(!pthread_create(&server, NULL, keep_alive_server, &ka));
+
+  assert(!zsock_send(req, "ss", "prewarm", "http://localhost:44446/"));
+  assert(!zsock_recv(req, "ss", &status, &value));
+  Assert2(!strcmp(status, "error"), value);
+  free(status);
+  free(value);
+
+  requests = get_stat(req, "requests");
+  assert(!zsock_send(req, "ssss", "prewarm", "https://localhost:44446/", "validate_ssl_certificates", "false"));
+  assert(!zsock_recv(req, "ss", &status, &value));
+  Assert2(!strcmp(status, "prewarmed"), value);
+  Assert2(!strcmp(value, "https://localhost:44446"), value);
+  free(status);
+  free(value);
+
+  // the HEAD request has to finish, as it would while the card is read
+  for (waited = 0; get_stat(req, "requests") == requests && waited < 5000; waited += 10)
+    zclock_sleep(10);
+  Assert(ka.connections == 1);
+
+  assert(!zsock_send(dealer, "ssss", "url", "https://localhost:44446/", "validate_ssl_certificates", "false"));
+  assert(msg = zmsg_recv(dealer)); // the ID
+  zmsg_destroy(&msg);
+  assert(msg = zmsg_recv(dealer));
+  free(zmsg_popstr(msg));
+  free(zmsg_popstr(msg));
+  while ((name = zmsg_popstr(msg))) {
+    value = zmsg_popstr(msg);
+    assert(value);
+    if (!strcmp(name, "code"))   code   = atol(value);
+    if (!strcmp(name, "reused")) reused = strdup(value);
+    free(name);
+    free(value);
+  }
+  zmsg_destroy(&msg);
+  zsock_destroy(&dealer);
+
+  Assert(code == 200);
+  Assert2(reused && !strcmp(reused, "true"), reused);
+  Assert(ka.connections == 1);
+  free(reused);
+
+  ka.stop = 1;
+  pthread_join(server, NULL);
+  close(ka.listener);
+}
+
+/*
+ * Every request so far either opened a connection or reused one, and since
+ * the webserver closes each connection, repeated requests to "localhost"
+ * must have found its address in the DNS cache.
+ */
+void test_cache_stats(zsock_t *req) {
+  zmsg_t *msg;
+  char *name, *value;
+  long requests = -1, opened = -1, reused = -1, dns_cache_hits = -1;
+
+  assert(!zsock_send(req, "s", "stats"));
+  assert(msg = zmsg_recv(req));
+  name = zmsg_popstr(msg);
+  Assert2(!strcmp(name, "stats"), name);
+  free(name);
+  while ((name = zmsg_popstr(msg))) {
+    value = zmsg_popstr(msg);
+    assert(value);
+    LDEBUG("backend-test: %s = %s", name, value);
+    if (!strcmp(name, "requests"))           requests       = atol(value);
+    if (!strcmp(name, "connections_opened")) opened         = atol(value);
+    if (!strcmp(name, "connections_reused")) reused         = atol(value);
+    if (!strcmp(name, "dns_cache_hits"))     dns_cache_hits = atol(value);
+    free(name);
+    free(value);
+  }
+  zmsg_destroy(&msg);
+
+  Assert(requests > 0);
+  Assert(opened + reused <= requests);
+  Assert(dns_cache_hits > 0);
+}
+
 void termination_handler(int signum) {
   LERROR("received signal %d", signum);
 
@@ -383,6 +1316,19 @@ int main(int argc, char **argv) {
   T(test_valid_token_in_url(req));
   T(test_valid_token_in_headers(req));
   T(test_reuse_resources_without_leaking_data(req));
+  T(test_concurrent_requests(req, 8));
+  T(test_concurrent_requests(req, 64));
+  T(test_queue_limits_and_cancellation(req));
+  T(test_queue_full_of_background_work(req));
+  T(test_direct_reply(req));
+  T(test_lua_futures());
+  T(test_lua_futures_in_reactor());
+  T(test_large_responses(req));
+  T(test_outbox(req));
+  T(test_response_cache(req));
+  T(test_request_timing(req));
+  T(test_prewarm(req));
+  T(test_cache_stats(req));
   zactor_destroy(&api);
   
 shutdown:
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "services.h"
+#include "util/admission.h"
+#include "util/api_request.h"
+#include "util/headers_parser.h"
+
+/* answers every API request with "VERB path body|authorization", taking
+ * 3 seconds to answer /v1/slow.json */
+void api_server(zsock_t *pipe, void *arg) {
+  zsock_t *api = zsock_new_rep("inproc://api");
+  zpoller_t *poller = zpoller_new(pipe, api, NULL);
+  zsock_signal(pipe, 0);
+
+  while (zpoller_wait(poller, -1) == api) {
+    char *verb, *pkey, *path, *hkey, *headers, *bkey, *body, *response;
+    const char *auth;
+    zsock_recv(api, "sssssss", &verb, &pkey, &path, &hkey, &headers, &bkey, &body);
+    auth = strstr(headers, "authorization: ");
+    response = (char *) calloc(strlen(verb) + strlen(path) + strlen(body) + strlen(headers) + 8, sizeof(char));
+    sprintf(response, "%s %s %s|%s", verb, path, body, auth ? auth + 15 : "");
+    if (!strcmp(path, "/v1/slow.json"))
+      zclock_sleep(3000);
+    if (!strcmp(path, "/v1/missing.json"))
+      zsock_send(api, "sss", "404 Not Found", "Content-type: text/plain", response);
+    else
+      zsock_send(api, "sss", "200 OK", "Content-type: text/plain\nX-Test: yes", response);
+    free(verb); free(pkey); free(path); free(hkey); free(headers); free(bkey); free(body);
+    free(response);
+  }
+
+  zpoller_destroy(&poller);
+  zsock_destroy(&api);
+}
+
+static char *batch(const char *body) {
+  header_t *headers = NULL;
+  const char *raw = "Authorization: Basic abc\r\nContent-length: 99\r\n\r\n";
+  char *response;
+  parse_headers(&headers, raw, strlen(raw));
+  response = dispatch_request(ADMISSION_TRANSPORT_USB, "POST", "/v1/batch.json", &headers, body);
+  free_headers(&headers);
+  LDEBUG("batch-test: %s", response);
+  return response;
+}
+
+static void test_sequential(void) {
+  char *response = batch("[{\"method\":\"GET\",\"path\":\"/v1/battery.json\"},"
+                         " {\"method\":\"PUT\",\"path\":\"/v1/time.json\",\"body\":{\"a\":\"b\"}},"
+                         " {\"method\":\"GET\",\"path\":\"/v1/missing.json\","
+                         "  \"headers\":{\"Authorization\":\"Basic xyz\"}}]");
+  assert(!strncmp(response, "HTTP/1.1 200 OK", 15));
+  assert(strstr(response, "[{\"status\":200,\"headers\":{\"Content-type\":\"text/plain\",\"X-Test\":\"yes\"},"
+                          "\"body\":\"GET /v1/battery.json |Basic abc\"},"));
+  assert(strstr(response, "\"body\":\"PUT /v1/time.json {\\\"a\\\":\\\"b\\\"}|Basic abc\"}"));
+  assert(strstr(response, "{\"status\":404,\"headers\":{\"Content-type\":\"text/plain\"},"
+                          "\"body\":\"GET /v1/missing.json |Basic xyz\"}]"));
+  free(response);
+}
+
+static void test_parallel(void) {
+  char *response = batch("{\"parallel\":true,\"requests\":["
+                         " {\"method\":\"GET\",\"path\":\"/v1/battery.json\"},"
+                         " {\"method\":\"GET\",\"path\":\"/v1/device.json\"},"
+                         " {\"path\":\"no-verb\"}]}");
+  assert(!strncmp(response, "HTTP/1.1 200 OK", 15));
+  assert(strstr(response, "\"body\":\"GET /v1/battery.json |Basic abc\"},"));
+  assert(strstr(response, "\"body\":\"GET /v1/device.json |Basic abc\"},"));
+  assert(strstr(response, "{\"status\":400,"));
+  free(response);
+}
+
+/* sub-requests for resources served outside the API are answered as they
+ * would be on their own */
+static void test_local_resources(void) {
+  char *response = batch("[{\"method\":\"DELETE\",\"path\":\"/v1/sessions.json\"},"
+                         " {\"method\":\"GET\",\"path\":\"/v1/lua/memory.json\"}]");
+  assert(!strncmp(response, "HTTP/1.1 200 OK", 15));
+  assert(strstr(response, "[{\"status\":204,"));
+  assert(strstr(response, "\"body\":\"{\\\"live\\\":"));
+  assert(!strstr(response, "DELETE /v1/sessions.json"));
+  free(response);
+}
+
+/* escaped characters outside the BMP are decoded into one UTF-8 sequence */
+static void test_surrogate_pairs(void) {
+  char *response = batch("[{\"method\":\"PUT\",\"path\":\"/v1/time.json\","
+                         "  \"body\":\"\\ud83d\\ude00 \\u00e9 \\ud83d\"}]");
+  assert(strstr(response, "\"body\":\"PUT /v1/time.json \xf0\x9f\x98\x80 \xc3\xa9 \xef\xbf\xbd|Basic abc\"}"));
+  free(response);
+}
+
+static void test_malformed(void) {
+  char *response = batch("{\"method\":\"GET\"");
+  assert(!strncmp(response, "HTTP/1.1 400", 12));
+  free(response);
+  response = batch("[]");
+  assert(!strncmp(response, "HTTP/1.1 400", 12));
+  free(response);
+}
+
+static int count(const char *haystack, const char *needle) {
+  int n = 0;
+  for (; (haystack = strstr(haystack, needle)); haystack++) n++;
+  return n;
+}
+
+/* the whole batch gets BATCH_TIMEOUT, not each request in it */
+static void test_deadline(void) {
+  int64_t started = zclock_mono();
+  char *response = batch("[{\"method\":\"GET\",\"path\":\"/v1/slow.json\"},"
+                         " {\"method\":\"GET\",\"path\":\"/v1/slow.json\"},"
+                         " {\"method\":\"GET\",\"path\":\"/v1/slow.json\"},"
+                         " {\"method\":\"GET\",\"path\":\"/v1/slow.json\"}]");
+  int64_t elapsed = zclock_mono() - started;
+  assert(!strncmp(response, "HTTP/1.1 200 OK", 15));
+  // two are answered, the third times out and the fourth is never sent
+  assert(count(response, "{\"status\":200,") == 2);
+  assert(strstr(response, "gateway unavailable"));
+  assert(strstr(response, "batch timed out"));
+  assert(elapsed >= BATCH_TIMEOUT && elapsed < BATCH_TIMEOUT + 1000);
+  free(response);
+}
+
+int main(int argc, char **argv) {
+  zactor_t *server;
+
+  init_logger_service(LOG_LEVEL_DEBUG);
+  server = zactor_new(api_server, NULL);
+
+  test_sequential();
+  test_parallel();
+  test_local_resources();
+  test_surrogate_pairs();
+  test_malformed();
+  test_deadline();
+
+  zactor_destroy(&server);
+  shutdown_logger_service();
+  return 0;
+}
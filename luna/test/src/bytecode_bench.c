@@ -0,0 +1,152 @@
+/*
+ * Boot time benchmark for precompiled Lua scripts.
+ *
+ * Generates a main.lua which requires a number of modules, then times
+ * `lua_run_file` on it three ways: compiling every script from source, with
+ * the bytecode cache warm, and with the modules bundled into a precompiled
+ * image. Each run creates a fresh Lua state with every binding, as a boot
+ * does, so the difference between the modes is the time spent compiling.
+ *
+ * This is not run by `make check`. Run it from the test directory:
+ *
+ *     bin/bytecode_bench -m 40 -f 50 -r 20
+ *
+ * -m is the number of modules, -f the number of functions in each and -r
+ * the number of runs in each mode.
+ */
+#define _GNU_SOURCE
+#include "config.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "services.h"
+#include "bindings.h"
+#include "util/files.h"
+
+#define DEFAULT_MODULES   40
+#define DEFAULT_FUNCTIONS 50
+#define DEFAULT_RUNS      20
+
+typedef struct {
+  int modules;
+  int functions;
+  int runs;
+} options_t;
+
+static options_t options;
+static char dir[] = "./bytecode-bench-XXXXXX";
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* writes the modules, and a main.lua requiring each of them */
+static int generate(void) {
+  char path[PATH_MAX];
+  FILE *file;
+  int i, j;
+
+  for (i = 0; i < options.modules; i++) {
+    snprintf(path, sizeof(path), "%s/mod%03d.lua", dir, i);
+    if (!(file = fopen(path, "w"))) return 1;
+    fprintf(file, "local M = {}\n");
+    for (j = 0; j < options.functions; j++) {
+      fprintf(file,
+        "function M.f%d(t, n)\n"
+        "  local total = 0\n"
+        "  for k, v in pairs(t or {}) do\n"
+        "    if type(v) == 'number' then total = total + v * %d\n"
+        "    elseif type(v) == 'string' then total = total + #v\n"
+        "    else total = total + (n or 1) end\n"
+        "  end\n"
+        "  return string.format('%%s:%%d', 'f%d', total)\n"
+        "end\n", j, j, j);
+    }
+    fprintf(file, "return M\n");
+    fclose(file);
+  }
+
+  snprintf(path, sizeof(path), "%s/main.lua", dir);
+  if (!(file = fopen(path, "w"))) return 1;
+  fprintf(file, "package.path = '%s/?.lua'\n", dir);
+  fprintf(file, "for i = 0, %d do require(string.format('mod%%03d', i)) end\n", options.modules - 1);
+  fclose(file);
+  return 0;
+}
+
+static int run(const char *mode) {
+  char path[PATH_MAX];
+  double started, elapsed, total = 0, fastest = 0;
+  int i;
+
+  snprintf(path, sizeof(path), "%s/main.lua", dir);
+  for (i = 0; i < options.runs; i++) {
+    started = now_ms();
+    if (lua_run_file(path)) return 1;
+    elapsed = now_ms() - started;
+    total += elapsed;
+    if (i == 0 || elapsed < fastest) fastest = elapsed;
+  }
+  printf("%-8s %9.2f %9.2f\n", mode, total / options.runs, fastest);
+  return 0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-m modules] [-f functions per module] [-r runs]\n", name);
+}
+
+int main(int argc, char **argv) {
+  char main_lua[PATH_MAX], cache[PATH_MAX];
+  int opt, err = 0;
+
+  options.modules = DEFAULT_MODULES;
+  options.functions = DEFAULT_FUNCTIONS;
+  options.runs = DEFAULT_RUNS;
+  while ((opt = getopt(argc, argv, "m:f:r:h")) != -1) {
+    switch (opt) {
+      case 'm': options.modules = atoi(optarg); break;
+      case 'f': options.functions = atoi(optarg); break;
+      case 'r': options.runs = atoi(optarg); break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if (options.modules < 1 || options.modules > 999 || options.functions < 0 || options.runs < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  init_logger_service(LOG_LEVEL_WARN);
+  if (!mkdtemp(dir) || generate()) {
+    LERROR("couldn't write the scripts");
+    return 1;
+  }
+  // the image is looked for in the READ_PATHS, the cache kept in the WRITE_PATHS
+  setenv("READ_PATHS", dir, 1);
+  setenv("WRITE_PATHS", dir, 1);
+  snprintf(main_lua, sizeof(main_lua), "%s/main.lua", dir);
+  snprintf(cache, sizeof(cache), "%s/bytecode", dir);
+
+  printf("%d modules of %d functions, %d runs each\n\n",
+         options.modules, options.functions, options.runs);
+  printf("%-8s %9s %9s\n", "mode", "mean ms", "min ms");
+
+  setenv("LUA_BYTECODE_CACHE", "0", 1);
+  if (!err) err = run("source");
+  unsetenv("LUA_BYTECODE_CACHE");
+  if (!err) err = lua_run_file(main_lua);  // fills the cache
+  if (!err) err = run("cache");
+  if (!err) err = lua_bundle_scripts(dir);
+  if (!err) err = run("bundle");
+
+  rm_rf(cache);
+  rm_rf(dir);
+  shutdown_logger_service();
+
+  return err;
+}
@@ -0,0 +1,202 @@
+#define  _GNU_SOURCE
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include "services.h"
+
+#define STREAM_URL "https://localhost:44443/v1/events"
+#define MAX_STREAM 16384
+
+int err = 0;
+
+#define ASSERT(x) if (!(x)) { LERROR("FAIL: " #x); err++; return; }
+
+/* approves every subscription except to the "secret" topic */
+void api_server(zsock_t *pipe, void *arg) {
+  zsock_t *api = zsock_new_rep("inproc://api");
+  zpoller_t *poller = zpoller_new(pipe, api, NULL);
+  zsock_signal(pipe, 0);
+
+  while (zpoller_wait(poller, -1) == api) {
+    char *verb, *pkey, *path, *hkey, *headers, *bkey, *body;
+    zsock_recv(api, "sssssss", &verb, &pkey, &path, &hkey, &headers, &bkey, &body);
+    if (strstr(path, "secret"))
+      zsock_send(api, "sss", "403 Forbidden", "Content-type: application/json", "{\"error\":\"forbidden\"}");
+    else
+      zsock_send(api, "sss", "200 OK", "Content-type: application/json", "{}");
+    free(verb); free(pkey); free(path); free(hkey); free(headers); free(bkey); free(body);
+  }
+
+  zpoller_destroy(&poller);
+  zsock_destroy(&api);
+}
+
+/* one client of the stream, read on its own thread */
+typedef struct {
+  const char *query;
+  char data[MAX_STREAM];
+  size_t len;
+  long status;
+  pthread_mutex_t lock;
+  pthread_t thread;
+} client_t;
+
+static size_t on_data(char *ptr, size_t size, size_t nmemb, void *userdata) {
+  client_t *client = (client_t *) userdata;
+  size_t bytes = size * nmemb;
+
+  pthread_mutex_lock(&client->lock);
+  if (client->len + bytes >= MAX_STREAM) bytes = MAX_STREAM - client->len - 1;
+  memcpy(client->data + client->len, ptr, bytes);
+  client->len += bytes;
+  client->data[client->len] = '\0';
+  pthread_mutex_unlock(&client->lock);
+  // hang up once the last event of a test has arrived
+  return strstr(client->data, "event: keypad-done\n") ? 0 : size * nmemb;
+}
+
+static void *run_client(void *arg) {
+  client_t *client = (client_t *) arg;
+  CURL *curl = curl_easy_init();
+  char url[256];
+
+  snprintf(url, sizeof(url), "%s%s", STREAM_URL, client->query);
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+  curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, on_data);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, client);
+  curl_easy_perform(curl);
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &client->status);
+  curl_easy_cleanup(curl);
+  return NULL;
+}
+
+static client_t client;
+
+static void start_client(const char *query) {
+  memset(&client, 0, sizeof(client));
+  client.query = query;
+  pthread_mutex_init(&client.lock, NULL);
+  pthread_create(&client.thread, NULL, run_client, &client);
+}
+
+static void finish_client(void) {
+  pthread_join(client.thread, NULL);
+  pthread_mutex_destroy(&client.lock);
+  LDEBUG("event-stream-test: status %ld: %s", client.status, client.data);
+}
+
+static bool received(const char *text) {
+  bool found;
+  pthread_mutex_lock(&client.lock);
+  found = strstr(client.data, text) != NULL;
+  pthread_mutex_unlock(&client.lock);
+  return found;
+}
+
+/*
+ * Publishes "keypad-ready" until the client has seen it, so that nothing
+ * published afterward is lost while the subscription is being made.
+ */
+static bool wait_subscribed(zsock_t *pub) {
+  int i;
+  for (i = 0; i < 100; i++) {
+    zstr_sendx(pub, "keypad-ready", NULL);
+    if (received("event: keypad-ready\n")) return true;
+    zclock_sleep(50);
+  }
+  return false;
+}
+
+/*
+ * Only topics beginning with one of the requested prefixes are delivered,
+ * and prefixes are URL-decoded.
+ */
+void test_topic_filtering(zsock_t *pub) {
+  bool subscribed;
+
+  start_client("?topics=contact%2Demv,keypad&other=magstripe");
+  subscribed = wait_subscribed(pub);
+  zstr_sendx(pub, "magstripe", "swiped", NULL);
+  zstr_sendx(pub, "contact-emv", "card-inserted", NULL);
+  zstr_sendx(pub, "contactless", "tapped", NULL);
+  zstr_sendx(pub, "keypad-done", NULL);
+  finish_client();
+
+  ASSERT(subscribed);
+  ASSERT(client.status == 200);
+  ASSERT(strstr(client.data, "event: contact-emv\ndata: [\"card-inserted\"]\n\n"));
+  ASSERT(!strstr(client.data, "magstripe"));
+  ASSERT(!strstr(client.data, "contactless"));
+}
+
+/*
+ * Each message becomes one event: its first frame names it and the rest
+ * form a JSON array of strings. A newline can't smuggle in another field.
+ */
+void test_event_framing(zsock_t *pub) {
+  bool subscribed;
+
+  start_client("?topics=keypad");
+  subscribed = wait_subscribed(pub);
+  zstr_sendx(pub, "keypad", "1", "a\"b\\c", "line\nbreak", NULL);
+  zstr_sendx(pub, "keypad\ndata: injected", NULL);
+  zstr_sendx(pub, "keypad-done", NULL);
+  finish_client();
+
+  ASSERT(subscribed);
+  ASSERT(strstr(client.data, "event: keypad\n"
+                             "data: [\"1\",\"a\\\"b\\\\c\",\"line\\nbreak\"]\n\n"));
+  ASSERT(strstr(client.data, "event: keypad data: injected\ndata: []\n\n"));
+  ASSERT(!strstr(client.data, "\ndata: injected"));
+}
+
+/*
+ * A stream is refused without topics, and the API's answer is relayed when
+ * it doesn't allow the subscription.
+ */
+void test_refused(void) {
+  start_client("");
+  finish_client();
+  ASSERT(client.status == 400);
+  ASSERT(strstr(client.data, "topics must be specified"));
+
+  start_client("?topics=secret");
+  finish_client();
+  ASSERT(client.status == 403);
+  ASSERT(strstr(client.data, "forbidden"));
+}
+
+int main(int argc, char **argv) {
+  zactor_t *api = NULL;
+  zsock_t *pub = NULL;
+
+  curl_global_init(CURL_GLOBAL_ALL);
+  init_logger_service(LOG_LEVEL_INFO);
+  if (init_settings_service())      return 1;
+  if (init_events_proxy_service())  return 1;
+  if (init_webserver_service())     return 1;
+  api = zactor_new(api_server, NULL);
+  pub = zsock_new_pub(">" EVENTS_PUB_ENDPOINT);
+
+  #define RUN_TEST(x) LINFO("Beginning " #x); x;
+  RUN_TEST(test_topic_filtering(pub));
+  RUN_TEST(test_event_framing(pub));
+  RUN_TEST(test_refused());
+
+  zsock_destroy(&pub);
+  zactor_destroy(&api);
+  shutdown_webserver_service();
+  shutdown_events_proxy_service();
+  shutdown_settings_service();
+  shutdown_logger_service();
+  curl_global_cleanup();
+
+  return err;
+}
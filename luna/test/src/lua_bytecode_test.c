@@ -0,0 +1,102 @@
+#define  _GNU_SOURCE
+#include "config.h"
+#include <limits.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "services.h"
+#include "bindings.h"
+#include "util/files.h"
+
+int err = 0;
+
+#define ASSERT(x) if (!(x)) { LERROR("FAIL: " #x); err++; return; }
+
+/*
+ * Checks the counts of cached, compiled and bundled scripts against EXPECT.
+ */
+static const char *MAIN =
+  "package.path = '%s/?.lua'"                                             "\n"
+  "assert(require('mod').value == 42)"                                    "\n"
+  "local stats = require('bytecode').stats()"                             "\n"
+  "local counts = string.format('%%d %%d %%d', stats.hits, stats.misses, stats.bundled)\n"
+  "assert(counts == os.getenv('EXPECT'), counts)"                         "\n";
+
+static char dir[] = "./bytecode-test-XXXXXX";
+
+static int write_script(const char *name, const char *fmt, const char *arg) {
+  char path[PATH_MAX];
+  FILE *file;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  if (!(file = fopen(path, "w"))) return 1;
+  fprintf(file, fmt, arg);
+  fclose(file);
+  return 0;
+}
+
+static int run_expecting(const char *counts) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/main.lua", dir);
+  setenv("EXPECT", counts, 1);
+  return lua_run_file(path);
+}
+
+/*
+ * Scripts are compiled once, loaded from the cache afterward, and compiled
+ * again when they change.
+ */
+void test_cache(void) {
+  ASSERT(!write_script("main.lua", MAIN, dir));
+  ASSERT(!write_script("mod.lua", "return { value = %s }\n", "42"));
+  ASSERT(!run_expecting("0 2 0"));
+  ASSERT(!run_expecting("2 0 0"));
+  ASSERT(!write_script("mod.lua", "return { value = %s } -- changed\n", "42"));
+  ASSERT(!run_expecting("1 1 0"));
+  ASSERT(!run_expecting("2 0 0"));
+  setenv("LUA_BYTECODE_CACHE", "0", 1);
+  ASSERT(!run_expecting("0 0 0"));
+  unsetenv("LUA_BYTECODE_CACHE");
+}
+
+/*
+ * Modules are loaded from the image ahead of their sources, unless a source
+ * has changed since the image was built. One shipped without its source is
+ * loaded from the image.
+ */
+void test_bundle(void) {
+  char *read_paths = NULL, path[PATH_MAX];
+
+  ASSERT(!lua_bundle_scripts(dir));
+  ASSERT(asprintf(&read_paths, "%s:%s", getenv("READ_PATHS") ? getenv("READ_PATHS") : ".", dir) >= 0);
+  setenv("READ_PATHS", read_paths, 1);
+  free(read_paths);
+  ASSERT(!run_expecting("1 0 1"));
+  ASSERT(!write_script("mod.lua", "return { value = %s } -- edited since\n", "42"));
+  ASSERT(!run_expecting("1 1 0"));
+  ASSERT(!run_expecting("2 0 0"));
+  snprintf(path, sizeof(path), "%s/mod.lua", dir);
+  ASSERT(!unlink(path));
+  ASSERT(!run_expecting("1 0 1"));
+}
+
+int main(int argc, char **argv) {
+  char cache[PATH_MAX];
+
+  init_logger_service(LOG_LEVEL_INFO);
+  if (!mkdtemp(dir)) return 1;
+  // keep the cache in the temporary directory, not in ./bytecode
+  setenv("WRITE_PATHS", dir, 1);
+  snprintf(cache, sizeof(cache), "%s/bytecode", dir);
+
+  #define RUN_TEST(x) LINFO("Beginning " #x); x();
+  RUN_TEST(test_cache);
+  RUN_TEST(test_bundle);
+
+  rm_rf(cache);
+  rm_rf(dir);
+  shutdown_logger_service();
+
+  return err;
+}
@@ -0,0 +1,162 @@
+#define  _GNU_SOURCE
+#include "config.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "services.h"
+#include "bindings.h"
+#include "util/admission.h"
+#include "util/api_request.h"
+#include "util/headers_parser.h"
+
+int err = 0;
+
+#define ASSERT(x) if (!(x)) { LERROR("FAIL: " #x); err++; return; }
+
+/*
+ * Each script's state counts what it allocates and frees.
+ */
+void test_stats(void) {
+  ASSERT(!lua_run_script(
+    "local memory = require('memory')"                                      "\n"
+    "local before = memory.stats()"                                         "\n"
+    "assert(before.live > 0 and before.peak >= before.live, before.live)"   "\n"
+    "assert(before.limit == 0 and before.failures == 0, before.limit)"      "\n"
+    "assert(before.pooled > 0 and before.allocations > 0, before.pooled)"   "\n"
+    "local t = {}"                                                          "\n"
+    "for i = 1, 10000 do t[i] = tostring(i) end"                            "\n"
+    "local during = memory.stats()"                                         "\n"
+    "assert(during.live > before.live, during.live)"                        "\n"
+    "t = nil"                                                               "\n"
+    "collectgarbage()"                                                      "\n"
+    "local after = memory.stats()"                                          "\n"
+    "assert(after.live < during.live, after.live)"                          "\n"
+    "assert(after.peak >= during.live, after.peak)"                         "\n"
+  ));
+}
+
+/*
+ * Allocations past the limit raise a memory error, which leaves the state
+ * usable once it's caught.
+ */
+void test_limit(void) {
+  ASSERT(!lua_run_script(
+    "local memory = require('memory')"                                      "\n"
+    "assert(memory.limit(2 * 1024 * 1024) == 2 * 1024 * 1024)"              "\n"
+    "local ok, err = pcall(string.rep, 'x', 4 * 1024 * 1024)"               "\n"
+    "assert(not ok and err:find('^not enough memory'), err)"                "\n"
+    "assert(memory.stats().failures > 0)"                                   "\n"
+    "assert(#string.rep('x', 1024) == 1024)"                                "\n"
+    "assert(memory.stats().live <= memory.limit())"                         "\n"
+    "assert(memory.limit(0) == 0)"                                          "\n"
+    "assert(#string.rep('x', 4 * 1024 * 1024) == 4 * 1024 * 1024)"          "\n"
+  ));
+}
+
+/*
+ * A script which runs out of memory fails, without taking anything else
+ * with it.
+ */
+void test_runaway(void) {
+  ASSERT(lua_run_script(
+    "require('memory').limit(1024 * 1024)"                                  "\n"
+    "local t = {}"                                                          "\n"
+    "while true do t[#t + 1] = string.rep('x', 1000) .. #t end"             "\n"
+  ));
+  ASSERT(!lua_run_script("assert(require('memory').stats().limit == 0)"));
+}
+
+/*
+ * Slabs which empty are given back, and the limit counts the slabs a state
+ * holds as well as what it has live.
+ */
+void test_slabs(void) {
+  ASSERT(!lua_run_script(
+    "local memory = require('memory')"                                      "\n"
+    "collectgarbage()"                                                      "\n"
+    "local before = memory.stats().pooled"                                  "\n"
+    "local t = {}"                                                          "\n"
+    "for i = 1, 20000 do t[i] = {} end"                                     "\n"
+    "assert(memory.stats().pooled > before + 20000 * 48)"                   "\n"
+    "t = nil"                                                               "\n"
+    "collectgarbage()"                                                      "\n"
+    "local after = memory.stats().pooled"                                   "\n"
+    "assert(after < before + 64 * 1024, after - before)"                    "\n"
+    "memory.limit(memory.stats().live + 256 * 1024)"                        "\n"
+    "local ok, err = pcall(function()"                                      "\n"
+    "  local t = {}"                                                        "\n"
+    "  for i = 1, 100000 do t[i] = {} end"                                  "\n"
+    "end)"                                                                  "\n"
+    "assert(not ok and err:find('not enough memory'), err)"                 "\n"
+    "local stats = memory.stats()"                                          "\n"
+    "assert(stats.pooled <= stats.limit, stats.pooled)"                     "\n"
+    "memory.limit(0)"                                                       "\n"
+  ));
+}
+
+/* asks the REST API how much memory scripts are using, once a script is ready */
+static void *get_memory_json(void *arg) {
+  zsock_t *script = zsock_new_pair(">inproc://lua-memory-test");
+  header_t *headers = NULL;
+  char *ready, *response;
+
+  zsock_set_rcvtimeo(script, 5000);
+  if ((ready = zstr_recv(script))) {
+    response = dispatch_request(ADMISSION_TRANSPORT_USB, "GET", "/v1/lua/memory.json", &headers, "");
+    zstr_send(script, response);
+    free(response);
+    free(ready);
+  }
+  free_headers(&headers);
+  zsock_destroy(&script);
+  return NULL;
+}
+
+/*
+ * A new state takes its limit and garbage collector tuning from settings,
+ * and is listed by GET /v1/lua/memory.json while it runs.
+ */
+void test_settings(void) {
+  zsock_t *settings = zsock_new_req(SETTINGS_ENDPOINT);
+  pthread_t thread;
+  int failed;
+
+  settings_set(settings, 3, "lua.memory_limit", "3000000", "lua.gc_pause", "150",
+                            "lua.gc_stepmul", "300");
+  pthread_create(&thread, NULL, get_memory_json, NULL);
+  failed = lua_run_script(
+    "local memory = require('memory')"                                      "\n"
+    "assert(memory.stats().limit == 3000000, memory.stats().limit)"         "\n"
+    "assert(collectgarbage('setpause', 200) == 150)"                        "\n"
+    "assert(collectgarbage('setstepmul', 200) == 300)"                      "\n"
+    "local api = require('lzmq').pair('@inproc://lua-memory-test')"         "\n"
+    "api:send('ready')"                                                     "\n"
+    "local response = assert(api:recv(5000))"                               "\n"
+    "assert(response:find('^HTTP/1.1 200 OK'), response)"                   "\n"
+    "assert(response:find('\"limit\":3000000,', 1, true), response)"        "\n"
+    "api:close()"                                                           "\n"
+  );
+  pthread_join(thread, NULL);
+  settings_del(settings, 3, "lua.memory_limit", "lua.gc_pause", "lua.gc_stepmul");
+  zsock_destroy(&settings);
+  ASSERT(!failed);
+}
+
+int main(int argc, char **argv) {
+  init_logger_service(LOG_LEVEL_INFO);
+
+  #define RUN_TEST(x) LINFO("Beginning " #x); x();
+  RUN_TEST(test_stats);
+  RUN_TEST(test_limit);
+  RUN_TEST(test_runaway);
+  RUN_TEST(test_slabs);
+  if (init_settings_service()) return 1;
+  RUN_TEST(test_settings);
+  shutdown_settings_service();
+
+  shutdown_logger_service();
+
+  return err;
+}
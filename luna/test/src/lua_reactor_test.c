@@ -0,0 +1,112 @@
+#define  _GNU_SOURCE
+#include "config.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "services.h"
+#include "bindings.h"
+
+int err = 0;
+
+#define ASSERT(x) if (!(x)) { LERROR("FAIL: " #x); err++; return; }
+
+/*
+ * Sleeping tasks wake in the order of their deadlines, side by side, with
+ * one wakeup each.
+ */
+void test_sleep(void) {
+  ASSERT(!lua_run_script(
+    "local reactor = require('reactor')"                                    "\n"
+    "local order = {}"                                                      "\n"
+    "local started = reactor.now()"                                         "\n"
+    "for _, ms in ipairs({ 60, 20, 40 }) do"                                "\n"
+    "  reactor.spawn(function(ms)"                                          "\n"
+    "    reactor.sleep(ms)"                                                 "\n"
+    "    order[#order + 1] = ms"                                            "\n"
+    "  end, ms)"                                                            "\n"
+    "end"                                                                   "\n"
+    "assert(reactor.run() == 0)"                                            "\n"
+    "assert(table.concat(order, ',') == '20,40,60', table.concat(order, ','))\n"
+    "local elapsed = reactor.now() - started"                               "\n"
+    "assert(elapsed >= 60 and elapsed < 120, elapsed)"                      "\n"
+    "assert(reactor.stats().wakeups == 3, reactor.stats().wakeups)"         "\n"
+  ));
+}
+
+/*
+ * A recv waits for the message in the reactor instead of blocking the
+ * tasks which would send it, and times out without polling in a loop.
+ */
+void test_zmq(void) {
+  ASSERT(!lua_run_script(
+    "local reactor = require('reactor')"                                    "\n"
+    "local zmq = require('lzmq')"                                           "\n"
+    "local reply, timed_out"                                                "\n"
+    "reactor.spawn(function()"                                              "\n"
+    "  local rep = zmq.rep('@inproc://reactor-test')"                       "\n"
+    "  local msg = rep:recv(-1)"                                            "\n"
+    "  rep:send('pong:' .. msg)"                                            "\n"
+    "  rep:close()"                                                         "\n"
+    "end)"                                                                  "\n"
+    "reactor.spawn(function()"                                              "\n"
+    "  reactor.sleep(20)"                                                   "\n"
+    "  local req = zmq.req('>inproc://reactor-test')"                       "\n"
+    "  req:send('ping')"                                                    "\n"
+    "  reply = req:recv(1000)"                                              "\n"
+    "  req:close()"                                                         "\n"
+    "end)"                                                                  "\n"
+    "reactor.spawn(function()"                                              "\n"
+    "  local sub = zmq.sub('inproc://events/nothing')"                      "\n"
+    "  local started = reactor.now()"                                       "\n"
+    "  assert(sub:recv(50) == nil)"                                         "\n"
+    "  assert(reactor.now() - started >= 49)"                               "\n"
+    "  timed_out = not reactor.wait(sub, 'read', 10)"                       "\n"
+    "  sub:close()"                                                         "\n"
+    "end)"                                                                  "\n"
+    "assert(reactor.run() == 0)"                                            "\n"
+    "assert(reply == 'pong:ping', reply)"                                   "\n"
+    "assert(timed_out)"                                                     "\n"
+    "assert(reactor.stats().wakeups < 10, reactor.stats().wakeups)"         "\n"
+  ));
+}
+
+/*
+ * A failing task is dropped without stopping the others, a cancelled one
+ * isn't resumed again, and `run()` gives up at its timeout.
+ */
+void test_errors_and_cancel(void) {
+  ASSERT(!lua_run_script(
+    "local reactor = require('reactor')"                                    "\n"
+    "local ticks = 0"                                                       "\n"
+    "local ticker = reactor.spawn(function()"                               "\n"
+    "  while true do reactor.sleep(10) ticks = ticks + 1 end"               "\n"
+    "end)"                                                                  "\n"
+    "reactor.spawn(function() error('expected failure') end)"               "\n"
+    "reactor.spawn(function() coroutine.yield({}) end)"                     "\n"
+    "reactor.spawn(function()"                                              "\n"
+    "  reactor.sleep(55)"                                                   "\n"
+    "  assert(reactor.cancel(ticker))"                                      "\n"
+    "end)"                                                                  "\n"
+    "assert(reactor.run() == 0)"                                            "\n"
+    "assert(ticks >= 4 and ticks <= 5, ticks)"                              "\n"
+    "assert(reactor.stats().errors == 2, reactor.stats().errors)"           "\n"
+    "reactor.spawn(function() reactor.sleep(60000) end)"                    "\n"
+    "local started = reactor.now()"                                         "\n"
+    "assert(reactor.run(30) == 1)"                                          "\n"
+    "assert(reactor.now() - started < 1000)"                                "\n"
+  ));
+}
+
+int main(int argc, char **argv) {
+  init_logger_service(LOG_LEVEL_INFO);
+
+  #define RUN_TEST(x) LINFO("Beginning " #x); x();
+  RUN_TEST(test_sleep);
+  RUN_TEST(test_zmq);
+  RUN_TEST(test_errors_and_cancel);
+
+  shutdown_logger_service();
+
+  return err;
+}
@@ -0,0 +1,184 @@
+#define  _GNU_SOURCE
+#include "config.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include "services.h"
+#include "bindings.h"
+
+int err = 0;
+
+#define ASSERT(x) if (!(x)) { LERROR("FAIL: " #x); err++; return; }
+
+/*
+ * The device on the other end of the pseudo-terminal: it echoes whatever it
+ * reads, a byte at a time, so that every frame reaches the reader in
+ * pieces.
+ */
+static int master = -1;
+static volatile bool echoing = true;
+
+static void *echo(void *arg) {
+  struct pollfd pfd = { master, POLLIN, 0 };
+  char buf[256];
+  ssize_t n, i;
+
+  while (echoing) {
+    if (poll(&pfd, 1, 50) <= 0) continue;
+    if ((n = read(master, buf, sizeof(buf))) <= 0) continue;
+    for (i = 0; i < n; i++) {
+      if (write(master, buf + i, 1) != 1) break;
+      usleep(1000);
+    }
+  }
+  return NULL;
+}
+
+static int run_with_port(const char *script) {
+  char *source = NULL;
+  int res;
+
+  if (asprintf(&source, "local PORT = '%s'\n%s", ptsname(master), script) < 0)
+    return 1;
+  res = lua_run_script(source);
+  free(source);
+  return res;
+}
+
+/*
+ * Sends return at once, and the echoed frames come back both from `recv`
+ * and on the event bus.
+ */
+void test_delimiter(void) {
+  ASSERT(!run_with_port(
+    "local rs232 = require('rs232')"                                        "\n"
+    "local zmq = require('lzmq')"                                           "\n"
+    "local events = zmq.sub('inproc://events/sub', 'rs232')"                "\n"
+    "assert(rs232.open(PORT, 9600, 'none', 8, 1, { delimiter = '\\r\\n' }) == nil)\n"
+    "assert(rs232.open(PORT, 9600, 'none', 8, 1) == 'port is already open')\n"
+    "local started = os.time()"                                             "\n"
+    "assert(rs232.send(PORT, 'hello') == nil)"                              "\n"
+    "assert(rs232.send(PORT, 'world') == nil)"                              "\n"
+    "assert(os.time() - started < 1, 'send blocked')"                       "\n"
+    "local err, data = rs232.recv(PORT, 2000)"                              "\n"
+    "assert(err == nil and data == 'hello', err)"                           "\n"
+    "err, data = rs232.recv(PORT, 2000)"                                    "\n"
+    "assert(err == nil and data == 'world', err)"                           "\n"
+    "err, data = rs232.recv(PORT, 0)"                                       "\n"
+    "assert(err == 'timeout' and data == nil, err)"                         "\n"
+    "started = os.time()"                                                   "\n"
+    "err, data = rs232.recv(PORT)"                                          "\n"
+    "assert(err == 'timeout' and data == nil, err)"                         "\n"
+    "assert(os.time() - started < 1, 'recv waited without a timeout')"      "\n"
+    "local ev = { events:recv(1000) }"                                      "\n"
+    "assert(ev[2] == 'frame-received' and ev[4] == PORT, ev[2])"            "\n"
+    "assert(ev[5] == 'data' and ev[6] == 'hello', ev[6])"                   "\n"
+    "assert(rs232.flush(PORT) == nil)"                                      "\n"
+    "assert(rs232.close(PORT) == nil)"                                      "\n"
+    "assert(rs232.close(PORT) == 'port is not open')"                       "\n"
+  ));
+}
+
+/*
+ * Length-prefixed frames may hold any bytes, the delimiter included.
+ */
+void test_header(void) {
+  ASSERT(!run_with_port(
+    "local rs232 = require('rs232')"                                        "\n"
+    "assert(rs232.open(PORT, 9600, 'none', 8, 1, { header = 'binary2' }) == nil)\n"
+    "local frame = '\\0\\r\\n' .. string.rep('x', 300)"                     "\n"
+    "assert(rs232.send(PORT, frame) == nil)"                                "\n"
+    "local err, data = rs232.recv(PORT, 5000)"                              "\n"
+    "assert(err == nil and data == frame, err)"                             "\n"
+    "assert(rs232.send(PORT, string.rep('x', 70000)) == 'message is too long')\n"
+    "assert(rs232.close(PORT) == nil)"                                      "\n"
+    "err = rs232.open(PORT, 9600, 'none', 8, 1, { header = 'binary2', delimiter = '\\n' })\n"
+    "assert(err and err:find('delimiter'), err)"                            "\n"
+  ));
+}
+
+/*
+ * A port belongs to the state which opened it: other states can neither
+ * use nor close it, and closing one of them leaves it open.
+ */
+static int owner_result = 1;
+
+static void *open_and_wait(void *arg) {
+  owner_result = run_with_port(
+    "local rs232 = require('rs232')"                                        "\n"
+    "local zmq = require('lzmq')"                                           "\n"
+    "local other = zmq.pair('>inproc://rs232-test-owner')"                  "\n"
+    "assert(rs232.open(PORT, 9600, 'none', 8, 1, { delimiter = '\\n' }) == nil)\n"
+    "other:send('opened')"                                                  "\n"
+    "local _, done = other:recv(5000)"                                      "\n"
+    "assert(done == 'done', 'the other state never finished')"              "\n"
+    "assert(rs232.send(PORT, 'still mine') == nil)"                         "\n"
+    "local err, data = rs232.recv(PORT, 2000)"                              "\n"
+    "assert(err == nil and data == 'still mine', err)"                      "\n"
+    "assert(rs232.close(PORT) == nil)"                                      "\n"
+    "other:close()"                                                         "\n"
+  );
+  return NULL;
+}
+
+void test_owner(void) {
+  zsock_t *other = zsock_new_pair("@inproc://rs232-test-owner");
+  pthread_t owner;
+  char *opened;
+  int res;
+
+  pthread_create(&owner, NULL, open_and_wait, NULL);
+  opened = zstr_recv(other);
+  res = run_with_port(
+    "local rs232 = require('rs232')"                                        "\n"
+    "assert(rs232.send(PORT, 'x') == 'port is not open')"                   "\n"
+    "assert(rs232.close(PORT) == 'port is not open')"                       "\n"
+    "assert(rs232.open(PORT, 9600, 'none', 8, 1) == 'port is already open')\n"
+  );
+  zstr_send(other, "done");
+  pthread_join(owner, NULL);
+  zsock_destroy(&other);
+  ASSERT(opened && !strcmp(opened, "opened"));
+  free(opened);
+  ASSERT(!res);
+  ASSERT(!owner_result);
+}
+
+int main(int argc, char **argv) {
+  pthread_t echo_thread;
+
+  init_logger_service(LOG_LEVEL_INFO);
+  if (init_tokenizer_service())      return 1;
+  if (init_settings_service())       return 1;
+  if (init_events_proxy_service())   return 1;
+  if (init_plugins(NULL, argc, argv)) return 1;
+
+  if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 ||
+      grantpt(master) || unlockpt(master)) {
+    LERROR("couldn't open a pseudo-terminal");
+    return 1;
+  }
+  pthread_create(&echo_thread, NULL, echo, NULL);
+
+  #define RUN_TEST(x) LINFO("Beginning " #x); x();
+  RUN_TEST(test_delimiter);
+  RUN_TEST(test_header);
+  RUN_TEST(test_owner);
+
+  echoing = false;
+  pthread_join(echo_thread, NULL);
+  close(master);
+
+  shutdown_plugins();
+  shutdown_events_proxy_service();
+  shutdown_settings_service();
+  shutdown_tokenizer_service();
+  shutdown_logger_service();
+
+  return err;
+}
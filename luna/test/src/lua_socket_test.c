@@ -0,0 +1,418 @@
+#define  _GNU_SOURCE
+#include "config.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <poll.h>
+#include <pthread.h>
+#include <curl/curl.h>
+#include <linux/limits.h>
+#include <openssl/ssl.h>
+#include "services.h"
+#include "bindings.h"
+#include "ssl_locks.h"
+#include "util/files.h"
+#include "util/resolver.h"
+
+bool ALLOW_DISABLE_SSL_VERIFICATION = true;
+char cacerts_bundle[PATH_MAX];
+
+int err = 0;
+
+#define ASSERT(x) if (!(x)) { LERROR("FAIL: " #x); err++; return; }
+
+/*
+ * The webserver waits for a request after the handshake, so reading from it
+ * before sending one runs into the timeout, without using the CPU meanwhile.
+ */
+void test_timeouts(void) {
+  ASSERT(!lua_run_script(
+    "local socket = require('socket')"                                      "\n"
+    "local sock = assert(socket.tcp('localhost', 44443, 1000))"             "\n"
+    "local cpu = os.clock()"                                                "\n"
+    "local data, err = sock:recv(200)"                                      "\n"
+    "assert(data == nil and err == 'timeout', err)"                         "\n"
+    "assert(os.clock() - cpu < 0.05, 'busy waiting')"                       "\n"
+    "sock:close()"                                                          "\n"
+    "data, err = sock:recv(200)"                                            "\n"
+    "assert(data == nil and err == 'socket is closed', err)"                "\n"
+    "data, err = socket.tcp('localhost', 1)"                                "\n"
+    "assert(data == nil and err:find('connect failed'), err)"               "\n"
+  ));
+}
+
+/*
+ * Several connections are opened and read from at once by coroutines,
+ * which yield their sockets to a scheduler rather than blocking.
+ */
+void test_coroutines(void) {
+  ASSERT(!lua_run_script(
+    "local socket = require('socket')"                                      "\n"
+    "local waiting, yields, done = {}, 0, 0"                                "\n"
+    "local function run(co)"                                                "\n"
+    "  local ok, sock, what = assert(coroutine.resume(co))"                 "\n"
+    "  if sock then"                                                        "\n"
+    "    assert(what == 'read' or what == 'write', what)"                   "\n"
+    "    waiting[sock] = co"                                                "\n"
+    "    yields = yields + 1"                                               "\n"
+    "  end"                                                                 "\n"
+    "end"                                                                   "\n"
+    "for i = 1, 4 do"                                                       "\n"
+    "  run(coroutine.create(function()"                                     "\n"
+    "    local sock = assert(socket.tls('localhost', 44443, 5000))"         "\n"
+    "    local data, err = sock:recv(600)"                                  "\n"
+    "    assert(data == nil and err == 'timeout', err)"                     "\n"
+    "    sock:close()"                                                      "\n"
+    "    done = done + 1"                                                   "\n"
+    "  end))"                                                               "\n"
+    "end"                                                                   "\n"
+    "local started = os.time()"                                             "\n"
+    "while next(waiting) do"                                                "\n"
+    "  local socks = {}"                                                    "\n"
+    "  for sock in pairs(waiting) do socks[#socks + 1] = sock end"          "\n"
+    "  for _, sock in ipairs(socket.wait(socks)) do"                        "\n"
+    "    local co = waiting[sock]"                                          "\n"
+    "    waiting[sock] = nil"                                               "\n"
+    "    run(co)"                                                           "\n"
+    "  end"                                                                 "\n"
+    "end"                                                                   "\n"
+    "assert(done == 4, done)"                                               "\n"
+    "assert(yields >= 8, yields)"                                           "\n"
+    "-- the reads timed out side by side, not one after the other"          "\n"
+    "assert(os.time() - started < 2, os.time() - started)"                  "\n"
+  ));
+}
+
+/*
+ * Reads an HTTP response from the webserver a line and then a body at a
+ * time, from a request sent as several parts.
+ */
+void test_framing(void) {
+  ASSERT(!lua_run_script(
+    "local socket = require('socket')"                                      "\n"
+    "local sock = assert(socket.tls('localhost', 44443, 5000))"             "\n"
+    "assert(sock:send({ 'GET /123 HTTP/1.1\\r\\n', 'Host: localhost\\r\\n'," "\n"
+    "                   'Connection: close\\r\\n', '\\r\\n' }, 5000) == nil)" "\n"
+    "local status = assert(sock:recv_until('\\r\\n', 5000))"                "\n"
+    "assert(status:match('^HTTP/1%.%d %d%d%d'), status)"                    "\n"
+    "local length"                                                          "\n"
+    "while true do"                                                         "\n"
+    "  local header = assert(sock:recv_until('\\r\\n', 5000))"              "\n"
+    "  if header == '' then break end"                                      "\n"
+    "  length = length or header:lower():match('^content%-length: *(%d+)')" "\n"
+    "end"                                                                   "\n"
+    "local body = assert(sock:recv_exact(tonumber(length), 5000))"          "\n"
+    "assert(#body == tonumber(length))"                                     "\n"
+    "local data, err = sock:recv_exact(1, 5000)"                            "\n"
+    "assert(data == nil and err == 'closed', err)"                          "\n"
+    "sock:close()"                                                          "\n"
+  ));
+}
+
+/*
+ * Host names are looked up in a table of the test's own. "dual.test" has an
+ * IPv6 address nothing listens on ahead of its IPv4 one, so connecting to it
+ * has to fall back to the second.
+ */
+static int fake_lookup(const char *host, resolver_addr_t *addrs, int max) {
+  if (!strcmp(host, "dual.test") && max >= 2) {
+    addrs[0].family = AF_INET6;
+    strcpy(addrs[0].ip, "::1");
+    addrs[1].family = AF_INET;
+    strcpy(addrs[1].ip, "127.0.0.1");
+    return 2;
+  }
+  return 0;
+}
+
+void test_resolver(void) {
+  resolver_addr_t addrs[RESOLVER_MAX_ADDRS];
+
+  resolver_set_lookup(fake_lookup);
+  ASSERT(!lua_run_script(
+    "local socket = require('socket')"                                      "\n"
+    "local sock = assert(socket.tls('dual.test', 44443, 5000))"             "\n"
+    "sock:close()"                                                          "\n"
+    "local data, err = socket.tcp('nowhere.test', 44443, 1000)"             "\n"
+    "assert(data == nil and err == 'host not found', err)"                  "\n"
+  ));
+  ASSERT(resolver_cached("dual.test", addrs, RESOLVER_MAX_ADDRS) == 2);
+  ASSERT(resolver_cached("nowhere.test", addrs, RESOLVER_MAX_ADDRS) == 0);
+  resolver_set_lookup(NULL);
+}
+
+/*
+ * Every host name resolves to 127.0.0.1, slowly, and the most lookups ever
+ * running at once is noted.
+ */
+static int lookups_running = 0, most_lookups_running = 0;
+static pthread_mutex_t lookups_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int slow_lookup(const char *host, resolver_addr_t *addrs, int max) {
+  pthread_mutex_lock(&lookups_lock);
+  if (++lookups_running > most_lookups_running) most_lookups_running = lookups_running;
+  pthread_mutex_unlock(&lookups_lock);
+  usleep(20000);
+  pthread_mutex_lock(&lookups_lock);
+  lookups_running--;
+  pthread_mutex_unlock(&lookups_lock);
+  addrs[0].family = AF_INET;
+  strcpy(addrs[0].ip, "127.0.0.1");
+  return 1;
+}
+
+/*
+ * A burst of lookups for different hosts runs on a bounded number of
+ * threads, and every one of them still finishes.
+ */
+void test_resolver_burst(void) {
+  resolver_query_t *queries[4 * RESOLVER_MAX_LOOKUPS];
+  resolver_addr_t addr;
+  char host[32];
+  int i, found = 0;
+
+  resolver_set_lookup(slow_lookup);
+  for (i = 0; i < 4 * RESOLVER_MAX_LOOKUPS; i++) {
+    snprintf(host, sizeof(host), "host%d.test", i);
+    queries[i] = resolver_query(host);
+  }
+  for (i = 0; i < 4 * RESOLVER_MAX_LOOKUPS; i++) {
+    struct pollfd pfd = { resolver_query_fd(queries[i]), POLLIN, 0 };
+    if (pfd.fd >= 0) poll(&pfd, 1, 5000);
+    if (resolver_query_result(queries[i], &addr, 1) == 1) found++;
+    resolver_query_free(queries[i]);
+  }
+  resolver_set_lookup(NULL);
+  ASSERT(found == 4 * RESOLVER_MAX_LOOKUPS);
+  ASSERT(most_lookups_running > 1);
+  ASSERT(most_lookups_running <= RESOLVER_MAX_LOOKUPS);
+}
+
+/*
+ * A TLS listener echoes the frames sent by several clients at once, each
+ * connection handled by a coroutine of its own, and turns away those over
+ * its limit.
+ */
+void test_listen(void) {
+  char *crt = find_readable_file(NULL, "server.crt");
+  char *key = find_readable_file(NULL, "server.key");
+  char *script;
+
+  ASSERT(asprintf(&script,
+    "local socket = require('socket')"                                      "\n"
+    "local waiting, echoed, replies = {}, 0, 0"                             "\n"
+    "local function run(co)"                                                "\n"
+    "  local ok, sock = assert(coroutine.resume(co))"                       "\n"
+    "  if sock then waiting[sock] = co end"                                 "\n"
+    "end"                                                                   "\n"
+    "local listener = assert(socket.listen_tls(0, '%s', '%s',"              "\n"
+    "                                          { host = '127.0.0.1' }))"    "\n"
+    "local _, port = listener:local_address()"                              "\n"
+    "run(coroutine.create(function()"                                       "\n"
+    "  for i = 1, 4 do"                                                     "\n"
+    "    local sock = assert(listener:accept(5000))"                        "\n"
+    "    run(coroutine.create(function()"                                   "\n"
+    "      local msg = assert(sock:recv_frame('binary2', 5000))"            "\n"
+    "      assert(sock:send_frame('binary2', msg, 5000) == nil)"            "\n"
+    "      sock:close()"                                                    "\n"
+    "      echoed = echoed + 1"                                             "\n"
+    "    end))"                                                             "\n"
+    "  end"                                                                 "\n"
+    "end))"                                                                 "\n"
+    "for i = 1, 4 do"                                                       "\n"
+    "  run(coroutine.create(function()"                                     "\n"
+    "    local sock = assert(socket.tls('127.0.0.1', port, 5000))"          "\n"
+    "    assert(sock:send_frame('binary2', 'hello ' .. i, 5000) == nil)"    "\n"
+    "    local big = string.rep('x', 1024 * 1024 + 1)"                      "\n"
+    "    local err = sock:send_frame('binary4', big, 5000)"                 "\n"
+    "    assert(err == 'message is too long', err)"                         "\n"
+    "    assert(sock:recv_frame('binary2', 5000) == 'hello ' .. i)"         "\n"
+    "    sock:close()"                                                      "\n"
+    "    replies = replies + 1"                                             "\n"
+    "  end))"                                                               "\n"
+    "end"                                                                   "\n"
+    "while next(waiting) do"                                                "\n"
+    "  local socks = {}"                                                    "\n"
+    "  for sock in pairs(waiting) do socks[#socks + 1] = sock end"          "\n"
+    "  for _, sock in ipairs(socket.wait(socks, 5000)) do"                  "\n"
+    "    local co = waiting[sock]"                                          "\n"
+    "    waiting[sock] = nil"                                               "\n"
+    "    run(co)"                                                           "\n"
+    "  end"                                                                 "\n"
+    "end"                                                                   "\n"
+    "assert(echoed == 4 and replies == 4, echoed .. ' ' .. replies)"        "\n"
+    "listener:close()"                                                      "\n"
+    "listener = assert(socket.listen_tcp(0, { host = '127.0.0.1',"          "\n"
+    "                                         max_connections = 1 }))"      "\n"
+    "_, port = listener:local_address()"                                    "\n"
+    "local first = assert(socket.tcp('127.0.0.1', port, 1000))"             "\n"
+    "local second = assert(socket.tcp('127.0.0.1', port, 1000))"            "\n"
+    "local accepted = assert(listener:accept(1000))"                        "\n"
+    "local data, err = listener:accept(200)"                                "\n"
+    "assert(data == nil and err == 'timeout', err)"                         "\n"
+    "assert(second:recv(1000) == '')"                                       "\n"
+    "listener:close()"                                                      "\n"
+    "accepted:close()"                                                      "\n"
+    "first:close()"                                                         "\n"
+    "second:close()"                                                        "\n",
+    crt, key) > 0);
+  free(crt);
+  free(key);
+  if (lua_run_script(script)) err++;
+  free(script);
+}
+
+/*
+ * The reactor runs socket conversations alongside zmq sockets and timers,
+ * waking only when one of them is ready.
+ */
+void test_reactor(void) {
+  ASSERT(!lua_run_script(
+    "local socket = require('socket')"                                      "\n"
+    "local reactor = require('reactor')"                                    "\n"
+    "local zmq = require('lzmq')"                                           "\n"
+    "local echoed, replies, events = 0, 0, 0"                               "\n"
+    "local listener = assert(socket.listen_tcp(0, { host = '127.0.0.1' }))" "\n"
+    "local _, port = listener:local_address()"                              "\n"
+    "reactor.spawn(function()"                                              "\n"
+    "  for i = 1, 4 do"                                                     "\n"
+    "    local sock = assert(listener:accept(5000))"                        "\n"
+    "    reactor.spawn(function()"                                          "\n"
+    "      local msg = assert(sock:recv_frame('binary2', 5000))"            "\n"
+    "      reactor.sleep(20)"                                               "\n"
+    "      assert(sock:send_frame('binary2', msg, 5000) == nil)"            "\n"
+    "      sock:close()"                                                    "\n"
+    "      echoed = echoed + 1"                                             "\n"
+    "    end)"                                                              "\n"
+    "  end"                                                                 "\n"
+    "  listener:close()"                                                    "\n"
+    "end)"                                                                  "\n"
+    "for i = 1, 4 do"                                                       "\n"
+    "  reactor.spawn(function()"                                            "\n"
+    "    local sock = assert(socket.tcp('127.0.0.1', port, 5000))"          "\n"
+    "    assert(sock:send_frame('binary2', 'hello ' .. i, 5000) == nil)"    "\n"
+    "    assert(sock:recv_frame('binary2', 5000) == 'hello ' .. i)"         "\n"
+    "    sock:close()"                                                      "\n"
+    "    replies = replies + 1"                                             "\n"
+    "  end)"                                                                "\n"
+    "end"                                                                   "\n"
+    "local pub = zmq.pub('@inproc://reactor-socket-test')"                  "\n"
+    "reactor.spawn(function()"                                              "\n"
+    "  local sub = zmq.sub('inproc://reactor-socket-test', 'tick')"         "\n"
+    "  while select(2, sub:recv(-1)) ~= 'stop' do events = events + 1 end"  "\n"
+    "  sub:close()"                                                         "\n"
+    "end)"                                                                  "\n"
+    "reactor.spawn(function()"                                              "\n"
+    "  for i = 1, 5 do reactor.sleep(10) pub:send('tick', tostring(i)) end" "\n"
+    "  pub:send('tick', 'stop')"                                            "\n"
+    "end)"                                                                  "\n"
+    "assert(reactor.run(10000) == 0)"                                       "\n"
+    "pub:close()"                                                           "\n"
+    "assert(echoed == 4 and replies == 4, echoed .. ' ' .. replies)"        "\n"
+    "assert(events == 5, events)"                                           "\n"
+    "assert(reactor.stats().errors == 0)"                                   "\n"
+  ));
+}
+
+/*
+ * Cancelling a task lets go of the sockets it was waiting on: the next call
+ * on each starts afresh rather than finding it busy or the old timeout
+ * still running.
+ */
+void test_cancel(void) {
+  ASSERT(!lua_run_script(
+    "local socket = require('socket')"                                      "\n"
+    "local reactor = require('reactor')"                                    "\n"
+    "local zmq = require('lzmq')"                                           "\n"
+    "local listener = assert(socket.listen_tcp(0, { host = '127.0.0.1' }))" "\n"
+    "local _, port = listener:local_address()"                              "\n"
+    "local client = assert(socket.tcp('127.0.0.1', port, 1000))"            "\n"
+    "local server = assert(listener:accept(1000))"                          "\n"
+    "listener:close()"                                                      "\n"
+    "local sub = zmq.sub('inproc://events/nothing')"                        "\n"
+    "local reader = reactor.spawn(function() client:recv(5000) end)"        "\n"
+    "local waiter = reactor.spawn(function() sub:recv(60000) end)"          "\n"
+    "local data, err"                                                       "\n"
+    "reactor.spawn(function()"                                              "\n"
+    "  reactor.sleep(20)"                                                   "\n"
+    "  assert(reactor.cancel(reader) and reactor.cancel(waiter))"           "\n"
+    "  assert(select(3, sub:waitable()) == nil)"                            "\n"
+    "  assert(server:send('again', 1000) == nil)"                           "\n"
+    "  data, err = client:recv(1000)"                                       "\n"
+    "end)"                                                                  "\n"
+    "assert(reactor.run(5000) == 0)"                                        "\n"
+    "assert(data == 'again', err)"                                          "\n"
+    "assert(reactor.stats().errors == 0)"                                   "\n"
+    "client:close()"                                                        "\n"
+    "server:close()"                                                        "\n"
+    "sub:close()"                                                           "\n"
+  ));
+}
+
+/*
+ * Soak test: thousands of TLS connections share one context, resume the
+ * session of the first, and leave the memory in use where it was.
+ */
+void test_tls_soak(void) {
+  ASSERT(!lua_run_script(
+    "local socket = require('socket')"                                      "\n"
+    "local function rss()"                                                  "\n"
+    "  local f = io.open('/proc/self/statm')"                               "\n"
+    "  local pages = f:read('*a'):match('%d+ (%d+)')"                       "\n"
+    "  f:close()"                                                           "\n"
+    "  return tonumber(pages) * 4"                                          "\n"
+    "end"                                                                   "\n"
+    "local first = assert(socket.tls('localhost', 44443, 5000))"            "\n"
+    "assert(not first:is_resumed())"                                        "\n"
+    "first:close()"                                                         "\n"
+    "local resumed, baseline = 0"                                           "\n"
+    "for i = 1, 3000 do"                                                    "\n"
+    "  local sock = assert(socket.tls('localhost', 44443, 5000))"           "\n"
+    "  if sock:is_resumed() then resumed = resumed + 1 end"                 "\n"
+    "  sock:close()"                                                        "\n"
+    "  if i == 500 then collectgarbage() baseline = rss() end"              "\n"
+    "end"                                                                   "\n"
+    "collectgarbage()"                                                      "\n"
+    "assert(resumed == 3000, resumed)"                                      "\n"
+    "assert(rss() - baseline < 1024, 'grew by ' .. rss() - baseline .. ' kB')\n"
+  ));
+}
+
+int main(int argc, char **argv) {
+  char *cwd = get_current_dir_name();
+
+  curl_global_init(CURL_GLOBAL_ALL);
+  sprintf(cacerts_bundle, "%s/fs_data/cacerts.pem", cwd);
+  free(cwd);
+
+  init_ssl_locks();
+  init_logger_service(LOG_LEVEL_INFO);
+  if (init_tokenizer_service())      return 1;
+  if (init_settings_service())       return 1;
+  if (init_events_proxy_service())   return 1;
+  if (init_webserver_service())      return 1;
+  if (init_plugins(NULL, argc, argv)) return 1;
+
+  #define RUN_TEST(x) LINFO("Beginning " #x); x();
+  RUN_TEST(test_timeouts);
+  RUN_TEST(test_coroutines);
+  RUN_TEST(test_framing);
+  RUN_TEST(test_resolver);
+  RUN_TEST(test_resolver_burst);
+  RUN_TEST(test_listen);
+  RUN_TEST(test_reactor);
+  RUN_TEST(test_cancel);
+  RUN_TEST(test_tls_soak);
+
+  shutdown_plugins();
+  shutdown_webserver_service();
+  shutdown_events_proxy_service();
+  shutdown_settings_service();
+  shutdown_tokenizer_service();
+  shutdown_logger_service();
+  shutdown_ssl_locks();
+  curl_global_cleanup();
+
+  return err;
+}
@@ -0,0 +1,109 @@
+#define  _GNU_SOURCE
+#include "config.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "services.h"
+#include "bindings.h"
+
+int err = 0;
+
+#define ASSERT(x) if (!(x)) { LERROR("FAIL: " #x); err++; return; }
+
+/*
+ * Frames can be measured and read in part or in whole, and sent on as they
+ * are, any number of times.
+ */
+void test_frames(void) {
+  ASSERT(!lua_run_script(
+    "local zmq = require('lzmq')"                                           "\n"
+    "local a = zmq.pair('@inproc://zmq-test-frames')"                       "\n"
+    "local b = zmq.pair('>inproc://zmq-test-frames')"                       "\n"
+    "a:send('header', 'hello\\0world')"                                     "\n"
+    "local header, body = b:recv_frames(1000)"                              "\n"
+    "assert(header:tostring() == 'header', tostring(header))"               "\n"
+    "assert(body:len() == 11 and #body == 11, body:len())"                  "\n"
+    "assert(body:sub(1, 5) == 'hello', body:sub(1, 5))"                     "\n"
+    "assert(body:sub(-5) == 'world', body:sub(-5))"                         "\n"
+    "assert(body:sub(7, 100) == 'world', body:sub(7, 100))"                 "\n"
+    "assert(body:sub(6, 6) == '\\0' and body:sub(8, 7) == '')"              "\n"
+    "b:send(body, 'tail')"                                                  "\n"
+    "b:send(body)"                                                          "\n"
+    "local again, tail = a:recv(1000)"                                      "\n"
+    "assert(again == 'hello\\0world' and tail == 'tail', again)"            "\n"
+    "assert(a:recv(1000) == 'hello\\0world')"                               "\n"
+    "assert(body:tostring() == 'hello\\0world')"                            "\n"
+    "local made = zmq.frame('made')"                                        "\n"
+    "a:send(made, made)"                                                    "\n"
+    "local x, y = b:recv(1000)"                                             "\n"
+    "assert(x == 'made' and y == 'made', x)"                                "\n"
+    "a:close()"                                                             "\n"
+    "b:close()"                                                             "\n"
+  ));
+}
+
+/*
+ * Long strings are sent whole, and still arrive after the Lua state which
+ * sent them has closed.
+ */
+void test_long_strings(void) {
+  zsock_t *sink = zsock_new_pair("@inproc://zmq-test-long-strings");
+  zmsg_t *msg;
+  char *part;
+  int i;
+
+  zsock_set_rcvtimeo(sink, 1000);
+  ASSERT(!lua_run_script(
+    "local zmq = require('lzmq')"                                           "\n"
+    "local sock = zmq.pair('>inproc://zmq-test-long-strings')"              "\n"
+    "local chunk = string.rep('0123456789abcdef', 65536)"                   "\n"
+    "for i = 1, 4 do assert(sock:send(i .. ':' .. chunk) == true) end"      "\n"
+    "assert(sock:send('header', chunk) == true)"                            "\n"
+  ));
+  for (i = 1; i <= 5; i++) {
+    ASSERT(msg = zmsg_recv(sink));
+    ASSERT(zmsg_size(msg) == (i <= 4 ? 1 : 2));
+    part = zmsg_popstr(msg);
+    if (i <= 4) ASSERT(strlen(part) == 16 * 65536 + 2 && part[0] == '0' + i && part[1] == ':');
+    free(part);
+    part = zmsg_popstr(msg);
+    if (i == 5) ASSERT(strlen(part) == 16 * 65536 && !strncmp(part, "0123456789abcdef", 16));
+    free(part);
+    zmsg_destroy(&msg);
+  }
+  zsock_destroy(&sink);
+}
+
+/*
+ * A message with a part that can't be sent isn't sent at all.
+ */
+void test_send_errors(void) {
+  ASSERT(!lua_run_script(
+    "local zmq = require('lzmq')"                                           "\n"
+    "local a = zmq.pair('@inproc://zmq-test-send-errors')"                  "\n"
+    "local b = zmq.pair('>inproc://zmq-test-send-errors')"                  "\n"
+    "local frame = zmq.frame('gone')"                                       "\n"
+    "getmetatable(frame).__gc(frame)"                                       "\n"
+    "local ok, err = pcall(a.send, a, 'first', frame)"                      "\n"
+    "assert(not ok and err:find('frame has been freed'), err)"              "\n"
+    "assert(a:send('second') == true)"                                      "\n"
+    "assert(b:recv(1000) == 'second')"                                      "\n"
+    "assert(b:recv() == nil)"                                               "\n"
+    "a:close()"                                                             "\n"
+    "b:close()"                                                             "\n"
+  ));
+}
+
+int main(int argc, char **argv) {
+  init_logger_service(LOG_LEVEL_INFO);
+
+  #define RUN_TEST(x) LINFO("Beginning " #x); x();
+  RUN_TEST(test_frames);
+  RUN_TEST(test_long_strings);
+  RUN_TEST(test_send_errors);
+
+  shutdown_logger_service();
+
+  return err;
+}
@@ -0,0 +1,182 @@
+/*
+ * Wakeup and latency benchmark for the Lua reactor.
+ *
+ * A publisher thread sends timestamped messages to a number of SUB sockets
+ * in one Lua state, which receives them twice: first the way scripts did
+ * before the reactor, by waiting on each socket in turn with a short
+ * timeout, and then with a reactor task per socket. For each it reports
+ * how many times the script woke up, and how long messages took from
+ * being published to being handled.
+ *
+ * This is not run by `make check`. Run it from the test directory:
+ *
+ *     bin/reactor_bench -s 16 -n 500 -i 5000
+ *
+ * -s is the number of sockets, -n the number of messages and -i the
+ * interval between them in microseconds. The sparser the messages, the
+ * more often polling in turn wakes up for nothing, and the longer a message
+ * waits for its socket's turn.
+ */
+#define _GNU_SOURCE
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <czmq.h>
+
+#include "services.h"
+#include "bindings.h"
+
+#define DEFAULT_SOCKETS  16
+#define DEFAULT_MESSAGES 500
+#define DEFAULT_INTERVAL 5000
+#define POLL_TIMEOUT     10  // ms each socket is waited on, when polling in turn
+
+/*
+ * The receiving script, for either mode. It runs until every socket has
+ * had its 'stop', collecting the milliseconds between each message's
+ * timestamp and its arrival, then prints a line of results.
+ */
+static const char *COMMON =
+  "local zmq = require('lzmq')"                                           "\n"
+  "local reactor = require('reactor')"                                    "\n"
+  "local MODE, SOCKETS, POLL_TIMEOUT = '%s', %d, %d"                      "\n"
+  "local latencies, wakeups = {}, 0"                                      "\n"
+  "local subs = {}"                                                       "\n"
+  "for i = 1, SOCKETS do"                                                 "\n"
+  "  subs[i] = zmq.sub('inproc://reactor-bench', string.format('t%%03d|', i))\n"
+  "end"                                                                   "\n"
+  "local function handle(sent)"                                           "\n"
+  "  latencies[#latencies + 1] = reactor.now() - tonumber(sent)"          "\n"
+  "end"                                                                   "\n"
+  "-- give the subscriptions time to reach the publisher"                 "\n"
+  "reactor.sleep(200)"                                                    "\n"
+  "local ready = zmq.pair('>inproc://reactor-bench-ready')"               "\n"
+  "ready:send('go')"                                                      "\n"
+  "local started = reactor.now()"                                         "\n"
+  "if MODE == 'polling' then"                                             "\n"
+  "  local open = SOCKETS"                                                "\n"
+  "  while open > 0 do"                                                   "\n"
+  "    for i = 1, SOCKETS do"                                             "\n"
+  "      if subs[i] then"                                                 "\n"
+  "        local _, sent = subs[i]:recv(POLL_TIMEOUT)"                    "\n"
+  "        wakeups = wakeups + 1"                                         "\n"
+  "        if sent == 'stop' then subs[i]:close() subs[i] = false open = open - 1\n"
+  "        elseif sent then handle(sent) end"                             "\n"
+  "      end"                                                             "\n"
+  "    end"                                                               "\n"
+  "  end"                                                                 "\n"
+  "else"                                                                  "\n"
+  "  for i = 1, SOCKETS do"                                               "\n"
+  "    reactor.spawn(function()"                                          "\n"
+  "      while true do"                                                   "\n"
+  "        local _, sent = subs[i]:recv(-1)"                              "\n"
+  "        if sent == 'stop' then break end"                              "\n"
+  "        handle(sent)"                                                  "\n"
+  "      end"                                                             "\n"
+  "      subs[i]:close()"                                                 "\n"
+  "    end)"                                                              "\n"
+  "  end"                                                                 "\n"
+  "  reactor.run()"                                                       "\n"
+  "  wakeups = reactor.stats().wakeups"                                   "\n"
+  "end"                                                                   "\n"
+  "local elapsed = reactor.now() - started"                               "\n"
+  "ready:close()"                                                         "\n"
+  "table.sort(latencies)"                                                 "\n"
+  "local function pct(p) return latencies[math.max(1, math.ceil(#latencies * p))] end\n"
+  "local sum = 0"                                                         "\n"
+  "for _, l in ipairs(latencies) do sum = sum + l end"                    "\n"
+  "print(string.format('%%-8s %%8d %%8d %%10.2f %%9.3f %%9.3f %%9.3f %%9.1f',"   "\n"
+  "  MODE, #latencies, wakeups, wakeups / #latencies, sum / #latencies,"  "\n"
+  "  pct(0.5), pct(0.99), elapsed))"                                      "\n";
+
+typedef struct {
+  int sockets;
+  int messages;
+  int interval;
+} options_t;
+
+static options_t options;
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* publishes once the script is listening, to each socket in turn */
+static void *publish(void *arg) {
+  zsock_t *ready = zsock_new_pair("@inproc://reactor-bench-ready");
+  zsock_t *pub = zsock_new_pub("@inproc://reactor-bench");
+  char topic[16], stamp[32];
+  char *go;
+  int i;
+
+  go = zstr_recv(ready);
+  free(go);
+  for (i = 0; i < options.messages; i++) {
+    snprintf(topic, sizeof(topic), "t%03d|", i % options.sockets + 1);
+    snprintf(stamp, sizeof(stamp), "%.3f", now_ms());
+    zsock_send(pub, "ss", topic, stamp);
+    usleep(options.interval);
+  }
+  for (i = 0; i < options.sockets; i++) {
+    snprintf(topic, sizeof(topic), "t%03d|", i + 1);
+    zsock_send(pub, "ss", topic, "stop");
+  }
+
+  zsock_destroy(&pub);
+  zsock_destroy(&ready);
+  return NULL;
+}
+
+static int run(const char *mode) {
+  pthread_t publisher;
+  char *script = NULL;
+  int err;
+
+  if (asprintf(&script, COMMON, mode, options.sockets, POLL_TIMEOUT) < 0) return 1;
+  pthread_create(&publisher, NULL, publish, NULL);
+  err = lua_run_script(script);
+  pthread_join(publisher, NULL);
+  free(script);
+  return err;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-s sockets] [-n messages] [-i interval in us]\n", name);
+}
+
+int main(int argc, char **argv) {
+  int opt, err = 0;
+
+  options.sockets = DEFAULT_SOCKETS;
+  options.messages = DEFAULT_MESSAGES;
+  options.interval = DEFAULT_INTERVAL;
+  while ((opt = getopt(argc, argv, "s:n:i:h")) != -1) {
+    switch (opt) {
+      case 's': options.sockets = atoi(optarg); break;
+      case 'n': options.messages = atoi(optarg); break;
+      case 'i': options.interval = atoi(optarg); break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if (options.sockets < 1 || options.sockets > 999 || options.messages < 1 || options.interval < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  init_logger_service(LOG_LEVEL_WARN);
+  printf("%d sockets, %d messages, one every %d us\n\n",
+         options.sockets, options.messages, options.interval);
+  printf("%-8s %8s %8s %10s %9s %9s %9s %9s\n", "mode", "messages", "wakeups",
+         "per msg", "mean ms", "p50 ms", "p99 ms", "total ms");
+  if (!err) err = run("polling");
+  if (!err) err = run("reactor");
+  shutdown_logger_service();
+
+  return err;
+}
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "services.h"
+#include "util/admission.h"
+#include "util/api_request.h"
+#include "util/headers_parser.h"
+#include "util/sessions.h"
+
+// sha256("secret")
+#define SECRET_DIGEST "2bb80d537b1da3e38bd30361aa855686bde0eacd7162fef6a25fe97bf527a25b"
+
+/* answers every API request with the request headers */
+void api_server(zsock_t *pipe, void *arg) {
+  zsock_t *api = zsock_new_rep("inproc://api");
+  zpoller_t *poller = zpoller_new(pipe, api, NULL);
+  zsock_signal(pipe, 0);
+
+  while (zpoller_wait(poller, -1) == api) {
+    char *verb, *pkey, *path, *hkey, *headers, *bkey, *body;
+    zsock_recv(api, "sssssss", &verb, &pkey, &path, &hkey, &headers, &bkey, &body);
+    zsock_send(api, "sss", "200 OK", "Content-type: text/plain", headers);
+    free(verb); free(pkey); free(path); free(hkey); free(headers); free(bkey); free(body);
+  }
+
+  zpoller_destroy(&poller);
+  zsock_destroy(&api);
+}
+
+static char *request(const char *verb, const char *path, const char *authorization) {
+  header_t *headers = NULL;
+  char raw[256];
+  char *response;
+  sprintf(raw, "Authorization: %s\r\nX-Authenticated-User: spoofed\r\n\r\n", authorization);
+  parse_headers(&headers, raw, strlen(raw));
+  response = dispatch_request(ADMISSION_TRANSPORT_USB, verb, path, &headers, NULL);
+  free_headers(&headers);
+  LDEBUG("sessions-test: %s", response);
+  return response;
+}
+
+static void test_session_table(void) {
+  char *first, *token, *user = NULL;
+  int i;
+
+  sessions_revoke_all();
+  token = session_create("tester", 100);
+  assert(token);
+  assert(session_lookup(token, &user));
+  assert(!strcmp(user, "tester"));
+  free(user);
+  assert(!session_lookup("not-a-token", NULL));
+
+  session_revoke(token);
+  assert(!session_lookup(token, NULL));
+  free(token);
+
+  token = session_create("tester", 0);
+  assert(!session_lookup(token, NULL)); // already expired
+  free(token);
+
+  // the session closest to expiry is evicted when the table is full
+  first = session_create("tester", 10);
+  for (i = 0; i < SESSION_MAX; i++) {
+    token = session_create("tester", 100);
+    assert(session_lookup(token, NULL));
+    free(token);
+  }
+  assert(sessions_count() == SESSION_MAX);
+  assert(!session_lookup(first, NULL));
+  free(first);
+
+  sessions_revoke_all();
+  assert(sessions_count() == 0);
+}
+
+static void test_session_requests(void) {
+  zsock_t *settings = zsock_new_req(SETTINGS_ENDPOINT);
+  char *response, *token, authorization[128];
+
+  settings_set(settings, 2, "auth.user", "tester", "auth.password", SECRET_DIGEST);
+  zsock_destroy(&settings);
+
+  // "tester:wrong", "tester:secret"
+  response = request("POST", "/v1/sessions.json", "Basic dGVzdGVyOndyb25n");
+  assert(!strncmp(response, "HTTP/1.1 401", 12));
+  free(response);
+  response = request("POST", "/v1/sessions.json", "Basic !!!!");
+  assert(!strncmp(response, "HTTP/1.1 401", 12));
+  free(response);
+  response = request("POST", "/v1/sessions.json", "Basic dGVzdGVyOnNlY3JldA==");
+  assert(!strncmp(response, "HTTP/1.1 201", 12));
+  token = strstr(response, "\"token\":\"") + 9;
+  *strchr(token, '"') = '\0';
+  sprintf(authorization, "Bearer %s", token);
+  free(response);
+
+  // a valid token is replaced by the user name; a client can't supply it
+  response = request("GET", "/v1/settings.json", authorization);
+  assert(!strncmp(response, "HTTP/1.1 200", 12));
+  assert(strstr(response, SESSION_USER_HEADER ": tester"));
+  assert(!strstr(response, "spoofed"));
+  assert(!strstr(response, "Bearer"));
+  free(response);
+
+  response = request("GET", "/v1/settings.json", "Bearer 0123456789abcdef");
+  assert(!strncmp(response, "HTTP/1.1 401", 12));
+  free(response);
+
+  response = request("DELETE", "/v1/sessions.json", authorization);
+  assert(!strncmp(response, "HTTP/1.1 204", 12));
+  free(response);
+  response = request("GET", "/v1/settings.json", authorization);
+  assert(!strncmp(response, "HTTP/1.1 401", 12));
+  free(response);
+}
+
+int main(int argc, char **argv) {
+  zactor_t *server;
+  int err = 0;
+
+  if ((err = init_logger_service(LOG_LEVEL_DEBUG))) goto shutdown;
+  if ((err = init_settings_service()))              goto shutdown;
+  server = zactor_new(api_server, NULL);
+
+  test_session_table();
+  test_session_requests();
+
+  zactor_destroy(&server);
+shutdown:
+  shutdown_settings_service();
+  shutdown_logger_service();
+  return err;
+}
@@ -54,8 +54,25 @@ void test_hex2bytes(void) {
   assert(len == 6);     // leave len unchanged
 }
 
+void test_json_escape(void) {
+  char *str = json_escape("a\"b\\c\n\x01", 7);
+  assert(!strcmp(str, "a\\\"b\\\\c\\n\\u0001"));
+  free(str);
+
+  // embedded NULs are escaped rather than terminating the string
+  str = json_escape("a\0b", 3);
+  assert(!strcmp(str, "a\\u0000b"));
+  free(str);
+
+  // UTF-8 passes through untouched; only DEL is escaped above ASCII
+  str = json_escape("caf\xc3\xa9 \xe2\x82\xac\x7f", 10);
+  assert(!strcmp(str, "caf\xc3\xa9 \xe2\x82\xac\\u007f"));
+  free(str);
+}
+
 int main() {
   test_hex2bytes();
   test_hex2bcd();
+  test_json_escape();
   return 0;
 }
@@ -0,0 +1,400 @@
+/*
+ * Load generator and latency benchmark for the REST API.
+ *
+ * Starts the webserver on localhost against a stub Lua API handler (or the
+ * script given with -s), then sends requests to it from a number of client
+ * threads and reports throughput and latency percentiles. Nothing here
+ * depends on terminal hardware, so it can be used on any Linux machine to
+ * compare changes to the request path.
+ *
+ * This is not run by `make check`. Run it from the test directory, pointing
+ * READ_PATHS at the server certificate:
+ *
+ *     READ_PATHS=../resources WRITE_PATHS=. bin/webserver_bench -c 8 -n 2000 -k
+ *
+ * With -k, each client keeps its connection open between requests and
+ * reconnects (resuming its TLS session) only when the server closes it.
+ */
+#define _GNU_SOURCE
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "services.h"
+#include "bindings.h"
+
+#define DEFAULT_PORT        44443
+#define DEFAULT_CONCURRENCY 4
+#define DEFAULT_REQUESTS    1000
+#define DEFAULT_PATH        "/v1/device.json"
+#define MAX_RESPONSE        65536
+
+/* answers every API request with a small JSON document, until told to stop */
+static const char *STUB_HANDLER =
+  "local zmq = require('lzmq')"                                          "\n"
+  "local api = zmq.rep('inproc://api')"                                   "\n"
+  "while true do"                                                         "\n"
+  "  local verb = api:recv(-1)"                                           "\n"
+  "  if verb == nil or verb == '$STOP' then"                              "\n"
+  "    api:send('200 OK', '', '')"                                        "\n"
+  "    break"                                                             "\n"
+  "  end"                                                                 "\n"
+  "  api:send('200 OK', 'Content-type: application/json', '{\"ok\":true}')""\n"
+  "end"                                                                   "\n"
+  "api:close()"                                                           "\n";
+
+typedef struct {
+  int port;
+  int concurrency;
+  int num_requests;
+  int keep_alive;
+  const char *path;
+  const char *script;
+} options_t;
+
+/* per-request timings, in microseconds */
+typedef struct {
+  double total;
+  double connect;   // 0 if an open connection was used
+  double handshake; // 0 if an open connection was used
+  double response;  // from sending the request to the last byte of the reply
+  int    resumed;   // TLS session was resumed
+  int    status;    // HTTP status, or 0 if the request failed
+} sample_t;
+
+typedef struct {
+  int sd;
+  SSL *ssl;
+} connection_t;
+
+static options_t options;
+static SSL_CTX *client_ctx = NULL;
+static sample_t *samples = NULL;
+static int next_request = 0;
+static pthread_mutex_t next_request_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+static int claim_request(void) {
+  int i;
+  pthread_mutex_lock(&next_request_lock);
+  i = next_request < options.num_requests ? next_request++ : -1;
+  pthread_mutex_unlock(&next_request_lock);
+  return i;
+}
+
+static void disconnect(connection_t *conn) {
+  if (conn->ssl) {
+    SSL_shutdown(conn->ssl);
+    SSL_free(conn->ssl);
+    conn->ssl = NULL;
+  }
+  if (conn->sd != -1) {
+    close(conn->sd);
+    conn->sd = -1;
+  }
+}
+
+static int connect_to_server(connection_t *conn, SSL_SESSION **session, sample_t *sample) {
+  struct sockaddr_in addr;
+  double start = now_us(), connected;
+  int one = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(options.port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  conn->sd = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(conn->sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(conn->sd, (struct sockaddr *) &addr, sizeof(addr))) {
+    disconnect(conn);
+    return -1;
+  }
+  connected = now_us();
+  sample->connect += connected - start;
+
+  conn->ssl = SSL_new(client_ctx);
+  SSL_set_fd(conn->ssl, conn->sd);
+  if (*session) SSL_set_session(conn->ssl, *session);
+  if (SSL_connect(conn->ssl) != 1) {
+    disconnect(conn);
+    return -1;
+  }
+  sample->handshake += now_us() - connected;
+  sample->resumed = SSL_session_reused(conn->ssl);
+  return 0;
+}
+
+/*
+ * Returns 1 if the server has already closed this connection. Noticing the
+ * close before sending the next request keeps the TLS session resumable,
+ * which it would not be if the connection failed mid-request.
+ */
+static int closed_by_server(connection_t *conn) {
+  struct pollfd pfd = { conn->sd, POLLIN, 0 };
+  char c;
+  if (poll(&pfd, 1, 0) <= 0) return 0;
+  return SSL_peek(conn->ssl, &c, 1) <= 0;
+}
+
+/* returns the HTTP status, or 0 if the connection failed before a full reply */
+static int exchange(connection_t *conn, const char *request, char *buf) {
+  int len = 0, bytes, header_len = 0, content_length = -1, status = 0;
+  char *end, *line;
+
+  if (SSL_write(conn->ssl, request, strlen(request)) <= 0) return 0;
+
+  while (header_len == 0 || len < header_len + content_length) {
+    bytes = SSL_read(conn->ssl, buf + len, MAX_RESPONSE - 1 - len);
+    if (bytes <= 0) return 0;
+    len += bytes;
+    buf[len] = '\0';
+
+    if (header_len == 0 && (end = strstr(buf, "\r\n\r\n"))) {
+      header_len = end - buf + 4;
+      if (sscanf(buf, "HTTP/1.%*d %d", &status) != 1) return 0;
+      content_length = 0;
+      for (line = strstr(buf, "\r\n"); line && line < end; line = strstr(line + 2, "\r\n")) {
+        if (!strncasecmp(line + 2, "content-length:", 15))
+          content_length = atoi(line + 17);
+      }
+    }
+    if (len >= MAX_RESPONSE - 1) return 0;
+  }
+  return status;
+}
+
+static void *client(void *arg) {
+  connection_t conn = { -1, NULL };
+  SSL_SESSION *session = NULL;
+  char request[512];
+  char *buf = (char *) malloc(MAX_RESPONSE);
+  int i;
+
+  sprintf(request, "GET %s HTTP/1.1\r\n"
+                   "Host: localhost:%d\r\n"
+                   "Connection: %s\r\n"
+                   "\r\n",
+          options.path, options.port, options.keep_alive ? "keep-alive" : "close");
+
+  while ((i = claim_request()) != -1) {
+    sample_t *sample = &samples[i];
+    double start = now_us(), sent;
+    int reused;
+
+    if (conn.ssl && closed_by_server(&conn)) disconnect(&conn);
+    reused = conn.ssl != NULL;
+
+    if (!conn.ssl && connect_to_server(&conn, &session, sample)) {
+      sample->total = now_us() - start;
+      continue;
+    }
+
+    sent = now_us();
+    sample->status = exchange(&conn, request, buf);
+    if (sample->status == 0 && reused) {
+      // the server closed the connection after the last reply; reconnect
+      // and try once more, as any HTTP client would
+      disconnect(&conn);
+      if (!connect_to_server(&conn, &session, sample)) {
+        sent = now_us();
+        sample->status = exchange(&conn, request, buf);
+      }
+    }
+    sample->response = now_us() - sent;
+    sample->total = now_us() - start;
+
+    // keep the session to resume it on the next connection. With TLS 1.3
+    // the session ticket only arrives after the handshake, so this waits
+    // until a reply has been read.
+    if (options.keep_alive && sample->status && sample->handshake > 0) {
+      if (session) SSL_SESSION_free(session);
+      session = SSL_get1_session(conn.ssl);
+    }
+
+    if (!options.keep_alive || sample->status == 0)
+      disconnect(&conn);
+  }
+
+  disconnect(&conn);
+  if (session) SSL_SESSION_free(session);
+  free(buf);
+  return NULL;
+}
+
+/* runs the Lua API handler until it receives "$STOP" */
+static void api_handler(zsock_t *pipe, void *arg) {
+  zsock_signal(pipe, 0);
+  if (options.script) lua_run_file(options.script);
+  else lua_run_script(STUB_HANDLER);
+}
+
+static void stop_api_handler(void) {
+  zsock_t *api = zsock_new_req("inproc://api");
+  char *status, *headers, *body;
+  zsock_send(api, "s", "$STOP");
+  zsock_recv(api, "sss", &status, &headers, &body);
+  free(status); free(headers); free(body);
+  zsock_destroy(&api);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, int n, double p) {
+  int i = (int) (p * n + 0.5) - 1;
+  if (i < 0) i = 0;
+  if (i >= n) i = n - 1;
+  return sorted[i];
+}
+
+static void report(double elapsed_us) {
+  double *latencies = (double *) calloc(options.num_requests, sizeof(double));
+  double connect = 0, handshake = 0, response = 0;
+  int i, n = 0, connections = 0, resumed = 0, rejected = 0, failed = 0;
+
+  for (i = 0; i < options.num_requests; i++) {
+    sample_t *s = &samples[i];
+    if (s->status == 0) { failed++; continue; }
+    if (s->status < 200 || s->status > 299) rejected++;
+    latencies[n++] = s->total;
+    if (s->handshake > 0) {
+      connections++;
+      connect   += s->connect;
+      handshake += s->handshake;
+      resumed   += s->resumed;
+    }
+    response += s->response;
+  }
+
+  printf("requests:     %d completed, %d rejected (non-2xx), %d failed\n",
+         n, rejected, failed);
+  printf("concurrency:  %d clients, keep-alive %s\n",
+         options.concurrency, options.keep_alive ? "on" : "off");
+  printf("elapsed:      %.3f s\n", elapsed_us / 1000000.0);
+  printf("throughput:   %.1f requests/s\n", n / (elapsed_us / 1000000.0));
+  printf("connections:  %d opened, %d TLS sessions resumed, %d requests reused a connection\n",
+         connections, resumed, n - connections);
+  if (n > 0) {
+    qsort(latencies, n, sizeof(double), compare_doubles);
+    printf("latency (ms): p50 %.3f  p99 %.3f  p999 %.3f  max %.3f\n",
+           percentile(latencies, n, 0.50) / 1000.0,
+           percentile(latencies, n, 0.99) / 1000.0,
+           percentile(latencies, n, 0.999) / 1000.0,
+           latencies[n - 1] / 1000.0);
+    printf("mean (ms):    connect %.3f  handshake %.3f  response %.3f\n",
+           connections ? connect / connections / 1000.0 : 0,
+           connections ? handshake / connections / 1000.0 : 0,
+           response / n / 1000.0);
+  }
+  free(latencies);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-c clients] [-n requests] [-k] [-p path] [-P port] [-s script.lua] [-v]\n"
+                  "  -c  number of concurrent clients (default %d)\n"
+                  "  -n  total number of requests (default %d)\n"
+                  "  -k  keep connections alive between requests\n"
+                  "  -p  request path (default %s)\n"
+                  "  -P  port to serve on (default %d)\n"
+                  "  -s  Lua script to handle API requests instead of the stub; it must\n"
+                  "      stop when it receives a \"$STOP\" request\n"
+                  "  -v  log at debug level\n",
+          name, DEFAULT_CONCURRENCY, DEFAULT_REQUESTS, DEFAULT_PATH, DEFAULT_PORT);
+}
+
+int main(int argc, char **argv) {
+  int log_level = LOG_LEVEL_WARN, opt, i, err = 0;
+  zactor_t *handler = NULL;
+  pthread_t *clients;
+  zsock_t *settings;
+  char port[6];
+  double start;
+
+  options.port = DEFAULT_PORT;
+  options.concurrency = DEFAULT_CONCURRENCY;
+  options.num_requests = DEFAULT_REQUESTS;
+  options.path = DEFAULT_PATH;
+
+  while ((opt = getopt(argc, argv, "c:n:kp:P:s:vh")) != -1) {
+    switch (opt) {
+      case 'c': options.concurrency  = atoi(optarg); break;
+      case 'n': options.num_requests = atoi(optarg); break;
+      case 'k': options.keep_alive   = 1;            break;
+      case 'p': options.path         = optarg;       break;
+      case 'P': options.port         = atoi(optarg); break;
+      case 's': options.script       = optarg;       break;
+      case 'v': log_level = LOG_LEVEL_DEBUG;         break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if (options.concurrency < 1 || options.num_requests < 1 ||
+      options.port < 1024 || options.port > 65535 || strlen(options.path) > 256) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  SSL_library_init();
+  SSL_load_error_strings();
+
+  if ((err = init_logger_service(log_level)))   return err;
+  if ((err = init_events_proxy_service()))      goto shutdown;
+  if ((err = init_settings_service()))          goto shutdown;
+
+  settings = zsock_new_req(SETTINGS_ENDPOINT);
+  sprintf(port, "%d", options.port);
+  settings_set(settings, 2, "webserver.port", port, "webserver.beacon.enabled", "false");
+  zsock_destroy(&settings);
+
+  handler = zactor_new(api_handler, NULL);
+  if ((err = init_webserver_service())) goto shutdown;
+
+  client_ctx = SSL_CTX_new(SSLv23_client_method());
+  SSL_CTX_set_verify(client_ctx, SSL_VERIFY_NONE, NULL);
+  SSL_CTX_set_session_cache_mode(client_ctx, SSL_SESS_CACHE_CLIENT);
+  samples = (sample_t *) calloc(options.num_requests, sizeof(sample_t));
+  clients = (pthread_t *) calloc(options.concurrency, sizeof(pthread_t));
+
+  start = now_us();
+  for (i = 0; i < options.concurrency; i++)
+    pthread_create(&clients[i], NULL, client, NULL);
+  for (i = 0; i < options.concurrency; i++)
+    pthread_join(clients[i], NULL);
+  report(now_us() - start);
+
+  free(clients);
+  free(samples);
+  SSL_CTX_free(client_ctx);
+  shutdown_webserver_service();
+
+shutdown:
+  if (handler) {
+    stop_api_handler();
+    zactor_destroy(&handler);
+  }
+  shutdown_settings_service();
+  shutdown_events_proxy_service();
+  shutdown_logger_service();
+  return err;
+}